@@ -21,15 +21,20 @@ TheApp* CreateApp() { return new AnimationApp(); }
 // bin count
 #define BINS 8
 
+// rebuild once refitting has increased the SAH cost by more than this factor
+#define REBUILD_THRESHOLD 1.25f
+
 // forward declarations
 void Subdivide( uint nodeIdx );
 void UpdateNodeBounds( uint nodeIdx );
+float ComputeSAHCost();
 
 // application data
 Tri tri[N], original[N];
 uint triIdx[N];
 BVHNode* bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * N * 2, 64 );
 uint rootNodeIdx = 0, nodesUsed = 2;
+float buildCost; // SAH cost right after the last build
 
 // functions
 
@@ -146,6 +151,7 @@ void BuildBVH()
 	Timer t;
 	Subdivide( rootNodeIdx );
 	printf( "BVH constructed in %.2fms  ", t.elapsed() * 1000 );
+	buildCost = ComputeSAHCost();
 }
 
 void UpdateNodeBounds( uint nodeIdx )
@@ -226,6 +232,21 @@ float CalculateNodeCost( BVHNode& node )
 	return node.triCount * surfaceArea;
 }
 
+float ComputeSAHCost()
+{
+	// SAH cost of the tree, relative to the root: interior nodes cost 1, leaves 1 per triangle;
+	// nodes are stored compactly, so there is no need to walk the tree
+	float cost = 0;
+	for (uint i = 0; i < nodesUsed; i++) if (i != 1)
+	{
+		float3 e = bvhNode[i].aabbMax - bvhNode[i].aabbMin;
+		float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
+		cost += surfaceArea * (bvhNode[i].isLeaf() ? bvhNode[i].triCount : 1);
+	}
+	float3 e = bvhNode[rootNodeIdx].aabbMax - bvhNode[rootNodeIdx].aabbMin;
+	return cost / (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
 void Subdivide( uint nodeIdx )
 {
 	// terminate recursion
@@ -294,8 +315,11 @@ void AnimationApp::Init()
 void AnimationApp::Tick( float deltaTime )
 {
 	Animate();
-	// BuildBVH();
+	// refit, unless that made the tree too much worse than a fresh build
 	RefitBVH();
+	float cost = ComputeSAHCost();
+	printf( "SAH cost: %.2f (%.2fx)  ", cost, cost / buildCost );
+	if (cost > buildCost * REBUILD_THRESHOLD) BuildBVH();
 	// draw the scene
 	float3 p0( -1, 1, 2 ), p1( 1, 1, 2 ), p2( -1, -1, 2 );
 	Timer t;
@@ -0,0 +1,270 @@
+#include "precomp.h"
+#include "bvh.h"
+#include "benchmark.h"
+#include <filesystem>
+
+// THIS SOURCE FILE:
+// Headless benchmark for the shared BVH code (bvh.cpp): for each mesh in
+// the assets folder, the builders are timed and the resulting trees are
+// measured, after which fixed sets of primary, diffuse and shadow rays are
+// traced. Results go to benchmark.csv (and stdout), one line per test:
+// asset, triangles, config, test, ms, count (nodes or rays), sah, mrays;
+// a 0 means 'not applicable'. The project defines HEADLESS, see template.cpp.
+
+// timings are the best of this many runs
+#define BENCH_RUNS 3
+
+// primary rays: a square image of this resolution
+#define BENCH_RES 512
+
+// instances in the TLAS build tests
+#define BENCH_INSTANCES 2048
+
+TheApp* CreateApp() { return new BenchmarkApp(); }
+
+// load a .tri file: one triangle per line, nine floats; the list ends with a line of 999s
+static Mesh* LoadTri( const char* file )
+{
+	FILE* f = fopen( file, "r" );
+	if (!f) return 0;
+	int count = 0;
+	for (int c; (c = fgetc( f )) != EOF;) if (c == '\n') count++;
+	rewind( f );
+	Mesh* mesh = new Mesh( count );
+	int t = 0;
+	for (; t < count; t++)
+	{
+		Tri& tri = mesh->tri[t];
+		if (fscanf( f, "%f %f %f %f %f %f %f %f %f\n", &tri.vertex0.x, &tri.vertex0.y, &tri.vertex0.z,
+			&tri.vertex1.x, &tri.vertex1.y, &tri.vertex1.z, &tri.vertex2.x, &tri.vertex2.y, &tri.vertex2.z ) != 9) break;
+		if (tri.vertex0.x == 999) break;
+	}
+	fclose( f );
+	mesh->triCount = t;
+	mesh->bvh = new BVH( mesh );
+#ifdef BVH_REORDER
+	mesh->bvh->Reorder();
+#endif
+	mesh->bvh->CollapseWide();
+#ifdef BVH_QUANTIZED
+	mesh->bvh->CompressQ4();
+#endif
+	return mesh;
+}
+
+// number of nodes reachable from the root of a binary tree
+inline void Children( const BVHNode& n, uint& left, uint& right ) { left = n.leftFirst, right = n.leftFirst + 1; }
+inline void Children( const TLASNode& n, uint& left, uint& right ) { left = n.left, right = n.right; }
+template <class T> uint CountNodes( T* node )
+{
+	uint stack[64], stackPtr = 0, idx = 0, nodes = 0;
+	while (1)
+	{
+		nodes++;
+		if (!node[idx].isLeaf())
+		{
+			uint left, right;
+			Children( node[idx], left, right );
+			stack[stackPtr++] = right, idx = left;
+			continue;
+		}
+		if (stackPtr == 0) break; else idx = stack[--stackPtr];
+	}
+	return nodes;
+}
+
+// best of BENCH_RUNS multithreaded passes over a ray set; returns the time in milliseconds
+static float TraceRays( BVHInstance& instance, const Ray* rays, Intersection* hit, const int N, const bool shadow )
+{
+	float best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		Timer t;
+		JobManager::GetJobManager()->ParallelFor( N, [&]( int i )
+		{
+			Ray ray = rays[i];
+			if (shadow) hit[i].t = instance.IsOccluded( ray ) ? 0 : 1e30f;
+			else instance.Intersect( ray ), hit[i] = ray.hit;
+		}, 256 );
+		best = min( best, t.elapsed() );
+	}
+	return best * 1000;
+}
+
+// BenchmarkApp implementation
+
+void BenchmarkApp::Init()
+{
+	int soa = 0, woop = 0, sbvh = 0;
+#ifdef LEAF_SOA
+	soa = LEAF_SOA;
+#endif
+#ifdef TRI_WOOP
+	woop = 1;
+#endif
+#ifdef USE_SBVH
+	sbvh = 1;
+#endif
+	sprintf( config, "w%i_soa%i_woop%i_sbvh%i_bins%i", BVH_WIDTH, soa, woop, sbvh, BINS );
+	csv = fopen( "benchmark.csv", "w" );
+	if (!csv) FatalError( "BenchmarkApp::Init: could not create benchmark.csv." );
+	fprintf( csv, "asset,triangles,config,test,ms,count,sah,mrays\n" );
+	// all meshes in the assets folder, in a fixed order
+	vector<string> files;
+	for (const auto& entry : filesystem::directory_iterator( "assets" ))
+	{
+		const string ext = entry.path().extension().string();
+		if (ext == ".obj" || ext == ".tri") files.push_back( entry.path().generic_string() );
+	}
+	sort( files.begin(), files.end() );
+	for (const string& file : files)
+	{
+		const bool obj = file.substr( file.size() - 4 ) == ".obj";
+		Mesh* mesh = obj ? new Mesh( file.c_str(), "assets/bricks.png" ) : LoadTri( file.c_str() );
+		if (!mesh || !mesh->bvh) { printf( "skipping %s\n", file.c_str() ); continue; }
+		BenchmarkMesh( file.c_str() + file.find_last_of( '/' ) + 1, mesh );
+	}
+}
+
+void BenchmarkApp::BenchmarkMesh( const char* name, Mesh* mesh )
+{
+	BenchmarkBuilds( name, mesh );
+	BenchmarkTLAS( name, mesh );
+	BenchmarkRays( name, mesh );
+}
+
+void BenchmarkApp::BenchmarkBuilds( const char* name, Mesh* mesh )
+{
+	// a separate BVH over the same triangles, so the mesh BVH used for tracing stays intact
+	BVH* bvh = new BVH( mesh );
+	float best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->Build(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "binned", best * 1000, CountNodes( bvh->bvhNode ), bvh->ComputeSAHCost(), 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->BuildLBVH(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "lbvh", best * 1000, CountNodes( bvh->bvhNode ), bvh->ComputeSAHCost(), 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->BuildLBVH( true ); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "lbvh_treelets", best * 1000, CountNodes( bvh->bvhNode ), bvh->ComputeSAHCost(), 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->BuildSBVH(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "sbvh", best * 1000, CountNodes( bvh->bvhNode ), bvh->ComputeSAHCost(), 0 );
+	// wide trees, collapsed from the binned tree; Build keeps existing wide trees in sync, so they come last
+	bvh->Build();
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->Collapse4(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "collapse4", best * 1000, bvh->nodes4Used, 0, 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->Collapse8(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "collapse8", best * 1000, bvh->nodes8Used, 0, 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; bvh->CompressQ4(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "compressq4", best * 1000, bvh->nodes4Used, 0, 0 );
+}
+
+void BenchmarkApp::BenchmarkTLAS( const char* name, Mesh* mesh )
+{
+	// instances of the mesh at fixed pseudo-random positions and orientations
+	const BVHNode& root = mesh->bvh->bvhNode[0];
+	const float3 e = root.aabbMax - root.aabbMin;
+	const float size = max( max( e.x, e.y ), e.z ) * 16;
+	BVHInstance* instance = new BVHInstance[BENCH_INSTANCES];
+	uint seed = 0x1234567;
+	for (int i = 0; i < BENCH_INSTANCES; i++)
+	{
+		instance[i] = BVHInstance( mesh->bvh, i );
+		const float3 P( RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f );
+		instance[i].SetTransform( mat4::Translate( P * size ) * mat4::RotateY( RandomFloat( seed ) * 2 * PI ) );
+	}
+	TLAS tlas( instance, BENCH_INSTANCES );
+	float best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; tlas.Build(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "tlas_build", best * 1000, CountNodes( tlas.tlasNode ), tlas.ComputeSAHCost(), 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; tlas.BuildQuick(); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "tlas_buildquick", best * 1000, CountNodes( tlas.tlasNode ), tlas.ComputeSAHCost(), 0 );
+	best = 1e30f;
+	for (int run = 0; run < BENCH_RUNS; run++) { Timer t; tlas.BuildQuick( 3 ); best = min( best, t.elapsed() ); }
+	Report( name, mesh, "tlas_ploc", best * 1000, CountNodes( tlas.tlasNode ), tlas.ComputeSAHCost(), 0 );
+	delete[] instance;
+}
+
+void BenchmarkApp::BenchmarkRays( const char* name, Mesh* mesh )
+{
+	// fixed camera, looking at the center of the mesh from the front, slightly above
+	const BVHNode& root = mesh->bvh->bvhNode[0];
+	const float3 center = (root.aabbMin + root.aabbMax) * 0.5f, e = root.aabbMax - root.aabbMin;
+	const float size = max( max( e.x, e.y ), e.z );
+	const float3 camPos = center + float3( 0.4f, 0.5f, -1.6f ) * size;
+	const float3 lightPos = center + float3( -0.5f, 2, -0.5f ) * size;
+	const float3 F = normalize( center - camPos ), R = normalize( cross( float3( 0, 1, 0 ), F ) ), U = cross( F, R );
+	const int N = BENCH_RES * BENCH_RES;
+	Ray* rays = (Ray*)_aligned_malloc( N * sizeof( Ray ), 64 );
+	Intersection* hit = new Intersection[N], * primaryHit = new Intersection[N];
+	float4* shadowOrigin = new float4[N]; // w: distance to the light
+	BVHInstance instance( mesh->bvh, 0 );
+	for (int i = 0; i < N; i++)
+	{
+		const float u = (i % BENCH_RES + 0.5f) / BENCH_RES - 0.5f, v = 0.5f - (i / BENCH_RES + 0.5f) / BENCH_RES;
+		rays[i] = Ray();
+		rays[i].O = camPos, rays[i].D = normalize( F + (u * R + v * U) * 0.8f );
+		rays[i].rD = float3( 1 / rays[i].D.x, 1 / rays[i].D.y, 1 / rays[i].D.z );
+		rays[i].hit.t = 1e30f;
+	}
+	float ms = TraceRays( instance, rays, primaryHit, N, false );
+	Report( name, mesh, "primary", ms, N, 0, N / (ms * 1000) );
+	// diffuse bounces and shadow rays from the primary hits; the ray sets are deterministic
+	int count = 0;
+	uint seed = 0x7654321;
+	for (int i = 0; i < N; i++) if (primaryHit[i].t < 1e30f)
+	{
+		const Tri& tri = mesh->tri[PRIM_IDX( primaryHit[i].instPrim )];
+		float3 Ng = normalize( cross( tri.vertex1 - tri.vertex0, tri.vertex2 - tri.vertex0 ) );
+		if (dot( Ng, rays[i].D ) > 0) Ng = -Ng;
+		const float3 I = rays[i].O + primaryHit[i].t * rays[i].D + Ng * (size * 0.0001f);
+		// cosine-weighted direction around the normal
+		const float r0 = RandomFloat( seed ), r1 = RandomFloat( seed ), r = sqrtf( r0 ), phi = 2 * PI * r1;
+		const float3 T = normalize( cross( fabs( Ng.x ) > 0.9f ? float3( 0, 1, 0 ) : float3( 1, 0, 0 ), Ng ) ), B = cross( Ng, T );
+		shadowOrigin[count] = float4( I, length( lightPos - I ) );
+		Ray& ray = rays[count++];
+		ray.O = I, ray.D = normalize( T * (r * cosf( phi )) + B * (r * sinf( phi )) + Ng * sqrtf( 1 - r0 ) );
+		ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+		ray.hit.t = 1e30f;
+	}
+	if (count > 0)
+	{
+		ms = TraceRays( instance, rays, hit, count, false );
+		Report( name, mesh, "diffuse", ms, count, 0, count / (ms * 1000) );
+		// shadow rays towards a point light above the mesh
+		for (int i = 0; i < count; i++)
+		{
+			const float3 I = make_float3( shadowOrigin[i] );
+			const float dist = shadowOrigin[i].w;
+			rays[i].O = I, rays[i].D = (lightPos - I) * (1 / dist);
+			rays[i].rD = float3( 1 / rays[i].D.x, 1 / rays[i].D.y, 1 / rays[i].D.z );
+			rays[i].hit.t = dist;
+		}
+		ms = TraceRays( instance, rays, hit, count, true );
+		Report( name, mesh, "shadow", ms, count, 0, count / (ms * 1000) );
+	}
+	_aligned_free( rays );
+	delete[] hit;
+	delete[] primaryHit;
+	delete[] shadowOrigin;
+}
+
+void BenchmarkApp::Report( const char* name, Mesh* mesh, const char* test, float ms, uint count, float sah, float mrays )
+{
+	char line[256];
+	sprintf( line, "%s,%i,%s,%s,%.3f,%u,%.2f,%.2f", name, mesh->triCount, config, test, ms, count, sah, mrays );
+	printf( "%s\n", line );
+	fprintf( csv, "%s\n", line );
+	fflush( csv );
+}
+
+void BenchmarkApp::Shutdown()
+{
+	if (csv) fclose( csv );
+}
+
+// EOF
\ No newline at end of file
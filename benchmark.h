@@ -0,0 +1,31 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// application class
+class BenchmarkApp : public TheApp
+{
+public:
+	// game flow methods
+	void Init();
+	void BenchmarkMesh( const char* name, Mesh* mesh );
+	void BenchmarkBuilds( const char* name, Mesh* mesh );
+	void BenchmarkTLAS( const char* name, Mesh* mesh );
+	void BenchmarkRays( const char* name, Mesh* mesh );
+	void Report( const char* name, Mesh* mesh, const char* test, float ms, uint count, float sah, float mrays );
+	void Tick( float deltaTime ) { /* the benchmark runs in Init */ }
+	void Shutdown();
+	// input handling
+	void MouseUp( int button ) { /* implement if you want to detect mouse button presses */ }
+	void MouseDown( int button ) { /* implement if you want to detect mouse button presses */ }
+	void MouseMove( int x, int y ) { /* implement if you want to detect mouse movement */ }
+	void MouseWheel( float y ) { /* implement if you want to handle the mouse wheel */ }
+	void KeyUp( int key ) { /* implement if you want to handle keys */ }
+	void KeyDown( int key ) { /* implement if you want to handle keys */ }
+	// data members
+	FILE* csv = 0;		// results, one line per test, also echoed to stdout
+	char config[64];	// compile-time BVH switches, so results of different builds can be told apart
+};
+
+} // namespace Tmpl8
\ No newline at end of file
@@ -13,13 +13,40 @@
 // rights are reserved. No responsibility is accepted either.
 // For updates, follow me on twitter: @j_bikker.
 
+// build the TLAS on the GPU: only boid positions and velocities are uploaded per frame;
+// comment out to build and refit the TLAS on the CPU and upload the changed nodes instead
+#define GPU_TLAS
+
+// simulate the flock on the GPU as well: boid state stays on the device
+#ifdef GPU_TLAS
+#define GPU_FLOCK
+#endif
+
+// time kernels and transfers; statistics are written to profile.csv on exit
+// #define GPU_PROFILING
+
+// push the dragon triangles apart along their normals and back; the BLAS is rebuilt every
+// frame, as an LBVH: on the GPU with GPU_TLAS, otherwise on the CPU
+// #define EXPLODING_DRAGONS
+
+// render with the wavefront path tracer (cl/wavefront.cl); value is the maximum path length
+// #define WAVEFRONT 4
+
+// simulate the next frame on the CPU while the GPU renders this one, see TheApp::Simulate
+#define FRAME_PIPELINING
+
+// one sample per pixel, denoised with temporal accumulation and an a-trous filter (cl/denoise.cl)
+// #define DENOISE
+
 TheApp* CreateApp() { return new BeyondApp(); }
 
 struct Flock
 {
 	const static int GRIDDIM = 32;		// dimension of the 3D acceleration grid
-	const static int BINSIZE = 128;	// capacity of each grid cell
+	const static int CELLS = GRIDDIM * GRIDDIM * GRIDDIM;
 	const static int GROUPS = 64;		// job count for threaded flock update
+	const static int SORTGROUPS = 8;	// job count for the counting sort; one histogram each
+	const static int MAXBOIDS = 21000;
 	struct Boid // adapted from https://processing.org/examples/flocking.html
 	{
 	public:
@@ -29,13 +56,16 @@ struct Flock
 			velocity = float3( RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f );
 			maxspeed = 1, maxforce = 0.03f;
 		}
-		void Tick( int group )
+		void Tick()
 		{
-			Flock::FindNearbyBoids( group, position, 80 );
-			velocity += separate( group ) * 2.5f;
-			velocity += align( group ) * 1.0f;
-			velocity += cohesion( group ) * 0.3f;
-			velocity += aim( group ) * 0.05f;
+			// a single pass over the neighbours yields the input for all three steering terms
+			float3 separation, velocitySum, positionSum;
+			int separating, neighbours;
+			Flock::Gather( position, 80, 35, separation, separating, velocitySum, positionSum, neighbours );
+			velocity += separate( separation, separating ) * 2.5f;
+			velocity += align( velocitySum, neighbours ) * 1.0f;
+			velocity += cohesion( positionSum, neighbours ) * 0.3f;
+			velocity += aim() * 0.05f;
 			if (sqrLength( velocity ) > maxspeed * maxspeed) velocity = normalize( velocity ) * maxspeed;
 			newpos = position + velocity;
 			for (int a = 0; a < 3; a++)
@@ -44,50 +74,32 @@ struct Flock
 				if (newpos[a] > 249.9f) newpos[a] = -249.9f;
 			}
 		}
-		float3 separate( int group )
+		float3 separate( float3 steer, int count )
 		{
-			float3 steer( 0 );
-			int count = Flock::nearBoids[group], actual = 0;
-			for (int i = 0; i < count; i++)
-			{
-				Boid& other = Flock::boid[nearBoid[group][i]];
-				float d2 = sqrLength( position - other.position );
-				if (d2 == 0 || d2 > ( 35 * 35 )) continue;
-				steer += normalize( position - other.position ) * (1.0f / sqrtf( d2 )), actual++;
-			}
+			// steer: sum of normalize( position - other ) / distance over close boids
 			if (sqrLength( steer ) > 0)
 			{
-				steer = normalize( steer * (1.0f / actual) ) * maxspeed - velocity;
+				steer = normalize( steer * (1.0f / count) ) * maxspeed - velocity;
 				if (sqrLength( steer ) > maxforce * maxforce) steer = normalize( steer ) * maxforce;
 			}
 			return steer;
 		}
-		float3 align( int group )
+		float3 align( float3 sum, int count )
 		{
-			float3 sum( 0 );
-			int count = Flock::nearBoids[group];
 			if (count == 0) return float3( 0 );
-			for (int i = 0; i < count; i++)
-			{
-				Boid& other = Flock::boid[nearBoid[group][i]];
-				sum += other.velocity;
-			}
 			sum = normalize( sum * (1.0f / count) ) * maxspeed;
 			float3 steer = sum - velocity;
 			if (sqrLength( steer ) > maxforce * maxforce) steer = normalize( steer ) * maxforce;
 			return steer;
 		}
-		float3 cohesion( int group )
+		float3 cohesion( float3 sum, int count )
 		{
-			float3 sum( 0 );
-			int count = Flock::nearBoids[group];
 			if (count == 0) return float3( 0 );
-			for (int i = 0; i < count; i++) sum += Flock::boid[nearBoid[group][i]].position;
 			float3 steer = normalize( sum * (1.0f / count) - position ) * maxspeed - velocity;
 			if (sqrLength( steer ) > maxforce * maxforce) steer = normalize( steer ) * maxforce;
 			return steer;
 		}
-		float3 aim( int group )
+		float3 aim()
 		{
 			float3 steer = normalize( Flock::food - position ) * maxspeed - velocity;
 			if (sqrLength( steer ) > maxforce * maxforce) steer = normalize( steer ) * maxforce;
@@ -100,62 +112,129 @@ struct Flock
 	};
 	Flock()
 	{
-		for (int i = 0; i < GROUPS; i++) nearBoid[i] = new int[BINSIZE * 5 * 5 * 5];
-		boid = new Boid[21000], boids = 0;
-		grid = new int[GRIDDIM * GRIDDIM * GRIDDIM * BINSIZE];
+		boid = new Boid[MAXBOIDS], boids = 0;
+		cellOf = new int[MAXBOIDS];
+		cellStart = new int[CELLS + 1];
+		histogram = new int[SORTGROUPS * CELLS];
+		// boid state sorted by cell, in SoA layout; padded for 8-wide loads, and zeroed, so that
+		// the lanes past the last boid hold finite values
+		for (int i = 0; i < 6; i++)
+			sorted[i] = (float*)_aligned_malloc( (MAXBOIDS + 8) * sizeof( float ), 64 ),
+			memset( sorted[i], 0, (MAXBOIDS + 8) * sizeof( float ) );
+	}
+	static int CellIdx( const float3& p )
+	{
+		int ix = min( GRIDDIM - 1, max( 0, (int)((p.x + 256) * 0.0625f) ) ); // yields 0..31
+		int iy = min( GRIDDIM - 1, max( 0, (int)((p.y + 256) * 0.0625f) ) );
+		int iz = min( GRIDDIM - 1, max( 0, (int)((p.z + 256) * 0.0625f) ) );
+		return ix + iy * GRIDDIM + iz * GRIDDIM * GRIDDIM;
 	}
 	void Tick()
 	{
-		// rebuild the grid
-		memset( grid, 0, GRIDDIM * GRIDDIM * GRIDDIM * BINSIZE * 4 ); // bin holds counter + BINSIZE indices
-		for (int i = 0; i < boids; i++)
+		// counting sort of the boids by grid cell: per-job histograms, prefix sum, scatter
+		JobManager* jm = JobManager::GetJobManager();
+		memset( histogram, 0, SORTGROUPS * CELLS * sizeof( int ) );
+		jm->ParallelFor( SORTGROUPS, [&]( int g )
 		{
-			int ix = (int)((boid[i].position.x + 256) * 0.0625f); // yields 0..31
-			int iy = (int)((boid[i].position.y + 256) * 0.0625f); // yields 0..31
-			int iz = (int)((boid[i].position.z + 256) * 0.0625f); // yields 0..31
-			int addr = (ix + iy * GRIDDIM + iz * GRIDDIM * GRIDDIM) * BINSIZE;
-			int& count = grid[addr];
-			if (count < (BINSIZE - 1)) grid[++count] = i; // otherwise, skip the boid, np
+			int* h = histogram + g * CELLS;
+			for (int i = (boids * g) / SORTGROUPS; i < (boids * (g + 1)) / SORTGROUPS; i++)
+				h[cellOf[i] = CellIdx( boid[i].position )]++;
+		} );
+		for (int c = 0, sum = 0; c < CELLS; c++)
+		{
+			// within a cell, boids are ordered by job and then by index, so the result is deterministic
+			cellStart[c] = sum;
+			for (int g = 0; g < SORTGROUPS; g++)
+			{
+				const int n = histogram[g * CELLS + c];
+				histogram[g * CELLS + c] = sum, sum += n;
+			}
 		}
-		// update the boids in groups using OpenMP
-	#pragma omp parallel for schedule(dynamic)
-		for (int g = 0; g < GROUPS; g++)
+		cellStart[CELLS] = boids;
+		jm->ParallelFor( SORTGROUPS, [&]( int g )
+		{
+			int* h = histogram + g * CELLS;
+			for (int i = (boids * g) / SORTGROUPS; i < (boids * (g + 1)) / SORTGROUPS; i++)
+			{
+				const int j = h[cellOf[i]]++;
+				sorted[0][j] = boid[i].position.x, sorted[1][j] = boid[i].position.y, sorted[2][j] = boid[i].position.z;
+				sorted[3][j] = boid[i].velocity.x, sorted[4][j] = boid[i].velocity.y, sorted[5][j] = boid[i].velocity.z;
+			}
+		} );
+		// update the boids in groups using the job manager
+		jm->ParallelFor( GROUPS, [&]( int g )
 		{
 			int first = (boids * g) / GROUPS;
 			int last = (boids * (g + 1)) / GROUPS - 1;
 			if (g == (GROUPS - 1)) last = boids - 1;
-			for (int i = first; i <= last; i++) boid[i].Tick( g );
-		}
+			for (int i = first; i <= last; i++) boid[i].Tick();
+		} );
 		// record the updated positions
 		for (int i = 0; i < boids; i++) boid[i].position = boid[i].newpos;
 	}
-	static void FindNearbyBoids( int group, float3 position, float radius )
+	static float HorizontalSum( const __m256 v )
 	{
-		int count = 0;
+		const __m128 s = _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+		const __m128 t = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+		return _mm_cvtss_f32( _mm_add_ss( t, _mm_shuffle_ps( t, t, 1 ) ) );
+	}
+	static void Gather( const float3& position, float radius, float separation,
+		float3& separationSum, int& separating, float3& velocitySum, float3& positionSum, int& neighbours )
+	{
+		// boids within 'radius' contribute to alignment and cohesion, those within
+		// 'separation' also to separation; 8 boids per iteration, in cell order
 		int ix = (int)((position.x + 256) * 0.0625f);
 		int iy = (int)((position.y + 256) * 0.0625f);
 		int iz = (int)((position.z + 256) * 0.0625f);
 		int gx1 = max( 0, ix - 2 ), gx2 = min( GRIDDIM - 1, ix + 2 );
 		int gy1 = max( 0, iy - 2 ), gy2 = min( GRIDDIM - 1, iy + 2 );
 		int gz1 = max( 0, iz - 2 ), gz2 = min( GRIDDIM - 1, iz + 2 );
-		float r2 = radius * radius;
-		for (int z = gz1; z <= gz2; z++) for (int y = gy1; y <= gy2; y++) for (int x = gx1; x <= gx2; x++)
+		const __m256 px = _mm256_set1_ps( position.x ), py = _mm256_set1_ps( position.y ), pz = _mm256_set1_ps( position.z );
+		const __m256 r2 = _mm256_set1_ps( radius * radius ), s2 = _mm256_set1_ps( separation * separation );
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps( 1 ), lane = _mm256_set_ps( 7, 6, 5, 4, 3, 2, 1, 0 );
+		__m256 sepX = zero, sepY = zero, sepZ = zero, sepN = zero, velX = zero, velY = zero, velZ = zero;
+		__m256 posX = zero, posY = zero, posZ = zero, nearN = zero;
+		for (int z = gz1; z <= gz2; z++) for (int y = gy1; y <= gy2; y++)
 		{
-			int addr = (x + y * GRIDDIM + z * GRIDDIM * GRIDDIM) * BINSIZE;
-			for (int c = 0; c < grid[addr]; c++)
+			// cells gx1..gx2 of a row are adjacent in the sorted arrays
+			const int row = y * GRIDDIM + z * GRIDDIM * GRIDDIM;
+			const int first = cellStart[row + gx1], last = cellStart[row + gx2 + 1];
+			for (int j = first; j < last; j += 8)
 			{
-				int j = grid[addr + c + 1];
-				float dist2 = sqrLength( position - boid[j].position );
-				if (dist2 < r2 && dist2 > 0) nearBoid[group][count++] = j;
+				const __m256 ox = _mm256_loadu_ps( sorted[0] + j ), oy = _mm256_loadu_ps( sorted[1] + j ), oz = _mm256_loadu_ps( sorted[2] + j );
+				const __m256 dx = _mm256_sub_ps( px, ox ), dy = _mm256_sub_ps( py, oy ), dz = _mm256_sub_ps( pz, oz );
+				const __m256 d2 = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ), _mm256_mul_ps( dz, dz ) );
+				const __m256 inRange = _mm256_cmp_ps( lane, _mm256_set1_ps( (float)(last - j) ), _CMP_LT_OQ );
+				const __m256 nonzero = _mm256_and_ps( inRange, _mm256_cmp_ps( d2, zero, _CMP_GT_OQ ) );
+				const __m256 isNear = _mm256_and_ps( nonzero, _mm256_cmp_ps( d2, r2, _CMP_LT_OQ ) );
+				const __m256 isClose = _mm256_and_ps( isNear, _mm256_cmp_ps( d2, s2, _CMP_LE_OQ ) );
+				if (_mm256_movemask_ps( isNear ) == 0) continue;
+				// separation: normalize( d ) / |d| = d / d2; lanes are masked after the product, as
+				// NaN * 0 is not 0 (lanes past the last boid of the row hold other boids' data)
+				const __m256 w = _mm256_div_ps( one, d2 );
+				sepX = _mm256_add_ps( sepX, _mm256_and_ps( isClose, _mm256_mul_ps( dx, w ) ) ), sepN = _mm256_add_ps( sepN, _mm256_and_ps( isClose, one ) );
+				sepY = _mm256_add_ps( sepY, _mm256_and_ps( isClose, _mm256_mul_ps( dy, w ) ) );
+				sepZ = _mm256_add_ps( sepZ, _mm256_and_ps( isClose, _mm256_mul_ps( dz, w ) ) );
+				// alignment and cohesion
+				velX = _mm256_add_ps( velX, _mm256_and_ps( isNear, _mm256_loadu_ps( sorted[3] + j ) ) );
+				velY = _mm256_add_ps( velY, _mm256_and_ps( isNear, _mm256_loadu_ps( sorted[4] + j ) ) );
+				velZ = _mm256_add_ps( velZ, _mm256_and_ps( isNear, _mm256_loadu_ps( sorted[5] + j ) ) );
+				posX = _mm256_add_ps( posX, _mm256_and_ps( isNear, ox ) ), nearN = _mm256_add_ps( nearN, _mm256_and_ps( isNear, one ) );
+				posY = _mm256_add_ps( posY, _mm256_and_ps( isNear, oy ) ), posZ = _mm256_add_ps( posZ, _mm256_and_ps( isNear, oz ) );
 			}
 		}
-		nearBoids[group] = count;
+		separationSum = float3( HorizontalSum( sepX ), HorizontalSum( sepY ), HorizontalSum( sepZ ) );
+		velocitySum = float3( HorizontalSum( velX ), HorizontalSum( velY ), HorizontalSum( velZ ) );
+		positionSum = float3( HorizontalSum( posX ), HorizontalSum( posY ), HorizontalSum( posZ ) );
+		separating = (int)HorizontalSum( sepN ), neighbours = (int)HorizontalSum( nearN );
 	}
 	// data members
-	static inline int* nearBoid[GROUPS];
-	static inline int nearBoids[GROUPS], boids = 0;
+	static inline int boids = 0;
 	static inline Boid* boid = 0;
-	static inline int* grid = 0;
+	static inline int* cellOf = 0;		// grid cell per boid
+	static inline int* cellStart = 0;	// first sorted boid per cell; cellStart[CELLS] = boids
+	static inline int* histogram = 0;	// per sort job: boid count, then scatter offset, per cell
+	static inline float* sorted[6];		// x, y, z of position and velocity, sorted by cell
 	static inline float3 food = float3( 0 );
 };
 Flock flock;
@@ -192,6 +271,7 @@ void BeyondApp::Init()
 	// initial flock configuration: dragons in the shape of a dragon
 	boidCount = mesh->triCount;
 	bvhInstance = new BVHInstance[boidCount];
+	boidTransform = new mat4[boidCount];
 	flock.boids = boidCount;
 	for (int i = 0; i < boidCount; i++)
 		Flock::boid[i] = Flock::Boid( float3( RandomFloat() * 480 - 240, RandomFloat() * 480 - 240, RandomFloat() * 480 - 240 ) ),
@@ -199,23 +279,78 @@ void BeyondApp::Init()
 	tlas = TLAS( bvhInstance, boidCount );
 	// prepare OpenCL
 	tracer = new Kernel( "cl/raytracer.cl", "render" );
+	tracer->tracesRays = true;
+#ifdef WAVEFRONT
+	wavefront = new WavefrontTracer( 2, WAVEFRONT );
+#elif defined DENOISE
+	denoiser = new Denoiser( tracer );
+#endif
 	target = new Buffer( GetRenderTarget()->ID, 0, Buffer::TARGET );
 	screen = 0;
-	skyData = new Buffer( skyWidth * skyHeight * 3 * sizeof( float ), skyPixels );
-	skyData->CopyToDevice();
-	triData = new Buffer( mesh->triCount * sizeof( Tri ), mesh->tri );
-	triExData = new Buffer( mesh->triCount * sizeof( TriEx ), mesh->triEx );
-	Surface* tex = mesh->texture;
-	texData = new Buffer( tex->width * tex->height * sizeof( uint ), tex->pixels );
+	skyData = SkyDome( skyPixels, skyWidth, skyHeight ).skyData;
+	stbi_image_free( skyPixels ), skyPixels = 0;
+	// upload geometry; instances receive the offsets of their BLAS in the scene buffers
+	scene.AddMesh( mesh );
+	scene.SetInstances( bvhInstance, boidCount );
+	scene.Upload();
+	triData = scene.triData, triExData = scene.triExData, texData = scene.texData;
+	bvhData = scene.bvhData, idxData = scene.idxData;
 	instData = new Buffer( boidCount * sizeof( BVHInstance ), bvhInstance );
 	tlasData = new Buffer( (boidCount * 2 + 64) * sizeof( TLASNode ), tlas.tlasNode );
-	bvhData = new Buffer( mesh->bvh->nodesUsed * sizeof( BVHNode ), mesh->bvh->bvhNode );
-	idxData = new Buffer( mesh->triCount * sizeof( uint ), mesh->bvh->triIdx );
-	triData->CopyToDevice();
-	triExData->CopyToDevice();
-	texData->CopyToDevice();
-	bvhData->CopyToDevice();
-	idxData->CopyToDevice();
+	instData->CopyToDevice(); // BLAS offsets; GPU_TLAS only updates the transforms
+	meshMin = mesh->bvh->bvhNode[0].aabbMin, meshMax = mesh->bvh->bvhNode[0].aabbMax;
+#ifdef EXPLODING_DRAGONS
+#ifdef BVH_QUANTIZED
+	FatalError( "EXPLODING_DRAGONS uploads BVHNodes; disable BVH_QUANTIZED." );
+#endif
+	// keep the rest pose; the node buffer is sized for an LBVH, which may need more
+	// nodes than the reordered tree in the scene buffers. A full Build reserves enough
+	// nodes for both, so the buffer keeps pointing at the nodes, and it prepares the
+	// subtrees for BVH::UpdatePartial.
+	restTri = (Tri*)_aligned_malloc( mesh->triCount * sizeof( Tri ), 64 );
+	memcpy( restTri, mesh->tri, mesh->triCount * sizeof( Tri ) );
+	restMin = meshMin, restMax = meshMax;
+	mesh->bvh->Build();
+	scene.bvhData = bvhData = new Buffer( mesh->triCount * 2 * sizeof( BVHNode ), mesh->bvh->bvhNode ); // for WAVEFRONT, DENOISE
+	bvhData->CopyToDevice(), idxData->CopyToDevice();
+#ifdef GPU_TLAS
+	gpuBVH = new GPUBVH( triData, bvhData, idxData, mesh->triCount );
+#endif
+#endif
+#ifdef GPU_TLAS
+	// instance transforms, instance bounds and the TLAS are produced on the device
+	boidState = (float4*)_aligned_malloc( boidCount * 2 * sizeof( float4 ), 64 );
+	boidData = new Buffer( boidCount * 2 * sizeof( float4 ), boidState );
+	instBoundsData = new Buffer( boidCount * 2 * sizeof( float4 ) );
+	boidUpdater = new Kernel( "cl/boids.cl", "updateBoids" );
+	gpuTLAS = new GPUTLAS( instBoundsData, tlasData, boidCount );
+#ifdef GPU_FLOCK
+	// initial boid state is uploaded once; the simulation ping-pongs between two buffers
+	for (int i = 0; i < boidCount; i++)
+		boidState[i * 2] = make_float4( Flock::boid[i].position, 0 ),
+		boidState[i * 2 + 1] = make_float4( Flock::boid[i].velocity, 0 );
+	boidData->CopyToDevice();
+	nextBoidData = new Buffer( boidCount * 2 * sizeof( float4 ) );
+	sortedBoidData = new Buffer( boidCount * 2 * sizeof( float4 ) );
+	cellOfData = new Buffer( boidCount * sizeof( uint ) );
+	cellCountData = new Buffer( Flock::CELLS * sizeof( uint ) );
+	cellStartData = new Buffer( (Flock::CELLS + 1) * sizeof( uint ) );
+	countCells = new Kernel( boidUpdater->GetProgram(), "countCells" );
+	scanCells = new Kernel( boidUpdater->GetProgram(), "scanCells" );
+	scatterBoids = new Kernel( boidUpdater->GetProgram(), "scatterBoids" );
+	simulateBoids = new Kernel( boidUpdater->GetProgram(), "simulateBoids" );
+#endif
+#else
+	// per-frame TLAS and instance uploads overlap with rendering the previous frame
+	instRing = new UploadRing( boidCount * sizeof( BVHInstance ) );
+	tlasRing = new UploadRing( (boidCount * 2 + 64) * sizeof( TLASNode ) );
+#endif
+#ifdef GPU_PROFILING
+	GPUProfiler::enabled = true;
+#endif
+#ifdef FRAME_PIPELINING
+	pipelined = true;
+#endif
 	// fetch camera
 	FILE* f = fopen( "camera.bin", "rb" );
 	if (!f) return;
@@ -224,44 +359,116 @@ void BeyondApp::Init()
 	fclose( f );
 }
 
-void CL_CALLBACK process( cl_event ev, cl_int status, void* data )
+void BeyondApp::Explode( float deltaTime )
 {
-	cl_ulong start, end;
-	clGetEventProfilingInfo( ev, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &start, NULL );
-	clGetEventProfilingInfo( ev, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &end, NULL );
-	float sec = ((float)(end - start)) / 1000000000.0f;
-	static float avg = 0;
-	static int frames = 0;
-	if (frames++ < 10) avg = sec; else avg = 0.95f * avg + 0.05f * sec;
-	printf( "kernel time: %.2fms (%.2fMrays/s)\n", sec * 1000, ((float)(512 * 1024 * 16) / 1000000) / avg );
+	// offset each triangle along its face normal; a full cycle takes about three seconds
+	static float phase = 0;
+	Timer t;
+	phase += deltaTime * 0.002f;
+	const float3 extent = restMax - restMin;
+	const float distance = (0.5f - 0.5f * cosf( phase )) * 0.2f * max( extent.x, max( extent.y, extent.z ) );
+	JobManager::GetJobManager()->ParallelFor( mesh->triCount, [&]( int i )
+	{
+		const Tri& rest = restTri[i];
+		const float3 N = cross( rest.vertex1 - rest.vertex0, rest.vertex2 - rest.vertex0 );
+		const float area = length( N );
+		const float3 offset = area > 0 ? N * (distance / area) : float3( 0 );
+		Tri& tri = mesh->tri[i];
+		tri.vertex0 = rest.vertex0 + offset, tri.vertex1 = rest.vertex1 + offset, tri.vertex2 = rest.vertex2 + offset;
+	}, 4096 );
+#ifdef GPU_TLAS
+	// the BLAS is built on the device, in Tick; the instance bounds conservatively include the offsets
+	meshMin = restMin - float3( distance ), meshMax = restMax + float3( distance );
+	printf( "explosion: %.2fms, ", t.elapsed() * 1000 );
+#else
+	// the triangles move apart locally: rebuild only the subtrees that degraded
+	mesh->bvh->UpdatePartial();
+	meshMin = mesh->bvh->bvhNode[0].aabbMin, meshMax = mesh->bvh->bvhNode[0].aabbMax;
+	printf( "explosion + BLAS update: %.2fms, ", t.elapsed() * 1000 );
+#endif
 }
 
-void BeyondApp::Tick( float deltaTime )
+void BeyondApp::Simulate( float deltaTime )
 {
-#if 1
+	// the CPU side of the next frame; no OpenCL calls here, see TheApp::Simulate
+#ifdef EXPLODING_DRAGONS
+	Explode( deltaTime );
+#endif
 	// move the boids
 	Timer t;
-	flock.Tick();
 	static int foodCounter = 300;
 	if (--foodCounter < 0)
 	{
 		foodCounter = (RandomUInt() & 255) + 64;
 		Flock::food = float3( RandomFloat() * 300 - 150, RandomFloat() * 300 - 150, RandomFloat() * 300 - 150 );
 	}
+#ifndef GPU_FLOCK
+	flock.Tick();
 	printf( "flock update: %.2fms, ", t.elapsed() * 1000 );
 	t.reset();
+#ifdef GPU_TLAS
+	for (int i = 0; i < boidCount; i++)
+		boidState[i * 2] = make_float4( Flock::boid[i].position, 0 ),
+		boidState[i * 2 + 1] = make_float4( Flock::boid[i].velocity, 0 );
+#else
 	for (int i = 0; i < boidCount; i++)
 	{
 		float3 boidPos = Flock::boid[i].position * 0.1f;
 		float3 boidDir = normalize( Flock::boid[i].velocity );
 		mat4 orientation = mat4::LookAt( boidPos, boidPos + boidDir, float3( 0, 1, 0 ) );
-		bvhInstance[i].SetTransform( mat4::Translate( boidPos ) * orientation * mat4::Scale( 0.0025f ) );
+		boidTransform[i] = mat4::Translate( boidPos ) * orientation * mat4::Scale( 0.0025f );
 	}
-	// rebuild the TLAS
-	tlas.BuildQuick();
-	printf( "TLAS update: %.2fms\n", t.elapsed() * 1000 );
-	instData->CopyToDevice();
-	tlasData->CopyToDevice();
+	BVHInstance::SetTransforms( bvhInstance, boidTransform, boidCount, &instDirty );
+	// update the TLAS; this only rebuilds it if the tree quality degraded too much
+	tlas.Update();
+	printf( "TLAS update: %.2fms, ", t.elapsed() * 1000 );
+#endif
+#endif
+}
+
+void BeyondApp::Tick( float deltaTime )
+{
+	// send the state of the last Simulate to the device, and render it; the host copies are
+	// free for the next Simulate once this returns: uploads block, or go via staging memory
+	if (!pipelined) Simulate( deltaTime );
+	Timer t;
+#ifdef EXPLODING_DRAGONS
+#ifdef GPU_TLAS
+	triData->CopyToDevice();
+	gpuBVH->Build();
+#else
+	triData->CopyToDevice(), bvhData->CopyToDevice(), idxData->CopyToDevice();
+#endif
+#endif
+#ifdef GPU_FLOCK
+	// counting sort of the boids by grid cell, then steering and instance transforms in one kernel
+	cellCountData->Clear();
+	countCells->SetArguments( boidData, cellOfData, cellCountData, boidCount );
+	countCells->Run( boidCount );
+	scanCells->SetArguments( cellCountData, cellStartData, boidCount );
+	scanCells->Run( 256, 256 );
+	scatterBoids->SetArguments( boidData, cellOfData, cellCountData, sortedBoidData, boidCount );
+	scatterBoids->Run( boidCount );
+	simulateBoids->SetArguments( boidData, sortedBoidData, cellStartData, nextBoidData, instData, instBoundsData,
+		Flock::food, meshMin, meshMax, 0.0025f, boidCount );
+	simulateBoids->Run( boidCount );
+	swap( boidData, nextBoidData );
+	gpuTLAS->Build();
+	printf( "flock update + TLAS build (enqueued): %.2fms\n", t.elapsed() * 1000 );
+#elif defined GPU_TLAS
+	boidData->CopyToDevice();
+	boidUpdater->SetArguments( boidData, instData, instBoundsData,
+		meshMin, meshMax, 0.0025f, boidCount );
+	boidUpdater->Run( boidCount );
+	gpuTLAS->Build();
+	printf( "TLAS build (enqueued): %.2fms\n", t.elapsed() * 1000 );
+#else
+	// only the instances and TLAS nodes that changed are sent
+	instData = instRing->Upload( bvhInstance, boidCount * sizeof( BVHInstance ), &instDirty, sizeof( BVHInstance ) );
+	instDirty.Clear();
+	tlasData = tlasRing->Upload( tlas.tlasNode, tlas.nodesUsed * sizeof( TLASNode ), &tlas.dirty, sizeof( TLASNode ) );
+	tlas.dirty.Clear();
+	printf( "upload: %.2fms\n", t.elapsed() * 1000 );
 #endif
 	// construct camera matrix
 	HandleKeys( deltaTime );
@@ -271,16 +478,27 @@ void BeyondApp::Tick( float deltaTime )
 	p1 = TransformPosition( float3( 1 * ar, 1, 1.5f ), M );
 	p2 = TransformPosition( float3( -1 * ar, -1, 1.5f ), M );
 	// render the scene using the GPU & gather profling information
+#ifdef WAVEFRONT
+	wavefront->Render( target, skyData, scene, tlasData, instData, camPos, p0, p1, p2 );
+#elif defined DENOISE
+	denoiser->Render( target, skyData, scene, tlasData, instData, camPos, p0, p1, p2 );
+#else
 	tracer->SetArguments(
 		target, skyData,
 		triData, triExData, texData, tlasData, instData, bvhData, idxData,
 		camPos, p0, p1, p2
 	);
-	static bool inited = false;
-	static cl_event ev;
-	if (!inited) ev = clCreateUserEvent( tracer->GetContext(), 0 ), inited = true;
-	// clSetEventCallback( ev, CL_COMPLETE, &process, NULL );
-	tracer->Run( SCRWIDTH * SCRHEIGHT, 0, 0, &ev );
+	tracer->Run( SCRWIDTH * SCRHEIGHT );
+#endif
+#ifndef GPU_TLAS
+	instRing->Release(), tlasRing->Release();
+#endif
+#ifdef GPU_PROFILING
+	// kernel and transfer timings of the frames that completed so far
+	GPUProfiler::Update();
+	static int frame = 0;
+	if (++frame % 100 == 0) GPUProfiler::Print();
+#endif
 }
 
 void BeyondApp::Shutdown()
@@ -289,6 +507,11 @@ void BeyondApp::Shutdown()
 	fwrite( &camPos, 1, sizeof( camPos ), f );
 	fwrite( &camTarget, 1, sizeof( camTarget ), f );
 	fclose( f );
+#ifdef GPU_PROFILING
+	clFinish( Kernel::GetQueue() ), clFinish( Kernel::GetQueue2() );
+	GPUProfiler::Update();
+	GPUProfiler::Save( "profile.csv" );
+#endif
 }
 
 // EOF
\ No newline at end of file
@@ -10,6 +10,8 @@ public:
 	// game flow methods
 	void Init();
 	void HandleKeys( float dt );
+	void Explode( float deltaTime );
+	void Simulate( float deltaTime );
 	void Tick( float deltaTime );
 	void Shutdown();
 	// input handling
@@ -28,6 +30,8 @@ public:
 	float* skyPixels;
 	int skyWidth, skyHeight, skyBpp;
 	Kernel* tracer;		// the ray tracing kernel
+	WavefrontTracer* wavefront;	// alternative renderer (WAVEFRONT)
+	Denoiser* denoiser;	// one sample per pixel, filtered (DENOISE)
 	Buffer* target;		// buffer encapsulating texture that holds the rendered image
 	Buffer* skyData;	// buffer for the skydome texture
 	Buffer* triData;	// buffer for the mesh Tri data (vertices for intersection)
@@ -37,10 +41,30 @@ public:
 	Buffer* instData;	// buffer for BVHInstance data
 	Buffer* bvhData;	// buffer for BVH node data
 	Buffer* idxData;	// buffer for triangle index data for BVH
+	Scene scene;		// consolidated geometry buffers for all meshes
+	Buffer* boidData;	// buffer for boid positions and velocities (GPU_TLAS)
+	Buffer* instBoundsData;	// buffer for world space instance bounds (GPU_TLAS)
+	Kernel* boidUpdater;	// calculates instance transforms and bounds (GPU_TLAS)
+	GPUTLAS* gpuTLAS;	// builds the TLAS on the device (GPU_TLAS)
+	GPUBVH* gpuBVH;		// rebuilds the BLAS on the device (EXPLODING_DRAGONS + GPU_TLAS)
+	UploadRing* instRing, *tlasRing;	// double-buffered uploads (no GPU_TLAS)
+	DirtyRanges instDirty;	// instances changed since the last upload (no GPU_TLAS)
+	Buffer* nextBoidData;	// boid state after the simulation step (GPU_FLOCK)
+	Buffer* sortedBoidData;	// boid state in grid cell order (GPU_FLOCK)
+	Buffer* cellOfData;	// grid cell per boid (GPU_FLOCK)
+	Buffer* cellCountData;	// boid count per cell, then scatter offset (GPU_FLOCK)
+	Buffer* cellStartData;	// first sorted boid per cell (GPU_FLOCK)
+	Kernel* countCells, *scanCells, *scatterBoids, *simulateBoids; // flock simulation (GPU_FLOCK)
 	// boids data
 	float3* boidPos = 0;
 	float3* boidDir = 0;
+	float4* boidState = 0;	// position, velocity
+	mat4* boidTransform = 0;	// instance transforms, for BVHInstance::SetTransforms
 	int boidCount = 0;
+	// exploding dragons
+	Tri* restTri = 0;	// undeformed triangles (EXPLODING_DRAGONS)
+	float3 restMin, restMax;	// bounds of the undeformed mesh
+	float3 meshMin, meshMax;	// object space bounds of the BLAS, for the instance bounds
 };
 
 } // namespace Tmpl8
\ No newline at end of file
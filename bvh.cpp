@@ -11,9 +11,13 @@ with kDtree:
 - 836ms with cache alignment
 */
 
+#ifdef TRAVERSAL_STATS
+thread_local TraversalStats Tmpl8::traversalStats;
+#endif
+
 // functions
 
-void IntersectTri( Ray& ray, const Tri& tri, const uint instPrim )
+void IntersectTri( Ray& ray, const Tri& tri, const instprim instPrim )
 {
 	// Moeller-Trumbore ray/triangle intersection algorithm, see:
 	// en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
@@ -35,6 +39,67 @@ void IntersectTri( Ray& ray, const Tri& tri, const uint instPrim )
 		ray.hit.v = v, ray.hit.instPrim = instPrim;
 }
 
+inline void IntersectTri( Ray& ray, const TriWoop& tri, const instprim instPrim )
+{
+	// transform the ray to unit triangle space; the plane of the triangle is z = 0 there
+	const float Oz = tri.m2.w + tri.m2.x * ray.O.x + tri.m2.y * ray.O.y + tri.m2.z * ray.O.z;
+	const float Dz = tri.m2.x * ray.D.x + tri.m2.y * ray.D.y + tri.m2.z * ray.D.z;
+	const float t = -Oz / Dz;
+	if (!(t > 0.0001f && t < ray.hit.t)) return; // also rejects Dz == 0
+	const float u = tri.m0.w + tri.m0.x * ray.O.x + tri.m0.y * ray.O.y + tri.m0.z * ray.O.z +
+		t * (tri.m0.x * ray.D.x + tri.m0.y * ray.D.y + tri.m0.z * ray.D.z);
+	if (u < 0 || u > 1) return;
+	const float v = tri.m1.w + tri.m1.x * ray.O.x + tri.m1.y * ray.O.y + tri.m1.z * ray.O.z +
+		t * (tri.m1.x * ray.D.x + tri.m1.y * ray.D.y + tri.m1.z * ray.D.z);
+	if (v < 0 || u + v > 1) return;
+	ray.hit.t = t, ray.hit.u = u, ray.hit.v = v, ray.hit.instPrim = instPrim;
+}
+
+inline bool OccludesTri( const Ray& ray, const TriWoop& tri )
+{
+	const float Oz = tri.m2.w + tri.m2.x * ray.O.x + tri.m2.y * ray.O.y + tri.m2.z * ray.O.z;
+	const float Dz = tri.m2.x * ray.D.x + tri.m2.y * ray.D.y + tri.m2.z * ray.D.z;
+	const float t = -Oz / Dz;
+	if (!(t > 0.0001f && t < ray.hit.t)) return false;
+	const float u = tri.m0.w + tri.m0.x * ray.O.x + tri.m0.y * ray.O.y + tri.m0.z * ray.O.z +
+		t * (tri.m0.x * ray.D.x + tri.m0.y * ray.D.y + tri.m0.z * ray.D.z);
+	if (u < 0 || u > 1) return false;
+	const float v = tri.m1.w + tri.m1.x * ray.O.x + tri.m1.y * ray.O.y + tri.m1.z * ray.O.z +
+		t * (tri.m1.x * ray.D.x + tri.m1.y * ray.D.y + tri.m1.z * ray.D.z);
+	return v >= 0 && u + v <= 1;
+}
+
+// leaf data used by the single-ray BLAS traversal functions, see IntersectLeaf
+#if defined LEAF_SOA
+#define LEAF_IDX leafBlock
+#define LEAF_TRIS leafSoA
+#elif defined TRI_WOOP
+#define LEAF_IDX (directTris ? 0 : triIdx)
+#define LEAF_TRIS triWoop
+#else
+#define LEAF_IDX (directTris ? 0 : triIdx)
+#define LEAF_TRIS mesh->tri
+#endif
+
+bool OccludesTri( const Ray& ray, const Tri& tri )
+{
+	// Moeller-Trumbore without the hit record update, for shadow rays
+	const float3 edge1 = tri.vertex1 - tri.vertex0;
+	const float3 edge2 = tri.vertex2 - tri.vertex0;
+	const float3 h = cross( ray.D, edge2 );
+	const float a = dot( edge1, h );
+	if (fabs( a ) < 0.00001f) return false; // ray parallel to triangle
+	const float f = 1 / a;
+	const float3 s = ray.O - tri.vertex0;
+	const float u = f * dot( s, h );
+	if (u < 0 || u > 1) return false;
+	const float3 q = cross( s, edge1 );
+	const float v = f * dot( ray.D, q );
+	if (v < 0 || u + v > 1) return false;
+	const float t = f * dot( edge2, q );
+	return t > 0.0001f && t < ray.hit.t;
+}
+
 inline float IntersectAABB( const Ray& ray, const float3 bmin, const float3 bmax )
 {
 	// "slab test" ray/AABB intersection
@@ -59,667 +124,4377 @@ float IntersectAABB_SSE( const Ray& ray, const __m128& bmin4, const __m128& bmax
 	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
 }
 
-// Mesh class implementation
+// ray data broadcast over 4 and 8 lanes, for wide BVH traversal
+struct WideRay4
+{
+	WideRay4( const Ray& ray )
+	{
+		Ox = _mm_set1_ps( ray.O.x ), Oy = _mm_set1_ps( ray.O.y ), Oz = _mm_set1_ps( ray.O.z );
+		rDx = _mm_set1_ps( ray.rD.x ), rDy = _mm_set1_ps( ray.rD.y ), rDz = _mm_set1_ps( ray.rD.z );
+	}
+	__m128 Ox, Oy, Oz, rDx, rDy, rDz;
+};
+struct WideRay8
+{
+	WideRay8( const Ray& ray )
+	{
+		Ox = _mm256_set1_ps( ray.O.x ), Oy = _mm256_set1_ps( ray.O.y ), Oz = _mm256_set1_ps( ray.O.z );
+		rDx = _mm256_set1_ps( ray.rD.x ), rDy = _mm256_set1_ps( ray.rD.y ), rDz = _mm256_set1_ps( ray.rD.z );
+	}
+	__m256 Ox, Oy, Oz, rDx, rDy, rDz;
+};
 
-Mesh::Mesh( const uint primCount )
+inline int IntersectChildren( const BVHNode4& node, const WideRay4& r, const float t, float* dist )
 {
-	// basic constructor, for top-down TLAS construction
-	tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 );
-	memset( tri, 0, primCount * sizeof( Tri ) );
-	triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
-	memset( triEx, 0, primCount * sizeof( TriEx ) );
-	triCount = primCount;
+	// slab test for four child nodes at once; returns a hit mask and entry distances
+	const __m128 tx1 = _mm_mul_ps( _mm_sub_ps( node.xmin4, r.Ox ), r.rDx ), tx2 = _mm_mul_ps( _mm_sub_ps( node.xmax4, r.Ox ), r.rDx );
+	const __m128 ty1 = _mm_mul_ps( _mm_sub_ps( node.ymin4, r.Oy ), r.rDy ), ty2 = _mm_mul_ps( _mm_sub_ps( node.ymax4, r.Oy ), r.rDy );
+	const __m128 tz1 = _mm_mul_ps( _mm_sub_ps( node.zmin4, r.Oz ), r.rDz ), tz2 = _mm_mul_ps( _mm_sub_ps( node.zmax4, r.Oz ), r.rDz );
+	const __m128 tmin = _mm_max_ps( _mm_max_ps( _mm_min_ps( tx1, tx2 ), _mm_min_ps( ty1, ty2 ) ), _mm_min_ps( tz1, tz2 ) );
+	const __m128 tmax = _mm_min_ps( _mm_min_ps( _mm_max_ps( tx1, tx2 ), _mm_max_ps( ty1, ty2 ) ), _mm_max_ps( tz1, tz2 ) );
+	const __m128 hit = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax, tmin ), _mm_cmplt_ps( tmin, _mm_set1_ps( t ) ) ), _mm_cmpgt_ps( tmax, _mm_setzero_ps() ) );
+	_mm_storeu_ps( dist, tmin );
+	return _mm_movemask_ps( hit );
 }
 
-Mesh::Mesh( const char* objFile, const char* texFile )
+inline int IntersectChildren( const BVHNode8& node, const WideRay8& r, const float t, float* dist )
 {
-	// bare-bones obj file loader; only supports very basic meshes
-	tri = new Tri[25000];
-	triEx = new TriEx[25000];
-	float2* UV = new float2[11042]; // enough for dragon.obj
-	N = new float3[11042], P = new float3[11042];
-	int UVs = 0, Ns = 0, Ps = 0, a, b, c, d, e, f, g, h, i;
-	FILE* file = fopen( objFile, "r" );
-	if (!file) return; // file doesn't exist
-	while (!feof( file ))
-	{
-		char line[512] = { 0 };
-		fgets( line, 511, file );
-		if (line == strstr( line, "vt " ))
-			sscanf( line + 3, "%f %f", &UV[UVs].x, &UV[UVs].y ), UVs++;
-		else if (line == strstr( line, "vn " ))
-			sscanf( line + 3, "%f %f %f", &N[Ns].x, &N[Ns].y, &N[Ns].z ), Ns++;
-		else if (line[0] == 'v')
-			sscanf( line + 2, "%f %f %f", &P[Ps].x, &P[Ps].y, &P[Ps].z ), Ps++;
-		if (line[0] != 'f') continue; else
-			sscanf( line + 2, "%i/%i/%i %i/%i/%i %i/%i/%i",
-				&a, &b, &c, &d, &e, &f, &g, &h, &i );
-		tri[triCount].vertex0 = P[a - 1], triEx[triCount].N0 = N[c - 1];
-		tri[triCount].vertex1 = P[d - 1], triEx[triCount].N1 = N[f - 1];
-		tri[triCount].vertex2 = P[g - 1], triEx[triCount].N2 = N[i - 1];
-		triEx[triCount].uv0 = UV[b - 1], triEx[triCount].uv1 = UV[e - 1];
-		triEx[triCount++].uv2 = UV[h - 1];
-	}
-	fclose( file );
-	bvh = new BVH( this );
-	texture = new Surface( texFile );
+	// slab test for eight child nodes at once; returns a hit mask and entry distances
+	const __m256 tx1 = _mm256_mul_ps( _mm256_sub_ps( node.xmin8, r.Ox ), r.rDx ), tx2 = _mm256_mul_ps( _mm256_sub_ps( node.xmax8, r.Ox ), r.rDx );
+	const __m256 ty1 = _mm256_mul_ps( _mm256_sub_ps( node.ymin8, r.Oy ), r.rDy ), ty2 = _mm256_mul_ps( _mm256_sub_ps( node.ymax8, r.Oy ), r.rDy );
+	const __m256 tz1 = _mm256_mul_ps( _mm256_sub_ps( node.zmin8, r.Oz ), r.rDz ), tz2 = _mm256_mul_ps( _mm256_sub_ps( node.zmax8, r.Oz ), r.rDz );
+	const __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_min_ps( tx1, tx2 ), _mm256_min_ps( ty1, ty2 ) ), _mm256_min_ps( tz1, tz2 ) );
+	const __m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_max_ps( tx1, tx2 ), _mm256_max_ps( ty1, ty2 ) ), _mm256_max_ps( tz1, tz2 ) );
+	const __m256 hit = _mm256_and_ps( _mm256_and_ps( _mm256_cmp_ps( tmax, tmin, _CMP_GE_OQ ),
+		_mm256_cmp_ps( tmin, _mm256_set1_ps( t ), _CMP_LT_OQ ) ), _mm256_cmp_ps( tmax, _mm256_setzero_ps(), _CMP_GT_OQ ) );
+	_mm256_storeu_ps( dist, tmin );
+	return _mm256_movemask_ps( hit );
 }
 
-// BVH class implementation
+inline float QuantStep( const int e )
+{
+	// power of two without a call to ldexpf
+	union { uint u; float f; } step;
+	step.u = (uint)(e + 127) << 23;
+	return step.f;
+}
 
-BVH::BVH( Mesh* triMesh )
+inline __m128 Dequantize( const uchar* q )
 {
-	mesh = triMesh;
-	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * mesh->triCount * 2 + 64, 64 );
-	triIdx = new uint[mesh->triCount];
-	Build();
+	return _mm_cvtepi32_ps( _mm_cvtepu8_epi32( _mm_cvtsi32_si128( *(const int*)q ) ) );
 }
 
-void BVH::Intersect( Ray& ray, uint instanceIdx )
+inline int IntersectChildren( const BVHNodeQ4& node, const WideRay4& r, const float t, float* dist )
 {
-	BVHNode* node = &bvhNode[0], * stack[64];
-	uint stackPtr = 0;
+	// quantized slab test: bounds are origin + q * step, so t = q * (step * rD) + (origin - O) * rD
+	const __m128 ax = _mm_mul_ps( _mm_set1_ps( QuantStep( node.ex ) ), r.rDx ), bx = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.origin.x ), r.Ox ), r.rDx );
+	const __m128 ay = _mm_mul_ps( _mm_set1_ps( QuantStep( node.ey ) ), r.rDy ), by = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.origin.y ), r.Oy ), r.rDy );
+	const __m128 az = _mm_mul_ps( _mm_set1_ps( QuantStep( node.ez ) ), r.rDz ), bz = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node.origin.z ), r.Oz ), r.rDz );
+	const __m128 tx1 = _mm_add_ps( _mm_mul_ps( Dequantize( node.xmin ), ax ), bx ), tx2 = _mm_add_ps( _mm_mul_ps( Dequantize( node.xmax ), ax ), bx );
+	const __m128 ty1 = _mm_add_ps( _mm_mul_ps( Dequantize( node.ymin ), ay ), by ), ty2 = _mm_add_ps( _mm_mul_ps( Dequantize( node.ymax ), ay ), by );
+	const __m128 tz1 = _mm_add_ps( _mm_mul_ps( Dequantize( node.zmin ), az ), bz ), tz2 = _mm_add_ps( _mm_mul_ps( Dequantize( node.zmax ), az ), bz );
+	const __m128 tmin = _mm_max_ps( _mm_max_ps( _mm_min_ps( tx1, tx2 ), _mm_min_ps( ty1, ty2 ) ), _mm_min_ps( tz1, tz2 ) );
+	const __m128 tmax = _mm_min_ps( _mm_min_ps( _mm_max_ps( tx1, tx2 ), _mm_max_ps( ty1, ty2 ) ), _mm_max_ps( tz1, tz2 ) );
+	const __m128 hit = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax, tmin ), _mm_cmplt_ps( tmin, _mm_set1_ps( t ) ) ), _mm_cmpgt_ps( tmax, _mm_setzero_ps() ) );
+	_mm_storeu_ps( dist, tmin );
+	return _mm_movemask_ps( hit ) & node.validMask;
+}
+
+inline uint LowestBit( const int mask )
+{
+	// index of the lowest set bit in a SIMD hit mask
+#ifdef _MSC_VER
+	unsigned long lane;
+	_BitScanForward( &lane, mask );
+	return lane;
+#else
+	return __builtin_ctz( mask );
+#endif
+}
+
+// leaf tests: one triangle at a time, via triIdx, for Tri and TriWoop; without triIdx, the
+// leaf stores its triangles in place (BVH::directTris)
+template <class P> inline void IntersectLeaf( Ray& ray, const uint instanceIdx, const uint first, const uint count, const uint* triIdx, const P* tri )
+{
+	TRAVERSAL_STAT( traversalStats.tris += count );
+	if (!triIdx) for (uint i = first; i < first + count; i++)
+		IntersectTri( ray, tri[i], INST_PRIM( instanceIdx, i ) );
+	else for (uint i = 0; i < count; i++)
+	{
+		instprim instPrim = INST_PRIM( instanceIdx, triIdx[first + i] );
+		IntersectTri( ray, tri[PRIM_IDX( instPrim )], instPrim );
+	}
+}
+template <class P> inline bool OccludesLeaf( const Ray& ray, const uint first, const uint count, const uint* triIdx, const P* tri )
+{
+	for (uint i = 0; i < count; i++)
+	{
+		TRAVERSAL_STAT( traversalStats.tris++ );
+		if (OccludesTri( ray, tri[triIdx ? triIdx[first + i] : first + i] )) return true;
+	}
+	return false;
+}
+
+// leaf tests for SoA blocks: Moeller-Trumbore for LEAF_SOA triangles at once; the leaf
+// that starts at triIdx entry 'first' occupies blocks leafBlock[first] and onwards
+#ifdef LEAF_SOA
+#if LEAF_SOA == 8
+#define SOA_F __m256
+#define SOA_SET1 _mm256_set1_ps
+#define SOA_ADD _mm256_add_ps
+#define SOA_SUB _mm256_sub_ps
+#define SOA_MUL _mm256_mul_ps
+#define SOA_DIV _mm256_div_ps
+#define SOA_MIN _mm256_min_ps
+#define SOA_AND _mm256_and_ps
+#define SOA_BLEND _mm256_blendv_ps
+#define SOA_MASK _mm256_movemask_ps
+#define SOA_GE( a, b ) _mm256_cmp_ps( a, b, _CMP_GE_OQ )
+#define SOA_GT( a, b ) _mm256_cmp_ps( a, b, _CMP_GT_OQ )
+#define SOA_LE( a, b ) _mm256_cmp_ps( a, b, _CMP_LE_OQ )
+#define SOA_LT( a, b ) _mm256_cmp_ps( a, b, _CMP_LT_OQ )
+#define SOA_EQ( a, b ) _mm256_cmp_ps( a, b, _CMP_EQ_OQ )
+#define SOA_ABS( a ) _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a )
+#else
+#define SOA_F __m128
+#define SOA_SET1 _mm_set1_ps
+#define SOA_ADD _mm_add_ps
+#define SOA_SUB _mm_sub_ps
+#define SOA_MUL _mm_mul_ps
+#define SOA_DIV _mm_div_ps
+#define SOA_MIN _mm_min_ps
+#define SOA_AND _mm_and_ps
+#define SOA_BLEND _mm_blendv_ps
+#define SOA_MASK _mm_movemask_ps
+#define SOA_GE _mm_cmpge_ps
+#define SOA_GT _mm_cmpgt_ps
+#define SOA_LE _mm_cmple_ps
+#define SOA_LT _mm_cmplt_ps
+#define SOA_EQ _mm_cmpeq_ps
+#define SOA_ABS( a ) _mm_andnot_ps( _mm_set1_ps( -0.0f ), a )
+#endif
+
+inline SOA_F IntersectSoA( const Ray& ray, const TriSoA& b, SOA_F& u, SOA_F& v, int& mask )
+{
+	// same operations as the scalar IntersectTri, so results are identical; returns t
+	const SOA_F Dx = SOA_SET1( ray.D.x ), Dy = SOA_SET1( ray.D.y ), Dz = SOA_SET1( ray.D.z );
+	const SOA_F hx = SOA_SUB( SOA_MUL( Dy, b.e2z ), SOA_MUL( Dz, b.e2y ) );
+	const SOA_F hy = SOA_SUB( SOA_MUL( Dz, b.e2x ), SOA_MUL( Dx, b.e2z ) );
+	const SOA_F hz = SOA_SUB( SOA_MUL( Dx, b.e2y ), SOA_MUL( Dy, b.e2x ) );
+	const SOA_F a = SOA_ADD( SOA_ADD( SOA_MUL( b.e1x, hx ), SOA_MUL( b.e1y, hy ) ), SOA_MUL( b.e1z, hz ) );
+	const SOA_F f = SOA_DIV( SOA_SET1( 1 ), a );
+	const SOA_F sx = SOA_SUB( SOA_SET1( ray.O.x ), b.v0x ), sy = SOA_SUB( SOA_SET1( ray.O.y ), b.v0y ), sz = SOA_SUB( SOA_SET1( ray.O.z ), b.v0z );
+	u = SOA_MUL( f, SOA_ADD( SOA_ADD( SOA_MUL( sx, hx ), SOA_MUL( sy, hy ) ), SOA_MUL( sz, hz ) ) );
+	const SOA_F qx = SOA_SUB( SOA_MUL( sy, b.e1z ), SOA_MUL( sz, b.e1y ) );
+	const SOA_F qy = SOA_SUB( SOA_MUL( sz, b.e1x ), SOA_MUL( sx, b.e1z ) );
+	const SOA_F qz = SOA_SUB( SOA_MUL( sx, b.e1y ), SOA_MUL( sy, b.e1x ) );
+	v = SOA_MUL( f, SOA_ADD( SOA_ADD( SOA_MUL( Dx, qx ), SOA_MUL( Dy, qy ) ), SOA_MUL( Dz, qz ) ) );
+	const SOA_F t = SOA_MUL( f, SOA_ADD( SOA_ADD( SOA_MUL( b.e2x, qx ), SOA_MUL( b.e2y, qy ) ), SOA_MUL( b.e2z, qz ) ) );
+	const SOA_F zero = SOA_SET1( 0 ), one = SOA_SET1( 1 );
+	const SOA_F valid = SOA_AND( SOA_AND( SOA_AND( SOA_GE( SOA_ABS( a ), SOA_SET1( 0.00001f ) ), SOA_GE( u, zero ) ),
+		SOA_AND( SOA_LE( u, one ), SOA_GE( v, zero ) ) ), SOA_AND( SOA_AND( SOA_LE( SOA_ADD( u, v ), one ),
+		SOA_GT( t, SOA_SET1( 0.0001f ) ) ), SOA_LT( t, SOA_SET1( ray.hit.t ) ) ) );
+	mask = SOA_MASK( valid );
+	return SOA_BLEND( SOA_SET1( 1e30f ), t, valid );
+}
+
+inline void IntersectLeaf( Ray& ray, const uint instanceIdx, const uint first, const uint count, const uint* leafBlock, const TriSoA* block )
+{
+	for (uint i = leafBlock[first], last = i + (count + LEAF_SOA - 1) / LEAF_SOA; i < last; i++)
+	{
+		SOA_F u, v;
+		int mask;
+		TRAVERSAL_STAT( traversalStats.tris += LEAF_SOA ); // all lanes are tested
+		const SOA_F t = IntersectSoA( ray, block[i], u, v, mask );
+		if (!mask) continue;
+		// closest hit in the block: reduce to the minimum distance, then find its lane
+		float tl[LEAF_SOA], ul[LEAF_SOA], vl[LEAF_SOA], tmin = 1e30f;
+		memcpy( tl, &t, sizeof( t ) ), memcpy( ul, &u, sizeof( u ) ), memcpy( vl, &v, sizeof( v ) );
+		uint lane = 0;
+		for (int m = mask; m; m &= m - 1)
+		{
+			const uint l = LowestBit( m );
+			if (tl[l] < tmin) tmin = tl[l], lane = l;
+		}
+		ray.hit.t = tmin, ray.hit.u = ul[lane], ray.hit.v = vl[lane];
+		ray.hit.instPrim = INST_PRIM( instanceIdx, block[i].prim[lane] );
+	}
+}
+
+inline bool OccludesLeaf( const Ray& ray, const uint first, const uint count, const uint* leafBlock, const TriSoA* block )
+{
+	for (uint i = leafBlock[first], last = i + (count + LEAF_SOA - 1) / LEAF_SOA; i < last; i++)
+	{
+		SOA_F u, v;
+		int mask;
+		TRAVERSAL_STAT( traversalStats.tris += LEAF_SOA );
+		IntersectSoA( ray, block[i], u, v, mask );
+		if (mask) return true;
+	}
+	return false;
+}
+#endif
+
+// single-ray BLAS traversal, specialized at compile time on the query type: closest hit
+// (ANY_HIT false) updates ray.hit, any hit leaves the ray alone and stops at the first hit
+template <bool ANY_HIT> using QueryRay = conditional_t<ANY_HIT, const Ray, Ray>;
+
+template <bool ANY_HIT, int W, class T, class R, class P> bool TraverseWide( QueryRay<ANY_HIT>& ray, const uint instanceIdx, const T* wideNode, const uint* triIdx, const P* tri )
+{
+	// wide BVH traversal: test all children of a node in a single SIMD operation; for the
+	// closest hit, visit hit leaves right away (near to far) and push interior nodes sorted
+	// by distance. Any hit will do for an occlusion query: no child ordering.
+	struct StackEntry { uint node; float dist; } stack[64 * (W - 1)];
+	const R wideRay( ray );
+	uint nodeIdx = 0, stackPtr = 0;
 	while (1)
 	{
-		if (node->isLeaf())
+		const T& node = wideNode[nodeIdx];
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		float dist[W];
+		int mask = IntersectChildren( node, wideRay, ray.hit.t, dist );
+		if constexpr (ANY_HIT)
 		{
-			for (uint i = 0; i < node->triCount; i++)
+			while (mask)
 			{
-				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
-				IntersectTri( ray, mesh->tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+				const uint lane = LowestBit( mask );
+				mask &= mask - 1;
+				if (node.triCount[lane] == 0) { stack[stackPtr++].node = node.child[lane]; continue; }
+				if (OccludesLeaf( ray, node.child[lane], node.triCount[lane], triIdx, tri )) return true;
 			}
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
+			if (stackPtr == 0) return false;
+			nodeIdx = stack[--stackPtr].node;
 			continue;
 		}
-		BVHNode* child1 = &bvhNode[node->leftFirst];
-		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
-	#ifdef USE_SSE
-		float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
-		float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
-	#else
-		float dist1 = IntersectAABB( ray, child1->aabbMin, child1->aabbMax );
-		float dist2 = IntersectAABB( ray, child2->aabbMin, child2->aabbMax );
-	#endif
-		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
+		else
+		{
+			// sort the intersected children by distance (insertion sort, at most W entries)
+			uint hitIdx[W], hits = 0;
+			while (mask)
+			{
+				const uint lane = LowestBit( mask );
+				mask &= mask - 1;
+				uint j = hits++;
+				while (j > 0 && dist[hitIdx[j - 1]] > dist[lane]) hitIdx[j] = hitIdx[j - 1], j--;
+				hitIdx[j] = lane;
+			}
+			// process leaves first, so hit.t shrinks before we decide which interior nodes to push
+			uint interior[W], interiors = 0;
+			for (uint i = 0; i < hits; i++)
+			{
+				const uint lane = hitIdx[i];
+				if (node.triCount[lane] == 0) { interior[interiors++] = lane; continue; }
+				IntersectLeaf( ray, instanceIdx, node.child[lane], node.triCount[lane], triIdx, tri );
+			}
+			// push far interior nodes in reverse order; continue with the nearest one
+			for (int i = (int)interiors - 1; i > 0; i--)
+				stack[stackPtr].node = node.child[interior[i]],
+				stack[stackPtr++].dist = dist[interior[i]];
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
+			if (interiors > 0) { nodeIdx = node.child[interior[0]]; continue; }
+			// pop a node from the stack, skipping nodes beyond the nearest intersection
+			while (1)
+			{
+				if (stackPtr == 0) return false;
+				if (stack[--stackPtr].dist < ray.hit.t) break;
+			}
+			nodeIdx = stack[stackPtr].node;
+		}
+	}
+}
+
+template <bool SSE> inline float IntersectBox( const Ray& ray, const BVHNode& node )
+{
+	if constexpr (SSE) return IntersectAABB_SSE( ray, node.aabbMin4, node.aabbMax4 );
+	else return IntersectAABB( ray, node.aabbMin, node.aabbMax );
+}
+
+template <bool ANY_HIT, bool SSE, class P> bool TraverseBinary( QueryRay<ANY_HIT>& ray, const uint instanceIdx, const BVHNode* bvhNode, const uint* triIdx, const P* tri )
+{
+	// binary BVH traversal; for an occlusion query, children are visited in storage order
+	const BVHNode* node = &bvhNode[0], * stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		if (node->isLeaf())
+		{
+			if constexpr (ANY_HIT) { if (OccludesLeaf( ray, node->leftFirst, node->triCount, triIdx, tri )) return true; }
+			else IntersectLeaf( ray, instanceIdx, node->leftFirst, node->triCount, triIdx, tri );
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		const BVHNode* child1 = &bvhNode[node->leftFirst];
+		const BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		float dist1 = IntersectBox<SSE>( ray, *child1 );
+		float dist2 = IntersectBox<SSE>( ray, *child2 );
+		// closest hit: near child first; any hit: the first child that was hit
+		if (ANY_HIT ? dist1 == 1e30f : dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
 		if (dist1 == 1e30f)
 		{
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
 		}
 		else
 		{
 			node = child1;
 			if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
 		}
 	}
 }
 
-void BVH::Refit()
+#ifdef USE_SSE
+#define BOX_SSE true
+#else
+#define BOX_SSE false
+#endif
+
+// packet traversal functions
+
+void IntersectTri4( RayPacket& packet, const uint g, const Tri& tri, const instprim instPrim )
+{
+	// Moeller-Trumbore for four rays of a packet at once
+	const float3 edge1 = tri.vertex1 - tri.vertex0, edge2 = tri.vertex2 - tri.vertex0;
+	const __m128 e1x = _mm_set1_ps( edge1.x ), e1y = _mm_set1_ps( edge1.y ), e1z = _mm_set1_ps( edge1.z );
+	const __m128 e2x = _mm_set1_ps( edge2.x ), e2y = _mm_set1_ps( edge2.y ), e2z = _mm_set1_ps( edge2.z );
+	const __m128 Dx = packet.D4[0][g], Dy = packet.D4[1][g], Dz = packet.D4[2][g];
+	const __m128 hx = _mm_sub_ps( _mm_mul_ps( Dy, e2z ), _mm_mul_ps( Dz, e2y ) );
+	const __m128 hy = _mm_sub_ps( _mm_mul_ps( Dz, e2x ), _mm_mul_ps( Dx, e2z ) );
+	const __m128 hz = _mm_sub_ps( _mm_mul_ps( Dx, e2y ), _mm_mul_ps( Dy, e2x ) );
+	const __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+	const __m128 f = _mm_div_ps( _mm_set1_ps( 1 ), a );
+	const __m128 sx = _mm_sub_ps( packet.O4[0][g], _mm_set1_ps( tri.vertex0.x ) );
+	const __m128 sy = _mm_sub_ps( packet.O4[1][g], _mm_set1_ps( tri.vertex0.y ) );
+	const __m128 sz = _mm_sub_ps( packet.O4[2][g], _mm_set1_ps( tri.vertex0.z ) );
+	const __m128 u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+	const __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+	const __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+	const __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+	const __m128 v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( Dx, qx ), _mm_mul_ps( Dy, qy ) ), _mm_mul_ps( Dz, qz ) ) );
+	const __m128 t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+	// combine the conditions of the scalar version into a single mask
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps( 1 );
+	__m128 mask = _mm_cmpge_ps( _mm_andnot_ps( _mm_set1_ps( -0.0f ), a ), _mm_set1_ps( 0.00001f ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( u, zero ), _mm_cmple_ps( u, one ) ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( v, zero ), _mm_cmple_ps( _mm_add_ps( u, v ), one ) ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpgt_ps( t, _mm_set1_ps( 0.0001f ) ), _mm_cmplt_ps( t, packet.hit.t4[g] ) ) );
+	if (_mm_movemask_ps( mask ) == 0) return;
+	packet.hit.t4[g] = _mm_blendv_ps( packet.hit.t4[g], t, mask );
+	packet.hit.u4[g] = _mm_blendv_ps( packet.hit.u4[g], u, mask );
+	packet.hit.v4[g] = _mm_blendv_ps( packet.hit.v4[g], v, mask );
+#ifdef WIDE_INDICES
+	packet.hit.instPrim4[g] = _mm_blendv_ps( packet.hit.instPrim4[g], _mm_castsi128_ps( _mm_set1_epi32( PRIM_IDX( instPrim ) ) ), mask );
+	packet.hit.inst4[g] = _mm_blendv_ps( packet.hit.inst4[g], _mm_castsi128_ps( _mm_set1_epi32( INST_IDX( instPrim ) ) ), mask );
+#else
+	packet.hit.instPrim4[g] = _mm_blendv_ps( packet.hit.instPrim4[g], _mm_castsi128_ps( _mm_set1_epi32( instPrim ) ), mask );
+#endif
+}
+
+inline int IntersectAABB4( const RayPacket& packet, const uint g, const __m128* b )
+{
+	// slab test for four rays of a packet; b holds the broadcast box bounds (xmin, xmax, ymin, ..)
+	const __m128 tx1 = _mm_mul_ps( _mm_sub_ps( b[0], packet.O4[0][g] ), packet.rD4[0][g] ), tx2 = _mm_mul_ps( _mm_sub_ps( b[1], packet.O4[0][g] ), packet.rD4[0][g] );
+	const __m128 ty1 = _mm_mul_ps( _mm_sub_ps( b[2], packet.O4[1][g] ), packet.rD4[1][g] ), ty2 = _mm_mul_ps( _mm_sub_ps( b[3], packet.O4[1][g] ), packet.rD4[1][g] );
+	const __m128 tz1 = _mm_mul_ps( _mm_sub_ps( b[4], packet.O4[2][g] ), packet.rD4[2][g] ), tz2 = _mm_mul_ps( _mm_sub_ps( b[5], packet.O4[2][g] ), packet.rD4[2][g] );
+	const __m128 tmin = _mm_max_ps( _mm_max_ps( _mm_min_ps( tx1, tx2 ), _mm_min_ps( ty1, ty2 ) ), _mm_min_ps( tz1, tz2 ) );
+	const __m128 tmax = _mm_min_ps( _mm_min_ps( _mm_max_ps( tx1, tx2 ), _mm_max_ps( ty1, ty2 ) ), _mm_max_ps( tz1, tz2 ) );
+	const __m128 hit = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax, tmin ), _mm_cmplt_ps( tmin, packet.hit.t4[g] ) ), _mm_cmpgt_ps( tmax, _mm_setzero_ps() ) );
+	return _mm_movemask_ps( hit );
+}
+
+bool PacketMissesAABB( const RayPacket& packet, const __m128& bmin4, const __m128& bmax4 )
+{
+	// interval arithmetic: bound entry and exit distances over all rays of the packet at once;
+	// only valid if the directions of all rays have the same sign along each axis
+	const __m128 near4 = _mm_blendv_ps( bmin4, bmax4, packet.sign4 );
+	const __m128 far4 = _mm_blendv_ps( bmax4, bmin4, packet.sign4 );
+	const __m128 n1 = _mm_sub_ps( near4, packet.Omax4 ), n2 = _mm_sub_ps( near4, packet.Omin4 );
+	const __m128 f1 = _mm_sub_ps( far4, packet.Omax4 ), f2 = _mm_sub_ps( far4, packet.Omin4 );
+	const __m128 tnear = _mm_min_ps( _mm_min_ps( _mm_mul_ps( n1, packet.rDmin4 ), _mm_mul_ps( n1, packet.rDmax4 ) ),
+		_mm_min_ps( _mm_mul_ps( n2, packet.rDmin4 ), _mm_mul_ps( n2, packet.rDmax4 ) ) );
+	const __m128 tfar = _mm_max_ps( _mm_max_ps( _mm_mul_ps( f1, packet.rDmin4 ), _mm_mul_ps( f1, packet.rDmax4 ) ),
+		_mm_max_ps( _mm_mul_ps( f2, packet.rDmin4 ), _mm_mul_ps( f2, packet.rDmax4 ) ) );
+	const float tmin = max( tnear.m128_f32[0], max( tnear.m128_f32[1], tnear.m128_f32[2] ) );
+	const float tmax = min( tfar.m128_f32[0], min( tfar.m128_f32[1], tfar.m128_f32[2] ) );
+	return tmax < tmin || tmax <= 0;
+}
+
+uint FirstHit( const RayPacket& packet, const __m128& bmin4, const __m128& bmax4, const uint first )
 {
-	Timer t;
-	for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+	// find the first ray in the packet, starting at 'first', that intersects the box
+	const __m128 b[6] = {
+		_mm_shuffle_ps( bmin4, bmin4, _MM_SHUFFLE( 0, 0, 0, 0 ) ), _mm_shuffle_ps( bmax4, bmax4, _MM_SHUFFLE( 0, 0, 0, 0 ) ),
+		_mm_shuffle_ps( bmin4, bmin4, _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_shuffle_ps( bmax4, bmax4, _MM_SHUFFLE( 1, 1, 1, 1 ) ),
+		_mm_shuffle_ps( bmin4, bmin4, _MM_SHUFFLE( 2, 2, 2, 2 ) ), _mm_shuffle_ps( bmax4, bmax4, _MM_SHUFFLE( 2, 2, 2, 2 ) )
+	};
+	uint g = first >> 2;
+	int mask = IntersectAABB4( packet, g, b ) & (15 << (first & 3));
+	if (mask) return g * 4 + LowestBit( mask );
+	// the first active rays miss; try to reject the box for the whole packet
+	if (packet.coherent && PacketMissesAABB( packet, bmin4, bmax4 )) return PACKET_SIZE;
+	while (++g < PACKET_SIZE / 4) if ((mask = IntersectAABB4( packet, g, b ))) return g * 4 + LowestBit( mask );
+	return PACKET_SIZE;
+}
+
+void RayPacket::Prepare()
+{
+	// calculate reciprocal ray directions and the bounds of the packet
+	coherent = true;
+	for (int a = 0; a < 3; a++)
 	{
-		BVHNode& node = bvhNode[i];
-		if (node.isLeaf())
+		float Omin = 1e30f, Omax = -1e30f, rDmin = 1e30f, rDmax = -1e30f;
+		uint negative = 0;
+		for (int i = 0; i < PACKET_SIZE; i++)
 		{
-			// leaf node: adjust bounds to contained triangles
-			float3 dummy1, dummy2; // we don't need centroid bounds here
-			UpdateNodeBounds( i, dummy1, dummy2 );
-			continue;
+			rD[a][i] = 1 / D[a][i];
+			Omin = min( Omin, O[a][i] ), Omax = max( Omax, O[a][i] );
+			rDmin = min( rDmin, rD[a][i] ), rDmax = max( rDmax, rD[a][i] );
+			if (D[a][i] < 0) negative++;
 		}
-		// interior node: adjust bounds to child node bounds
-		BVHNode& leftChild = bvhNode[node.leftFirst];
-		BVHNode& rightChild = bvhNode[node.leftFirst + 1];
-		node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
-		node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+		// mixed signs or axis-aligned rays: interval culling is not reliable
+		if ((negative != 0 && negative != PACKET_SIZE) || rDmin < -1e30f || rDmax > 1e30f) coherent = false;
+		Omin4.m128_f32[a] = Omin, Omax4.m128_f32[a] = Omax;
+		rDmin4.m128_f32[a] = rDmin, rDmax4.m128_f32[a] = rDmax;
+		sign4.m128_u32[a] = negative ? 0xffffffff : 0;
 	}
-	printf( "BVH refitted in %.2fms\n", t.elapsed() * 1000 );
+	Omin4.m128_f32[3] = Omax4.m128_f32[3] = rDmin4.m128_f32[3] = rDmax4.m128_f32[3] = 0;
+	sign4.m128_u32[3] = 0;
 }
 
-void BVH::Build()
+// Arena implementation
+
+void* Arena::Alloc( size_t size )
 {
-	// reset node pool
-	nodesUsed = 2;
-	memset( bvhNode, 0, mesh->triCount * 2 * sizeof( BVHNode ) );
-	// populate triangle index array
-	for (int i = 0; i < mesh->triCount; i++) triIdx[i] = i;
-	// calculate triangle centroids for partitioning
-	Tri* tri = mesh->tri;
-	for (int i = 0; i < mesh->triCount; i++)
-		mesh->tri[i].centroid = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
-	// assign all triangles to root node
-	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = mesh->triCount;
-	float3 centroidMin, centroidMax;
-	UpdateNodeBounds( 0, centroidMin, centroidMax );
-	// subdivide recursively
-	buildStackPtr = 0;
-	Subdivide( 0, 0, nodesUsed, centroidMin, centroidMax );
-	// do the parallel tasks, if any
-	uint nodePtr[64];
-	int N = buildStackPtr;
-	nodePtr[0] = nodesUsed;
-	for (int i = 1; i < N; i++) nodePtr[i] = nodePtr[i - 1] + bvhNode[buildStack[i - 1].nodeIdx].triCount * 2;
-	#pragma omp parallel for schedule(dynamic,1)
-	for (int i = 0; i < N; i++)
+	size = (size + 63) & ~(size_t)63;
+	// a block that is too small for this request stays available for smaller ones; only
+	// full blocks are skipped for good
+	for (uint i = current; i < block.size(); i++)
 	{
-		float3 cmin = buildStack[i].centroidMin, cmax = buildStack[i].centroidMax;
-		Subdivide( buildStack[i].nodeIdx, 99, nodePtr[i], cmin, cmax );
+		Block& b = block[i];
+		if (b.used + size > b.size) continue;
+		void* p = b.data + b.used;
+		b.used += size;
+		while (current < block.size() && block[current].used == block[current].size) current++;
+		return p;
 	}
-	nodesUsed = mesh->triCount * 2 + 64;
+	// no room: add a block; oversized requests get a block of their own
+	const size_t newSize = max( size, blockSize );
+	block.push_back( { (char*)_aligned_malloc( newSize, 64 ), newSize, size } );
+	return block.back().data;
 }
 
-void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax )
+void Arena::Reset()
 {
-	BVHNode& node = bvhNode[nodeIdx];
-	// determine split axis using SAH
-	int axis, splitPos;
-	float splitCost = FindBestSplitPlane( node, axis, splitPos, centroidMin, centroidMax );
-	// terminate recursion
-	if (subdivToOnePrim)
+	for (Block& b : block) b.used = 0;
+	current = 0;
+}
+
+void Arena::ShrinkToFit()
+{
+	vector<Block> keep;
+	for (Block& b : block) if (b.used) keep.push_back( b ); else _aligned_free( b.data );
+	block.swap( keep );
+	current = 0;
+}
+
+size_t Arena::Used() const
+{
+	size_t used = 0;
+	for (const Block& b : block) used += b.used;
+	return used;
+}
+
+size_t Arena::Reserved() const
+{
+	size_t size = 0;
+	for (const Block& b : block) size += b.size;
+	return size;
+}
+
+// RadixSort implementation
+
+void RadixSort::Sort( SortItem* items, uint N )
+{
+	if (N > capacity)
 	{
-		if (node.triCount == 1) return;
+		delete[] tmp, delete[] offset;
+		tmp = new SortItem[N], offset = new uint[BUILD_CHUNKS * 256];
+		capacity = N;
 	}
-	else
+	// small inputs are sorted on the calling thread
+	const uint chunks = N < 16384 ? 1 : BUILD_CHUNKS, chunkSize = (N + chunks - 1) / chunks;
+	SortItem* src = items, * dst = tmp;
+	for (uint shift = 0; shift < 32; shift += 8)
 	{
-		float nosplitCost = node.CalculateNodeCost();
-		if (splitCost >= nosplitCost) return;
+		auto count = [&]( int c )
+		{
+			uint* digits = offset + c * 256;
+			memset( digits, 0, 256 * sizeof( uint ) );
+			const uint first = min( N, c * chunkSize ), last = min( N, first + chunkSize );
+			for (uint i = first; i < last; i++) digits[(src[i].key >> shift) & 255]++;
+		};
+		if (chunks == 1) count( 0 ); else JobManager::GetJobManager()->ParallelFor( chunks, count );
+		bool skip = false;
+		for (uint d = 0, sum = 0; d < 256; d++)
+		{
+			const uint first = sum;
+			for (uint c = 0; c < chunks; c++)
+			{
+				const uint n = offset[c * 256 + d];
+				offset[c * 256 + d] = sum, sum += n;
+			}
+			if (sum - first == N) skip = true; // all keys have this digit
+		}
+		if (skip) continue;
+		auto scatter = [&]( int c )
+		{
+			uint* next = offset + c * 256;
+			const uint first = min( N, c * chunkSize ), last = min( N, first + chunkSize );
+			for (uint i = first; i < last; i++) dst[next[(src[i].key >> shift) & 255]++] = src[i];
+		};
+		if (chunks == 1) scatter( 0 ); else JobManager::GetJobManager()->ParallelFor( chunks, scatter );
+		swap( src, dst );
 	}
-	// in-place partition
-	int i = node.leftFirst;
-	int j = i + node.triCount - 1;
-	float scale = BINS / (centroidMax[axis] - centroidMin[axis]);
-	while (i <= j)
+	if (src != items) memcpy( items, src, N * sizeof( SortItem ) );
+}
+
+void RadixSort::SortFloat( SortItem* items, uint N )
+{
+	// negative floats: flip all bits; positive floats: flip the sign bit
+	for (uint i = 0; i < N; i++) items[i].key ^= (items[i].key >> 31) ? 0xffffffff : 0x80000000;
+	Sort( items, N );
+	for (uint i = 0; i < N; i++) items[i].key ^= (items[i].key >> 31) ? 0x80000000 : 0xffffffff;
+}
+
+void RadixSort::ShrinkToFit()
+{
+	delete[] tmp, delete[] offset;
+	tmp = 0, offset = 0, capacity = 0;
+}
+
+// Mesh class implementation
+
+Mesh::Mesh( const uint primCount )
+{
+	// basic constructor, for top-down TLAS construction
+	tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 );
+	memset( tri, 0, primCount * sizeof( Tri ) );
+	triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
+	memset( triEx, 0, primCount * sizeof( TriEx ) );
+	triCount = primCount;
+}
+
+Mesh::Mesh( const char* objFile, const char* texFile )
+{
+#ifdef MESH_CACHE
+	const string cacheFile = string( objFile ) + ".bvh";
+	if (!LoadCache( cacheFile.c_str(), objFile ))
+#endif
 	{
-		// use the exact calculation we used for binning to prevent rare inaccuracies
-		int binIdx = min( BINS - 1, (int)((mesh->tri[triIdx[i]].centroid[axis] - centroidMin[axis]) * scale) );
-		if (binIdx < splitPos) i++; else swap( triIdx[i], triIdx[j--] );
+		if (!LoadOBJ( objFile )) return; // file doesn't exist
+		bvh = new BVH( this );
+#ifdef USE_SBVH
+		bvh->BuildSBVH();
+#endif
+#ifdef BVH_REORDER
+		bvh->Reorder();
+#endif
+		bvh->ShrinkToFit();
+#ifdef MESH_CACHE
+		SaveCache( cacheFile.c_str() );
+#endif
 	}
-	// abort split if one of the sides is empty
-	int leftCount = i - node.leftFirst;
-	if (leftCount == 0 || leftCount == node.triCount) return; // never happens for dragon mesh, nice
-	// create child nodes
-	int leftChildIdx = nodePtr++;
-	int rightChildIdx = nodePtr++;
-	bvhNode[leftChildIdx].leftFirst = node.leftFirst;
-	bvhNode[leftChildIdx].triCount = leftCount;
-	bvhNode[rightChildIdx].leftFirst = i;
-	bvhNode[rightChildIdx].triCount = node.triCount - leftCount;
-	node.leftFirst = leftChildIdx;
-	node.triCount = 0;
-	// recurse
-	UpdateNodeBounds( leftChildIdx, centroidMin, centroidMax );
-	if (depth == 3)
+	bvh->CollapseWide();
+#ifdef BVH_QUANTIZED
+	bvh->CompressQ4();
+#endif
+	texture = new Surface( texFile );
+	BuildMips();
+}
+
+static inline float3 Corner( const Tri& tri, const uint i ) { return i == 0 ? tri.vertex0 : (i == 1 ? tri.vertex1 : tri.vertex2); }
+
+Mesh* Mesh::Simplify( const float cellSize )
+{
+	// vertex clustering (Rossignac & Borrel, 1993): the corners in a grid cell move to their
+	// average, and triangles with two corners in the same cell collapse. The averages stay
+	// inside the bounds of the original, so instances can switch level without a TLAS rebuild.
+	aabb bounds;
+	for (int i = 0; i < triCount; i++) bounds.grow( tri[i].vertex0 ), bounds.grow( tri[i].vertex1 ), bounds.grow( tri[i].vertex2 );
+	const float3 cells = (bounds.bmax - bounds.bmin) * (1 / cellSize);
+	const uint rx = min( 1024u, (uint)cells.x + 1 ), ry = min( 1024u, (uint)cells.y + 1 ), rz = min( 1024u, (uint)cells.z + 1 );
+	const uint N = triCount * 3;
+	SortItem* item = new SortItem[N];
+	for (uint i = 0; i < N; i++)
 	{
-		// postpone the work, we'll do this in parallel later
-		buildStack[buildStackPtr].nodeIdx = leftChildIdx;
-		buildStack[buildStackPtr].centroidMin = centroidMin;
-		buildStack[buildStackPtr++].centroidMax = centroidMax;
+		const float3 c = (Corner( tri[i / 3], i % 3 ) - bounds.bmin) * (1 / cellSize);
+		const uint x = min( rx - 1, (uint)c.x ), y = min( ry - 1, (uint)c.y ), z = min( rz - 1, (uint)c.z );
+		item[i].key = x + rx * (y + ry * z), item[i].idx = i;
 	}
-	else Subdivide( leftChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
-	UpdateNodeBounds( rightChildIdx, centroidMin, centroidMax );
-	if (depth == 3)
+	RadixSort sorter;
+	sorter.Sort( item, N );
+	// one cluster per run of equal keys
+	uint* cluster = new uint[N];
+	vector<float3> pos;
+	for (uint i = 0, j; i < N; i = j)
 	{
-		// postpone the work, we'll do this in parallel later
-		buildStack[buildStackPtr].nodeIdx = rightChildIdx;
-		buildStack[buildStackPtr].centroidMin = centroidMin;
-		buildStack[buildStackPtr++].centroidMax = centroidMax;
+		float3 sum( 0 );
+		for (j = i; j < N && item[j].key == item[i].key; j++)
+			sum += Corner( tri[item[j].idx / 3], item[j].idx % 3 ), cluster[item[j].idx] = (uint)pos.size();
+		pos.push_back( sum * (1.0f / (j - i)) );
 	}
-	else Subdivide( rightChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
-}
-
+	vector<uint> keep;
+	for (uint i = 0; i < (uint)triCount; i++)
+	{
+		const uint a = cluster[i * 3], b = cluster[i * 3 + 1], c = cluster[i * 3 + 2];
+		if (a != b && b != c && a != c) keep.push_back( i );
+	}
+	if (keep.empty()) keep.push_back( 0 ); // everything collapsed; keep a degenerate triangle
+	Mesh* lod = new Mesh( (uint)keep.size() );
+	for (uint i = 0; i < keep.size(); i++)
+	{
+		Tri& t = lod->tri[i];
+		const uint k = keep[i];
+		t.vertex0 = pos[cluster[k * 3]], t.vertex1 = pos[cluster[k * 3 + 1]], t.vertex2 = pos[cluster[k * 3 + 2]];
+		t.centroid = (t.vertex0 + t.vertex1 + t.vertex2) * 0.3333f;
+		lod->triEx[i] = triEx[k]; // the original uvs and normals are close enough at a distance
+	}
+	delete[] item;
+	delete[] cluster;
+	lod->texture = texture, lod->texMips = texMips, lod->texLevels = texLevels, lod->lodCell = cellSize;
+	lod->bvh = new BVH( lod );
+#ifdef BVH_REORDER
+	lod->bvh->Reorder();
+#endif
+	lod->bvh->ShrinkToFit();
+	lod->bvh->CollapseWide();
+#ifdef BVH_QUANTIZED
+	lod->bvh->CompressQ4();
+#endif
+	return lod;
+}
+
+void Mesh::BuildLODs( const uint levels )
+{
+	// the first level uses cells of about twice the average edge length, so each level has
+	// roughly a quarter of the triangles of the previous one; all levels simplify the original
+	float edge = 0;
+	for (int i = 0; i < triCount; i++) edge += length( tri[i].vertex1 - tri[i].vertex0 );
+	float cellSize = 2 * edge / triCount;
+	for (uint l = 0; l < levels; l++, cellSize *= 2)
+	{
+		lods.push_back( Simplify( cellSize ) );
+		if (lods.back()->triCount < 64) break; // coarser levels would not be cheaper
+	}
+}
+
+// obj parsing helpers; the file is split in chunks at line boundaries which are parsed in parallel
+
+static inline const char* SkipSpaces( const char* p, const char* end )
+{
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+static const char* ParseFloat( const char* p, const char* end, float& value )
+{
+	// hand-written float parser: much faster than sscanf, accurate enough for geometry
+	p = SkipSpaces( p, end );
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	double v = 0, scale = 1;
+	while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+	if (p < end && *p == '.') for (p++; p < end && *p >= '0' && *p <= '9'; p++) scale *= 0.1, v += (*p - '0') * scale;
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negativeExp = false;
+		if (p < end && (*p == '-' || *p == '+')) negativeExp = *p++ == '-';
+		int e = 0;
+		while (p < end && *p >= '0' && *p <= '9') e = e * 10 + (*p++ - '0');
+		v *= pow( 10.0, negativeExp ? -e : e );
+	}
+	value = (float)(negative ? -v : v);
+	return p;
+}
+
+static const char* ParseInt( const char* p, const char* end, int& value )
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	int v = 0;
+	while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+	value = negative ? -v : v;
+	return p;
+}
+
+#define OBJ_RELATIVE (1 << 30) // marks an index that is relative to the chunk
+
+struct OBJChunk
+{
+	const char* start, * end;
+	vector<float3> P, N;
+	vector<float2> UV;
+	vector<int3> corner;		// position, uv and normal index per triangle corner; -1 if absent
+	int3 base;					// attribute counts of the preceding chunks
+	int firstTri;
+};
+
+static void ParseOBJChunk( OBJChunk& chunk )
+{
+	for (const char* p = chunk.start; p < chunk.end;)
+	{
+		const char* end = (const char*)memchr( p, '\n', chunk.end - p );
+		if (!end) end = chunk.end;
+		p = SkipSpaces( p, end );
+		if (end - p > 2 && p[0] == 'v')
+		{
+			float3 v;
+			if (p[1] == ' ' || p[1] == '\t')
+			{
+				p = ParseFloat( p + 1, end, v.x ), p = ParseFloat( p, end, v.y ), ParseFloat( p, end, v.z );
+				chunk.P.push_back( v );
+			}
+			else if (p[1] == 'n')
+			{
+				p = ParseFloat( p + 2, end, v.x ), p = ParseFloat( p, end, v.y ), ParseFloat( p, end, v.z );
+				chunk.N.push_back( v );
+			}
+			else if (p[1] == 't')
+			{
+				p = ParseFloat( p + 2, end, v.x ), ParseFloat( p, end, v.y );
+				chunk.UV.push_back( float2( v.x, v.y ) );
+			}
+		}
+		else if (end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			// faces: v, v/vt, v//vn or v/vt/vn; polygons are triangulated as a fan
+			const int counts[3] = { (int)chunk.P.size(), (int)chunk.UV.size(), (int)chunk.N.size() };
+			int3 first, prev;
+			p += 2;
+			for (int n = 0;; n++)
+			{
+				p = SkipSpaces( p, end );
+				if (p == end || *p < '+' || *p == '#') break;
+				int3 v = make_int3( -1 );
+				for (int a = 0; a < 3; a++)
+				{
+					if (a > 0) { if (p < end && *p == '/') p++; else break; }
+					if (p == end || *p == '/') continue;
+					int idx;
+					p = ParseInt( p, end, idx );
+					// negative indices are relative; they are made absolute once chunk offsets are known
+					v.cell[a] = idx > 0 ? idx - 1 : (OBJ_RELATIVE + counts[a] + idx);
+				}
+				while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+				if (n == 0) first = v;
+				else if (n >= 2) chunk.corner.push_back( first ), chunk.corner.push_back( prev ), chunk.corner.push_back( v );
+				prev = v;
+			}
+		}
+		p = end + 1;
+	}
+}
+
+static inline int ResolveIndex( int idx, const int base, const int count )
+{
+	if (idx >= OBJ_RELATIVE / 2) idx += base - OBJ_RELATIVE;
+	return idx < count ? idx : -1; // invalid indices are treated as absent
+}
+
+bool Mesh::LoadOBJ( const char* objFile )
+{
+	// obj loader: supports v, vt, vn and polygonal faces, with or without normals and uvs
+	size_t size;
+	const char* data = (const char*)MapFile( objFile, size );
+	if (!data) return false; // file doesn't exist
+	// split the file in chunks that end at a line boundary, and parse these in parallel
+	const int chunkCount = (int)min( (size_t)256, size / 65536 + 1 );
+	vector<OBJChunk> chunk( chunkCount );
+	for (int i = 0; i < chunkCount; i++)
+	{
+		const char* start = i == 0 ? data : chunk[i - 1].end, * end = data + size * (i + 1) / chunkCount;
+		if (end < start) end = start;
+		while (end < data + size && end[-1] != '\n') end++;
+		chunk[i].start = start, chunk[i].end = end;
+	}
+	JobManager::GetJobManager()->ParallelFor( chunkCount, [&]( int i ) { ParseOBJChunk( chunk[i] ); } );
+	// concatenate the chunks; the offsets also resolve relative indices
+	int UVs = 0;
+	for (int i = 0; i < chunkCount; i++)
+	{
+		chunk[i].base = make_int3( vertexCount, UVs, normalCount ), chunk[i].firstTri = triCount;
+		vertexCount += (int)chunk[i].P.size(), UVs += (int)chunk[i].UV.size(), normalCount += (int)chunk[i].N.size();
+		triCount += (int)chunk[i].corner.size() / 3;
+	}
+	P = new float3[vertexCount + 1], N = new float3[normalCount + 1];
+	float2* UV = new float2[UVs + 1];
+	tri = new Tri[triCount + 1];
+	triEx = new TriEx[triCount + 1];
+	JobManager::GetJobManager()->ParallelFor( chunkCount, [&]( int i )
+	{
+		const OBJChunk& c = chunk[i];
+		memcpy( P + c.base.x, c.P.data(), c.P.size() * sizeof( float3 ) );
+		memcpy( UV + c.base.y, c.UV.data(), c.UV.size() * sizeof( float2 ) );
+		memcpy( N + c.base.z, c.N.data(), c.N.size() * sizeof( float3 ) );
+	} );
+	const int count[3] = { vertexCount, UVs, normalCount };
+	JobManager::GetJobManager()->ParallelFor( chunkCount, [&]( int i )
+	{
+		const OBJChunk& c = chunk[i];
+		for (int j = 0; j < (int)c.corner.size() / 3; j++)
+		{
+			int3 v[3];
+			for (int k = 0; k < 3; k++) for (int a = 0; a < 3; a++)
+				v[k].cell[a] = ResolveIndex( c.corner[j * 3 + k].cell[a], c.base.cell[a], count[a] );
+			Tri& t = tri[c.firstTri + j];
+			TriEx& e = triEx[c.firstTri + j];
+			t.vertex0 = v[0].x < 0 ? 0 : P[v[0].x];
+			t.vertex1 = v[1].x < 0 ? 0 : P[v[1].x];
+			t.vertex2 = v[2].x < 0 ? 0 : P[v[2].x];
+			// missing normals: use the face normal; missing uvs: zero
+			const float3 faceN = normalize( cross( t.vertex1 - t.vertex0, t.vertex2 - t.vertex0 ) );
+			e.N0 = v[0].z < 0 ? faceN : N[v[0].z], e.uv0 = v[0].y < 0 ? 0 : UV[v[0].y];
+			e.N1 = v[1].z < 0 ? faceN : N[v[1].z], e.uv1 = v[1].y < 0 ? 0 : UV[v[1].y];
+			e.N2 = v[2].z < 0 ? faceN : N[v[2].z], e.uv2 = v[2].y < 0 ? 0 : UV[v[2].y];
+		}
+	} );
+	delete[] UV;
+	UnmapFile( (void*)data, size );
+	return true;
+}
+
+static const uint cacheMagic = 'B' + ('V' << 8) + ('H' << 16) + ('C' << 24);
+
+static uint CacheFlags()
+{
+	uint flags = 0;
+#ifdef USE_SBVH
+	flags |= 1;
+#endif
+#ifdef BVH_REORDER
+	flags |= 2;
+#endif
+#ifdef LEAF_SOA
+	flags |= 4; // larger leaves
+#endif
+	return flags;
+}
+
+bool Mesh::LoadCache( const char* cacheFile, const char* objFile )
+{
+	// use the cache only if it is at least as recent as the obj file
+	if (!FileExists( cacheFile )) return false;
+	if (FileExists( objFile ) && !FileIsNewer( cacheFile, objFile )) return false;
+	size_t size;
+	char* data = (char*)MapFile( cacheFile, size );
+	if (!data) return false;
+	MeshCacheHeader& h = *(MeshCacheHeader*)data;
+	if (size < sizeof( MeshCacheHeader ) || h.magic != cacheMagic || h.version != MESH_CACHE_VERSION ||
+		h.layout[0] != sizeof( Tri ) || h.layout[1] != sizeof( TriEx ) || h.layout[2] != sizeof( BVHNode ) ||
+		h.flags != CacheFlags() || h.fileSize != size)
+	{
+		// stale or foreign file; it will be overwritten
+		UnmapFile( data, size );
+		return false;
+	}
+	// pages are mapped copy-on-write, so the data can be refit or animated in place
+	cache = data;
+	triCount = h.triCount, vertexCount = h.vertexCount, normalCount = h.normalCount;
+	tri = (Tri*)(data + h.offset[0]), triEx = (TriEx*)(data + h.offset[1]);
+	P = (float3*)(data + h.offset[2]), N = (float3*)(data + h.offset[3]);
+	bvh = new BVH( this, (BVHNode*)(data + h.offset[4]), h.nodeCount, (uint*)(data + h.offset[5]), h.idxCount );
+#ifdef BVH_REORDER
+	bvh->directTris = h.idxCount == h.triCount; // see Reorder
+#endif
+	return true;
+}
+
+void Mesh::SaveCache( const char* cacheFile )
+{
+	// layout: header, then each section at a 64-byte aligned offset
+	MeshCacheHeader h;
+	memset( &h, 0, sizeof( h ) );
+	h.magic = cacheMagic, h.version = MESH_CACHE_VERSION, h.flags = CacheFlags();
+	h.layout[0] = sizeof( Tri ), h.layout[1] = sizeof( TriEx ), h.layout[2] = sizeof( BVHNode );
+	h.triCount = triCount, h.vertexCount = vertexCount, h.normalCount = normalCount;
+	h.nodeCount = bvh->nodesUsed, h.idxCount = bvh->idxCount;
+	const void* section[6] = { tri, triEx, P, N, bvh->bvhNode, bvh->triIdx };
+	const uint64_t sectionSize[6] = { triCount * sizeof( Tri ), triCount * sizeof( TriEx ),
+		vertexCount * sizeof( float3 ), normalCount * sizeof( float3 ),
+		bvh->nodesUsed * sizeof( BVHNode ), bvh->idxCount * sizeof( uint ) };
+	uint64_t pos = (sizeof( h ) + 63) & ~63ull;
+	for (int i = 0; i < 6; i++) h.offset[i] = pos, pos = (pos + sectionSize[i] + 63) & ~63ull;
+	h.fileSize = pos;
+	FILE* f = fopen( cacheFile, "wb" );
+	if (!f) return; // caching is optional
+	static const char zeroes[64] = { 0 };
+	fwrite( &h, 1, sizeof( h ), f );
+	fwrite( zeroes, 1, h.offset[0] - sizeof( h ), f );
+	for (int i = 0; i < 6; i++)
+	{
+		fwrite( section[i], 1, sectionSize[i], f );
+		fwrite( zeroes, 1, (i < 5 ? h.offset[i + 1] : h.fileSize) - h.offset[i] - sectionSize[i], f );
+	}
+	fclose( f );
+}
+
+// BVH class implementation
+
+BVH::BVH( Mesh* triMesh )
+{
+	mesh = triMesh, nodeCapacity = mesh->triCount * 2 + 64;
+	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * nodeCapacity, 64 );
+	triIdx = new uint[mesh->triCount];
+	Build();
+}
+
+BVH::BVH( Mesh* triMesh, BVHNode* nodes, uint nodeCount, uint* idx, uint indexCount )
+{
+	// wrap a previously built BVH, e.g. from a memory-mapped cache file
+	mesh = triMesh, bvhNode = nodes, nodesUsed = nodeCapacity = nodeCount, triIdx = idx, idxCount = indexCount;
+	ownsNodes = ownsIdx = false;
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+}
+
+void BVH::Intersect( Ray& ray, uint instanceIdx )
+{
+	TraverseBinary<false, BOX_SSE>( ray, instanceIdx, bvhNode, LEAF_IDX, LEAF_TRIS );
+}
+
+bool BVH::IsOccluded( const Ray& ray )
+{
+	if (bvhNodeQ4) return TraverseWide<true, 4, BVHNodeQ4, WideRay4>( ray, 0, bvhNodeQ4, LEAF_IDX, LEAF_TRIS );
+	if (bvhNode8) return TraverseWide<true, 8, BVHNode8, WideRay8>( ray, 0, bvhNode8, LEAF_IDX, LEAF_TRIS );
+	if (bvhNode4) return TraverseWide<true, 4, BVHNode4, WideRay4>( ray, 0, bvhNode4, LEAF_IDX, LEAF_TRIS );
+	return TraverseBinary<true, BOX_SSE>( ray, 0, bvhNode, LEAF_IDX, LEAF_TRIS );
+}
+
+void BVH::Intersect( RayPacket& packet, uint instanceIdx )
+{
+	// ranged packet traversal over the binary tree: for each node we track the
+	// first ray that intersects it; rays before that one can skip the subtree
+	struct StackEntry { BVHNode* node; uint first; } stack[64];
+	BVHNode* node = &bvhNode[0];
+	uint first = 0, stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		if (node->isLeaf())
+		{
+			TRAVERSAL_STAT( traversalStats.tris += node->triCount * (PACKET_SIZE - (first & ~3)) );
+			for (uint i = 0; i < node->triCount; i++)
+			{
+				const uint primIdx = directTris ? node->leftFirst + i : triIdx[node->leftFirst + i];
+				instprim instPrim = INST_PRIM( instanceIdx, primIdx );
+				const Tri& tri = mesh->tri[primIdx];
+				for (uint g = first >> 2; g < PACKET_SIZE / 4; g++) IntersectTri4( packet, g, tri, instPrim );
+			}
+			if (stackPtr == 0) break;
+			node = stack[--stackPtr].node, first = stack[stackPtr].first;
+			continue;
+		}
+		BVHNode* child1 = &bvhNode[node->leftFirst];
+		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		uint first1 = FirstHit( packet, child1->aabbMin4, child1->aabbMax4, first );
+		uint first2 = FirstHit( packet, child2->aabbMin4, child2->aabbMax4, first );
+		if (first1 < PACKET_SIZE && first2 < PACKET_SIZE)
+		{
+			// visit the child that is nearest along the first active ray; push the other one
+			const float3 D( packet.D[0][first], packet.D[1][first], packet.D[2][first] );
+			if (dot( (child2->aabbMin + child2->aabbMax) - (child1->aabbMin + child1->aabbMax), D ) < 0)
+				swap( child1, child2 ), swap( first1, first2 );
+			stack[stackPtr].node = child2, stack[stackPtr++].first = first2;
+			node = child1, first = first1;
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
+		}
+		else if (first1 < PACKET_SIZE) node = child1, first = first1;
+		else if (first2 < PACKET_SIZE) node = child2, first = first2;
+		else if (stackPtr == 0) break;
+		else node = stack[--stackPtr].node, first = stack[stackPtr].first;
+	}
+}
+
+template <int W, class T> void BVH::CollapseNode( T* wideNode, uint* wideSlot, uint nodeIdx, uint wideIdx, uint& widePtr )
+{
+	// gather up to W children by repeatedly opening the interior child with the largest area
+	uint child[W], count = 0;
+	const BVHNode& node = bvhNode[nodeIdx];
+	if (node.isLeaf()) child[count++] = nodeIdx; /* root is a leaf */ else
+		child[count++] = node.leftFirst, child[count++] = node.leftFirst + 1;
+	while (count < W)
+	{
+		int best = -1;
+		float bestArea = -1;
+		for (uint i = 0; i < count; i++) if (!bvhNode[child[i]].isLeaf())
+		{
+			const float area = bvhNode[child[i]].SurfaceArea();
+			if (area > bestArea) best = i, bestArea = area;
+		}
+		if (best == -1) break; // all children are leaves
+		const uint opened = child[best];
+		child[best] = bvhNode[opened].leftFirst;
+		child[count++] = bvhNode[opened].leftFirst + 1;
+	}
+	// store the child bounds in SoA layout; empty slots get NaN bounds, which fail every slab test
+	T& wide = wideNode[wideIdx];
+	const float nan = nanf( "" );
+	for (uint i = 0; i < W; i++)
+	{
+		if (i >= count)
+		{
+			wide.xmin[i] = wide.ymin[i] = wide.zmin[i] = nan;
+			wide.xmax[i] = wide.ymax[i] = wide.zmax[i] = nan;
+			wide.child[i] = wide.triCount[i] = 0;
+			continue;
+		}
+		const BVHNode& c = bvhNode[child[i]];
+		wideSlot[child[i]] = wideIdx * W + i; // for partial refits
+		wide.xmin[i] = c.aabbMin.x, wide.ymin[i] = c.aabbMin.y, wide.zmin[i] = c.aabbMin.z;
+		wide.xmax[i] = c.aabbMax.x, wide.ymax[i] = c.aabbMax.y, wide.zmax[i] = c.aabbMax.z;
+		if (c.isLeaf()) wide.child[i] = c.leftFirst, wide.triCount[i] = c.triCount;
+		else wide.child[i] = widePtr++, wide.triCount[i] = 0;
+	}
+	// recurse into the interior children
+	for (uint i = 0; i < count; i++) if (!bvhNode[child[i]].isLeaf())
+		CollapseNode<W, T>( wideNode, wideSlot, child[i], wide.child[i], widePtr );
+}
+
+void BVH::Collapse4()
+{
+	// a wide tree never has more nodes than the binary tree has interior nodes
+	if (!bvhNode4) bvhNode4 = (BVHNode4*)_aligned_malloc( sizeof( BVHNode4 ) * (idxCount + 1), 64 );
+	// sized for the largest tree Build can produce; nodesUsed only covers the current tree
+	if (!wideSlot4) wideSlot4 = new uint[max( nodesUsed, (uint)mesh->triCount * 2 + 64 )];
+	memset( wideSlot4, 255, nodesUsed * sizeof( uint ) );
+	nodes4Used = 1;
+	CollapseNode<4, BVHNode4>( bvhNode4, wideSlot4, 0, 0, nodes4Used );
+}
+
+void BVH::Collapse8()
+{
+	if (!bvhNode8) bvhNode8 = (BVHNode8*)_aligned_malloc( sizeof( BVHNode8 ) * (idxCount + 1), 64 );
+	if (!wideSlot8) wideSlot8 = new uint[max( nodesUsed, (uint)mesh->triCount * 2 + 64 )];
+	memset( wideSlot8, 255, nodesUsed * sizeof( uint ) );
+	nodes8Used = 1;
+	CollapseNode<8, BVHNode8>( bvhNode8, wideSlot8, 0, 0, nodes8Used );
+}
+
+void BVH::CollapseWide()
+{
+#if BVH_WIDTH == 4
+	Collapse4();
+#elif BVH_WIDTH == 8
+	Collapse8();
+#endif
+}
+
+static void QuantizeNode( const BVHNode4& node, BVHNodeQ4& q )
+{
+	const float* bmin[3] = { node.xmin, node.ymin, node.zmin }, * bmax[3] = { node.xmax, node.ymax, node.zmax };
+	uchar* qmin[3] = { q.xmin, q.ymin, q.zmin }, * qmax[3] = { q.xmax, q.ymax, q.zmax };
+	char* e[3] = { &q.ex, &q.ey, &q.ez };
+	q.validMask = 0;
+	for (int i = 0; i < 4; i++) if (node.xmin[i] == node.xmin[i]) q.validMask |= 1 << i; // NaN: empty slot
+	for (int a = 0; a < 3; a++)
+	{
+		// origin and the smallest power-of-two step that spans all children in 255 steps
+		float lo = 1e30f, hi = -1e30f;
+		for (int i = 0; i < 4; i++) if (q.validMask & (1 << i)) lo = min( lo, bmin[a][i] ), hi = max( hi, bmax[a][i] );
+		if (!q.validMask) lo = hi = 0;
+		int exponent;
+		frexpf( (hi - lo) / 255, &exponent );
+		exponent = max( -126, min( 127, exponent ) );
+		const float step = QuantStep( exponent );
+		q.origin.cell[a] = lo, *e[a] = (char)exponent;
+		for (int i = 0; i < 4; i++)
+		{
+			if (!(q.validMask & (1 << i))) { qmin[a][i] = qmax[a][i] = 0; continue; }
+			// round outwards, so the decoded box always contains the original box
+			int l = (int)floorf( (bmin[a][i] - lo) / step ), h = (int)ceilf( (bmax[a][i] - lo) / step );
+			while (l > 0 && lo + l * step > bmin[a][i]) l--;
+			while (h < 255 && lo + h * step < bmax[a][i]) h++;
+			qmin[a][i] = (uchar)max( 0, min( 255, l ) ), qmax[a][i] = (uchar)max( 0, min( 255, h ) );
+		}
+	}
+	for (int i = 0; i < 4; i++) q.child[i] = node.child[i], q.triCount[i] = (ushort)node.triCount[i];
+}
+
+void BVH::CompressQ4()
+{
+	// quantize the 4-wide tree; node indices and topology are unchanged
+	if (!bvhNode4) Collapse4();
+	if (!bvhNodeQ4) bvhNodeQ4 = (BVHNodeQ4*)_aligned_malloc( sizeof( BVHNodeQ4 ) * (idxCount + 1), 64 );
+	for (uint i = 0; i < nodes4Used; i++) QuantizeNode( bvhNode4[i], bvhNodeQ4[i] );
+}
+
+void BVH::IntersectQ4( Ray& ray, uint instanceIdx )
+{
+	TraverseWide<false, 4, BVHNodeQ4, WideRay4>( ray, instanceIdx, bvhNodeQ4, LEAF_IDX, LEAF_TRIS );
+}
+
+void BVH::Intersect4( Ray& ray, uint instanceIdx )
+{
+	TraverseWide<false, 4, BVHNode4, WideRay4>( ray, instanceIdx, bvhNode4, LEAF_IDX, LEAF_TRIS );
+}
+
+void BVH::Intersect8( Ray& ray, uint instanceIdx )
+{
+	TraverseWide<false, 8, BVHNode8, WideRay8>( ray, instanceIdx, bvhNode8, LEAF_IDX, LEAF_TRIS );
+}
+
+void BVH::PrepareRefit()
+{
+	// collect the nodes per tree level, their parents, and the leaf that holds each triangle
+	delete[] nodeParent, delete[] nodeLevel, delete[] nodeDirty, delete[] triLeaf;
+	nodeParent = new uint[nodesUsed], triLeaf = new uint[mesh->triCount];
+	nodeLevel = new ushort[nodesUsed], nodeDirty = new uchar[nodesUsed];
+	memset( nodeDirty, 0, nodesUsed );
+	refitLevel.clear();
+	vector<uint> stack( 1, 0 );
+	nodeParent[0] = 0, nodeLevel[0] = 0;
+	while (!stack.empty())
+	{
+		const uint nodeIdx = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvhNode[nodeIdx];
+		const uint level = nodeLevel[nodeIdx];
+		if (refitLevel.size() <= level) refitLevel.resize( level + 1 );
+		refitLevel[level].push_back( nodeIdx );
+		if (node.isLeaf())
+		{
+			for (uint i = 0; i < node.triCount; i++) triLeaf[triIdx[node.leftFirst + i]] = nodeIdx;
+			continue;
+		}
+		for (uint i = 0; i < 2; i++)
+		{
+			const uint child = node.leftFirst + i;
+			nodeParent[child] = nodeIdx, nodeLevel[child] = level + 1;
+			stack.push_back( child );
+		}
+	}
+	refitReady = true;
+}
+
+void BVH::RefitNode( uint nodeIdx )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	if (node.isLeaf())
+	{
+		// leaf node: adjust bounds to contained triangles
+		float3 dummy1, dummy2; // we don't need centroid bounds here
+		UpdateNodeBounds( nodeIdx, dummy1, dummy2 );
+		return;
+	}
+	// interior node: adjust bounds to child node bounds
+	BVHNode& leftChild = bvhNode[node.leftFirst];
+	BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+	node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
+	node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+}
+
+template <int W, class T> void BVH::RefitWide( T* wideNode, const uint* wideSlot, vector<vector<uint>>& levels )
+{
+	// copy the new bounds of the refitted binary nodes to the wide nodes that reference them
+	for (const vector<uint>& nodes : levels) for (const uint nodeIdx : nodes)
+	{
+		const uint slot = wideSlot[nodeIdx];
+		if (slot == ~0u) continue; // binary node was collapsed into a wide node
+		T& wide = wideNode[slot / W];
+		const uint i = slot % W;
+		const BVHNode& c = bvhNode[nodeIdx];
+		wide.xmin[i] = c.aabbMin.x, wide.ymin[i] = c.aabbMin.y, wide.zmin[i] = c.aabbMin.z;
+		wide.xmax[i] = c.aabbMax.x, wide.ymax[i] = c.aabbMax.y, wide.zmax[i] = c.aabbMax.z;
+		if (W == 4 && bvhNodeQ4) QuantizeNode( bvhNode4[slot / 4], bvhNodeQ4[slot / 4] );
+	}
+}
+
+void BVH::RefitNodes( vector<vector<uint>>& levels )
+{
+	// deepest level first; the nodes within a level are independent, so they are refit in parallel
+	for (int level = (int)levels.size() - 1; level >= 0; level--)
+	{
+		const vector<uint>& nodes = levels[level];
+		JobManager::GetJobManager()->ParallelFor( (int)nodes.size(), [&]( int i ) { RefitNode( nodes[i] ); }, 256 );
+	}
+}
+
+void BVH::RefitLevels( vector<vector<uint>>& levels, bool partial )
+{
+	RefitNodes( levels );
+	// keep the wide trees in sync; a partial refit only updates the affected lanes
+	if (partial)
+	{
+		if (bvhNode4) RefitWide<4, BVHNode4>( bvhNode4, wideSlot4, levels );
+		if (bvhNode8) RefitWide<8, BVHNode8>( bvhNode8, wideSlot8, levels );
+		return;
+	}
+	if (bvhNode4) Collapse4();
+	if (bvhNode8) Collapse8();
+	if (bvhNodeQ4) CompressQ4();
+}
+
+void BVH::ComputeBuildCost()
+{
+	// a refit changes the node bounds, so this has to run before the first one after a
+	// build; trees that are never refitted, like the per-frame TLAS of BuildQuick, skip it
+	if (buildCost > 0) return;
+	buildCost = ComputeSAHCost();
+	for (int i = 0; i < buildStackPtr; i++) buildStack[i].cost = ComputeSAHCost( buildStack[i].nodeIdx );
+}
+
+void BVH::Refit()
+{
+	if (!refitReady) PrepareRefit();
+	ComputeBuildCost();
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+	RefitLevels( refitLevel, false );
+	refitCount++;
+}
+
+void BVH::Refit( const uint2* dirty, const int rangeCount )
+{
+	// partial refit: only the leaves that hold changed triangles, and their ancestors
+	if (!refitReady) PrepareRefit();
+	ComputeBuildCost();
+	vector<vector<uint>> levels( refitLevel.size() );
+	auto mark = [&]( uint nodeIdx )
+	{
+		// walk up until we reach a node that is already marked dirty
+		while (!nodeDirty[nodeIdx])
+		{
+			nodeDirty[nodeIdx] = 1;
+			levels[nodeLevel[nodeIdx]].push_back( nodeIdx );
+			if (nodeIdx == 0) break; else nodeIdx = nodeParent[nodeIdx];
+		}
+	};
+	if (idxCount == mesh->triCount)
+	{
+		for (int r = 0; r < rangeCount; r++)
+			for (uint i = dirty[r].x, last = min( dirty[r].x + dirty[r].y, (uint)mesh->triCount ); i < last; i++)
+				mark( triLeaf[i] );
+	}
+	else
+	{
+		// SBVH: a triangle may be referenced by several leaves, so check each leaf
+		vector<uchar> changed( mesh->triCount, 0 );
+		for (int r = 0; r < rangeCount; r++)
+			for (uint i = dirty[r].x, last = min( dirty[r].x + dirty[r].y, (uint)mesh->triCount ); i < last; i++)
+				changed[i] = 1;
+		for (const vector<uint>& nodes : refitLevel) for (const uint nodeIdx : nodes)
+		{
+			const BVHNode& node = bvhNode[nodeIdx];
+			for (uint i = 0; i < node.triCount; i++) if (changed[triIdx[node.leftFirst + i]]) { mark( nodeIdx ); break; }
+		}
+	}
+#ifdef TRI_WOOP
+	for (int r = 0; r < rangeCount; r++) PrecomputeTris( dirty[r].x, dirty[r].y );
+#endif
+#ifdef LEAF_SOA
+	for (const vector<uint>& nodes : levels) for (const uint nodeIdx : nodes)
+		if (bvhNode[nodeIdx].isLeaf()) FillLeafSoA( bvhNode[nodeIdx] );
+#endif
+	RefitLevels( levels, true );
+	for (const vector<uint>& nodes : levels) for (const uint nodeIdx : nodes) nodeDirty[nodeIdx] = 0;
+	refitCount++;
+}
+
+void BVH::Update( float rebuildThreshold )
+{
+	// refitting keeps the topology of the tree, which degrades as triangles move; rebuild
+	// once the SAH cost exceeds the cost right after the last build by too much
+	Refit();
+	if (Degradation() > rebuildThreshold) Build();
+}
+
+void BVH::UpdatePartial( float rebuildThreshold )
+{
+	// for locally deforming meshes: after a refit, rebuild only the subtrees of the last Build
+	// whose SAH cost degraded too much; the levels above them are refitted, and rebuilt with
+	// the rest of the tree if the whole tree still degraded too much
+	if (buildStackPtr == 0) { Update( rebuildThreshold ); return; }
+	if (!refitReady) PrepareRefit();
+	ComputeBuildCost();
+	RefitNodes( refitLevel ); // wide trees and leaf data follow below
+	// each degraded subtree is rebuilt in a worst-case node range past the used nodes; the
+	// worst ones go first, and the others wait for the next update if the ranges do not fit
+	struct Candidate { int job; float degradation; } candidate[64];
+	int candidates = 0;
+	for (int i = 0; i < buildStackPtr; i++)
+	{
+		const float degradation = ComputeSAHCost( buildStack[i].nodeIdx ) / buildStack[i].cost;
+		if (degradation > rebuildThreshold) candidate[candidates++] = { i, degradation };
+	}
+	sort( candidate, candidate + candidates, []( const Candidate& a, const Candidate& b ) { return a.degradation > b.degradation; } );
+	bool rebuild[64] = {};
+	uint spare = nodeCapacity - nodesUsed, rebuilds = 0;
+	for (int i = 0; i < candidates; i++)
+	{
+		const uint worstCase = buildStack[candidate[i].job].count * 2;
+		if (worstCase <= spare) rebuild[candidate[i].job] = true, spare -= worstCase, rebuilds++;
+	}
+	if (rebuilds > 0)
+	{
+		// ranges in subtree order: when the nodes are made dense again, no subtree moves past
+		// the range of a rebuilt subtree that follows it, so no unread node is overwritten
+		int job[64];
+		uint start[64], end[64], ptr = nodesUsed;
+		for (int i = 0, j = 0; i < buildStackPtr; i++) if (rebuild[i])
+			job[j] = i, start[j] = ptr, ptr += buildStack[i].count * 2, j++;
+		Tri* tri = mesh->tri;
+		JobManager::GetJobManager()->ParallelFor( (int)rebuilds, [&]( int j )
+		{
+			BuildJob& s = buildStack[job[j]];
+			for (uint i = 0; i < s.count; i++)
+			{
+				Tri& t = tri[triIdx[s.first + i]];
+				t.centroid = (t.vertex0 + t.vertex1 + t.vertex2) * 0.3333f;
+			}
+			BVHNode& root = bvhNode[s.nodeIdx];
+			root.leftFirst = s.first, root.triCount = s.count;
+			float3 cmin, cmax;
+			UpdateNodeBounds( s.nodeIdx, cmin, cmax );
+			end[j] = start[j];
+			Subdivide( s.nodeIdx, 99, end[j], cmin, cmax );
+			s.cost = ComputeSAHCost( s.nodeIdx );
+		} );
+		// close the gaps: the untouched subtrees are read from a copy, since they may move up
+		const uint base = buildStack[0].firstNode;
+		scratch.Reset();
+		BVHNode* old = scratch.Alloc<BVHNode>( nodesUsed - base );
+		memcpy( old, bvhNode + base, (nodesUsed - base) * sizeof( BVHNode ) );
+		uint dst = base;
+		for (int i = 0, j = 0; i < buildStackPtr; i++)
+		{
+			BuildJob& s = buildStack[i];
+			const BVHNode* src = rebuild[i] ? bvhNode + start[j] : old + (s.firstNode - base);
+			const uint count = rebuild[i] ? end[j] - start[j] : s.nodeCount;
+			const int delta = (int)dst - (int)(rebuild[i] ? start[j++] : s.firstNode);
+			for (uint k = 0; k < count; k++)
+			{
+				BVHNode node = src[k];
+				if (!node.isLeaf()) node.leftFirst += delta;
+				bvhNode[dst + k] = node;
+			}
+			BVHNode& root = bvhNode[s.nodeIdx];
+			if (!root.isLeaf()) root.leftFirst += delta;
+			s.firstNode = dst, s.nodeCount = count, dst += count;
+		}
+		nodesUsed = dst, refitReady = false, directTris = false;
+	}
+	refitCount++;
+	if (Degradation() > rebuildThreshold) { Build(); return; }
+	// leaf data and wide trees, as after a refit or build
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+	if (bvhNode4) Collapse4();
+	if (bvhNode8) Collapse8();
+	if (bvhNodeQ4) CompressQ4();
+}
+
+float BVH::ComputeSAHCost( uint nodeIdx )
+{
+	BVHNode* node = &bvhNode[nodeIdx], * stack[64];
+	uint stackPtr = 0;
+	float cost = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			cost += node->SurfaceArea() * node->triCount;
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		cost += node->SurfaceArea();
+		stack[stackPtr++] = &bvhNode[node->leftFirst + 1];
+		node = &bvhNode[node->leftFirst];
+	}
+	return cost / bvhNode[nodeIdx].SurfaceArea();
+}
+
+float BVH::ComputeOverlap()
+{
+	// a ray that enters the overlap of two siblings has to visit both subtrees
+	BVHNode* node = &bvhNode[0], * stack[64];
+	uint stackPtr = 0;
+	float overlap = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode* child1 = &bvhNode[node->leftFirst];
+		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		const float3 e = fminf( child1->aabbMax, child2->aabbMax ) - fmaxf( child1->aabbMin, child2->aabbMin );
+		if (e.x >= 0 && e.y >= 0 && e.z >= 0) overlap += e.x * e.y + e.y * e.z + e.z * e.x;
+		stack[stackPtr++] = child2, node = child1;
+	}
+	return overlap / bvhNode[0].SurfaceArea();
+}
+
+void BVH::PrecomputeTris( uint first, uint count )
+{
+	// the unit triangle transform is the inverse of [edge1 edge2 N | vertex0]; its rows are
+	// cross( edge2, N ), cross( N, edge1 ) and N, divided by the determinant (Woop et al., 2004)
+	if (!triWoop) triWoop = (TriWoop*)_aligned_malloc( mesh->triCount * sizeof( TriWoop ), 64 );
+	const uint last = min( first + min( count, (uint)mesh->triCount ), (uint)mesh->triCount );
+	for (uint i = first; i < last; i++)
+	{
+		const Tri& tri = mesh->tri[i];
+		const float3 e1 = tri.vertex1 - tri.vertex0, e2 = tri.vertex2 - tri.vertex0, N = cross( e1, e2 );
+		const float det = dot( N, N ); // = dot( e1, cross( e2, N ) )
+		TriWoop& w = triWoop[i];
+		if (det == 0) { memset( &w, 0, sizeof( TriWoop ) ); continue; } // degenerate: never hit
+		const float3 r0 = cross( e2, N ) / det, r1 = cross( N, e1 ) / det, r2 = N / det;
+		w.m0 = float4( r0, -dot( r0, tri.vertex0 ) );
+		w.m1 = float4( r1, -dot( r1, tri.vertex0 ) );
+		w.m2 = float4( r2, -dot( r2, tri.vertex0 ) );
+	}
+}
+
+#ifdef LEAF_SOA
+void BVH::BuildLeafSoA()
+{
+	// count the blocks; each leaf starts a new block
+	vector<uint> stack( 1, 0 ), leaves;
+	uint blocks = 0;
+	while (!stack.empty())
+	{
+		const uint nodeIdx = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf()) leaves.push_back( nodeIdx ), blocks += (node.triCount + LEAF_SOA - 1) / LEAF_SOA;
+		else stack.push_back( node.leftFirst ), stack.push_back( node.leftFirst + 1 );
+	}
+	// the block count and idxCount change independently, e.g. for an SBVH built after a Build
+	if (blocks > leafSoACapacity)
+	{
+		_aligned_free( leafSoA );
+		leafSoA = (TriSoA*)_aligned_malloc( blocks * sizeof( TriSoA ), 64 );
+		leafSoACapacity = blocks;
+	}
+	if (idxCount > leafBlockCapacity)
+	{
+		delete[] leafBlock;
+		leafBlock = new uint[idxCount];
+		leafBlockCapacity = idxCount;
+	}
+	leafBlocks = 0;
+	for (const uint nodeIdx : leaves)
+	{
+		const BVHNode& leaf = bvhNode[nodeIdx];
+		leafBlock[leaf.leftFirst] = leafBlocks;
+		leafBlocks += (leaf.triCount + LEAF_SOA - 1) / LEAF_SOA;
+		FillLeafSoA( leaf );
+	}
+}
+
+void BVH::FillLeafSoA( const BVHNode& leaf )
+{
+	TriSoA* block = leafSoA + leafBlock[leaf.leftFirst];
+	for (uint i = 0; i < (leaf.triCount + LEAF_SOA - 1) / LEAF_SOA * LEAF_SOA; i++)
+	{
+		float* lane = (float*)&block[i / LEAF_SOA] + (i % LEAF_SOA);
+		if (i >= leaf.triCount)
+		{
+			// empty lane: zero edges never pass the determinant test
+			for (int j = 0; j < 9; j++) lane[j * LEAF_SOA] = 0;
+			block[i / LEAF_SOA].prim[i % LEAF_SOA] = 0;
+			continue;
+		}
+		const uint primIdx = triIdx[leaf.leftFirst + i];
+		const Tri& tri = mesh->tri[primIdx];
+		const float3 e1 = tri.vertex1 - tri.vertex0, e2 = tri.vertex2 - tri.vertex0;
+		const float v[9] = { tri.vertex0.x, tri.vertex0.y, tri.vertex0.z, e1.x, e1.y, e1.z, e2.x, e2.y, e2.z };
+		for (int j = 0; j < 9; j++) lane[j * LEAF_SOA] = v[j];
+		block[i / LEAF_SOA].prim[i % LEAF_SOA] = primIdx;
+	}
+}
+#endif
+
+void BVH::Reorder()
+{
+	// depth-first layout: the root is node 0, node 1 stays unused so that sibling pairs
+	// share a cache line, and each pair is followed by the subtree of its left child
+	scratch.Reset();
+	BVHNode* newNode = scratch.Alloc<BVHNode>( nodesUsed );
+	uint* newIdx = scratch.Alloc<uint>( idxCount );
+	struct Entry { uint oldIdx, newIdx; } stack[64];
+	uint stackPtr = 0, nodePtr = 2, primPtr = 0;
+	newNode[0] = bvhNode[0];
+	memset( newNode + 1, 0, sizeof( BVHNode ) );
+	stack[stackPtr++] = { 0, 0 };
+	while (stackPtr > 0)
+	{
+		const Entry e = stack[--stackPtr];
+		BVHNode& node = newNode[e.newIdx];
+		if (node.isLeaf())
+		{
+			// leaves receive consecutive triangle ranges, in traversal order
+			memcpy( newIdx + primPtr, triIdx + node.leftFirst, node.triCount * sizeof( uint ) );
+			node.leftFirst = primPtr, primPtr += node.triCount;
+			continue;
+		}
+		const uint left = node.leftFirst;
+		newNode[nodePtr] = bvhNode[left], newNode[nodePtr + 1] = bvhNode[left + 1];
+		node.leftFirst = nodePtr;
+		stack[stackPtr++] = { left + 1, nodePtr + 1 };
+		stack[stackPtr++] = { left, nodePtr };
+		nodePtr += 2;
+	}
+	memcpy( bvhNode, newNode, nodePtr * sizeof( BVHNode ) );
+	nodesUsed = nodePtr;
+	if (idxCount == (uint)mesh->triCount)
+	{
+		// every triangle is referenced once: store the triangles in leaf order
+		Tri* newTri = scratch.Alloc<Tri>( idxCount );
+		TriEx* newTriEx = scratch.Alloc<TriEx>( idxCount );
+		for (uint i = 0; i < idxCount; i++) newTri[i] = mesh->tri[newIdx[i]], newTriEx[i] = mesh->triEx[newIdx[i]];
+		memcpy( mesh->tri, newTri, idxCount * sizeof( Tri ) );
+		memcpy( mesh->triEx, newTriEx, idxCount * sizeof( TriEx ) );
+		for (uint i = 0; i < idxCount; i++) triIdx[i] = i;
+		directTris = true;
+	#ifdef TRI_WOOP
+		PrecomputeTris();
+	#endif
+	}
+	else memcpy( triIdx, newIdx, idxCount * sizeof( uint ) ), directTris = false; // SBVH: only the references move
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+	// refit data, wide trees and the subtrees of the last Build refer to the old node indices
+	refitReady = false, buildStackPtr = 0;
+	if (bvhNode4) Collapse4();
+	if (bvhNode8) Collapse8();
+	if (bvhNodeQ4) CompressQ4();
+}
+
+void BVH::Build()
+{
+	// reset node pool
+	ReserveNodes( mesh->triCount * 2 + 64 );
+	scratch.Reset();
+	nodesUsed = 2, idxCount = mesh->triCount, refitReady = false, directTris = false;
+	memset( bvhNode, 0, mesh->triCount * 2 * sizeof( BVHNode ) );
+	if (mesh->triCount >= PARALLEL_BINNING && !tmpIdx) tmpIdx = new uint[mesh->triCount];
+	// populate triangle index array and calculate triangle centroids for partitioning
+	Tri* tri = mesh->tri;
+	JobManager::GetJobManager()->ParallelFor( mesh->triCount, [&]( int i )
+	{
+		triIdx[i] = i;
+		tri[i].centroid = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
+	}, 4096 );
+	// assign all triangles to root node
+	BVHNode& root = bvhNode[0];
+	root.leftFirst = 0, root.triCount = mesh->triCount;
+	float3 centroidMin, centroidMax;
+	if (root.triCount >= PARALLEL_BINNING) UpdateNodeBoundsParallel( 0, centroidMin, centroidMax );
+	else UpdateNodeBounds( 0, centroidMin, centroidMax );
+	// subdivide recursively; large nodes are split by all threads, smaller subtrees are deferred
+	buildStackPtr = 0;
+	Subdivide( 0, 0, nodesUsed, centroidMin, centroidMax );
+	// do the parallel tasks, if any
+	uint nodePtr[64], nodeStart[64];
+	int N = buildStackPtr;
+	nodePtr[0] = nodesUsed;
+	for (int i = 1; i < N; i++) nodePtr[i] = nodePtr[i - 1] + bvhNode[buildStack[i - 1].nodeIdx].triCount * 2;
+	memcpy( nodeStart, nodePtr, N * sizeof( uint ) );
+	JobManager::GetJobManager()->ParallelFor( N, [&]( int i )
+	{
+		// keep the triangle range of each subtree, for UpdatePartial
+		BuildJob& job = buildStack[i];
+		job.first = bvhNode[job.nodeIdx].leftFirst, job.count = bvhNode[job.nodeIdx].triCount;
+		float3 cmin = job.centroidMin, cmax = job.centroidMax;
+		Subdivide( job.nodeIdx, 99, nodePtr[i], cmin, cmax );
+	} );
+	// each subtree was built in a range reserved for its worst case; close the gaps, so
+	// that the nodes are dense and nodesUsed is the true node count
+	for (int i = 0; i < N; i++)
+	{
+		const uint count = nodePtr[i] - nodeStart[i], delta = nodeStart[i] - nodesUsed;
+		BVHNode& root = bvhNode[buildStack[i].nodeIdx];
+		buildStack[i].firstNode = nodesUsed, buildStack[i].nodeCount = count;
+		if (!root.isLeaf()) root.leftFirst -= delta;
+		if (delta) for (uint j = 0; j < count; j++)
+		{
+			BVHNode& node = bvhNode[nodesUsed + j];
+			node = bvhNode[nodeStart[i] + j]; // ranges only move down, so this never overwrites unread nodes
+			if (!node.isLeaf()) node.leftFirst -= delta;
+		}
+		nodesUsed += count;
+	}
+	buildCost = 0, refitCount = 0;
+	// keep the wide trees in sync
+	if (bvhNode4) Collapse4();
+	if (bvhNode8) Collapse8();
+	if (bvhNodeQ4) CompressQ4();
+	// a tree over instance bounds (subdivToOnePrim, see TLAS::BuildQuick) is copied to the
+	// TLAS every frame and never traversed itself: it needs no per-triangle data
+	if (subdivToOnePrim) return;
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+}
+
+void BVH::ShrinkToFit()
+{
+	// for static meshes: after the final build, keep only what traversal and refitting need
+	if (ownsNodes && nodesUsed < nodeCapacity)
+	{
+		BVHNode* node = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * nodesUsed, 64 );
+		memcpy( node, bvhNode, nodesUsed * sizeof( BVHNode ) );
+		_aligned_free( bvhNode );
+		bvhNode = node, nodeCapacity = nodesUsed;
+	}
+	delete[] tmpIdx, delete[] lbvhNode, delete[] mortonCode, delete[] lbvhVisits;
+	tmpIdx = 0, lbvhNode = 0, mortonCode = 0, lbvhVisits = 0;
+	sorter.ShrinkToFit();
+	scratch.Reset();
+	scratch.ShrinkToFit();
+}
+
+void BVH::ReserveNodes( uint count )
+{
+	if (nodeCapacity >= count) return;
+	if (ownsNodes) _aligned_free( bvhNode ); // wrapped nodes, e.g. in a mapped cache file, are not ours
+	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * count, 64 );
+	nodeCapacity = count, ownsNodes = true;
+}
+
+void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	// determine split axis using SAH
+	int axis, splitPos;
+	const bool parallel = depth < 99 && node.triCount >= PARALLEL_BINNING;
+	float splitCost = parallel ? FindBestSplitPlaneParallel( node, axis, splitPos, centroidMin, centroidMax ) :
+		FindBestSplitPlane( node, axis, splitPos, centroidMin, centroidMax );
+	// terminate recursion
+	if (subdivToOnePrim)
+	{
+		if (node.triCount == 1) return;
+	}
+	else
+	{
+	#ifdef LEAF_SOA
+		// a leaf with up to LEAF_SOA triangles is tested as a single SIMD block: never split it
+		if (node.triCount <= LEAF_SOA) return;
+	#endif
+		float nosplitCost = node.CalculateNodeCost();
+		if (splitCost >= nosplitCost) return;
+	}
+	// in-place partition
+	int i = node.leftFirst;
+	int j = i + node.triCount - 1;
+	float scale = BINS / (centroidMax[axis] - centroidMin[axis]);
+	if (parallel) i = PartitionParallel( node, axis, splitPos, centroidMin, centroidMax ); else while (i <= j)
+	{
+		// use the exact calculation we used for binning to prevent rare inaccuracies
+		int binIdx = min( BINS - 1, (int)((mesh->tri[triIdx[i]].centroid[axis] - centroidMin[axis]) * scale) );
+		if (binIdx < splitPos) i++; else swap( triIdx[i], triIdx[j--] );
+	}
+	// abort split if one of the sides is empty
+	int leftCount = i - node.leftFirst;
+	if (leftCount == 0 || leftCount == node.triCount) return; // never happens for dragon mesh, nice
+	// create child nodes
+	int leftChildIdx = nodePtr++;
+	int rightChildIdx = nodePtr++;
+	bvhNode[leftChildIdx].leftFirst = node.leftFirst;
+	bvhNode[leftChildIdx].triCount = leftCount;
+	bvhNode[rightChildIdx].leftFirst = i;
+	bvhNode[rightChildIdx].triCount = node.triCount - leftCount;
+	node.leftFirst = leftChildIdx;
+	node.triCount = 0;
+	// recurse; subtrees smaller than 1/16th of the mesh are postponed, so that at most
+	// 32 of them end up on the build stack, each with enough work for a single thread
+	const uint deferLimit = mesh->triCount / 16;
+	if (parallel && leftCount >= PARALLEL_BINNING) UpdateNodeBoundsParallel( leftChildIdx, centroidMin, centroidMax );
+	else UpdateNodeBounds( leftChildIdx, centroidMin, centroidMax );
+	if (depth < 99 && (uint)leftCount < deferLimit && buildStackPtr < 32)
+	{
+		// postpone the work, we'll do this in parallel later
+		buildStack[buildStackPtr].nodeIdx = leftChildIdx;
+		buildStack[buildStackPtr].centroidMin = centroidMin;
+		buildStack[buildStackPtr++].centroidMax = centroidMax;
+	}
+	else Subdivide( leftChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
+	if (parallel && bvhNode[rightChildIdx].triCount >= PARALLEL_BINNING) UpdateNodeBoundsParallel( rightChildIdx, centroidMin, centroidMax );
+	else UpdateNodeBounds( rightChildIdx, centroidMin, centroidMax );
+	if (depth < 99 && bvhNode[rightChildIdx].triCount < deferLimit && buildStackPtr < 32)
+	{
+		// postpone the work, we'll do this in parallel later
+		buildStack[buildStackPtr].nodeIdx = rightChildIdx;
+		buildStack[buildStackPtr].centroidMin = centroidMin;
+		buildStack[buildStackPtr++].centroidMax = centroidMax;
+	}
+	else Subdivide( rightChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
+}
+
 float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax )
 {
-	float bestCost = 1e30f;
-	for (int a = 0; a < 3; a++)
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++)
+	{
+		float boundsMin = centroidMin[a], boundsMax = centroidMax[a];
+		if (boundsMin == boundsMax) continue;
+		// populate the bins
+		float scale = BINS / (boundsMax - boundsMin);
+		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
+		int leftSum = 0, rightSum = 0;
+	#ifdef USE_SSE
+		__m128 min4[BINS], max4[BINS];
+		uint count[BINS];
+		for (uint i = 0; i < BINS; i++)
+			min4[i] = _mm_set_ps1( 1e30f ),
+			max4[i] = _mm_set_ps1( -1e30f ),
+			count[i] = 0;
+		for (uint i = 0; i < node.triCount; i++)
+		{
+			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
+			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
+			count[binIdx]++;
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v0 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v0 );
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v1 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v1 );
+			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v2 );
+			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v2 );
+		}
+		// gather data for the 7 planes between the 8 bins
+		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
+		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			leftSum += count[i];
+			rightSum += count[BINS - 1 - i];
+			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
+			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 1 - i] );
+			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
+			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 1 - i] );
+			const __m128 le = _mm_sub_ps( leftMax4, leftMin4 );
+			const __m128 re = _mm_sub_ps( rightMax4, rightMin4 );
+			leftCountArea[i] = leftSum * (le.m128_f32[0] * le.m128_f32[1] + le.m128_f32[1] * le.m128_f32[2] + le.m128_f32[2] * le.m128_f32[0]);
+			rightCountArea[BINS - 2 - i] = rightSum * (re.m128_f32[0] * re.m128_f32[1] + re.m128_f32[1] * re.m128_f32[2] + re.m128_f32[2] * re.m128_f32[0]);
+		}
+	#else
+		struct Bin { aabb bounds; int triCount = 0; } bin[BINS];
+		for (uint i = 0; i < node.triCount; i++)
+		{
+			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
+			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
+			bin[binIdx].triCount++;
+			bin[binIdx].bounds.grow( triangle.vertex0 );
+			bin[binIdx].bounds.grow( triangle.vertex1 );
+			bin[binIdx].bounds.grow( triangle.vertex2 );
+		}
+		// gather data for the 7 planes between the 8 bins
+		aabb leftBox, rightBox;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			leftSum += bin[i].triCount;
+			leftCount[i] = leftSum;
+			leftBox.grow( bin[i].bounds );
+			leftArea[i] = leftBox.area();
+			rightSum += bin[BINS - 1 - i].triCount;
+			rightCount[BINS - 2 - i] = rightSum;
+			rightBox.grow( bin[BINS - 1 - i].bounds );
+			rightArea[BINS - 2 - i] = rightBox.area();
+		}
+	#endif
+		// calculate SAH cost for the 7 planes
+		scale = (boundsMax - boundsMin) / BINS;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			const float planeCost = leftCountArea[i] + rightCountArea[i];
+			if (planeCost < bestCost)
+				axis = a, splitPos = i + 1, bestCost = planeCost;
+		}
+	}
+	return bestCost;
+}
+
+void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+#ifdef USE_SSE
+	__m128 min4 = _mm_set_ps1( 1e30f ), max4 = _mm_set_ps1( -1e30f );
+	__m128 cmin4 = _mm_set_ps1( 1e30f ), cmax4 = _mm_set_ps1( -1e30f );
+	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	{
+		Tri& leafTri = mesh->tri[triIdx[first + i]];
+		min4 = _mm_min_ps( min4, leafTri.v0 ), max4 = _mm_max_ps( max4, leafTri.v0 );
+		min4 = _mm_min_ps( min4, leafTri.v1 ), max4 = _mm_max_ps( max4, leafTri.v1 );
+		min4 = _mm_min_ps( min4, leafTri.v2 ), max4 = _mm_max_ps( max4, leafTri.v2 );
+		cmin4 = _mm_min_ps( cmin4, leafTri.centroid4 );
+		cmax4 = _mm_max_ps( cmax4, leafTri.centroid4 );
+	}
+	__m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
+	node.aabbMin4 = _mm_blendv_ps( node.aabbMin4, min4, mask4 );
+	node.aabbMax4 = _mm_blendv_ps( node.aabbMax4, max4, mask4 );
+	centroidMin = *(float3*)&cmin4;
+	centroidMax = *(float3*)&cmax4;
+#else
+	node.aabbMin = float3( 1e30f );
+	node.aabbMax = float3( -1e30f );
+	centroidMin = float3( 1e30f );
+	centroidMax = float3( -1e30f );
+	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	{
+		uint leafTriIdx = triIdx[first + i];
+		Tri& leafTri = mesh->tri[leafTriIdx];
+		node.aabbMin = fminf( node.aabbMin, leafTri.vertex0 );
+		node.aabbMin = fminf( node.aabbMin, leafTri.vertex1 );
+		node.aabbMin = fminf( node.aabbMin, leafTri.vertex2 );
+		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex0 );
+		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex1 );
+		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex2 );
+		centroidMin = fminf( centroidMin, leafTri.centroid );
+		centroidMax = fmaxf( centroidMax, leafTri.centroid );
+	}
+#endif
+}
+
+void BVH::UpdateNodeBoundsParallel( uint nodeIdx, float3& centroidMin, float3& centroidMax )
+{
+	// same as UpdateNodeBounds, but each thread reduces a fixed chunk of the triangles
+	BVHNode& node = bvhNode[nodeIdx];
+	__m128 min4[BUILD_CHUNKS], max4[BUILD_CHUNKS], cmin4[BUILD_CHUNKS], cmax4[BUILD_CHUNKS];
+	const uint chunkSize = (node.triCount + BUILD_CHUNKS - 1) / BUILD_CHUNKS;
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		__m128 bmin4 = _mm_set_ps1( 1e30f ), bmax4 = _mm_set_ps1( -1e30f );
+		__m128 bcmin4 = _mm_set_ps1( 1e30f ), bcmax4 = _mm_set_ps1( -1e30f );
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		for (uint i = first; i < last; i++)
+		{
+			Tri& leafTri = mesh->tri[triIdx[node.leftFirst + i]];
+			bmin4 = _mm_min_ps( bmin4, leafTri.v0 ), bmax4 = _mm_max_ps( bmax4, leafTri.v0 );
+			bmin4 = _mm_min_ps( bmin4, leafTri.v1 ), bmax4 = _mm_max_ps( bmax4, leafTri.v1 );
+			bmin4 = _mm_min_ps( bmin4, leafTri.v2 ), bmax4 = _mm_max_ps( bmax4, leafTri.v2 );
+			bcmin4 = _mm_min_ps( bcmin4, leafTri.centroid4 );
+			bcmax4 = _mm_max_ps( bcmax4, leafTri.centroid4 );
+		}
+		min4[c] = bmin4, max4[c] = bmax4, cmin4[c] = bcmin4, cmax4[c] = bcmax4;
+	} );
+	for (int c = 1; c < BUILD_CHUNKS; c++)
+		min4[0] = _mm_min_ps( min4[0], min4[c] ), max4[0] = _mm_max_ps( max4[0], max4[c] ),
+		cmin4[0] = _mm_min_ps( cmin4[0], cmin4[c] ), cmax4[0] = _mm_max_ps( cmax4[0], cmax4[c] );
+	__m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
+	node.aabbMin4 = _mm_blendv_ps( node.aabbMin4, min4[0], mask4 );
+	node.aabbMax4 = _mm_blendv_ps( node.aabbMax4, max4[0], mask4 );
+	centroidMin = *(float3*)&cmin4[0];
+	centroidMax = *(float3*)&cmax4[0];
+}
+
+float BVH::FindBestSplitPlaneParallel( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax )
+{
+	// bin all three axes in a single pass; each chunk of triangles fills its own bins,
+	// which are merged afterwards. Chunks have a fixed size, so the result does not
+	// depend on the number of threads.
+	struct ChunkBins { __m128 min4[3][BINS], max4[3][BINS]; uint count[3][BINS]; };
+	ChunkBins* chunk = scratch.Alloc<ChunkBins>( BUILD_CHUNKS );
+	float scale[3];
+	for (int a = 0; a < 3; a++) scale[a] = BINS / (centroidMax[a] - centroidMin[a]);
+	const uint chunkSize = (node.triCount + BUILD_CHUNKS - 1) / BUILD_CHUNKS;
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		ChunkBins& bins = chunk[c];
+		for (int a = 0; a < 3; a++) for (int i = 0; i < BINS; i++)
+			bins.min4[a][i] = _mm_set_ps1( 1e30f ),
+			bins.max4[a][i] = _mm_set_ps1( -1e30f ),
+			bins.count[a][i] = 0;
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		for (uint i = first; i < last; i++)
+		{
+			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
+			const __m128 tmin4 = _mm_min_ps( triangle.v0, _mm_min_ps( triangle.v1, triangle.v2 ) );
+			const __m128 tmax4 = _mm_max_ps( triangle.v0, _mm_max_ps( triangle.v1, triangle.v2 ) );
+			for (int a = 0; a < 3; a++) if (centroidMin[a] != centroidMax[a])
+			{
+				int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - centroidMin[a]) * scale[a]) );
+				bins.count[a][binIdx]++;
+				bins.min4[a][binIdx] = _mm_min_ps( bins.min4[a][binIdx], tmin4 );
+				bins.max4[a][binIdx] = _mm_max_ps( bins.max4[a][binIdx], tmax4 );
+			}
+		}
+	} );
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++)
+	{
+		if (centroidMin[a] == centroidMax[a]) continue;
+		// merge the bins of all chunks
+		__m128 min4[BINS], max4[BINS];
+		uint count[BINS];
+		for (int i = 0; i < BINS; i++)
+		{
+			min4[i] = chunk[0].min4[a][i], max4[i] = chunk[0].max4[a][i], count[i] = chunk[0].count[a][i];
+			for (int c = 1; c < BUILD_CHUNKS; c++)
+				min4[i] = _mm_min_ps( min4[i], chunk[c].min4[a][i] ),
+				max4[i] = _mm_max_ps( max4[i], chunk[c].max4[a][i] ),
+				count[i] += chunk[c].count[a][i];
+		}
+		// gather data for the 7 planes between the 8 bins, as in FindBestSplitPlane
+		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
+		int leftSum = 0, rightSum = 0;
+		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
+		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			leftSum += count[i];
+			rightSum += count[BINS - 1 - i];
+			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
+			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 1 - i] );
+			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
+			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 1 - i] );
+			const __m128 le = _mm_sub_ps( leftMax4, leftMin4 );
+			const __m128 re = _mm_sub_ps( rightMax4, rightMin4 );
+			leftCountArea[i] = leftSum * (le.m128_f32[0] * le.m128_f32[1] + le.m128_f32[1] * le.m128_f32[2] + le.m128_f32[2] * le.m128_f32[0]);
+			rightCountArea[BINS - 2 - i] = rightSum * (re.m128_f32[0] * re.m128_f32[1] + re.m128_f32[1] * re.m128_f32[2] + re.m128_f32[2] * re.m128_f32[0]);
+		}
+		// calculate SAH cost for the 7 planes
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			const float planeCost = leftCountArea[i] + rightCountArea[i];
+			if (planeCost < bestCost)
+				axis = a, splitPos = i + 1, bestCost = planeCost;
+		}
+	}
+	return bestCost;
+}
+
+uint BVH::PartitionParallel( BVHNode& node, int axis, int splitPos, float3& centroidMin, float3& centroidMax )
+{
+	// stable partition in three parallel passes: count per chunk, scatter to a scratch
+	// buffer using the prefix sums of the counts, and copy back
+	uint leftCount[BUILD_CHUNKS], leftPos[BUILD_CHUNKS], rightPos[BUILD_CHUNKS];
+	uint* idx = triIdx + node.leftFirst;
+	const float scale = BINS / (centroidMax[axis] - centroidMin[axis]);
+	const uint chunkSize = (node.triCount + BUILD_CHUNKS - 1) / BUILD_CHUNKS;
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		uint count = 0;
+		for (uint i = first; i < last; i++)
+		{
+			// use the exact calculation we used for binning to prevent rare inaccuracies
+			int binIdx = min( BINS - 1, (int)((mesh->tri[idx[i]].centroid[axis] - centroidMin[axis]) * scale) );
+			if (binIdx < splitPos) count++;
+		}
+		leftCount[c] = count;
+	} );
+	uint leftTotal = 0, rightTotal = 0;
+	for (int c = 0; c < BUILD_CHUNKS; c++)
+	{
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		leftPos[c] = leftTotal, leftTotal += leftCount[c];
+		rightPos[c] = rightTotal, rightTotal += (last - first) - leftCount[c];
+	}
+	for (int c = 0; c < BUILD_CHUNKS; c++) rightPos[c] += leftTotal;
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		for (uint i = first; i < last; i++)
+		{
+			int binIdx = min( BINS - 1, (int)((mesh->tri[idx[i]].centroid[axis] - centroidMin[axis]) * scale) );
+			if (binIdx < splitPos) tmpIdx[leftPos[c]++] = idx[i]; else tmpIdx[rightPos[c]++] = idx[i];
+		}
+	} );
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		const uint first = min( node.triCount, c * chunkSize ), last = min( node.triCount, first + chunkSize );
+		memcpy( idx + first, tmpIdx + first, (last - first) * sizeof( uint ) );
+	} );
+	return node.leftFirst + leftTotal;
+}
+
+// spatial split BVH construction, see: Stich et al., Spatial Splits in Bounding Volume Hierarchies, 2009
+
+static aabb ClipTriangle( const Tri& tri, const int axis, const float lo, const float hi, const aabb& limit )
+{
+	// bounds of the part of the triangle between two axis-aligned planes, restricted to 'limit'
+	const float3 v[3] = { tri.vertex0, tri.vertex1, tri.vertex2 };
+	aabb b;
+	for (int i = 0; i < 3; i++)
+	{
+		const float3 p = v[i], q = v[(i + 1) % 3];
+		const float pa = p.cell[axis], qa = q.cell[axis];
+		if (pa >= lo && pa <= hi) b.grow( p );
+		if ((pa < lo) != (qa < lo)) b.grow( p + (q - p) * ((lo - pa) / (qa - pa)) );
+		if ((pa > hi) != (qa > hi)) b.grow( p + (q - p) * ((hi - pa) / (qa - pa)) );
+	}
+	b.bmin = fmaxf( b.bmin, limit.bmin ), b.bmax = fminf( b.bmax, limit.bmax );
+	b.bmin.cell[axis] = max( b.bmin.cell[axis], lo ), b.bmax.cell[axis] = min( b.bmax.cell[axis], hi );
+	return b;
+}
+
+static bool IsEmpty( const aabb& b ) { return b.bmin.x > b.bmax.x || b.bmin.y > b.bmax.y || b.bmin.z > b.bmax.z; }
+
+void BVH::BuildSBVH( float budget )
+{
+	// reallocate the node pool and the index array for the maximum number of references
+	const uint maxRefs = mesh->triCount + (uint)(mesh->triCount * budget);
+	if (ownsNodes) _aligned_free( bvhNode );
+	nodeCapacity = maxRefs * 2 + 64;
+	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * nodeCapacity, 64 );
+	memset( bvhNode, 0, sizeof( BVHNode ) * nodeCapacity );
+	if (ownsIdx) delete[] triIdx;
+	triIdx = new uint[maxRefs];
+	ownsNodes = ownsIdx = true;
+	const bool wide4 = bvhNode4 != 0, wide8 = bvhNode8 != 0, quantized = bvhNodeQ4 != 0;
+	if (wide4) _aligned_free( bvhNode4 ), bvhNode4 = 0;
+	if (wide8) _aligned_free( bvhNode8 ), bvhNode8 = 0;
+	if (quantized) _aligned_free( bvhNodeQ4 ), bvhNodeQ4 = 0;
+	delete[] wideSlot4, delete[] wideSlot8;
+	wideSlot4 = wideSlot8 = 0;
+	// start with one reference per triangle
+	vector<SBVHRef> refs( mesh->triCount );
+	aabb rootBounds;
+	for (int i = 0; i < mesh->triCount; i++)
+	{
+		refs[i].tri = i, refs[i].bounds = aabb();
+		refs[i].bounds.grow( mesh->tri[i].vertex0 );
+		refs[i].bounds.grow( mesh->tri[i].vertex1 );
+		refs[i].bounds.grow( mesh->tri[i].vertex2 );
+		rootBounds.grow( refs[i].bounds );
+	}
+	// subdivide recursively; this is an offline build, so it runs on a single thread
+	nodesUsed = 2, idxCount = 0, refitReady = false, directTris = false, buildStackPtr = 0;
+	int spareRefs = maxRefs - mesh->triCount;
+	SubdivideSBVH( 0, 0, refs, SBVH_ALPHA * rootBounds.area(), spareRefs );
+	buildCost = 0, refitCount = 0;
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+	// keep the wide trees in sync
+	if (wide4) Collapse4();
+	if (wide8) Collapse8();
+	if (quantized) CompressQ4();
+}
+
+void BVH::SubdivideSBVH( uint nodeIdx, uint depth, vector<SBVHRef>& refs, float minOverlap, int& spareRefs )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	const int count = (int)refs.size();
+	aabb bounds, centroidBounds;
+	for (int i = 0; i < count; i++)
+		bounds.grow( refs[i].bounds ),
+		centroidBounds.grow( (refs[i].bounds.bmin + refs[i].bounds.bmax) * 0.5f );
+	node.aabbMin = bounds.bmin, node.aabbMax = bounds.bmax;
+#ifdef LEAF_SOA
+	// a leaf with up to LEAF_SOA triangles is tested as a single SIMD block: never split it
+	const float nosplitCost = count <= LEAF_SOA ? 0 : bounds.area() * count;
+#else
+	const float nosplitCost = bounds.area() * count;
+#endif
+	// 1. find the best object split, binning reference centroids
+	int objAxis = -1, objSplit = 0;
+	float objCost = 1e30f;
+	aabb objLeft, objRight;
+	for (int a = 0; a < 3 && count > 1; a++)
+	{
+		const float boundsMin = centroidBounds.bmin.cell[a], boundsMax = centroidBounds.bmax.cell[a];
+		if (boundsMin == boundsMax) continue;
+		struct Bin { aabb bounds; int count = 0; } bin[BINS];
+		const float scale = BINS / (boundsMax - boundsMin);
+		for (int i = 0; i < count; i++)
+		{
+			const float c = (refs[i].bounds.bmin.cell[a] + refs[i].bounds.bmax.cell[a]) * 0.5f;
+			const int binIdx = min( BINS - 1, (int)((c - boundsMin) * scale) );
+			bin[binIdx].count++, bin[binIdx].bounds.grow( refs[i].bounds );
+		}
+		aabb leftBox[BINS - 1], rightBox[BINS - 1], leftSum, rightSum;
+		int leftCount[BINS - 1], rightCount[BINS - 1];
+		for (int i = 0, l = 0, r = 0; i < BINS - 1; i++)
+		{
+			leftSum.grow( bin[i].bounds ), leftBox[i] = leftSum, leftCount[i] = l += bin[i].count;
+			rightSum.grow( bin[BINS - 1 - i].bounds ), rightBox[BINS - 2 - i] = rightSum;
+			rightCount[BINS - 2 - i] = r += bin[BINS - 1 - i].count;
+		}
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+			const float cost = leftBox[i].area() * leftCount[i] + rightBox[i].area() * rightCount[i];
+			if (cost < objCost) objCost = cost, objAxis = a, objSplit = i + 1, objLeft = leftBox[i], objRight = rightBox[i];
+		}
+	}
+	// 2. find the best spatial split, but only if the object split children overlap considerably
+	int spatialAxis = -1;
+	float spatialCost = 1e30f, spatialPlane = 0;
+	aabb overlap;
+	overlap.bmin = fmaxf( objLeft.bmin, objRight.bmin ), overlap.bmax = fminf( objLeft.bmax, objRight.bmax );
+	const bool trySpatial = count > 1 && spareRefs > 0 && (objAxis == -1 || (!IsEmpty( overlap ) && overlap.area() > minOverlap));
+	for (int a = 0; a < 3 && trySpatial; a++)
+	{
+		const float lo = bounds.bmin.cell[a], extent = bounds.bmax.cell[a] - lo;
+		if (extent <= 0) continue;
+		// chopped binning: each reference is clipped against every bin it overlaps
+		struct Bin { aabb bounds; int entry = 0, exit = 0; } bin[BINS];
+		for (int i = 0; i < count; i++)
+		{
+			const SBVHRef& ref = refs[i];
+			const int first = max( 0, min( BINS - 1, (int)((ref.bounds.bmin.cell[a] - lo) * BINS / extent) ) );
+			const int last = max( first, min( BINS - 1, (int)((ref.bounds.bmax.cell[a] - lo) * BINS / extent) ) );
+			for (int b = first; b <= last; b++)
+			{
+				aabb clipped = first == last ? ref.bounds : ClipTriangle( mesh->tri[ref.tri], a,
+					lo + extent * b / BINS, lo + extent * (b + 1) / BINS, ref.bounds );
+				if (!IsEmpty( clipped )) bin[b].bounds.grow( clipped );
+			}
+			bin[first].entry++, bin[last].exit++;
+		}
+		aabb leftBox[BINS - 1], rightBox[BINS - 1], leftSum, rightSum;
+		int leftCount[BINS - 1], rightCount[BINS - 1];
+		for (int i = 0, l = 0, r = 0; i < BINS - 1; i++)
+		{
+			leftSum.grow( bin[i].bounds ), leftBox[i] = leftSum, leftCount[i] = l += bin[i].entry;
+			rightSum.grow( bin[BINS - 1 - i].bounds ), rightBox[BINS - 2 - i] = rightSum;
+			rightCount[BINS - 2 - i] = r += bin[BINS - 1 - i].exit;
+		}
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			// both sides must get fewer references than the parent, or we never terminate
+			if (leftCount[i] == 0 || rightCount[i] == 0 || leftCount[i] == count || rightCount[i] == count) continue;
+			const float cost = leftBox[i].area() * leftCount[i] + rightBox[i].area() * rightCount[i];
+			if (cost < spatialCost) spatialCost = cost, spatialAxis = a, spatialPlane = lo + extent * (i + 1) / BINS;
+		}
+	}
+	// 3. partition the references, or create a leaf
+	vector<SBVHRef> left, right;
+	if (spatialAxis != -1 && spatialCost < objCost && spatialCost < nosplitCost && depth < 60)
+	{
+		// spatial split: references that straddle the plane are clipped and go to both sides
+		const int a = spatialAxis;
+		int straddling = 0;
+		for (int i = 0; i < count; i++)
+			if (refs[i].bounds.bmin.cell[a] < spatialPlane && refs[i].bounds.bmax.cell[a] > spatialPlane) straddling++;
+		if (straddling <= spareRefs) for (int i = 0; i < count; i++)
+		{
+			const SBVHRef& ref = refs[i];
+			if (ref.bounds.bmax.cell[a] <= spatialPlane) { left.push_back( ref ); continue; }
+			if (ref.bounds.bmin.cell[a] >= spatialPlane) { right.push_back( ref ); continue; }
+			SBVHRef l = { ClipTriangle( mesh->tri[ref.tri], a, -1e30f, spatialPlane, ref.bounds ), ref.tri };
+			SBVHRef r = { ClipTriangle( mesh->tri[ref.tri], a, spatialPlane, 1e30f, ref.bounds ), ref.tri };
+			if (IsEmpty( l.bounds )) right.push_back( r );
+			else if (IsEmpty( r.bounds )) left.push_back( l );
+			else left.push_back( l ), right.push_back( r ), spareRefs--;
+		}
+	}
+	if (left.empty() && right.empty() && objAxis != -1 && objCost < nosplitCost && depth < 60)
+	{
+		// object split: partition by centroid bin, using the exact calculation we used for binning
+		const float boundsMin = centroidBounds.bmin.cell[objAxis], boundsMax = centroidBounds.bmax.cell[objAxis];
+		const float scale = BINS / (boundsMax - boundsMin);
+		for (int i = 0; i < count; i++)
+		{
+			const float c = (refs[i].bounds.bmin.cell[objAxis] + refs[i].bounds.bmax.cell[objAxis]) * 0.5f;
+			if (min( BINS - 1, (int)((c - boundsMin) * scale) ) < objSplit) left.push_back( refs[i] ); else right.push_back( refs[i] );
+		}
+	}
+	if (left.empty() || right.empty())
+	{
+		// no useful split: store the references in a leaf
+		node.leftFirst = idxCount, node.triCount = count;
+		for (int i = 0; i < count; i++) triIdx[idxCount++] = refs[i].tri;
+		return;
+	}
+	vector<SBVHRef>().swap( refs ); // release parent references before recursing
+	// create child nodes and recurse
+	uint leftChildIdx = nodesUsed++, rightChildIdx = nodesUsed++;
+	node.leftFirst = leftChildIdx, node.triCount = 0;
+	SubdivideSBVH( leftChildIdx, depth + 1, left, minOverlap, spareRefs );
+	SubdivideSBVH( rightChildIdx, depth + 1, right, minOverlap, spareRefs );
+}
+
+// LBVH construction, following Karras, 2012, "Maximizing Parallelism in the Construction of
+// BVHs, Octrees, and k-d Trees", and Karras & Aila, 2013, "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies" for the treelet restructuring
+
+static inline uint ExpandBits( uint v )
+{
+	// spread the lower 10 bits of v so that there are two zero bits between each bit
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+uint Tmpl8::RayKey( const Ray& ray, const aabb& bounds )
+{
+	// 9 bits per axis for the origin cell; the octant goes in front, so rays sorted by key
+	// are grouped by direction first, then by origin along a Morton curve
+	const float3 extent = bounds.bmax - bounds.bmin;
+	const float3 p = (ray.O - bounds.bmin) * float3( 512 / extent.x, 512 / extent.y, 512 / extent.z );
+	const uint x = (uint)clamp( p.x, 0.0f, 511.0f ), y = (uint)clamp( p.y, 0.0f, 511.0f );
+	const uint z = (uint)clamp( p.z, 0.0f, 511.0f );
+	const uint octant = (ray.D.x < 0 ? 1 : 0) + (ray.D.y < 0 ? 2 : 0) + (ray.D.z < 0 ? 4 : 0);
+	return (octant << 27) | (ExpandBits( x ) << 2) | (ExpandBits( y ) << 1) | ExpandBits( z );
+}
+
+static inline uint LeadingZeros( const uint v )
+{
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanReverse( &bit, v );
+	return 31 - bit;
+#else
+	return __builtin_clz( v );
+#endif
+}
+
+static inline int Delta( const SortItem* sorted, const int N, const int i, const int j )
+{
+	// length of the common key prefix of sorted entries i and j; -1 if j is out of range
+	if (j < 0 || j >= N) return -1;
+	const uint a = sorted[i].key, b = sorted[j].key;
+	if (a == b) return 32 + LeadingZeros( (uint)i ^ (uint)j ); // duplicate keys: use the index as tie breaker
+	return LeadingZeros( a ^ b );
+}
+
+void BVH::BuildLBVH( bool optimize )
+{
+	const uint N = mesh->triCount;
+	if (!lbvhNode)
+	{
+		lbvhNode = new LBVHNode[N * 2];
+		mortonCode = new SortItem[N];
+		lbvhVisits = new atomic<uint>[N];
+	}
+	ReserveNodes( N * 2 ); // one triangle per leaf: 2 * N nodes, counting the unused node 1
+	nodesUsed = 2, idxCount = N, refitReady = false, directTris = false, buildStackPtr = 0;
+	memset( bvhNode, 0, N * 2 * sizeof( BVHNode ) );
+	// triangle centroids and their bounds
+	Tri* tri = mesh->tri;
+	__m128 cmin4[BUILD_CHUNKS], cmax4[BUILD_CHUNKS];
+	const uint chunkSize = (N + BUILD_CHUNKS - 1) / BUILD_CHUNKS;
+	JobManager::GetJobManager()->ParallelFor( BUILD_CHUNKS, [&]( int c )
+	{
+		__m128 bcmin4 = _mm_set_ps1( 1e30f ), bcmax4 = _mm_set_ps1( -1e30f );
+		const uint first = min( N, c * chunkSize ), last = min( N, first + chunkSize );
+		for (uint i = first; i < last; i++)
+		{
+			tri[i].centroid = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
+			bcmin4 = _mm_min_ps( bcmin4, tri[i].centroid4 );
+			bcmax4 = _mm_max_ps( bcmax4, tri[i].centroid4 );
+		}
+		cmin4[c] = bcmin4, cmax4[c] = bcmax4;
+	} );
+	for (int c = 1; c < BUILD_CHUNKS; c++) cmin4[0] = _mm_min_ps( cmin4[0], cmin4[c] ), cmax4[0] = _mm_max_ps( cmax4[0], cmax4[c] );
+	const float3 centroidMin = *(float3*)&cmin4[0], centroidMax = *(float3*)&cmax4[0];
+	// 30-bit Morton codes of the centroids, sorted
+	SortItem* sorted = mortonCode;
+	const float3 scale = 1023.0f / fmaxf( centroidMax - centroidMin, float3( 1e-20f ) );
+	JobManager::GetJobManager()->ParallelFor( N, [&]( int i )
+	{
+		const float3 p = (tri[i].centroid - centroidMin) * scale;
+		const uint x = min( 1023u, (uint)p.x ), y = min( 1023u, (uint)p.y ), z = min( 1023u, (uint)p.z );
+		sorted[i].key = (ExpandBits( x ) << 2) | (ExpandBits( y ) << 1) | ExpandBits( z ), sorted[i].idx = i;
+	}, 4096 );
+	sorter.Sort( sorted, N );
+	// topology: interior node i covers a range of sorted keys that starts or ends at i
+	JobManager::GetJobManager()->ParallelFor( N, [&]( int i )
+	{
+		LBVHNode& leaf = lbvhNode[N - 1 + i];
+		const Tri& leafTri = tri[sorted[i].idx];
+		leaf.aabbMin = fminf( fminf( leafTri.vertex0, leafTri.vertex1 ), leafTri.vertex2 );
+		leaf.aabbMax = fmaxf( fmaxf( leafTri.vertex0, leafTri.vertex1 ), leafTri.vertex2 );
+		leaf.count = 1, leaf.cost = leaf.SurfaceArea();
+		if (i == (int)N - 1) return; // there are only N - 1 interior nodes
+		const int n = (int)N, d = (Delta( sorted, n, i, i + 1 ) - Delta( sorted, n, i, i - 1 )) > 0 ? 1 : -1;
+		const int deltaMin = Delta( sorted, n, i, i - d );
+		int lmax = 2;
+		while (Delta( sorted, n, i, i + lmax * d ) > deltaMin) lmax *= 2;
+		int l = 0;
+		for (int t = lmax >> 1; t > 0; t >>= 1) if (Delta( sorted, n, i, i + (l + t) * d ) > deltaMin) l += t;
+		const int j = i + l * d, deltaNode = Delta( sorted, n, i, j );
+		// find the split position using binary search
+		int s = 0, t = l;
+		do
+		{
+			t = (t + 1) >> 1;
+			if (Delta( sorted, n, i, i + (s + t) * d ) > deltaNode) s += t;
+		} while (t > 1);
+		const int gamma = i + s * d + min( d, 0 );
+		LBVHNode& node = lbvhNode[i];
+		node.left = min( i, j ) == gamma ? (n - 1 + gamma) : gamma;
+		node.right = max( i, j ) == gamma + 1 ? (n + gamma) : (gamma + 1);
+		lbvhNode[node.left].parent = lbvhNode[node.right].parent = i;
+		lbvhVisits[i] = 0;
+	}, 4096 );
+	lbvhNode[0].parent = 0xffffffff;
+	// bounds, triangle counts and SAH costs, bottom-up; the second child to arrive does the parent
+	JobManager::GetJobManager()->ParallelFor( N, [&]( int i )
+	{
+		uint nodeIdx = lbvhNode[N - 1 + i].parent;
+		while (nodeIdx != 0xffffffff)
+		{
+			if (lbvhVisits[nodeIdx]++ == 0) return; // sibling subtree is not done yet
+			LBVHNode& node = lbvhNode[nodeIdx];
+			const LBVHNode& a = lbvhNode[node.left], & b = lbvhNode[node.right];
+			node.aabbMin = fminf( a.aabbMin, b.aabbMin ), node.aabbMax = fmaxf( a.aabbMax, b.aabbMax );
+			node.count = a.count + b.count, node.cost = node.SurfaceArea() + a.cost + b.cost;
+			nodeIdx = node.parent;
+		}
+	}, 4096 );
+	if (optimize && N >= 8)
+	{
+		// split the top of the tree until there are enough subtrees to keep all threads busy
+		vector<uint> queue( 1, 0 ), top;
+		uint head = 0;
+		while (head < queue.size() && queue.size() - head < 256)
+		{
+			const LBVHNode& node = lbvhNode[queue[head++]];
+			if (node.count < 8) continue;
+			top.push_back( queue[head - 1] );
+			queue.push_back( node.left ), queue.push_back( node.right );
+		}
+		JobManager::GetJobManager()->ParallelFor( (int)(queue.size() - head), [&]( int i ) { OptimizeLBVH( queue[head + i] ); } );
+		for (int i = (int)top.size() - 1; i >= 0; i--) RestructureTreelet( top[i] );
+	}
+	// convert to the BVHNode layout; small subtrees become leaves if that lowers the SAH cost
+	struct Entry { uint lbvhIdx, nodeIdx; } stack[64], gather[64];
+	uint stackPtr = 0, nodePtr = 2;
+	stack[stackPtr++] = { 0, 0 };
+	idxCount = 0;
+	while (stackPtr > 0)
+	{
+		const Entry e = stack[--stackPtr];
+		const LBVHNode& n = lbvhNode[e.lbvhIdx];
+		BVHNode& node = bvhNode[e.nodeIdx];
+		node.aabbMin = n.aabbMin, node.aabbMax = n.aabbMax;
+		bool leaf = n.count == 1 || (n.count <= 8 && n.SurfaceArea() * n.count <= n.cost);
+	#ifdef LEAF_SOA
+		leaf |= n.count <= LEAF_SOA; // a single SoA block
+	#endif
+		if (!leaf)
+		{
+			node.leftFirst = nodePtr, node.triCount = 0;
+			stack[stackPtr++] = { n.right, nodePtr + 1 };
+			stack[stackPtr++] = { n.left, nodePtr };
+			nodePtr += 2;
+			continue;
+		}
+		// collect the triangles of the subtree
+		node.leftFirst = idxCount, node.triCount = n.count;
+		uint gatherPtr = 0;
+		gather[gatherPtr++] = e;
+		while (gatherPtr > 0)
+		{
+			const uint idx = gather[--gatherPtr].lbvhIdx;
+			if (idx >= N - 1) { triIdx[idxCount++] = sorted[idx - (N - 1)].idx; continue; }
+			gather[gatherPtr++] = { lbvhNode[idx].right, 0 };
+			gather[gatherPtr++] = { lbvhNode[idx].left, 0 };
+		}
+	}
+	nodesUsed = nodePtr;
+	buildCost = 0, refitCount = 0;
+#ifdef TRI_WOOP
+	PrecomputeTris();
+#endif
+#ifdef LEAF_SOA
+	BuildLeafSoA();
+#endif
+	// keep the wide trees in sync
+	if (bvhNode4) Collapse4();
+	if (bvhNode8) Collapse8();
+	if (bvhNodeQ4) CompressQ4();
+}
+
+void BVH::OptimizeLBVH( uint nodeIdx )
+{
+	// post-order: the treelets below a node are restructured before the treelet at the node
+	const LBVHNode& node = lbvhNode[nodeIdx];
+	if (node.count < 8) return;
+	OptimizeLBVH( node.left );
+	OptimizeLBVH( node.right );
+	RestructureTreelet( nodeIdx );
+}
+
+void BVH::RestructureTreelet( uint nodeIdx )
+{
+	// treelet: grow the set of leaves by expanding the one with the largest surface area
+	const uint N = mesh->triCount;
+	uint leaf[7], interior[5], leafCount = 2, interiorCount = 0;
+	leaf[0] = lbvhNode[nodeIdx].left, leaf[1] = lbvhNode[nodeIdx].right;
+	while (leafCount < 7)
+	{
+		int best = -1;
+		float bestArea = -1;
+		for (uint i = 0; i < leafCount; i++) if (leaf[i] < N - 1)
+		{
+			const float area = lbvhNode[leaf[i]].SurfaceArea();
+			if (area > bestArea) best = i, bestArea = area;
+		}
+		if (best == -1) break;
+		const LBVHNode& expand = lbvhNode[interior[interiorCount++] = leaf[best]];
+		leaf[best] = expand.left, leaf[leafCount++] = expand.right;
+	}
+	// optimal topology for each subset of the treelet leaves, smaller subsets first
+	float3 smin[128], smax[128];
+	float cost[128];
+	uint count[128], split[128];
+	smin[0] = float3( 1e30f ), smax[0] = float3( -1e30f ), count[0] = 0;
+	const uint all = (1 << leafCount) - 1;
+	for (uint s = 1; s <= all; s++)
+	{
+		const LBVHNode& low = lbvhNode[leaf[LowestBit( s )]];
+		const uint rest = s & (s - 1);
+		smin[s] = fminf( smin[rest], low.aabbMin ), smax[s] = fmaxf( smax[rest], low.aabbMax );
+		count[s] = count[rest] + low.count;
+		if (rest == 0) { cost[s] = low.cost; continue; }
+		// partitions: each pair is visited once, as the part that holds the lowest leaf
+		float bestCost = 1e30f;
+		for (uint p = (s - 1) & s; p > 0; p = (p - 1) & s) if (p & (s & (0 - s)))
+		{
+			const float c = cost[p] + cost[s ^ p];
+			if (c < bestCost) bestCost = c, split[s] = p;
+		}
+		const float3 e = smax[s] - smin[s];
+		cost[s] = e.x * e.y + e.y * e.z + e.z * e.x + bestCost;
+	}
+	if (cost[all] >= lbvhNode[nodeIdx].cost) return;
+	// rebuild the treelet top-down, reusing its interior nodes
+	struct Entry { uint nodeIdx, set; } stack[8];
+	uint stackPtr = 0, nextInterior = 0;
+	stack[stackPtr++] = { nodeIdx, all };
+	while (stackPtr > 0)
+	{
+		const Entry e = stack[--stackPtr];
+		LBVHNode& node = lbvhNode[e.nodeIdx];
+		node.aabbMin = smin[e.set], node.aabbMax = smax[e.set];
+		node.count = count[e.set], node.cost = cost[e.set];
+		uint child[2], set[2] = { split[e.set], e.set ^ split[e.set] };
+		for (int i = 0; i < 2; i++)
+		{
+			if ((set[i] & (set[i] - 1)) == 0) child[i] = leaf[LowestBit( set[i] )];
+			else child[i] = interior[nextInterior++], stack[stackPtr++] = { child[i], set[i] };
+			lbvhNode[child[i]].parent = e.nodeIdx;
+		}
+		node.left = child[0], node.right = child[1];
+	}
+}
+
+// BVHInstance implementation
+
+BVHInstance::BVHInstance( TLAS* nested, uint index )
+{
+#ifndef WIDE_INDICES
+	FatalError( "BVHInstance: instancing a TLAS requires WIDE_INDICES." );
+#endif
+	for (uint i = 0; i < nested->blasCount; i++) if (nested->blas[i].GetTLAS())
+		FatalError( "BVHInstance: the instances of a nested TLAS must be BLAS instances." );
+	tlas = nested, idx = index, triOffset = NESTED_TLAS;
+	SetTransform( mat4() );
+}
+
+void BVHInstance::LocalBounds( float3& bmin, float3& bmax )
+{
+	if (triOffset == NESTED_TLAS) bmin = tlas->tlasNode[0].aabbMin, bmax = tlas->tlasNode[0].aabbMax;
+	else bmin = bvh->bvhNode[0].aabbMin, bmax = bvh->bvhNode[0].aabbMax;
+}
+
+// transform class for the ray transform: identity, translation or any other affine matrix
+static uint TransformClass( const float* M )
+{
+	if (M[0] != 1 || M[1] != 0 || M[2] != 0 || M[4] != 0 || M[5] != 1 || M[6] != 0 || M[8] != 0 || M[9] != 0 || M[10] != 1)
+		return BVHInstance::AFFINE;
+	return M[3] == 0 && M[7] == 0 && M[11] == 0 ? BVHInstance::IDENTITY : BVHInstance::TRANSLATION;
+}
+
+void BVHInstance::SetTransform( const mat4& T )
+{
+	transform = T;
+	invTransform = transform.Inverted();
+	transformClass = TransformClass( T.cell );
+	// calculate world-space bounds using the new matrix
+	float3 bmin, bmax;
+	LocalBounds( bmin, bmax );
+	bounds = aabb();
+	for (int i = 0; i < 8; i++)
+		bounds.grow( TransformPosition( float3( i & 1 ? bmax.x : bmin.x,
+			i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z ), transform ) );
+}
+
+void BVHInstance::SetTransforms( BVHInstance* instances, const mat4* T, uint count, DirtyRanges* dirty )
+{
+	// SetTransform for many instances, four at a time in SSE registers. For affine
+	// transforms the inverse is the inverted 3x3 part (adjugate / determinant) plus a
+	// translation, and the world space bounds follow from the center and extent of
+	// the BLAS root: c' = M * c, e' = |M| * e, which is exact for all 8 corners.
+	vector<uchar> changed( dirty ? (count + 3) / 4 : 0 ); // per group of four
+	JobManager::GetJobManager()->ParallelFor( (count + 3) / 4, [&]( int group )
+	{
+		const uint first = group * 4;
+		if (dirty) for (uint i = first; i < min( first + 4, count ); i++)
+			changed[group] |= memcmp( instances[i].transform.cell, T[i].cell, sizeof( mat4 ) ) != 0;
+		bool affine = first + 4 <= count;
+		for (uint i = first; i < first + 4 && affine; i++)
+			affine = T[i].cell[12] == 0 && T[i].cell[13] == 0 && T[i].cell[14] == 0 && T[i].cell[15] == 1;
+		if (!affine)
+		{
+			for (uint i = first; i < min( first + 4, count ); i++) instances[i].SetTransform( T[i] );
+			return;
+		}
+		// a[r][c]: element (r, c) of the four matrices
+		__m128 a[3][4];
+		for (int r = 0; r < 3; r++)
+		{
+			for (int j = 0; j < 4; j++) a[r][j] = _mm_loadu_ps( T[first + j].cell + r * 4 );
+			_MM_TRANSPOSE4_PS( a[r][0], a[r][1], a[r][2], a[r][3] );
+		}
+		#define MUL( x, y ) _mm_mul_ps( a[x / 10][x % 10], a[y / 10][y % 10] )
+		const __m128 c00 = _mm_sub_ps( MUL( 11, 22 ), MUL( 12, 21 ) );
+		const __m128 c01 = _mm_sub_ps( MUL( 12, 20 ), MUL( 10, 22 ) );
+		const __m128 c02 = _mm_sub_ps( MUL( 10, 21 ), MUL( 11, 20 ) );
+		const __m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( a[0][0], c00 ), _mm_mul_ps( a[0][1], c01 ) ), _mm_mul_ps( a[0][2], c02 ) );
+		const __m128 rdet = _mm_div_ps( _mm_set1_ps( 1 ), det );
+		__m128 inv[3][4] = {
+			{ c00, _mm_sub_ps( MUL( 2, 21 ), MUL( 1, 22 ) ), _mm_sub_ps( MUL( 1, 12 ), MUL( 2, 11 ) ) },
+			{ c01, _mm_sub_ps( MUL( 0, 22 ), MUL( 2, 20 ) ), _mm_sub_ps( MUL( 2, 10 ), MUL( 0, 12 ) ) },
+			{ c02, _mm_sub_ps( MUL( 1, 20 ), MUL( 0, 21 ) ), _mm_sub_ps( MUL( 0, 11 ), MUL( 1, 10 ) ) }
+		};
+		#undef MUL
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 3; c++) inv[r][c] = _mm_mul_ps( inv[r][c], rdet );
+			inv[r][3] = _mm_sub_ps( _mm_setzero_ps(), _mm_add_ps( _mm_add_ps( _mm_mul_ps( inv[r][0], a[0][3] ),
+				_mm_mul_ps( inv[r][1], a[1][3] ) ), _mm_mul_ps( inv[r][2], a[2][3] ) ) );
+		}
+		// world space bounds from the BLAS (or nested TLAS) root of each instance
+		float3 rootMin[4], rootMax[4];
+		for (int j = 0; j < 4; j++) instances[first + j].LocalBounds( rootMin[j], rootMax[j] );
+		__m128 c[3], e[3];
+		for (int k = 0; k < 3; k++)
+		{
+			union { __m128 c4; float cf[4]; }; union { __m128 e4; float ef[4]; };
+			for (int j = 0; j < 4; j++)
+				cf[j] = (rootMin[j][k] + rootMax[j][k]) * 0.5f, ef[j] = (rootMax[j][k] - rootMin[j][k]) * 0.5f;
+			c[k] = c4, e[k] = e4;
+		}
+		const __m128 signMask = _mm_set1_ps( -0.0f );
+		union { __m128 bmin4[3]; float bmin[3][4]; }; union { __m128 bmax4[3]; float bmax[3][4]; };
+		for (int r = 0; r < 3; r++)
+		{
+			__m128 wc = a[r][3], we = _mm_setzero_ps();
+			for (int k = 0; k < 3; k++)
+				wc = _mm_add_ps( wc, _mm_mul_ps( a[r][k], c[k] ) ),
+				we = _mm_add_ps( we, _mm_mul_ps( _mm_andnot_ps( signMask, a[r][k] ), e[k] ) );
+			bmin4[r] = _mm_sub_ps( wc, we ), bmax4[r] = _mm_add_ps( wc, we );
+		}
+		// back to one matrix per instance
+		for (int r = 0; r < 3; r++)
+		{
+			_MM_TRANSPOSE4_PS( a[r][0], a[r][1], a[r][2], a[r][3] );
+			_MM_TRANSPOSE4_PS( inv[r][0], inv[r][1], inv[r][2], inv[r][3] );
+		}
+		for (int j = 0; j < 4; j++)
+		{
+			BVHInstance& instance = instances[first + j];
+			instance.transform = mat4(), instance.invTransform = mat4();
+			for (int r = 0; r < 3; r++)
+				_mm_storeu_ps( instance.transform.cell + r * 4, a[r][j] ),
+				_mm_storeu_ps( instance.invTransform.cell + r * 4, inv[r][j] );
+			instance.bounds.bmin = float3( bmin[0][j], bmin[1][j], bmin[2][j] );
+			instance.bounds.bmax = float3( bmax[0][j], bmax[1][j], bmax[2][j] );
+			instance.transformClass = TransformClass( T[first + j].cell );
+		}
+	}, 64 );
+	if (dirty) for (uint group = 0; group < changed.size(); group++)
+		if (changed[group]) dirty->Mark( group * 4, min( 4u, count - group * 4 ) );
+}
+
+// affine ray transform in SSE registers; the bottom row of the matrix is not used
+static inline void TransformRay( Ray& r, const __m128 O4, const __m128 D4, const mat4& M )
+{
+	const __m128 row0 = _mm_loadu_ps( M.cell ), row1 = _mm_loadu_ps( M.cell + 4 ), row2 = _mm_loadu_ps( M.cell + 8 );
+	const __m128 one = _mm_set1_ps( 1 ), O = _mm_blend_ps( O4, one, 8 );
+	const __m128 D = _mm_or_ps( _mm_or_ps( _mm_dp_ps( row0, D4, 0x71 ), _mm_dp_ps( row1, D4, 0x72 ) ), _mm_dp_ps( row2, D4, 0x74 ) );
+	r.O4 = _mm_blend_ps( _mm_or_ps( _mm_or_ps( _mm_dp_ps( row0, O, 0xf1 ), _mm_dp_ps( row1, O, 0xf2 ) ), _mm_dp_ps( row2, O, 0xf4 ) ), one, 8 );
+	r.D4 = _mm_blend_ps( D, D4, 8 ); // keeps the time
+	r.rD4 = _mm_div_ps( one, _mm_blend_ps( D, one, 8 ) );
+}
+
+void BVHInstance::IntersectLocal( Ray& ray )
+{
+#ifdef WIDE_INDICES
+	if (triOffset == NESTED_TLAS)
+	{
+		// a closer hit in the nested TLAS reports its instance there; it becomes the inner one
+		const float t = ray.hit.t;
+		tlas->Intersect( ray );
+		if (ray.hit.t < t)
+			ray.hit.inner = INST_IDX( ray.hit.instPrim ), ray.hit.instPrim = INST_PRIM( idx, PRIM_IDX( ray.hit.instPrim ) );
+		return;
+	}
+#endif
+	// trace ray through BVH, using the most compact or widest available version
+	if (bvh->bvhNodeQ4) bvh->IntersectQ4( ray, idx );
+	else if (bvh->bvhNode8) bvh->Intersect8( ray, idx );
+	else if (bvh->bvhNode4) bvh->Intersect4( ray, idx );
+	else bvh->Intersect( ray, idx );
+}
+
+bool BVHInstance::OccludedLocal( const Ray& ray )
+{
+	if (triOffset == NESTED_TLAS) return tlas->IsOccluded( ray, ray.hit.t );
+	return bvh->IsOccluded( ray );
+}
+
+void BVHInstance::Intersect( Ray& ray )
+{
+	if (transformClass == AFFINE) { Intersect( ray, invTransform ); return; }
+	TRAVERSAL_STAT( traversalStats.instances++ );
+	if (transformClass == IDENTITY) { IntersectLocal( ray ); return; }
+	// translation: D and rD stay the same
+	const __m128 O4 = ray.O4;
+	ray.O4 = _mm_add_ps( O4, _mm_set_ps( 0, invTransform.cell[11], invTransform.cell[7], invTransform.cell[3] ) );
+	IntersectLocal( ray );
+	ray.O4 = O4;
+}
+
+void BVHInstance::Intersect( Ray& ray, const mat4& inverse )
+{
+	TRAVERSAL_STAT( traversalStats.instances++ );
+	// transform the ray in place; only origin, direction and reciprocal need to be restored
+	const __m128 O4 = ray.O4, D4 = ray.D4, rD4 = ray.rD4;
+	TransformRay( ray, O4, D4, inverse );
+	IntersectLocal( ray );
+	ray.O4 = O4, ray.D4 = D4, ray.rD4 = rD4;
+}
+
+bool BVHInstance::IsOccluded( const Ray& ray )
+{
+	if (transformClass == AFFINE) return IsOccluded( ray, invTransform );
+	TRAVERSAL_STAT( traversalStats.instances++ );
+	if (transformClass == IDENTITY) return OccludedLocal( ray );
+	Ray r = ray;
+	r.O4 = _mm_add_ps( ray.O4, _mm_set_ps( 0, invTransform.cell[11], invTransform.cell[7], invTransform.cell[3] ) );
+	return OccludedLocal( r );
+}
+
+bool BVHInstance::IsOccluded( const Ray& ray, const mat4& inverse )
+{
+	TRAVERSAL_STAT( traversalStats.instances++ );
+	// transform a copy of the ray; the hit distance is invariant under the affine transform
+	Ray r;
+	TransformRay( r, ray.O4, ray.D4, inverse );
+	r.hit.t = ray.hit.t;
+	return OccludedLocal( r );
+}
+
+void BVHInstance::Intersect( RayPacket& packet )
+{
+	TRAVERSAL_STAT( traversalStats.instances++ );
+	// backup packet and transform all rays, four at a time
+	RayPacket backupPacket = packet;
+	const float* M = invTransform.cell;
+	for (int g = 0; g < PACKET_SIZE / 4; g++)
+	{
+		const __m128 Ox = backupPacket.O4[0][g], Oy = backupPacket.O4[1][g], Oz = backupPacket.O4[2][g];
+		const __m128 Dx = backupPacket.D4[0][g], Dy = backupPacket.D4[1][g], Dz = backupPacket.D4[2][g];
+		for (int a = 0; a < 3; a++)
+		{
+			const __m128 m0 = _mm_set1_ps( M[a * 4] ), m1 = _mm_set1_ps( M[a * 4 + 1] ), m2 = _mm_set1_ps( M[a * 4 + 2] );
+			const __m128 d = _mm_add_ps( _mm_add_ps( _mm_mul_ps( m0, Dx ), _mm_mul_ps( m1, Dy ) ), _mm_mul_ps( m2, Dz ) );
+			const __m128 o = _mm_add_ps( _mm_add_ps( _mm_mul_ps( m0, Ox ), _mm_mul_ps( m1, Oy ) ), _mm_mul_ps( m2, Oz ) );
+			packet.O4[a][g] = _mm_add_ps( o, _mm_set1_ps( M[a * 4 + 3] ) ), packet.D4[a][g] = d;
+		}
+	}
+	packet.Prepare();
+#ifdef WIDE_INDICES
+	if (triOffset == NESTED_TLAS)
+	{
+		// as for a single ray: closer hits record the instance in the nested TLAS as the inner one
+		tlas->Intersect( packet );
+		for (int i = 0; i < PACKET_SIZE; i++) if (packet.hit.t[i] < backupPacket.hit.t[i])
+			packet.hit.inner[i] = packet.hit.inst[i], packet.hit.inst[i] = idx;
+	}
+	else
+#endif
+	// trace packet through BVH
+	bvh->Intersect( packet, idx );
+	// restore ray origins and directions
+	backupPacket.hit = packet.hit;
+	packet = backupPacket;
+}
+
+// TLAS implementation
+
+TLAS::TLAS( BVHInstance* bvhList, int N )
+{
+	// copy a pointer to the array of bottom level accstruc instances
+	blas = bvhList;
+	blasCount = N;
+	// allocate TLAS nodes
+	tlasNode = (TLASNode*)_aligned_malloc( sizeof( TLASNode ) * 2 * (N + 64), 64 );
+	nodeIdx = new uint[N];
+	nodesUsed = 2;
+}
+
+int TLAS::FindBestMatch( int N, int A )
+{
+	// find BLAS B that, when joined with A, forms the smallest AABB
+	float smallest = 1e30f;
+	int bestB = -1;
+	for (int B = 0; B < N; B++) if (B != A)
+	{
+		float3 bmax = fmaxf( tlasNode[nodeIdx[A]].aabbMax, tlasNode[nodeIdx[B]].aabbMax );
+		float3 bmin = fminf( tlasNode[nodeIdx[A]].aabbMin, tlasNode[nodeIdx[B]].aabbMin );
+		float3 e = bmax - bmin;
+		float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
+		if (surfaceArea < smallest) smallest = surfaceArea, bestB = B;
+	}
+	return bestB;
+}
+
+void TLAS::Build()
+{
+	// assign a TLASleaf node to each BLAS
+	nodesUsed = 1;
+	for (uint i = 0; i < blasCount; i++)
+	{
+		nodeIdx[i] = nodesUsed;
+		tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
+		tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
+		tlasNode[nodesUsed].BLAS = i;
+		tlasNode[nodesUsed++].left = 0; // makes it a leaf
+	}
+	// use agglomerative clustering to build the TLAS
+	int nodeIndices = blasCount;
+	int A = 0, B = FindBestMatch( nodeIndices, A );
+	FILE* f = fopen( "pairs.txt", "w" );
+	while (nodeIndices > 1)
+	{
+		int C = FindBestMatch( nodeIndices, B );
+		if (A == C)
+		{
+			// found a pair: create a new TLAS interior node
+			int nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
+			TLASNode& nodeA = tlasNode[nodeIdxA];
+			TLASNode& nodeB = tlasNode[nodeIdxB];
+			TLASNode& newNode = tlasNode[nodesUsed];
+			newNode.aabbMin = fminf( nodeA.aabbMin, nodeB.aabbMin );
+			newNode.aabbMax = fmaxf( nodeA.aabbMax, nodeB.aabbMax );
+			newNode.left = nodeIdxA, newNode.right = nodeIdxB;
+			fprintf( f, "%i,%i\n", nodeIdxA, nodeIdxB );
+			nodeIdx[A] = nodesUsed++;
+			nodeIdx[B] = nodeIdx[nodeIndices - 1];
+			B = FindBestMatch( --nodeIndices, A );
+		}
+		else A = B, B = C;
+	}
+	fclose( f );
+	// copy last remaining node to the root node
+	tlasNode[0] = tlasNode[nodeIdx[A]];
+	dirty.Clear(), dirty.Mark( 0, nodesUsed );
+}
+
+static inline float Area( const float3& bmin, const float3& bmax )
+{
+	const float3 e = bmax - bmin; // box extent
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void TLAS::SortAndSplit( uint first, uint last, uint level )
+{
+	// recursive median split over the dominant axis of the centroids, until there are 2^treeLevels groups
+	if (level == 0)
+	{
+		for (uint i = 0; i < blasCount; i++) item[i].idx = i;
+		treeIdx = 0;
+	}
+	if (level == treeLevels)
+	{
+		// create a group: its leaves are stored at treeCount + first .. treeCount + last
+		for (uint i = first; i <= last; i++)
+		{
+			BVHInstance& b = blas[item[i].idx];
+			TLASNode& leaf = tlasNode[treeCount + i];
+			leaf.aabbMin = b.bounds.bmin, leaf.aabbMax = b.bounds.bmax;
+			leaf.BLAS = item[i].idx;
+			leaf.left = 0; // makes it a leaf
+		}
+		if (!tree[treeIdx]) tree[treeIdx] = new KDTree( tlasNode + treeCount + first, last - first + 1, treeCount + first );
+		treeFirst[treeIdx] = first, treeSize[treeIdx++] = last - first + 1;
+		return;
+	}
+	aabb centroidBounds;
+	for (uint idx, i = first; i <= last; i++)
+		idx = item[i].idx, centroidBounds.grow( (blas[idx].bounds.bmin + blas[idx].bounds.bmax) * 0.5f );
+	uint axis = dominantAxis( centroidBounds.bmax - centroidBounds.bmin );
+	for (uint idx, i = first; i <= last; i++)
+		idx = item[i].idx,
+		item[i].pos = (blas[idx].bounds.bmin[axis] + blas[idx].bounds.bmax[axis]) * 0.5f;
+	sorter.SortFloat( item + first, last - first + 1 );
+	uint half = (first + last) >> 1;
+	SortAndSplit( first, half, level + 1 );
+	SortAndSplit( half + 1, last, level + 1 );
+}
+
+uint TLAS::ClusterGroup( uint group )
+{
+	// agglomerative clustering of one group using its kD-tree; returns the index of the group root
+	uint A = treeCount + treeFirst[group];
+	if (treeSize[group] == 1) return A;
+	KDTree* kdtree = tree[group];
+	kdtree->rebuild();
+	float sa = 1e30f;
+	// interior nodes of the group follow the leaves: each group of n leaves creates n - 1 nodes
+	uint best = 0, workLeft = treeSize[group], nodePtr = treeCount + blasCount + treeFirst[group] - group;
+	uint B = kdtree->FindNearest( A, best, sa );
+	while (1)
+	{
+		int C = kdtree->FindNearest( B, best = A, sa );
+		if (A == C)
+		{
+			// found a pair: create a new TLAS interior node
+			TLASNode& newNode = tlasNode[nodePtr];
+			newNode.aabbMin = fminf( tlasNode[A].aabbMin, tlasNode[B].aabbMin );
+			newNode.aabbMax = fmaxf( tlasNode[A].aabbMax, tlasNode[B].aabbMax );
+			newNode.left = A, newNode.right = B;
+			if (workLeft-- == 2) break;
+			kdtree->removeLeaf( A );
+			kdtree->removeLeaf( B );
+			kdtree->add( A = nodePtr++ );
+			B = kdtree->FindNearest( A, best = 0, sa = 1e30f );
+		}
+		else A = B, B = C;
+	}
+	return nodePtr;
+}
+
+void TLAS::BuildPLOC()
+{
+	// locally-ordered clustering (Meister & Bittner, 2018): in each round, all clusters find
+	// their nearest neighbour at once, and mutual nearest neighbours are merged. The kD-tree
+	// over the clusters is rebuilt per round and only read by the queries, so these run in
+	// parallel, in batches of four clusters that are close in Morton order.
+	const uint N = blasCount;
+	if (!item) item = new SortItem[N];
+	if (!cluster) cluster = new uint[N], nearest = new uint[N], nearestSA = new float[N], clusterNode = new TLASNode[N];
+	aabb bounds;
+	for (uint i = 0; i < N; i++) bounds.grow( (blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f );
+	const float3 scale = 1023.99f / fmaxf( bounds.bmax - bounds.bmin, float3( 1e-20f ) );
+	for (uint i = 0; i < N; i++)
+	{
+		const float3 C = ((blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f - bounds.bmin) * scale;
+		item[i].key = (ExpandBits( (uint)C.x ) << 2) | (ExpandBits( (uint)C.y ) << 1) | ExpandBits( (uint)C.z ), item[i].idx = i;
+	}
+	sorter.Sort( item, N );
+	// leaves are stored at N .. 2N - 1, in Morton order; interior nodes at 1 .. N - 2, the root at 0
+	for (uint i = 0; i < N; i++)
+	{
+		TLASNode& leaf = tlasNode[N + i];
+		leaf.aabbMin = blas[item[i].idx].bounds.bmin, leaf.aabbMax = blas[item[i].idx].bounds.bmax;
+		leaf.BLAS = item[i].idx, leaf.left = 0; // makes it a leaf
+		cluster[i] = N + i;
+	}
+	KDTree::ReserveLeafMap( N + 64 );
+	if (!clusterTree) clusterTree = new KDTree( clusterNode, N, 0 );
+	uint count = N, nodePtr = 1;
+	while (count > 1)
+	{
+		for (uint i = 0; i < count; i++) clusterNode[i] = tlasNode[cluster[i]];
+		clusterTree->rebuild( count );
+		JobManager::GetJobManager()->ParallelFor( (count + 3) / 4, [&]( int b )
+		{
+			const uint first = b * 4;
+			clusterTree->FindNearest4( first, min( 4u, count - first ), nearest + first, nearestSA + first );
+		}, 64 );
+		// merge mutual nearest neighbours; the new cluster takes the place of the first one
+		uint merged = 0, closest = 0;
+		for (uint i = 0; i < count; i++)
+		{
+			const uint j = nearest[i];
+			if (nearestSA[i] < nearestSA[closest]) closest = i;
+			if (j <= i || nearest[j] != i) continue;
+			const uint idx = count == 2 ? 0 : nodePtr++;
+			CreateParent( idx, cluster[i], cluster[j] );
+			cluster[i] = idx, cluster[j] = ~0u, merged++;
+		}
+		if (merged == 0)
+		{
+			// equal union areas can break every mutual pair: merge the closest pair anyway
+			const uint j = nearest[closest], idx = count == 2 ? 0 : nodePtr++;
+			CreateParent( idx, cluster[closest], cluster[j] );
+			cluster[closest] = idx, cluster[j] = ~0u;
+		}
+		uint remaining = 0;
+		for (uint i = 0; i < count; i++) if (cluster[i] != ~0u) cluster[remaining++] = cluster[i];
+		count = remaining;
+	}
+	if (N == 1) tlasNode[0] = tlasNode[N];
+	nodesUsed = 2 * N;
+}
+
+void TLAS::MergeGroups()
+{
+	// join the group roots by repeatedly combining the pair with the smallest union area,
+	// i.e. the pair that adds the least to the SAH cost; nodes are stored below treeCount
+	uint root[TLAS_MAX_GROUPS], count = treeCount, nodePtr = 1;
+	for (uint i = 0; i < count; i++) root[i] = treeRoot[i];
+	while (count > 1)
+	{
+		float smallest = 1e30f;
+		uint bestA = 0, bestB = 1;
+		for (uint a = 0; a < count; a++) for (uint b = a + 1; b < count; b++)
+		{
+			const TLASNode& A = tlasNode[root[a]], & B = tlasNode[root[b]];
+			float sa = Area( fminf( A.aabbMin, B.aabbMin ), fmaxf( A.aabbMax, B.aabbMax ) );
+			if (sa < smallest) smallest = sa, bestA = a, bestB = b;
+		}
+		uint idx = count == 2 ? 0 : nodePtr++;
+		CreateParent( idx, root[bestA], root[bestB] );
+		root[bestA] = idx, root[bestB] = root[--count];
+	}
+	if (treeCount == 1) tlasNode[0] = tlasNode[root[0]];
+}
+
+void TLAS::CreateParent( uint idx, uint left, uint right )
+{
+	tlasNode[idx].left = left, tlasNode[idx].right = right;
+	tlasNode[idx].aabbMin = fminf( tlasNode[left].aabbMin, tlasNode[right].aabbMin );
+	tlasNode[idx].aabbMax = fmaxf( tlasNode[left].aabbMax, tlasNode[right].aabbMax );
+}
+
+void TLAS::BuildQuick( int algorithm )
+{
+	// the algorithm is picked per call, so one binary can compare them, see TLAS_BUILD_QUICK
+	if (algorithm == 0)
+	{
+		// single-threaded code, for reference
+		// assign a TLASleaf node to each BLAS
+		nodesUsed = 1;
+		for (uint i = 0; i < blasCount; i++)
+		{
+			tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
+			tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
+			tlasNode[nodesUsed].BLAS = i;
+			tlasNode[nodesUsed++].left = 0; // makes it a leaf
+		}
+		// build a kD-tree over the TLAS nodes
+		KDTree::ReserveLeafMap( 2 * blasCount + 64 );
+		if (!kdtree) kdtree = new KDTree( tlasNode + 1, nodesUsed - 1, 1 /* skip root */ );
+		kdtree->rebuild();
+		// use the kD-tree for fast agglomerative clustering
+		float sa = 1e30f;
+		uint best = 0, workLeft = blasCount, A, B = kdtree->FindNearest( A = 1, best, sa );
+		while (1)
+		{
+			int C = kdtree->FindNearest( B, best = A, sa );
+			if (A == C)
+			{
+				// found a pair: create a new TLAS interior node
+				TLASNode& newNode = tlasNode[nodesUsed];
+				newNode.aabbMin = fminf( tlasNode[A].aabbMin, tlasNode[B].aabbMin );
+				newNode.aabbMax = fmaxf( tlasNode[A].aabbMax, tlasNode[B].aabbMax );
+				newNode.left = A, newNode.right = B;
+				if (workLeft-- == 2) break;
+				kdtree->removeLeaf( A );
+				kdtree->removeLeaf( B );
+				kdtree->add( A = nodesUsed++ );
+				B = kdtree->FindNearest( A, best = 0, sa = 1e30f );
+			}
+			else A = B, B = C;
+		}
+		// copy last remaining node to the root node
+		tlasNode[0] = tlasNode[nodesUsed];
+	}
+	else if (algorithm == 1)
+	{
+		// building the TLAS top-down, fastest option for the Boids demo
+		if (!boundsMesh) boundsMesh = new Mesh( blasCount );
+		Mesh& m = *boundsMesh;
+		for (uint i = 0; i < blasCount; i++)
+		{
+			m.tri[i].vertex0 = blas[i].bounds.bmin;
+			m.tri[i].vertex1 = blas[i].bounds.bmax;
+			m.tri[i].vertex2 = (blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f; // degenerate but with the correct aabb
+		}
+		if (!m.bvh)
+		{
+			m.bvh = new BVH( &m );
+			m.bvh->subdivToOnePrim = true;
+		}
+		m.bvh->Build();
+		// copy the BVH to a TLAS
+		memcpy( tlasNode, m.bvh->bvhNode, m.bvh->nodesUsed * sizeof( BVHNode ) );
+		for (uint i = 0; i < m.bvh->nodesUsed; i++) if (i != 1)
+		{
+			const BVHNode& n = m.bvh->bvhNode[i];
+			if (n.isLeaf())
+				tlasNode[i].BLAS = m.bvh->triIdx[n.leftFirst],
+				tlasNode[i].left = 0; // mark as leaf
+			else
+				tlasNode[i].left = n.leftFirst, tlasNode[i].right = n.leftFirst + 1;
+		}
+		nodesUsed = m.bvh->nodesUsed;
+	}
+	else if (algorithm == 3) BuildPLOC();
+	else
+	{
+		// multi-threaded: split the instances into 2^N spatially coherent groups,
+		// cluster each group on its own thread, then merge the group roots
+		if (!item) item = new SortItem[blasCount];
+		if (!treeCount)
+		{
+			// one group per thread, rounded up to a power of two; groups should not get too small
+			const uint threads = JobManager::GetJobManager()->GetNumThreads();
+			while ((1u << treeLevels) < threads && (2u << treeLevels) <= TLAS_MAX_GROUPS &&
+				(blasCount >> (treeLevels + 1)) >= 64) treeLevels++;
+			treeCount = 1 << treeLevels;
+		}
+		KDTree::ReserveLeafMap( 2 * blasCount + 64 );
+		SortAndSplit( 0, blasCount - 1, 0 );
+		JobManager::GetJobManager()->ParallelFor( treeCount, [&]( int i ) { treeRoot[i] = ClusterGroup( i ); } );
+		MergeGroups();
+		nodesUsed = 2 * blasCount;
+	}
+	dirty.Clear(), dirty.Mark( 0, nodesUsed + 1 );
+}
+
+float TLAS::Rotate( uint idx )
+{
+	// tree rotation (Kopta et al., 2012): swap a child with a grandchild on the other side,
+	// if that shrinks the other child; the bounds of this node do not change. Returns the
+	// change in the summed surface area of the interior nodes.
+	TLASNode& node = tlasNode[idx];
+	TLASNode& L = tlasNode[node.left], & R = tlasNode[node.right];
+	float bestDelta = 0;
+	int best = -1;
+	if (!R.isLeaf())
+	{
+		const TLASNode& RL = tlasNode[R.left], & RR = tlasNode[R.right];
+		const float area = Area( R.aabbMin, R.aabbMax );
+		float delta = Area( fminf( L.aabbMin, RR.aabbMin ), fmaxf( L.aabbMax, RR.aabbMax ) ) - area;
+		if (delta < bestDelta) bestDelta = delta, best = 0; // L <-> RL
+		delta = Area( fminf( L.aabbMin, RL.aabbMin ), fmaxf( L.aabbMax, RL.aabbMax ) ) - area;
+		if (delta < bestDelta) bestDelta = delta, best = 1; // L <-> RR
+	}
+	if (!L.isLeaf())
+	{
+		const TLASNode& LL = tlasNode[L.left], & LR = tlasNode[L.right];
+		const float area = Area( L.aabbMin, L.aabbMax );
+		float delta = Area( fminf( R.aabbMin, LR.aabbMin ), fmaxf( R.aabbMax, LR.aabbMax ) ) - area;
+		if (delta < bestDelta) bestDelta = delta, best = 2; // R <-> LL
+		delta = Area( fminf( R.aabbMin, LL.aabbMin ), fmaxf( R.aabbMax, LL.aabbMax ) ) - area;
+		if (delta < bestDelta) bestDelta = delta, best = 3; // R <-> LR
+	}
+	if (best == -1) return 0;
+	const uint l = node.left, r = node.right;
+	dirty.Mark( idx ), dirty.Mark( l ), dirty.Mark( r );
+	if (best == 0) node.left = R.left, R.left = l, CreateParent( r, R.left, R.right );
+	if (best == 1) node.left = R.right, R.right = l, CreateParent( r, R.left, R.right );
+	if (best == 2) node.right = L.left, L.left = r, CreateParent( l, L.left, L.right );
+	if (best == 3) node.right = L.right, L.right = r, CreateParent( l, L.left, L.right );
+	return bestDelta;
+}
+
+float TLAS::RefitRotate( uint idx )
+{
+	// refit a subtree bottom-up, improving it with rotations on the way;
+	// returns the summed surface area of the interior nodes, i.e. the unnormalized SAH cost
+	TLASNode& node = tlasNode[idx];
+	const TLASNode before = node;
+	if (node.isLeaf())
+	{
+		node.aabbMin = blas[node.BLAS].bounds.bmin;
+		node.aabbMax = blas[node.BLAS].bounds.bmax;
+		if (memcmp( &before, &node, sizeof( TLASNode ) )) dirty.Mark( idx );
+		return 0;
+	}
+	const float childCost = RefitRotate( node.left ) + RefitRotate( node.right );
+	CreateParent( idx, node.left, node.right );
+	if (memcmp( &before, &node, sizeof( TLASNode ) )) dirty.Mark( idx );
+	return childCost + Rotate( idx ) + Area( node.aabbMin, node.aabbMax );
+}
+
+void TLAS::Update( float rebuildThreshold )
+{
+	// incremental TLAS maintenance for moving instances: refitting plus local restructuring
+	// is much cheaper than a rebuild, as long as the instances move only a little per frame
+	if (buildCost > 0)
+	{
+		const float cost = RefitRotate( 0 ) / Area( tlasNode[0].aabbMin, tlasNode[0].aabbMax );
+		if (cost < buildCost * rebuildThreshold) return;
+	}
+	// first update or quality dropped too far: full rebuild
+	BuildQuick();
+	buildCost = RefitRotate( 0 ) / Area( tlasNode[0].aabbMin, tlasNode[0].aabbMax );
+}
+
+float TLAS::ComputeSAHCost()
+{
+	TLASNode* node = &tlasNode[0], * stack[64];
+	uint stackPtr = 0;
+	float cost = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			// a leaf holds a single instance, weighted like a triangle in BVH::ComputeSAHCost
+			cost += Area( node->aabbMin, node->aabbMax );
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		cost += Area( node->aabbMin, node->aabbMax );
+		stack[stackPtr++] = &tlasNode[node->right], node = &tlasNode[node->left];
+	}
+	return cost / Area( tlasNode[0].aabbMin, tlasNode[0].aabbMax );
+}
+
+float TLAS::ComputeOverlap()
+{
+	TLASNode* node = &tlasNode[0], * stack[64];
+	uint stackPtr = 0;
+	float overlap = 0;
+	while (1)
 	{
-		float boundsMin = centroidMin[a], boundsMax = centroidMax[a];
-		if (boundsMin == boundsMax) continue;
-		// populate the bins
-		float scale = BINS / (boundsMax - boundsMin);
-		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
-		int leftSum = 0, rightSum = 0;
-	#ifdef USE_SSE
-		__m128 min4[BINS], max4[BINS];
-		uint count[BINS];
-		for (uint i = 0; i < BINS; i++)
-			min4[i] = _mm_set_ps1( 1e30f ),
-			max4[i] = _mm_set_ps1( -1e30f ),
-			count[i] = 0;
-		for (uint i = 0; i < node.triCount; i++)
+		if (node->isLeaf())
 		{
-			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
-			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
-			count[binIdx]++;
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v0 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v0 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v1 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v1 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v2 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v2 );
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
 		}
-		// gather data for the 7 planes between the 8 bins
-		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
-		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
-		for (int i = 0; i < BINS - 1; i++)
+		TLASNode* child1 = &tlasNode[node->left];
+		TLASNode* child2 = &tlasNode[node->right];
+		const float3 e = fminf( child1->aabbMax, child2->aabbMax ) - fmaxf( child1->aabbMin, child2->aabbMin );
+		if (e.x >= 0 && e.y >= 0 && e.z >= 0) overlap += e.x * e.y + e.y * e.z + e.z * e.x;
+		stack[stackPtr++] = child2, node = child1;
+	}
+	return overlap / Area( tlasNode[0].aabbMin, tlasNode[0].aabbMax );
+}
+
+void TLAS::Intersect( Ray& ray )
+{
+	// calculate reciprocal ray directions for faster AABB intersection
+	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	// use a local stack instead of a recursive function; entries keep their entry distance,
+	// so nodes beyond the nearest hit found since they were pushed are skipped on the pop
+	struct StackEntry { TLASNode* node; float dist; } stack[64];
+	TLASNode* node = &tlasNode[0];
+	uint stackPtr = 0;
+	// traversl loop; terminates when the stack is empty
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		if (node->isLeaf())
 		{
-			leftSum += count[i];
-			rightSum += count[BINS - 1 - i];
-			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
-			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 2 - i] );
-			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
-			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 2 - i] );
-			const __m128 le = _mm_sub_ps( leftMax4, leftMin4 );
-			const __m128 re = _mm_sub_ps( rightMax4, rightMin4 );
-			leftCountArea[i] = leftSum * (le.m128_f32[0] * le.m128_f32[1] + le.m128_f32[1] * le.m128_f32[2] + le.m128_f32[2] * le.m128_f32[0]);
-			rightCountArea[BINS - 2 - i] = rightSum * (re.m128_f32[0] * re.m128_f32[1] + re.m128_f32[1] * re.m128_f32[2] + re.m128_f32[2] * re.m128_f32[0]);
+			// current node is a leaf: intersect BLAS
+			blas[node->BLAS].Intersect( ray );
+			// pop a node from the stack; terminate if none left
+			do if (stackPtr == 0) return; while (stack[--stackPtr].dist >= ray.hit.t);
+			node = stack[stackPtr].node;
+			continue;
 		}
-	#else
-		struct Bin { aabb bounds; int triCount = 0; } bin[BINS];
-		for (uint i = 0; i < node.triCount; i++)
+		// current node is an interior node: visit child nodes, ordered
+		TLASNode* child1 = &tlasNode[node->left];
+		TLASNode* child2 = &tlasNode[node->right];
+		float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
+		float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
+		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
+		if (dist1 == 1e30f)
 		{
-			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
-			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
-			bin[binIdx].triCount++;
-			bin[binIdx].bounds.grow( triangle.vertex0 );
-			bin[binIdx].bounds.grow( triangle.vertex1 );
-			bin[binIdx].bounds.grow( triangle.vertex2 );
+			// missed both child nodes; pop a node from the stack
+			do if (stackPtr == 0) return; while (stack[--stackPtr].dist >= ray.hit.t);
+			node = stack[stackPtr].node;
 		}
-		// gather data for the 7 planes between the 8 bins
-		aabb leftBox, rightBox;
-		for (int i = 0; i < BINS - 1; i++)
+		else
 		{
-			leftSum += bin[i].triCount;
-			leftCount[i] = leftSum;
-			leftBox.grow( bin[i].bounds );
-			leftArea[i] = leftBox.area();
-			rightSum += bin[BINS - 1 - i].triCount;
-			rightCount[BINS - 2 - i] = rightSum;
-			rightBox.grow( bin[BINS - 1 - i].bounds );
-			rightArea[BINS - 2 - i] = rightBox.area();
+			// visit near node; push the far node if the ray intersects it
+			node = child1;
+			if (dist2 != 1e30f) stack[stackPtr].node = child2, stack[stackPtr++].dist = dist2;
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
 		}
-	#endif
-		// calculate SAH cost for the 7 planes
-		scale = (boundsMax - boundsMin) / BINS;
-		for (int i = 0; i < BINS - 1; i++)
+	}
+}
+
+bool TLAS::IsOccluded( const Ray& ray, const float tmax )
+{
+	// any-hit traversal: no near/far ordering, and no hit record to maintain
+	Ray r;
+	r.O = ray.O, r.D = ray.D, r.hit.t = tmax;
+	r.rD = float3( 1 / r.D.x, 1 / r.D.y, 1 / r.D.z );
+	TLASNode* node = &tlasNode[0], * stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		if (node->isLeaf())
 		{
-			const float planeCost = leftCountArea[i] + rightCountArea[i];
-			if (planeCost < bestCost)
-				axis = a, splitPos = i + 1, bestCost = planeCost;
+			if (blas[node->BLAS].IsOccluded( r )) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
 		}
+		TLASNode* child1 = &tlasNode[node->left];
+		TLASNode* child2 = &tlasNode[node->right];
+		const bool hit1 = IntersectAABB_SSE( r, child1->aabbMin4, child1->aabbMax4 ) != 1e30f;
+		const bool hit2 = IntersectAABB_SSE( r, child2->aabbMin4, child2->aabbMax4 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) ); }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
 	}
-	return bestCost;
 }
 
-void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax )
+BVHInstance& TLAS::HitInstance( const Intersection& hit, mat4& transform )
 {
-	BVHNode& node = bvhNode[nodeIdx];
-#ifdef USE_SSE
-	__m128 min4 = _mm_set_ps1( 1e30f ), max4 = _mm_set_ps1( -1e30f );
-	__m128 cmin4 = _mm_set_ps1( 1e30f ), cmax4 = _mm_set_ps1( -1e30f );
-	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	BVHInstance& inst = blas[INST_IDX( hit.instPrim )];
+	transform = inst.GetTransform();
+#ifdef WIDE_INDICES
+	if (TLAS* nested = inst.GetTLAS())
 	{
-		Tri& leafTri = mesh->tri[triIdx[first + i]];
-		min4 = _mm_min_ps( min4, leafTri.v0 ), max4 = _mm_max_ps( max4, leafTri.v0 );
-		min4 = _mm_min_ps( min4, leafTri.v1 ), max4 = _mm_max_ps( max4, leafTri.v1 );
-		min4 = _mm_min_ps( min4, leafTri.v2 ), max4 = _mm_max_ps( max4, leafTri.v2 );
-		cmin4 = _mm_min_ps( cmin4, leafTri.centroid4 );
-		cmax4 = _mm_max_ps( cmax4, leafTri.centroid4 );
+		BVHInstance& inner = nested->blas[hit.inner];
+		transform = transform * inner.GetTransform();
+		return inner;
 	}
-	__m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
-	node.aabbMin4 = _mm_blendv_ps( node.aabbMin4, min4, mask4 );
-	node.aabbMax4 = _mm_blendv_ps( node.aabbMax4, max4, mask4 );
-	centroidMin = *(float3*)&cmin4;
-	centroidMax = *(float3*)&cmax4;
+#endif
+	return inst;
+}
+
+void TLAS::Intersect( RayPacket& packet )
+{
+	// calculate reciprocal ray directions and packet bounds
+	packet.Prepare();
+	// ranged packet traversal, see BVH::Intersect( RayPacket& )
+	struct StackEntry { TLASNode* node; uint first; } stack[64];
+	TLASNode* node = &tlasNode[0];
+	uint first = 0, stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		if (node->isLeaf())
+		{
+			// current node is a leaf: intersect BLAS
+			blas[node->BLAS].Intersect( packet );
+			if (stackPtr == 0) break;
+			node = stack[--stackPtr].node, first = stack[stackPtr].first;
+			continue;
+		}
+		// current node is an interior node: find the first active ray for each child
+		TLASNode* child1 = &tlasNode[node->left];
+		TLASNode* child2 = &tlasNode[node->right];
+		uint first1 = FirstHit( packet, child1->aabbMin4, child1->aabbMax4, first );
+		uint first2 = FirstHit( packet, child2->aabbMin4, child2->aabbMax4, first );
+		if (first1 < PACKET_SIZE && first2 < PACKET_SIZE)
+		{
+			// visit the near node; push the far node
+			const float3 D( packet.D[0][first], packet.D[1][first], packet.D[2][first] );
+			if (dot( (child2->aabbMin + child2->aabbMax) - (child1->aabbMin + child1->aabbMax), D ) < 0)
+				swap( child1, child2 ), swap( first1, first2 );
+			stack[stackPtr].node = child2, stack[stackPtr++].first = first2;
+			node = child1, first = first1;
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
+		}
+		else if (first1 < PACKET_SIZE) node = child1, first = first1;
+		else if (first2 < PACKET_SIZE) node = child2, first = first2;
+		else if (stackPtr == 0) break;
+		else node = stack[--stackPtr].node, first = stack[stackPtr].first;
+	}
+}
+
+// MotionTLAS implementation
+
+// inverse transforms are interpolated between this many intervals of the shutter time, instead
+// of inverting the interpolated transform for each instance a ray visits
+#define MOTION_KEYS 16
+
+MotionTLAS::MotionTLAS( BVHInstance* shutterOpen, BVHInstance* shutterClose, int N )
+{
+	open = shutterOpen, close = shutterClose, count = N;
+	swept = new BVHInstance[N];
+	invKey = new mat4[N * (MOTION_KEYS + 1)];
+	tlas = TLAS( swept, N );
+	closeNode = (TLASNode*)_aligned_malloc( sizeof( TLASNode ) * 2 * (N + 64), 64 );
+}
+
+void MotionTLAS::Build()
+{
+	// build the topology over the swept bounds, then store the bounds of both poses
+	for (uint i = 0; i < count; i++) swept[i] = open[i], swept[i].bounds.grow( close[i].bounds );
+	tlas.Build();
+	RefitNode( 0 );
+	for (uint i = 0; i < count; i++) for (int k = 0; k <= MOTION_KEYS; k++)
+		invKey[i * (MOTION_KEYS + 1) + k] = Transform( i, k * (1.0f / MOTION_KEYS) ).Inverted();
+}
+
+void MotionTLAS::RefitNode( uint nodeIdx )
+{
+	TLASNode& node = tlas.tlasNode[nodeIdx], & end = closeNode[nodeIdx];
+	if (node.isLeaf())
+	{
+		node.aabbMin = open[node.BLAS].bounds.bmin, node.aabbMax = open[node.BLAS].bounds.bmax;
+		end.aabbMin = close[node.BLAS].bounds.bmin, end.aabbMax = close[node.BLAS].bounds.bmax;
+		return;
+	}
+	RefitNode( node.left );
+	RefitNode( node.right );
+	const TLASNode& l = tlas.tlasNode[node.left], & r = tlas.tlasNode[node.right];
+	node.aabbMin = fminf( l.aabbMin, r.aabbMin ), node.aabbMax = fmaxf( l.aabbMax, r.aabbMax );
+	const TLASNode& lc = closeNode[node.left], & rc = closeNode[node.right];
+	end.aabbMin = fminf( lc.aabbMin, rc.aabbMin ), end.aabbMax = fmaxf( lc.aabbMax, rc.aabbMax );
+}
+
+mat4 MotionTLAS::Transform( uint instIdx, const float time )
+{
+	const mat4& A = open[instIdx].GetTransform(), & B = close[instIdx].GetTransform();
+	mat4 M;
+	for (int i = 0; i < 16; i++) M.cell[i] = lerp( A.cell[i], B.cell[i], time );
+	return M;
+}
+
+mat4 MotionTLAS::InvTransform( uint instIdx, const float time )
+{
+	// the error of interpolating the inverse shrinks quadratically with the key interval
+	const float s = clamp( time, 0.0f, 1.0f ) * MOTION_KEYS;
+	const int k = min( (int)s, MOTION_KEYS - 1 );
+	const float f = s - k;
+	const mat4& A = invKey[instIdx * (MOTION_KEYS + 1) + k], & B = invKey[instIdx * (MOTION_KEYS + 1) + k + 1];
+	mat4 M;
+	for (int i = 0; i < 16; i++) M.cell[i] = lerp( A.cell[i], B.cell[i], f );
+	return M;
+}
+
+void MotionTLAS::Intersect( Ray& ray )
+{
+	// TLAS::Intersect, with node bounds and instance transforms at the time of the ray
+	const float t = ray.time;
+	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	uint nodeIdx = 0, stack[64], stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		const TLASNode& node = tlas.tlasNode[nodeIdx];
+		if (node.left == 0)
+		{
+			open[node.BLAS].Intersect( ray, InvTransform( node.BLAS, t ) );
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		uint child1 = node.left, child2 = node.right;
+		float dist1 = IntersectAABB( ray, lerp( tlas.tlasNode[child1].aabbMin, closeNode[child1].aabbMin, t ),
+			lerp( tlas.tlasNode[child1].aabbMax, closeNode[child1].aabbMax, t ) );
+		float dist2 = IntersectAABB( ray, lerp( tlas.tlasNode[child2].aabbMin, closeNode[child2].aabbMin, t ),
+			lerp( tlas.tlasNode[child2].aabbMax, closeNode[child2].aabbMax, t ) );
+		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
+		if (dist1 == 1e30f)
+		{
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+		}
+		else
+		{
+			nodeIdx = child1;
+			if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) );
+		}
+	}
+}
+
+bool MotionTLAS::IsOccluded( const Ray& ray, const float tmax )
+{
+	const float t = ray.time;
+	Ray r;
+	r.O = ray.O, r.D = ray.D, r.hit.t = tmax;
+	r.rD = float3( 1 / r.D.x, 1 / r.D.y, 1 / r.D.z );
+	uint nodeIdx = 0, stack[64], stackPtr = 0;
+	while (1)
+	{
+		TRAVERSAL_STAT( traversalStats.nodes++ );
+		const TLASNode& node = tlas.tlasNode[nodeIdx];
+		if (node.left == 0)
+		{
+			if (open[node.BLAS].IsOccluded( r, InvTransform( node.BLAS, t ) )) return true;
+			if (stackPtr == 0) return false; else nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		const uint child1 = node.left, child2 = node.right;
+		const bool hit1 = IntersectAABB( r, lerp( tlas.tlasNode[child1].aabbMin, closeNode[child1].aabbMin, t ),
+			lerp( tlas.tlasNode[child1].aabbMax, closeNode[child1].aabbMax, t ) ) != 1e30f;
+		const bool hit2 = IntersectAABB( r, lerp( tlas.tlasNode[child2].aabbMin, closeNode[child2].aabbMin, t ),
+			lerp( tlas.tlasNode[child2].aabbMax, closeNode[child2].aabbMax, t ) ) != 1e30f;
+		if (hit1) { nodeIdx = child1; if (hit2) stack[stackPtr++] = child2; TRAVERSAL_STAT( traversalStats.Depth( stackPtr ) ); }
+		else if (hit2) nodeIdx = child2;
+		else if (stackPtr == 0) return false; else nodeIdx = stack[--stackPtr];
+	}
+}
+
+// Scene implementation
+
+// storage of a mip level in the scene texture buffer, in uints
+static uint MipLevelSize( uint w, uint h )
+{
+#ifdef TEXTURE_BC1
+	return ((w + 3) >> 2) * ((h + 3) >> 2) * 2;
 #else
-	node.aabbMin = float3( 1e30f );
-	node.aabbMax = float3( -1e30f );
-	centroidMin = float3( 1e30f );
-	centroidMax = float3( -1e30f );
-	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	return w * h;
+#endif
+}
+
+// 2x2 box filter; odd sizes repeat the last row / column
+static void Downsample( const uint* src, uint w, uint h, uint* dst )
+{
+	const uint dw = max( w >> 1, 1u ), dh = max( h >> 1, 1u );
+	for (uint y = 0; y < dh; y++) for (uint x = 0; x < dw; x++)
 	{
-		uint leafTriIdx = triIdx[first + i];
-		Tri& leafTri = mesh->tri[leafTriIdx];
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex0 );
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex1 );
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex2 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex0 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex1 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex2 );
-		centroidMin = fminf( centroidMin, leafTri.centroid );
-		centroidMax = fmaxf( centroidMax, leafTri.centroid );
+		const uint x0 = min( x * 2, w - 1 ), x1 = min( x * 2 + 1, w - 1 );
+		const uint y0 = min( y * 2, h - 1 ), y1 = min( y * 2 + 1, h - 1 );
+		const uint p[4] = { src[x0 + y0 * w], src[x1 + y0 * w], src[x0 + y1 * w], src[x1 + y1 * w] };
+		uint r = 2, g = 2, b = 2; // rounding
+		for (int i = 0; i < 4; i++) r += (p[i] >> 16) & 255, g += (p[i] >> 8) & 255, b += p[i] & 255;
+		dst[x + y * dw] = ((r >> 2) << 16) + ((g >> 2) << 8) + (b >> 2);
+	}
+}
+
+#ifdef TEXTURE_BC1
+
+static uint RGB8to565( const float3 c )
+{
+	return ((uint)(c.x * (31 / 255.0f) + 0.5f) << 11) + ((uint)(c.y * (63 / 255.0f) + 0.5f) << 5) + (uint)(c.z * (31 / 255.0f) + 0.5f);
+}
+
+static float3 RGB565to8( const uint c )
+{
+	return float3( (float)(c >> 11) * (255 / 31.0f), (float)((c >> 5) & 63) * (255 / 63.0f), (float)(c & 31) * (255 / 31.0f) );
+}
+
+// BC1 encoding: endpoints are the extremes of the block colors along their principal
+// axis, each texel picks the nearest of the four palette colors; two uints per block
+static void EncodeBC1( const uint* src, uint w, uint h, uint* dst )
+{
+	for (uint by = 0; by < h; by += 4) for (uint bx = 0; bx < w; bx += 4, dst += 2)
+	{
+		float3 texel[16], mean( 0 );
+		for (uint i = 0; i < 16; i++)
+		{
+			const uint p = src[min( bx + (i & 3), w - 1 ) + min( by + (i >> 2), h - 1 ) * w];
+			texel[i] = float3( (float)((p >> 16) & 255), (float)((p >> 8) & 255), (float)(p & 255) );
+			mean += texel[i] * (1 / 16.0f);
+		}
+		// principal axis by power iteration on the covariance matrix
+		float cov[6] = {};
+		for (uint i = 0; i < 16; i++)
+		{
+			const float3 d = texel[i] - mean;
+			cov[0] += d.x * d.x, cov[1] += d.x * d.y, cov[2] += d.x * d.z;
+			cov[3] += d.y * d.y, cov[4] += d.y * d.z, cov[5] += d.z * d.z;
+		}
+		float3 axis( 1, 1, 1 );
+		for (int i = 0; i < 8; i++)
+		{
+			axis = float3( cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+				cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+				cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z );
+			const float l = max( max( fabs( axis.x ), fabs( axis.y ) ), fabs( axis.z ) );
+			if (l == 0) break; else axis *= 1 / l;
+		}
+		float tmin = 1e30f, tmax = -1e30f;
+		for (uint i = 0; i < 16; i++)
+		{
+			const float t = dot( texel[i] - mean, axis );
+			tmin = min( tmin, t ), tmax = max( tmax, t );
+		}
+		const float3 cmin = fminf( fmaxf( mean + axis * tmin, 0 ), 255 );
+		const float3 cmax = fminf( fmaxf( mean + axis * tmax, 0 ), 255 );
+		// the decoder uses four colors if the first endpoint is larger
+		uint c0 = RGB8to565( cmax ), c1 = RGB8to565( cmin ), bits = 0;
+		if (c0 < c1) swap( c0, c1 );
+		if (c0 != c1)
+		{
+			const float3 e0 = RGB565to8( c0 ), e1 = RGB565to8( c1 );
+			const float3 palette[4] = { e0, e1, (e0 * 2 + e1) * (1 / 3.0f), (e0 + e1 * 2) * (1 / 3.0f) };
+			for (uint i = 0; i < 16; i++)
+			{
+				uint best = 0;
+				float bestDist = 1e30f;
+				for (uint j = 0; j < 4; j++)
+				{
+					const float3 d = texel[i] - palette[j];
+					const float dist = dot( d, d );
+					if (dist < bestDist) bestDist = dist, best = j;
+				}
+				bits += best << (i * 2);
+			}
+		}
+		dst[0] = c0 + (c1 << 16), dst[1] = bits;
 	}
+}
+
 #endif
+
+// fills a texture, all its mip levels, in the scene texture buffer
+static void StoreMipChain( const Mesh* mesh, uint* dst )
+{
+	const uint* level = mesh->texMips;
+	uint w = mesh->texture->width, h = mesh->texture->height;
+	for (uint l = 0; l < mesh->texLevels; l++)
+	{
+	#ifdef TEXTURE_BC1
+		EncodeBC1( level, w, h, dst );
+	#else
+		memcpy( dst, level, w * h * sizeof( uint ) );
+	#endif
+		dst += MipLevelSize( w, h ), level += w * h;
+		w = max( w >> 1, 1u ), h = max( h >> 1, 1u );
+	}
 }
 
-// BVHInstance implementation
+void Mesh::BuildMips()
+{
+	// 32-bit texels, stored like the scene texture buffer without TEXTURE_BC1
+	uint w = texture->width, h = texture->height, size = 0;
+	texLevels = 1;
+	while ((w >> texLevels) | (h >> texLevels)) texLevels++;
+	for (uint l = 0; l < texLevels; l++) size += max( w >> l, 1u ) * max( h >> l, 1u );
+	texMips = new uint[size];
+	memcpy( texMips, texture->pixels, w * h * sizeof( uint ) );
+	for (uint l = 1, *src = texMips; l < texLevels; l++)
+	{
+		Downsample( src, w, h, src + w * h );
+		src += w * h, w = max( w >> 1, 1u ), h = max( h >> 1, 1u );
+	}
+}
+
+float Mesh::TextureLOD( const uint triIdx, const mat4& T, const float3& D, const float3& N, const float width ) const
+{
+	// texel-to-world area ratio of the triangle, plus the projected cone width
+	const Tri& t = tri[triIdx];
+	const TriEx& tex = triEx[triIdx];
+	const float worldArea = length( cross( TransformVector( t.vertex1 - t.vertex0, T ), TransformVector( t.vertex2 - t.vertex0, T ) ) );
+	const float2 t1 = tex.uv1 - tex.uv0, t2 = tex.uv2 - tex.uv0;
+	const float texelArea = fabsf( t1.x * t2.y - t1.y * t2.x ) * texture->width * texture->height;
+	if (worldArea == 0 || texelArea == 0) return 0;
+	return 0.5f * log2f( texelArea / worldArea ) + log2f( width / max( fabsf( dot( N, D ) ), 0.01f ) );
+}
+
+float3 Mesh::SampleTexture( float2 uv, const float lod ) const
+{
+	const uint level = (uint)clamp( lod + 0.5f, 0.0f, (float)(texLevels - 1) );
+	const uint* texel = texMips;
+	uint w = texture->width, h = texture->height;
+	for (uint l = 0; l < level; l++) texel += w * h, w = max( w >> 1, 1u ), h = max( h >> 1, 1u );
+	uv.x -= floorf( uv.x ), uv.y -= floorf( uv.y ); // wrap
+	const int iu = min( (int)(uv.x * w), (int)w - 1 ), iv = min( (int)(uv.y * h), (int)h - 1 );
+	const uint c = texel[iu + iv * w];
+	return float3( (float)((c >> 16) & 255), (float)((c >> 8) & 255), (float)(c & 255) ) * (1 / 256.0f);
+}
 
-void BVHInstance::SetTransform( mat4& T )
+float Mesh::Curvature( const uint triIdx, const mat4& T ) const
 {
-	transform = T;
-	transform = T;
-	invTransform = transform.Inverted();
-	// calculate world-space bounds using the new matrix
-	float3 bmin = bvh->bvhNode[0].aabbMin, bmax = bvh->bvhNode[0].aabbMax;
-	bounds = aabb();
-	for (int i = 0; i < 8; i++)
-		bounds.grow( TransformPosition( float3( i & 1 ? bmax.x : bmin.x,
-			i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z ), transform ) );
+	// change of the vertex normal along each edge, per unit of length (Akenine-Moller et al.,
+	// 2021); positive where the normals diverge, i.e. for a convex surface
+	const Tri& t = tri[triIdx];
+	const TriEx& n = triEx[triIdx];
+	const float3 e0 = t.vertex1 - t.vertex0, e1 = t.vertex2 - t.vertex1, e2 = t.vertex0 - t.vertex2;
+	const float l0 = dot( e0, e0 ), l1 = dot( e1, e1 ), l2 = dot( e2, e2 );
+	if (l0 == 0 || l1 == 0 || l2 == 0) return 0;
+	const float k = (dot( n.N1 - n.N0, e0 ) / l0 + dot( n.N2 - n.N1, e1 ) / l1 + dot( n.N0 - n.N2, e2 ) / l2) * (1 / 3.0f);
+	// to world space: curvature scales inversely with the size of the triangle
+	const float objectArea = length( cross( e0, e2 ) );
+	const float worldArea = length( cross( TransformVector( e0, T ), TransformVector( e2, T ) ) );
+	return worldArea == 0 ? 0 : k * sqrtf( objectArea / worldArea );
 }
 
-void BVHInstance::Intersect( Ray& ray )
+uint Scene::AddMesh( Mesh* mesh )
 {
-	// backup ray and transform original
-	Ray backupRay = ray;
-	ray.O = TransformPosition( ray.O, invTransform );
-	ray.D = TransformVector( ray.D, invTransform );
-	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
-	// trace ray through BVH
-	bvh->Intersect( ray, idx );
-	// restore ray origin and direction
-	backupRay.hit = ray.hit;
-	ray = backupRay;
+	for (uint i = 0; i < meshes.size(); i++) if (meshes[i] == mesh) return i;
+	// reserve space for the mesh data in the consolidated buffers
+	MeshOffsets o;
+	o.tri = triCount, o.idx = idxCount, o.node = nodeCount, o.tex = texelCount;
+	Surface* tex = mesh->texture;
+	o.texWidth = tex ? tex->width : 1, o.texHeight = tex ? tex->height : 1;
+	o.texLevels = 1;
+	while ((o.texWidth >> o.texLevels) | (o.texHeight >> o.texLevels)) o.texLevels++;
+	triCount += mesh->triCount, idxCount += mesh->bvh->idxCount;
+	uint shared = 0; // a texture that is already in the buffer is stored once, e.g. for LODs
+	while (shared < meshes.size() && (!tex || meshes[shared]->texture != tex)) shared++;
+	if (shared < meshes.size()) o.tex = offsets[shared].tex;
+	else for (uint l = 0, w = o.texWidth, h = o.texHeight; l < o.texLevels; l++, w = max( w >> 1, 1u ), h = max( h >> 1, 1u ))
+		texelCount += MipLevelSize( w, h );
+#ifdef BVH_QUANTIZED
+	nodeCount += mesh->bvh->nodes4Used;
+#else
+	nodeCount += mesh->bvh->nodesUsed;
+#endif
+	meshes.push_back( mesh );
+	offsets.push_back( o );
+	const uint meshIdx = (uint)meshes.size() - 1;
+	for (Mesh* lod : mesh->lods) AddMesh( lod );
+	return meshIdx;
 }
 
-// TLAS implementation
+void Scene::SetInstances( BVHInstance* instances, uint count )
+{
+	for (uint i = 0; i < count; i++)
+	{
+		BVHInstance& inst = instances[i];
+		if (inst.GetTLAS()) continue; // see PackTLAS
+		uint meshIdx = 0;
+		while (meshIdx < meshes.size() && meshes[meshIdx]->bvh != inst.GetBVH()) meshIdx++;
+		if (meshIdx == meshes.size()) FatalError( "Scene::SetInstances: instance %i uses an unknown BLAS.", i );
+		const MeshOffsets& o = offsets[meshIdx];
+		inst.nodeOffset = o.node, inst.idxOffset = o.idx, inst.triOffset = o.tri;
+		inst.texOffset = o.tex, inst.texWidth = o.texWidth, inst.texHeight = o.texHeight, inst.texLevels = o.texLevels;
+	}
+}
 
-TLAS::TLAS( BVHInstance* bvhList, int N )
+uint Scene::SelectLOD( BVHInstance* instances, uint count, const float3& camPos, const float pixelAngle )
 {
-	// copy a pointer to the array of bottom level accstruc instances
-	blas = bvhList;
-	blasCount = N;
-	// allocate TLAS nodes
-	tlasNode = (TLASNode*)_aligned_malloc( sizeof( TLASNode ) * 2 * (N + 64), 64 );
-	nodeIdx = new uint[N];
-	nodesUsed = 2;
+	uint changed = 0;
+	for (uint i = 0; i < count; i++)
+	{
+		BVHInstance& inst = instances[i];
+		if (inst.GetTLAS() || inst.GetBVH()->mesh->lods.empty()) continue;
+		Mesh* mesh = inst.GetBVH()->mesh;
+		// world space size of an object space unit, and distance to the nearest point of the bounds
+		const float scale = length( inst.GetTransform().TransformVector( float3( 1, 0, 0 ) ) );
+		const float dist = length( fmaxf( fmaxf( inst.bounds.bmin - camPos, camPos - inst.bounds.bmax ), float3( 0 ) ) );
+		Mesh* level = mesh;
+		for (Mesh* lod : mesh->lods) if (lod->lodCell * scale < dist * pixelAngle) level = lod;
+		uint meshIdx = 0;
+		while (meshIdx < meshes.size() && meshes[meshIdx] != level) meshIdx++;
+		if (meshIdx == meshes.size()) FatalError( "Scene::SelectLOD: instance %i uses an unknown mesh.", i );
+		const MeshOffsets& o = offsets[meshIdx];
+		if (inst.nodeOffset == o.node) continue;
+		inst.nodeOffset = o.node, inst.idxOffset = o.idx, inst.triOffset = o.tri, changed++;
+	}
+	return changed;
 }
 
-int TLAS::FindBestMatch( int N, int A )
+void Scene::PackTLAS( TLAS& tlas, TLASNode*& nodes, BVHInstance*& instances, uint& nodeCount, uint& instCount )
 {
-	// find BLAS B that, when joined with A, forms the smallest AABB
-	float smallest = 1e30f;
-	int bestB = -1;
-	for (int B = 0; B < N; B++) if (B != A)
+	// node and instance indices inside a nested TLAS stay relative to its own arrays; like the
+	// TLAS uploads of the demos, 2 * blasCount nodes are copied, which covers every build variant
+	vector<TLAS*> nested;
+	vector<uint> nestedNode, nestedInst;
+	nodeCount = tlas.blasCount * 2, instCount = tlas.blasCount;
+	for (uint i = 0; i < tlas.blasCount; i++) if (TLAS* sub = tlas.blas[i].GetTLAS())
 	{
-		float3 bmax = fmaxf( tlasNode[nodeIdx[A]].aabbMax, tlasNode[nodeIdx[B]].aabbMax );
-		float3 bmin = fminf( tlasNode[nodeIdx[A]].aabbMin, tlasNode[nodeIdx[B]].aabbMin );
-		float3 e = bmax - bmin;
-		float surfaceArea = e.x * e.y + e.y * e.z + e.z * e.x;
-		if (surfaceArea < smallest) smallest = surfaceArea, bestB = B;
+		uint j = 0;
+		while (j < nested.size() && nested[j] != sub) j++;
+		if (j < nested.size()) continue;
+		nested.push_back( sub ), nestedNode.push_back( nodeCount ), nestedInst.push_back( instCount );
+		nodeCount += sub->blasCount * 2, instCount += sub->blasCount;
+	}
+	nodes = (TLASNode*)_aligned_malloc( nodeCount * sizeof( TLASNode ), 64 );
+	instances = (BVHInstance*)_aligned_malloc( instCount * sizeof( BVHInstance ), 64 );
+	memcpy( nodes, tlas.tlasNode, tlas.blasCount * 2 * sizeof( TLASNode ) );
+	memcpy( instances, tlas.blas, tlas.blasCount * sizeof( BVHInstance ) );
+	for (uint j = 0; j < nested.size(); j++)
+	{
+		memcpy( nodes + nestedNode[j], nested[j]->tlasNode, nested[j]->blasCount * 2 * sizeof( TLASNode ) );
+		memcpy( instances + nestedInst[j], nested[j]->blas, nested[j]->blasCount * sizeof( BVHInstance ) );
+	}
+	SetInstances( instances, instCount );
+	for (uint i = 0; i < tlas.blasCount; i++) if (TLAS* sub = instances[i].GetTLAS())
+	{
+		uint j = 0;
+		while (nested[j] != sub) j++;
+		instances[i].nodeOffset = nestedNode[j], instances[i].idxOffset = nestedInst[j];
 	}
-	return bestB;
 }
 
-void TLAS::Build()
+void Scene::Upload()
 {
-	// assign a TLASleaf node to each BLAS
-	nodesUsed = 1;
-	for (uint i = 0; i < blasCount; i++)
+#ifdef BVH_QUANTIZED
+	typedef BVHNodeQ4 NodeType;
+#else
+	typedef BVHNode NodeType;
+#endif
+	Tri* tri = 0;
+	TriEx* triEx = 0;
+	NodeType* node = 0;
+	uint* idx = 0;
+	if (meshes.size() == 1)
 	{
-		nodeIdx[i] = nodesUsed;
-		tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
-		tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
-		tlasNode[nodesUsed].BLAS = i;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		// single mesh: use the mesh data directly
+		Mesh* m = meshes[0];
+		tri = m->tri, triEx = m->triEx, idx = m->bvh->triIdx;
+	#ifdef BVH_QUANTIZED
+		node = m->bvh->bvhNodeQ4;
+	#else
+		node = m->bvh->bvhNode;
+	#endif
 	}
-	// use agglomerative clustering to build the TLAS
-	int nodeIndices = blasCount;
-	int A = 0, B = FindBestMatch( nodeIndices, A );
-	FILE* f = fopen( "pairs.txt", "w" );
-	while (nodeIndices > 1)
+	else
 	{
-		int C = FindBestMatch( nodeIndices, B );
-		if (A == C)
+		tri = (Tri*)_aligned_malloc( triCount * sizeof( Tri ), 64 );
+		triEx = (TriEx*)_aligned_malloc( triCount * sizeof( TriEx ), 64 );
+		node = (NodeType*)_aligned_malloc( nodeCount * sizeof( NodeType ), 64 );
+		idx = new uint[idxCount];
+		for (uint i = 0; i < meshes.size(); i++)
 		{
-			// found a pair: create a new TLAS interior node
-			int nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
-			TLASNode& nodeA = tlasNode[nodeIdxA];
-			TLASNode& nodeB = tlasNode[nodeIdxB];
-			TLASNode& newNode = tlasNode[nodesUsed];
-			newNode.aabbMin = fminf( nodeA.aabbMin, nodeB.aabbMin );
-			newNode.aabbMax = fmaxf( nodeA.aabbMax, nodeB.aabbMax );
-			newNode.leftRight = nodeIdxA + (nodeIdxB << 16);
-			fprintf( f, "%i,%i\n", nodeIdxA, nodeIdxB );
-			nodeIdx[A] = nodesUsed++;
-			nodeIdx[B] = nodeIdx[nodeIndices - 1];
-			B = FindBestMatch( --nodeIndices, A );
+			Mesh* m = meshes[i];
+			const MeshOffsets& o = offsets[i];
+			memcpy( tri + o.tri, m->tri, m->triCount * sizeof( Tri ) );
+			memcpy( triEx + o.tri, m->triEx, m->triCount * sizeof( TriEx ) );
+			memcpy( idx + o.idx, m->bvh->triIdx, m->bvh->idxCount * sizeof( uint ) );
+		#ifdef BVH_QUANTIZED
+			memcpy( node + o.node, m->bvh->bvhNodeQ4, m->bvh->nodes4Used * sizeof( NodeType ) );
+		#else
+			memcpy( node + o.node, m->bvh->bvhNode, m->bvh->nodesUsed * sizeof( NodeType ) );
+		#endif
 		}
-		else A = B, B = C;
 	}
-	fclose( f );
-	// copy last remaining node to the root node
-	tlasNode[0] = tlasNode[nodeIdx[A]];
+	triData = new Buffer( triCount * sizeof( Tri ), tri );
+	triExData = new Buffer( triCount * sizeof( TriEx ), triEx );
+	bvhData = new Buffer( nodeCount * sizeof( NodeType ), node );
+	idxData = new Buffer( idxCount * sizeof( uint ), idx );
+	triData->CopyToDevice();
+	triExData->CopyToDevice();
+	bvhData->CopyToDevice();
+	idxData->CopyToDevice();
+	UploadTextures();
 }
 
-void TLAS::SortAndSplit( uint first, uint last, uint level )
+void Scene::UploadTextures()
 {
-	if (!item) item = new SortItem[blasCount];
-	uint axis = level % 3; // TODO: use dominant axis at each level?
-	if (level == 0)
+	// textures are always copied: the meshes keep 32-bit mip chains, see Mesh::BuildMips
+	uint* texel = new uint[texelCount];
+	for (uint i = 0; i < meshes.size(); i++)
 	{
-		for (uint i = 0; i < blasCount; i++) item[i].blasIdx = i;
-		treeIdx = 0;
+		const MeshOffsets& o = offsets[i];
+		uint first = 0; // shared textures are stored with the first mesh that uses them
+		while (first < i && (!meshes[i]->texture || meshes[first]->texture != meshes[i]->texture)) first++;
+		if (first < i) continue;
+		if (meshes[i]->texture) StoreMipChain( meshes[i], texel + o.tex );
+	#ifdef TEXTURE_BC1
+		else texel[o.tex] = 0xffff + (0xffff << 16), texel[o.tex + 1] = 0; // untextured: white
+	#else
+		else texel[o.tex] = 0xffffff; // untextured: white
+	#endif
 	}
-	for (uint idx, i = first; i <= last; i++)
-		idx = item[i].blasIdx,
-		item[i].pos = (blas[idx].bounds.bmin[axis] + blas[idx].bounds.bmin[axis]) * 0.5f;
-	QuickSort( item, first, last );
-	uint half = (first + last) >> 1;
-	if (level < 3)
+	texData = new Buffer( texelCount * sizeof( uint ), texel );
+	texData->CopyToDevice();
+}
+
+// StreamingScene implementation
+
+void StreamingScene::SetInstances( BVHInstance* bvhInstances, uint count )
+{
+	instances = bvhInstances;
+	for (uint i = 0; i < count; i++)
 	{
-		SortAndSplit( first, half, level + 1 );
-		SortAndSplit( half + 1, last, level + 1 );
-		return;
+		BVHInstance& inst = instances[i];
+		if (inst.GetTLAS()) FatalError( "StreamingScene::SetInstances: nested TLAS instances are not supported." );
+		const uint meshIdx = AddMesh( inst.GetBVH()->mesh );
+		users.resize( meshes.size() );
+		users[meshIdx].push_back( i );
+	}
+	resident.resize( meshes.size(), -1 );
+	for (uint i = 0; i < meshes.size(); i++) Repoint( i );
+}
+
+void StreamingScene::Upload()
+{
+#ifdef BVH_QUANTIZED
+	typedef BVHNodeQ4 NodeType;
+#else
+	typedef BVHNode NodeType;
+#endif
+	// every slot fits the largest BLAS; its indices follow a word with the mesh index
+	for (Mesh* m : meshes)
+	{
+	#ifdef BVH_QUANTIZED
+		slotNodes = max( slotNodes, m->bvh->nodes4Used );
+	#else
+		slotNodes = max( slotNodes, m->bvh->nodesUsed );
+	#endif
+		slotIdx = max( slotIdx, m->bvh->idxCount + 1 ), slotTris = max( slotTris, (uint)m->triCount );
 	}
-	// create chunks
-	for (uint i = first; i <= half; i++)
+	slotIdx = (slotIdx + 15) & ~15, flagWords = ((uint)meshes.size() + 15) & ~15; // 64-byte aligned
+	slotCount = min( slotCount, (uint)meshes.size() );
+	slot.resize( slotCount );
+	flags = new uint[flagWords];
+	triData = new Buffer( slotCount * slotTris * sizeof( Tri ) );
+	triExData = new Buffer( slotCount * slotTris * sizeof( TriEx ) );
+	bvhData = new Buffer( slotCount * slotNodes * sizeof( NodeType ) );
+	idxData = new Buffer( (flagWords + slotCount * slotIdx) * sizeof( uint ) );
+	idxData->Clear();
+	UploadTextures();
+}
+
+void StreamingScene::Repoint( uint meshIdx )
+{
+	const MeshOffsets& o = offsets[meshIdx];
+	const int s = resident[meshIdx];
+	for (uint i : users[meshIdx])
 	{
-		BVHInstance& b = blas[item[i].blasIdx];
-		tlasNode[nodesUsed].aabbMin = b.bounds.bmin;
-		tlasNode[nodesUsed].aabbMax = b.bounds.bmax;
-		tlasNode[nodesUsed].BLAS = item[i].blasIdx;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		BVHInstance& inst = instances[i];
+		if (s < 0) inst.nodeOffset = 0, inst.idxOffset = meshIdx, inst.triOffset = NOT_RESIDENT; // see Resident in tools.cl
+		else inst.nodeOffset = s * slotNodes, inst.idxOffset = flagWords + s * slotIdx + 1, inst.triOffset = s * slotTris;
+		inst.texOffset = o.tex, inst.texWidth = o.texWidth, inst.texHeight = o.texHeight, inst.texLevels = o.texLevels;
+		dirty.Mark( i );
 	}
-	if (!tree[treeIdx]) tree[treeIdx] = new KDTree( tlasNode + first + 32, half - first + 1, first + 32 );
-	treeSize[treeIdx++] = half - first + 1;
-	for (uint i = half + 1; i <= last; i++)
+}
+
+void StreamingScene::Evict( uint s )
+{
+	const int meshIdx = slot[s].mesh;
+	slot[s].mesh = -1, resident[meshIdx] = -1;
+	Repoint( meshIdx );
+}
+
+void StreamingScene::Load( uint meshIdx, uint s )
+{
+#ifdef BVH_QUANTIZED
+	const void* node = meshes[meshIdx]->bvh->bvhNodeQ4;
+	const uint nodeBytes = meshes[meshIdx]->bvh->nodes4Used * sizeof( BVHNodeQ4 ), slotBytes = slotNodes * sizeof( BVHNodeQ4 );
+#else
+	const void* node = meshes[meshIdx]->bvh->bvhNode;
+	const uint nodeBytes = meshes[meshIdx]->bvh->nodesUsed * sizeof( BVHNode ), slotBytes = slotNodes * sizeof( BVHNode );
+#endif
+	// non-blocking writes from the mesh data, in order with the kernels of the next frame. The
+	// header word is written from the slot itself, which does not change before the next Update
+	// has waited for the queue.
+	Mesh* mesh = meshes[meshIdx];
+	slot[s].mesh = meshIdx, slot[s].lastUsed = frame, resident[meshIdx] = s;
+	cl_command_queue& queue = Kernel::GetQueue();
+	const size_t idxBase = (flagWords + s * slotIdx) * sizeof( uint );
+	clEnqueueWriteBuffer( queue, idxData->deviceBuffer, CL_FALSE, idxBase, sizeof( uint ), &slot[s].mesh, 0, 0, 0 );
+	clEnqueueWriteBuffer( queue, idxData->deviceBuffer, CL_FALSE, idxBase + sizeof( uint ), mesh->bvh->idxCount * sizeof( uint ), mesh->bvh->triIdx, 0, 0, 0 );
+	clEnqueueWriteBuffer( queue, bvhData->deviceBuffer, CL_FALSE, s * slotBytes, nodeBytes, node, 0, 0, 0 );
+	clEnqueueWriteBuffer( queue, triData->deviceBuffer, CL_FALSE, s * slotTris * sizeof( Tri ), mesh->triCount * sizeof( Tri ), mesh->tri, 0, 0, 0 );
+	clEnqueueWriteBuffer( queue, triExData->deviceBuffer, CL_FALSE, s * slotTris * sizeof( TriEx ), mesh->triCount * sizeof( TriEx ), mesh->triEx, 0, 0, 0 );
+	Repoint( meshIdx );
+}
+
+void StreamingScene::Update()
+{
+	// the blocking read waits for the last frame; then the flags are reset for the next one
+	cl_command_queue& queue = Kernel::GetQueue();
+	clEnqueueReadBuffer( queue, idxData->deviceBuffer, CL_TRUE, 0, flagWords * sizeof( uint ), flags, 0, 0, 0 );
+	const uint zero = 0;
+	clEnqueueFillBuffer( queue, idxData->deviceBuffer, &zero, sizeof( uint ), 0, flagWords * sizeof( uint ), 0, 0, 0 );
+	frame++, uploaded = 0;
+	for (uint i = 0; i < meshes.size(); i++) if (flags[i] && resident[i] >= 0) slot[resident[i]].lastUsed = frame;
+	for (uint i = 0; i < meshes.size() && uploaded < maxUploads; i++) if (flags[i] && resident[i] < 0)
 	{
-		BVHInstance& b = blas[item[i].blasIdx];
-		tlasNode[nodesUsed].aabbMin = b.bounds.bmin;
-		tlasNode[nodesUsed].aabbMax = b.bounds.bmax;
-		tlasNode[nodesUsed].BLAS = item[i].blasIdx;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		// free slots have lastUsed 0; a slot that the last frame needed is never evicted
+		uint best = 0;
+		for (uint s = 1; s < slotCount; s++) if (slot[s].lastUsed < slot[best].lastUsed) best = s;
+		if (slot[best].lastUsed == frame) break; // the pool is too small for the working set
+		if (slot[best].mesh >= 0) Evict( best );
+		Load( i, best ), uploaded++;
 	}
-	if (!tree[treeIdx]) tree[treeIdx] = new KDTree( tlasNode + half + 33, last - half, half + 33 );
-	treeSize[treeIdx++] = last - half;
 }
 
-void TLAS::CreateParent( uint idx, uint left, uint right )
+// SkyDome implementation
+
+// shared exponent: 8-bit r, g, b mantissas in the low bytes, exponent + 128 in the top byte
+static uint RGB32FtoRGBE( const float r, const float g, const float b )
 {
-	tlasNode[idx].left = left, tlasNode[idx].right = right;
-	tlasNode[idx].aabbMin = fminf( tlasNode[left].aabbMin, tlasNode[right].aabbMin );
-	tlasNode[idx].aabbMax = fmaxf( tlasNode[left].aabbMax, tlasNode[right].aabbMax );
+	const float m = max( max( r, g ), b );
+	if (m < 1e-32f) return 0;
+	int e;
+	const float s = frexpf( m, &e ) * 256 / m;
+	return (uint)(r * s) + ((uint)(g * s) << 8) + ((uint)(b * s) << 16) + ((uint)(e + 128) << 24);
 }
 
-void TLAS::QuickSort( SortItem a[], int first, int last )
+SkyDome::SkyDome( const float* rgb, uint w, uint h )
 {
-	struct Task { uint first, last; };
-	_declspec (align(64)) Task stack[64];
-	uint& stackPtr = stack[0].first; // so it sits in the same cacheline
-	stackPtr = 1;
-	while (1)
+	width = w, height = h, cdfWidth = max( w >> 2, 1u ), cdfHeight = max( h >> 2, 1u );
+	uint* data = new uint[4 + w * h + cdfHeight + cdfWidth * cdfHeight];
+	data[0] = w, data[1] = h, data[2] = cdfWidth, data[3] = cdfHeight;
+	uint* texel = data + 4;
+	for (uint i = 0; i < w * h; i++) texel[i] = RGB32FtoRGBE( rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2] );
+	// cell weights, accumulated per row; rows without light are sampled uniformly
+	float* marginal = (float*)(texel + w * h), *conditional = marginal + cdfHeight, sum = 0;
+	for (uint y = 0; y < cdfHeight; y++)
 	{
-		while (1)
+		float* cdf = conditional + y * cdfWidth, rowSum = 0;
+		const float sinTheta = sinf( PI * (y + 0.5f) / cdfHeight );
+		for (uint x = 0; x < cdfWidth; x++)
 		{
-			if (first >= last) break;
-			int p = first;
-			SortItem e = a[first];
-			for (int i = first + 1; i <= last; i++) if (a[i].pos <= e.pos) Swap( a[i], a[++p] );
-			Swap( a[p], a[first] );
-			stack[stackPtr].first = p + 1, stack[stackPtr++].last = last, last = p - 1;
+			float lum = 0;
+			for (uint v = y * h / cdfHeight; v < (y + 1) * h / cdfHeight; v++)
+				for (uint u = x * w / cdfWidth; u < (x + 1) * w / cdfWidth; u++)
+				{
+					const float* c = rgb + (u + v * w) * 3;
+					lum += 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+				}
+			cdf[x] = (rowSum += lum * sinTheta);
 		}
-		if (stackPtr == 1) break;
-		first = stack[--stackPtr].first, last = stack[stackPtr].last;
+		for (uint x = 0; x < cdfWidth; x++) cdf[x] = rowSum > 0 ? cdf[x] / rowSum : (float)(x + 1) / cdfWidth;
+		marginal[y] = (sum += rowSum);
 	}
+	for (uint y = 0; y < cdfHeight; y++) marginal[y] = sum > 0 ? marginal[y] / sum : (float)(y + 1) / cdfHeight;
+	// guard against rounding: the last entries must be exactly 1
+	marginal[cdfHeight - 1] = 1;
+	for (uint y = 0; y < cdfHeight; y++) conditional[y * cdfWidth + cdfWidth - 1] = 1;
+	skyData = new Buffer( (4 + w * h + cdfHeight + cdfWidth * cdfHeight) * sizeof( uint ), data );
+	skyData->CopyToDevice();
+}
+
+// DirtyRanges implementation
+
+void DirtyRanges::Mark( uint first, uint count )
+{
+	// extend the last range for sequential updates
+	if (!range.empty() && first >= range.back().first && first <= range.back().last)
+		range.back().last = max( range.back().last, first + count );
+	else range.push_back( { first, first + count } );
 }
 
-void TLAS::BuildQuick()
+void DirtyRanges::Coalesce( uint maxGap )
 {
-	// single-threaded code, for reference
-#if 0
-	// assign a TLASleaf node to each BLAS
-	nodesUsed = 1;
-	for (uint i = 0; i < blasCount; i++)
+	if (range.size() < 2) return;
+	sort( range.begin(), range.end(), []( const Range& a, const Range& b ) { return a.first < b.first; } );
+	uint n = 0;
+	for (uint i = 1; i < range.size(); i++)
+		if (range[i].first <= range[n].last + maxGap) range[n].last = max( range[n].last, range[i].last );
+		else range[++n] = range[i];
+	range.resize( n + 1 );
+}
+
+// UploadRing implementation
+
+UploadRing::UploadRing( uint size )
+{
+	for (int i = 0; i < 2; i++) buffer[i] = new Buffer( size, _aligned_malloc( size, 64 ) );
+}
+
+Buffer* UploadRing::Upload( const void* data, uint size, const DirtyRanges* dirty, uint stride )
+{
+	slot ^= 1;
+	// the frame that used this pair two frames ago must be done before the staging
+	// memory is overwritten; this also keeps the host at most two frames ahead
+	if (released[slot]) clWaitForEvents( 1, &released[slot] ), clReleaseEvent( released[slot] ), released[slot] = 0;
+	if (written[slot]) clReleaseEvent( written[slot] ), written[slot] = 0;
+	if (dirty) pending[0].Merge( *dirty ), pending[1].Merge( *dirty );
+	if (!dirty || !valid[slot])
 	{
-		tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
-		tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
-		tlasNode[nodesUsed].BLAS = i;
-		tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+		// full upload; without dirty ranges, the changes that the other pair missed are
+		// unknown, so it needs a full upload as well
+		memcpy( buffer[slot]->GetHostPtr(), data, size );
+		buffer[slot]->CopyToDevice2( false, &written[slot], size );
+		valid[slot] = true;
+		if (!dirty) valid[slot ^ 1] = false, pending[slot ^ 1].Clear();
 	}
-	// build a kD-tree over the TLAS nodes
-	static KDTree* kdtree = 0;
-	if (!kdtree) kdtree = new KDTree( tlasNode + 1, nodesUsed - 1, 1 /* skip root */ );
-	Timer t;
-	kdtree->rebuild();
-	printf( "kdtree rebuild: %.2fms, ", t.elapsed() * 1000 );
-	// use the kD-tree for fast agglomerative clustering
-	float sa = 1e30f;
-	uint best = 0, workLeft = blasCount, A, B = kdtree->FindNearest( A = 1, best, sa );
-	while (1)
+	else
 	{
-		int C = kdtree->FindNearest( B, best = A, sa );
-		if (A == C)
+		// this pair missed the changes of the previous frame as well as this one's;
+		// ranges less than 4KB apart are sent as one write
+		DirtyRanges& p = pending[slot];
+		p.Coalesce( max( 1u, 4096 / stride ) );
+		for (const DirtyRanges::Range& r : p.range)
 		{
-			// found a pair: create a new TLAS interior node
-			TLASNode& newNode = tlasNode[nodesUsed];
-			newNode.aabbMin = fminf( tlasNode[A].aabbMin, tlasNode[B].aabbMin );
-			newNode.aabbMax = fmaxf( tlasNode[A].aabbMax, tlasNode[B].aabbMax );
-			newNode.leftRight = A + (B << 16);
-			if (workLeft-- == 2) break;
-			kdtree->removeLeaf( A );
-			kdtree->removeLeaf( B );
-			kdtree->add( A = nodesUsed++ );
-			B = kdtree->FindNearest( A, best = 0, sa = 1e30f );
+			const uint first = r.first * stride, bytes = (min( r.last * stride, size ) - first);
+			if (first >= size) continue;
+			memcpy( (char*)buffer[slot]->GetHostPtr() + first, (const char*)data + first, bytes );
+			if (written[slot]) clReleaseEvent( written[slot] );
+			buffer[slot]->CopyToDevice2( false, &written[slot], bytes, first );
 		}
-		else A = B, B = C;
 	}
-	// copy last remaining node to the root node
-	tlasNode[0] = tlasNode[nodesUsed];
-#elif 1
-	// building the TLAS top-down, fastest option for the Boids demo
-	static Mesh m;
-	if (!m.tri) m = Mesh( blasCount );
-	for (uint i = 0; i < blasCount; i++)
+	pending[slot].Clear();
+	// holds as long as every change since the previous call is in 'dirty'
+	assert( memcmp( buffer[slot]->GetHostPtr(), data, size ) == 0 );
+	clFlush( Kernel::GetQueue2() );
+	// commands enqueued on the main queue from here on wait for the write; writes on
+	// the second queue complete in order, so the last one suffices
+	if (written[slot]) clEnqueueBarrierWithWaitList( Kernel::GetQueue(), 1, &written[slot], 0 );
+	return buffer[slot];
+}
+
+void UploadRing::Release()
+{
+	// marker: completes when all commands enqueued so far on the main queue are done
+	clEnqueueMarkerWithWaitList( Kernel::GetQueue(), 0, 0, &released[slot] );
+}
+
+// GPUTLAS implementation
+
+GPUTLAS::GPUTLAS( Buffer* boundsData, Buffer* nodeData, uint N )
+{
+	instBounds = boundsData, tlasNodes = nodeData, count = N;
+	for (paddedCount = 64; paddedCount < N;) paddedCount *= 2;
+	keys = new Buffer( paddedCount * sizeof( uint ) );
+	values = new Buffer( paddedCount * sizeof( uint ) );
+	parent = new Buffer( paddedCount * 2 * sizeof( uint ) );
+	counter = new Buffer( paddedCount * sizeof( uint ) );
+	static uint emptyBounds[8] = { 0xffffffff, 0xffffffff, 0xffffffff, 0, 0, 0, 0, 0 };
+	bounds = new Buffer( 8 * sizeof( uint ), emptyBounds );
+	bounds->CopyToDevice();
+	sceneBounds = new Kernel( "cl/lbvh.cl", "sceneBounds" );
+	mortonCodes = new Kernel( sceneBounds->GetProgram(), "mortonCodes" );
+	bitonicSort = new Kernel( sceneBounds->GetProgram(), "bitonicSort" );
+	buildHierarchy = new Kernel( sceneBounds->GetProgram(), "buildHierarchy" );
+	refitHierarchy = new Kernel( sceneBounds->GetProgram(), "refitHierarchy" );
+}
+
+void GPUTLAS::Build()
+{
+	// Morton codes of the instance centroids, normalized to the scene bounds
+	sceneBounds->SetArguments( instBounds, bounds, (int)count );
+	sceneBounds->Run( paddedCount, 64 );
+	mortonCodes->SetArguments( instBounds, bounds, keys, values, (int)count );
+	mortonCodes->Run( paddedCount, 64 );
+	// sort the codes; padding keys are 0xffffffff and end up behind the real ones
+	for (uint k = 2; k <= paddedCount; k *= 2) for (uint j = k / 2; j > 0; j /= 2)
 	{
-		m.tri[i].vertex0 = blas[i].bounds.bmin;
-		m.tri[i].vertex1 = blas[i].bounds.bmax;
-		m.tri[i].vertex2 = (blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f; // degenerate but with the correct aabb
+		bitonicSort->SetArguments( keys, values, (int)j, (int)k );
+		bitonicSort->Run( paddedCount, 64 );
 	}
-	if (!m.bvh)
+	// emit the tree topology, then propagate the bounds bottom-up
+	buildHierarchy->SetArguments( keys, values, instBounds, tlasNodes, parent, counter, bounds, (int)count );
+	buildHierarchy->Run( paddedCount, 64 );
+	refitHierarchy->SetArguments( tlasNodes, parent, counter, (int)count );
+	refitHierarchy->Run( paddedCount, 64 );
+}
+
+// GPUBVH implementation
+
+GPUBVH::GPUBVH( Buffer* triData, Buffer* nodeData, Buffer* idxData, uint triCount )
+{
+#ifdef BVH_QUANTIZED
+	FatalError( "GPUBVH: the device BVH is quantized; disable BVH_QUANTIZED." );
+#endif
+	tris = triData, bvhNodes = nodeData, triIdx = idxData, count = triCount;
+	triBounds = new Buffer( count * 2 * sizeof( float4 ) );
+	treeNodes = new Buffer( count * 2 * sizeof( TLASNode ) );
+	builder = new GPUTLAS( triBounds, treeNodes, count );
+	triangleBounds = new Kernel( "cl/lbvh.cl", "triangleBounds" );
+	emitBVH = new Kernel( triangleBounds->GetProgram(), "emitBVH" );
+}
+
+void GPUBVH::Build()
+{
+	// the TLAS builder sorts the triangles by the Morton codes of their bounds centroids
+	triangleBounds->SetArguments( tris, triBounds, (int)count );
+	triangleBounds->Run( builder->paddedCount, 64 );
+	builder->Build();
+	emitBVH->SetArguments( treeNodes, bvhNodes, triIdx, (int)count );
+	emitBVH->Run( builder->paddedCount, 64 );
+}
+
+// WavefrontTracer implementation
+
+WavefrontTracer::WavefrontTracer( uint samples, uint depth )
+{
+	// counter layout: 32 extension ray counts, followed by 32 shadow ray counts
+	if (depth < 1 || depth > 32) FatalError( "WavefrontTracer: path depth must be in [1..32]." );
+	samplesPerPixel = samples, maxDepth = depth, pathCount = SCRWIDTH * SCRHEIGHT * samples;
+	// 48 bytes per PathRay / ShadowRay, 16 bytes per float4
+	rays[0] = new Buffer( pathCount * 48 );
+	rays[1] = new Buffer( pathCount * 48 );
+	rays[2] = new Buffer( pathCount * 48 ); // reordering target
+	hits = new Buffer( pathCount * sizeof( Intersection ) );
+	shadowRays = new Buffer( pathCount * 48 );
+	accumulator = new Buffer( pathCount * 16 );
+	counter = new Buffer( 64 * sizeof( uint ) );
+	bins = new Buffer( 4096 * sizeof( uint ) ); // RAY_BINS in cl/wavefront.cl
+	generate = new Kernel( "cl/wavefront.cl", "generate" );
+	extend = new Kernel( generate->GetProgram(), "extend" );
+	shade = new Kernel( generate->GetProgram(), "shade" );
+	connect = new Kernel( generate->GetProgram(), "connect" );
+	extend->tracesRays = connect->tracesRays = true;
+	finalize = new Kernel( generate->GetProgram(), "finalize" );
+	binRays = new Kernel( generate->GetProgram(), "binRays" );
+	scanBins = new Kernel( generate->GetProgram(), "scanBins" );
+	scatterRays = new Kernel( generate->GetProgram(), "scatterRays" );
+}
+
+void WavefrontTracer::Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+	const float3 camPos, const float3 p0, const float3 p1, const float3 p2 )
+{
+	// ray counts stay on the device; each stage runs for pathCount threads and idle
+	// threads exit immediately, so there is no host synchronization between stages
+	counter->Clear();
+	generate->SetArguments( rays[0], accumulator, counter, (int)pathCount, camPos, p0, p1, p2 );
+	generate->Run( pathCount, 64 );
+	Buffer* in = rays[0], *out = rays[1], *spare = rays[2];
+	for (uint depth = 0; depth < maxDepth; depth++)
 	{
-		m.bvh = new BVH( &m );
-		m.bvh->subdivToOnePrim = true;
+		extend->SetArguments( in, hits, counter, (int)depth,
+			scene.triData, tlasData, instData, scene.bvhData, scene.idxData );
+		extend->Run( pathCount, 64 );
+		shade->SetArguments( in, hits, out, shadowRays, counter, accumulator, (int)depth, (int)maxDepth,
+			skyData, instData, scene.triData, scene.triExData, scene.texData );
+		shade->Run( pathCount, 64 );
+		if (reorder && depth + 1 < maxDepth)
+		{
+			// counting sort of the new extension rays into the spare buffer
+			bins->Clear();
+			binRays->SetArguments( out, counter, (int)(depth + 1), bins, tlasData );
+			binRays->Run( pathCount, 64 );
+			scanBins->SetArguments( bins );
+			scanBins->Run( 256, 256 );
+			scatterRays->SetArguments( out, spare, counter, (int)(depth + 1), bins, tlasData );
+			scatterRays->Run( pathCount, 64 );
+			swap( out, spare );
+		}
+		connect->SetArguments( shadowRays, counter, accumulator, (int)depth,
+			scene.triData, tlasData, instData, scene.bvhData, scene.idxData );
+		connect->Run( pathCount, 64 );
+		swap( in, out );
 	}
-	m.bvh->Build();
-	// copy the BVH to a TLAS
-	memcpy( tlasNode, m.bvh->bvhNode, m.bvh->nodesUsed * sizeof( BVHNode ) );
-	if (m.bvh->nodesUsed != blasCount * 2)
+	finalize->SetArguments( target, accumulator, (int)samplesPerPixel );
+	finalize->Run( SCRWIDTH * SCRHEIGHT, 64 );
+}
+
+// Denoiser implementation
+
+Denoiser::Denoiser( Kernel* renderKernel )
+{
+	const uint pixels = SCRWIDTH * SCRHEIGHT;
+	color = new Buffer( pixels * sizeof( float4 ) );
+	albedo = new Buffer( pixels * sizeof( float4 ) );
+	for (int i = 0; i < 2; i++)
+		normalDepth[i] = new Buffer( pixels * sizeof( float4 ) ),
+		history[i] = new Buffer( pixels * sizeof( float4 ) ),
+		filtered[i] = new Buffer( pixels * sizeof( float4 ) );
+	guides = new Kernel( renderKernel->GetProgram(), "renderGuides" );
+	guides->tracesRays = true;
+	reproject = new Kernel( "cl/denoise.cl", "reproject" );
+	atrous = new Kernel( reproject->GetProgram(), "atrous" );
+	compose = new Kernel( reproject->GetProgram(), "compose" );
+}
+
+void Denoiser::Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+	const float3 camPos, const float3 p0, const float3 p1, const float3 p2 )
+{
+	// guides and history alternate between two buffers, so the previous frame stays available
+	const uint pixels = SCRWIDTH * SCRHEIGHT, cur = frame & 1, prev = cur ^ 1;
+	guides->SetArguments( color, normalDepth[cur], albedo, skyData,
+		scene.triData, scene.triExData, scene.texData, tlasData, instData, scene.bvhData, scene.idxData,
+		camPos, p0, p1, p2, (int)frame );
+	guides->Run( pixels, 64 );
+	reproject->SetArguments( color, normalDepth[cur], albedo, normalDepth[prev], history[prev], history[cur],
+		camPos, p0, p1, p2, prevCamPos, prevP0, prevP1, prevP2, (int)(frame ? maxHistory : 0) );
+	reproject->Run( pixels, 64 );
+	// the unfiltered average is the history of the next frame; the filter works on copies
+	Buffer* in = history[cur];
+	for (uint i = 0; i < iterations; i++)
 	{
-		int w = 0;
+		atrous->SetArguments( in, filtered[i & 1], normalDepth[cur], (int)(1 << i), sigmaColor / (float)(1 << i) );
+		atrous->Run( pixels, 64 );
+		in = filtered[i & 1];
 	}
-	for (uint i = 0; i < m.bvh->nodesUsed; i++) if (i != 1)
+	compose->SetArguments( target, in, albedo );
+	compose->Run( pixels, 64 );
+	prevCamPos = camPos, prevP0 = p0, prevP1 = p1, prevP2 = p2, frame++;
+}
+
+// HybridRenderer implementation
+
+HybridRenderer::HybridRenderer( Kernel* renderKernel )
+{
+	tracer = renderKernel;
+	copyRows = new Kernel( tracer->GetProgram(), "copyRows" );
+	cpuPixels = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( uint ), new uint[SCRWIDTH * SCRHEIGHT] );
+}
+
+// SampleSky in cl/tools.cl, on the host copy of the SkyDome data
+static float3 SampleSkyDome( const uint* sky, const float3& D )
+{
+	const float phi = atan2f( D.z, D.x );
+	const uint u = (uint)(sky[0] * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
+	const uint v = (uint)(sky[1] * acosf( D.y ) * INVPI - 0.5f);
+	const uint c = sky[4 + (u + v * sky[0]) % (sky[0] * sky[1])];
+	const float s = ldexpf( 1.0f, (int)(c >> 24) - 136 );
+	return 0.65f * s * float3( (c & 255) + 0.5f, ((c >> 8) & 255) + 0.5f, ((c >> 16) & 255) + 0.5f );
+}
+
+// CPU version of Trace in cl/raytracer.cl
+float3 HybridRenderer::Trace( Ray& ray, const uint* sky, TLAS& tlas )
+{
+	static const float3 lightPos( LIGHT_POS ), lightColor( LIGHT_COLOR ), ambient( AMBIENT );
+	for (int rayDepth = 0; rayDepth < 2; rayDepth++)
 	{
-		const BVHNode& n = m.bvh->bvhNode[i];
-		if (n.isLeaf())
-			tlasNode[i].BLAS = m.bvh->triIdx[n.leftFirst],
-			tlasNode[i].leftRight = 0; // mark as leaf
-		else
-			tlasNode[i].leftRight = n.leftFirst + ((n.leftFirst + 1) << 16);
+		tlas.Intersect( ray );
+		const Intersection& i = ray.hit;
+		if (i.t == 1e30f) return SampleSkyDome( sky, ray.D );
+		const uint triIdx = PRIM_IDX( i.instPrim ), instIdx = INST_IDX( i.instPrim );
+		mat4 transform;
+		const Mesh* mesh = tlas.HitInstance( i, transform ).GetBVH()->mesh;
+		const TriEx& tri = mesh->triEx[triIdx];
+		float3 N = normalize( TransformVector( i.u * tri.N1 + i.v * tri.N2 + (1 - (i.u + i.v)) * tri.N0, transform ) );
+		const float3 I = ray.O + ray.D * i.t;
+		if (IS_MIRROR( instIdx ))
+		{
+			// mirror; the second bounce returns the sky
+			ReflectCone( ray, i.t, mesh->Curvature( triIdx, transform ) );
+			ray.D = ray.D - 2 * N * dot( N, ray.D );
+			if (rayDepth == 1) return SampleSkyDome( sky, ray.D );
+			ray.O = I + ray.D * 0.005f;
+			ray.hit.t = 1e30f;
+			continue;
+		}
+		float3 albedo( 1 );
+		if (mesh->texture)
+		{
+			const float2 uv = i.u * tri.uv1 + i.v * tri.uv2 + (1 - (i.u + i.v)) * tri.uv0;
+			const float width = fabsf( ray.coneWidth + ray.coneSpread * i.t );
+			albedo = mesh->SampleTexture( uv, mesh->TextureLOD( triIdx, transform, ray.D, N, width ) );
+		}
+		float3 L = lightPos - I;
+		const float dist = length( L );
+		L *= 1.0f / dist;
+		const float NdotL = dot( N, L );
+		if (NdotL <= 0) return albedo * ambient;
+		Ray shadow;
+		shadow.O = I + L * 0.005f, shadow.D = L;
+		if (tlas.IsOccluded( shadow, dist - 0.01f )) return albedo * ambient;
+		return albedo * (ambient + NdotL * lightColor * (1.0f / (dist * dist)));
 	}
-#else
-	// multi-threaded, using sorted pre-splitting. TODO: generalize to 2^N threads.
-	// 1. sort the list of TLAS nodes
-	if (!item) item = new SortItem[blasCount];
-	uint axis = 0; // TODO: dominant axis
-	for (uint i = 0; i < blasCount; i++) item[i].blasIdx = i;
-	// 2. split the sorted list into two equally-sized groups
-	nodesUsed = 32;
-	SortAndSplit( 0, blasCount - 1, 0 );
-	// 3. perform agglomerative clustering
-#pragma omp parallel for
-	for (int i = 0; i < 16; i++)
-	{
-		tree[i]->rebuild();
-		float sa = 1e30f;
-		uint A = 32, B, best = 0, workLeft = treeSize[i], nodePtr = blasCount + 32;
-		for (int j = 0; j < i; j++) A += treeSize[j], nodePtr += treeSize[j] - 1;
-		B = tree[i]->FindNearest( A, best, sa );
-		while (1)
+	return float3( 1 );
+}
+
+void HybridRenderer::Render( Buffer* target, Buffer* skyData, Scene& scene, TLAS& tlas, Buffer* tlasData, Buffer* instData,
+	const float3 camPos, const float3 p0, const float3 p1, const float3 p2 )
+{
+	// start the GPU on its rows; the kernel skips pixels beyond its launch size
+	const uint rows = gpuRows, cpuRows = SCRHEIGHT - rows;
+	cl_event gpuDone = 0, uploaded = 0;
+	tracer->SetArguments( target, skyData, scene.triData, scene.triExData, scene.texData, tlasData, instData,
+		scene.bvhData, scene.idxData, camPos, p0, p1, p2 );
+	if (rows > 0) tracer->Run( rows * SCRWIDTH, 0, 0, &gpuDone ), clFlush( Kernel::GetQueue() );
+	// meanwhile, the CPU renders the other rows, two samples per pixel; the noise changes
+	// every frame, like that of the denoiser input
+	Timer timer;
+	frame++;
+	const uint* sky = skyData->GetHostPtr();
+	uint* pixels = cpuPixels->GetHostPtr();
+	JobManager::GetJobManager()->ParallelFor( cpuRows, [&]( int row )
+	{
+		const int y = rows + row;
+		uint seed = ((y + 1) * 0x9e3779b9u) ^ (frame * 0x85ebca6bu);
+		if (seed == 0) seed = 1; // xorshift state may not be zero
+		for (int x = 0; x < SCRWIDTH; x++)
 		{
-			int C = tree[i]->FindNearest( B, best = A, sa );
-			if (A == C)
+			float3 color( 0 );
+			for (int s = 0; s < 2; s++)
 			{
-				// found a pair: create a new TLAS interior node
-				TLASNode& newNode = tlasNode[nodePtr];
-				newNode.aabbMin = fminf( tlasNode[A].aabbMin, tlasNode[B].aabbMin );
-				newNode.aabbMax = fmaxf( tlasNode[A].aabbMax, tlasNode[B].aabbMax );
-				newNode.leftRight = A + (B << 16);
-				if (workLeft-- == 2) break;
-				tree[i]->removeLeaf( A );
-				tree[i]->removeLeaf( B );
-				tree[i]->add( A = nodePtr++ );
-				B = tree[i]->FindNearest( A, best = 0, sa = 1e30f );
+				const float3 pixelPos = p0 + (p1 - p0) * ((x + RandomFloat( seed )) / SCRWIDTH) + (p2 - p0) * ((y + RandomFloat( seed )) / SCRHEIGHT);
+				Ray ray;
+				ray.O = camPos, ray.D = normalize( pixelPos - camPos ), ray.hit.t = 1e30f;
+				ray.coneSpread = length( p1 - p0 ) / (SCRWIDTH * length( pixelPos - camPos ));
+				color += Trace( ray, sky, tlas );
 			}
-			else A = B, B = C;
+			color = fminf( color * 0.5f, 1 );
+			pixels[x + row * SCRWIDTH] = ((uint)(color.x * 255) << 16) + ((uint)(color.y * 255) << 8) + (uint)(color.z * 255);
 		}
-		// copy last remaining node to the root node
-		tlasNode[i + 15] = tlasNode[nodePtr];
+	} );
+	const float cpuTime = timer.elapsed() * 1000;
+	if (cpuRows > 0)
+	{
+		cpuPixels->CopyToDevice2( false, &uploaded, cpuRows * SCRWIDTH * sizeof( uint ) );
+		copyRows->SetArguments( target, cpuPixels, (int)rows );
+		copyRows->Run( cpuRows * SCRWIDTH, 0, &uploaded );
+		clReleaseEvent( uploaded );
 	}
-	// 4. join together the resulting trees
-	for (int i = 0; i < 8; i++) CreateParent( 7 + i, 15 + 2 * i, 16 + 2 * i );
-	for (int i = 0; i < 4; i++) CreateParent( 3 + i, 7 + 2 * i, 8 + 2 * i );
-	for (int i = 0; i < 2; i++) CreateParent( 1 + i, 3 + 2 * i, 4 + 2 * i );
-	CreateParent( 0, 1, 2 );
-	// 5. profit.
-	nodesUsed = 2 * blasCount + 64;
-#endif
+	// GPU time from the profiling info of the queue
+	float gpuTime = 0;
+	if (gpuDone)
+	{
+		cl_ulong start = 0, end = 0;
+		clWaitForEvents( 1, &gpuDone );
+		clGetEventProfilingInfo( gpuDone, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &start, 0 );
+		clGetEventProfilingInfo( gpuDone, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &end, 0 );
+		clReleaseEvent( gpuDone );
+		gpuTime = (float)(end - start) * 1e-6f;
+	}
+	// rebalance: rows in proportion to the throughput; each side keeps a few rows, so that
+	// its rate stays known. Rows differ in cost, so the rates are smoothed over frames.
+	if (rows > 0 && gpuTime > 0) gpuRate = gpuRate == 0 ? rows / gpuTime : 0.8f * gpuRate + 0.2f * (rows / gpuTime);
+	if (cpuRows > 0 && cpuTime > 0) cpuRate = cpuRate == 0 ? cpuRows / cpuTime : 0.8f * cpuRate + 0.2f * (cpuRows / cpuTime);
+	if (gpuRate > 0 && cpuRate > 0)
+		gpuRows = clamp( (uint)(SCRHEIGHT * gpuRate / (gpuRate + cpuRate) + 0.5f), 8u, (uint)SCRHEIGHT - 8 );
 }
 
-void TLAS::Intersect( Ray& ray )
+// MultiGPURenderer implementation
+
+MultiGPURenderer::MultiGPURenderer( Kernel* renderKernel )
 {
-	// calculate reciprocal ray directions for faster AABB intersection
-	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
-	// use a local stack instead of a recursive function
-	TLASNode* node = &tlasNode[0], * stack[64];
-	uint stackPtr = 0;
-	// traversl loop; terminates when the stack is empty
-	while (1)
+	tracer = renderKernel, deviceCount = Kernel::GetDeviceCount();
+	tileTracer = new Kernel( tracer->GetProgram(), "renderTile" );
+	tileTracer->tracesRays = true;
+	copyTile = new Kernel( tracer->GetProgram(), "copyTile" );
+	// equal bands to start with; a band never exceeds the screen
+	for (uint i = 0; i <= deviceCount; i++) firstRow.push_back( i * SCRHEIGHT / deviceCount );
+	rate.resize( deviceCount, 0 );
+	band.push_back( 0 );
+	for (uint i = 1; i < deviceCount; i++) band.push_back( new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( float4 ) ) );
+}
+
+void MultiGPURenderer::Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+	const float3 camPos, const float3 p0, const float3 p1, const float3 p2 )
+{
+	Buffer* sceneData[] = { skyData, scene.triData, scene.triExData, scene.texData, scene.bvhData, scene.idxData };
+	if (!replicated)
 	{
-		if (node->isLeaf())
+		// copy the static scene data to each device up front, rather than on first use
+		for (uint i = 1; i < deviceCount; i++) for (Buffer* b : sceneData)
+			clEnqueueMigrateMemObjects( Kernel::GetDeviceQueue( i ), 1, b->GetDevicePtr(), 0, 0, 0, 0 );
+		replicated = true;
+	}
+	// the other devices wait for this frame's TLAS and instance uploads on queue 0
+	cl_event uploaded = 0;
+	vector<cl_event> done( deviceCount, (cl_event)0 );
+	clEnqueueMarkerWithWaitList( Kernel::GetQueue(), 0, 0, &uploaded );
+	clFlush( Kernel::GetQueue() );
+	const float3 dx = (p1 - p0) * (1.0f / SCRWIDTH), dy = (p2 - p0) * (1.0f / SCRHEIGHT);
+	for (uint i = deviceCount; i-- > 0; ) // device 0 last: it composites
+	{
+		const uint first = firstRow[i], rows = firstRow[i + 1] - first;
+		if (rows == 0) continue;
+		if (i == 0)
 		{
-			// current node is a leaf: intersect BLAS
-			blas[node->BLAS].Intersect( ray );
-			// pop a node from the stack; terminate if none left
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			tracer->SetArguments( target, skyData, scene.triData, scene.triExData, scene.texData, tlasData, instData,
+				scene.bvhData, scene.idxData, camPos, p0, p1, p2 );
+			tracer->Run( rows * SCRWIDTH, 0, 0, &done[0] ); // starts at row 0
 			continue;
 		}
-		// current node is an interior node: visit child nodes, ordered
-		TLASNode* child1 = &tlasNode[node->leftRight & 0xffff];
-		TLASNode* child2 = &tlasNode[node->leftRight >> 16];
-		float dist1 = IntersectAABB( ray, child1->aabbMin, child1->aabbMax );
-		float dist2 = IntersectAABB( ray, child2->aabbMin, child2->aabbMax );
-		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
-		if (dist1 == 1e30f)
-		{
-			// missed both child nodes; pop a node from the stack
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
-		}
-		else
-		{
-			// visit near node; push the far node if the ray intersects it
-			node = child1;
-			if (dist2 != 1e30f) stack[stackPtr++] = child2;
-		}
+		tileTracer->SetArguments( band[i], skyData, scene.triData, scene.triExData, scene.texData, tlasData, instData,
+			scene.bvhData, scene.idxData, camPos, p0 + dy * (float)first, dx, dy, SCRWIDTH, (int)rows, 2, (int)(first * SCRWIDTH) );
+		tileTracer->RunOnDevice( i, rows * SCRWIDTH, 0, &uploaded, &done[i] );
+		clFlush( Kernel::GetDeviceQueue( i ) );
+	}
+	// composite: device 0 copies each band into the target once that band is done
+	for (uint i = 1; i < deviceCount; i++) if (done[i])
+	{
+		copyTile->SetArguments( target, band[i], (int)firstRow[i] );
+		copyTile->Run( (firstRow[i + 1] - firstRow[i]) * SCRWIDTH, 0, &done[i] );
+	}
+	clFinish( Kernel::GetQueue() );
+	clReleaseEvent( uploaded );
+	// rebalance: bands in proportion to the rows per millisecond of each device
+	float rateSum = 0;
+	for (uint i = 0; i < deviceCount; i++) if (done[i])
+	{
+		cl_ulong start = 0, end = 0;
+		clGetEventProfilingInfo( done[i], CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &start, 0 );
+		clGetEventProfilingInfo( done[i], CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &end, 0 );
+		clReleaseEvent( done[i] );
+		const float ms = (float)(end - start) * 1e-6f, r = (firstRow[i + 1] - firstRow[i]) / max( ms, 0.001f );
+		rate[i] = rate[i] == 0 ? r : 0.8f * rate[i] + 0.2f * r;
 	}
+	for (uint i = 0; i < deviceCount; i++) rateSum += rate[i];
+	if (rateSum == 0) return;
+	// each device keeps a few rows, so that its rate stays known
+	float acc = 0;
+	for (uint i = 1; i < deviceCount; i++)
+		acc += rate[i - 1] / rateSum, firstRow[i] = clamp( (uint)(acc * SCRHEIGHT + 0.5f), firstRow[i - 1] + 8, (uint)SCRHEIGHT - 8 * (deviceCount - i) );
 }
 
 // EOF
\ No newline at end of file
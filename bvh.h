@@ -6,6 +6,50 @@
 // bin count for binned BVH building
 #define BINS 8
 
+// nodes with at least this many triangles are binned and partitioned by all threads
+#define PARALLEL_BINNING 65536
+#define BUILD_CHUNKS 64
+
+// uncomment to build static meshes as spatial split BVH (SBVH): slower build, faster tracing
+// #define USE_SBVH
+// spatial splits are only considered if object split children overlap by more than this
+// fraction of the root surface area (alpha in the SBVH paper)
+#define SBVH_ALPHA 1e-5f
+
+// cache meshes and their BVH in a binary file next to the obj file; the cache is memory-mapped
+// and used in place on the next run, skipping obj parsing and BVH construction; increase the
+// version whenever the layout or meaning of the cached nodes or indices changes
+#define MESH_CACHE
+#define MESH_CACHE_VERSION 2
+
+// after building a static mesh BVH: compact the nodes in depth-first order with sibling pairs
+// adjacent, and store the triangles in leaf order, so that triIdx becomes the identity and
+// leaves read their triangles directly (BVH::directTris)
+#define BVH_REORDER
+
+// default TLAS::BuildQuick algorithm: 0 = single-threaded agglomerative clustering (reference),
+// 1 = top-down binned build, 2 = multi-threaded agglomerative clustering,
+// 3 = locally-ordered clustering (PLOC) with batched kD-tree queries
+#define TLAS_BUILD_QUICK 1
+// maximum number of instance groups that are clustered in parallel (power of two)
+#define TLAS_MAX_GROUPS 64
+
+// uncomment to intersect triangles on the CPU using a precomputed transform to the unit
+// triangle (Woop et al., 2004) instead of Moeller-Trumbore; costs 48 bytes per triangle
+// #define TRI_WOOP
+
+// store the triangles of each leaf in SoA blocks of LEAF_SOA (4: SSE, 8: AVX) triangles, so that
+// the CPU single-ray traversal tests a block at once; requires USE_SSE, takes precedence over TRI_WOOP
+#define LEAF_SOA 4
+
+// BLAS width for CPU traversal: 2 (binary), 4 (SSE) or 8 (AVX); a compile-time choice, as the
+// library is built for AVX (see bvh.vcxproj), so the 4-wide tree is no fallback for older CPUs
+#define BVH_WIDTH 4
+
+// uncomment to count the nodes visited, triangles tested and stack depth of the CPU traversal
+// functions, per thread, see TraversalStats; without it the counters compile to nothing
+// #define TRAVERSAL_STATS
+
 namespace Tmpl8
 {
 
@@ -19,6 +63,17 @@ __declspec(align(64)) struct Tri
 	union { float3 centroid; __m128 centroid4; }; // total size: 64 bytes
 };
 
+// precomputed triangle: the rows of the affine transform that maps world space
+// to a space where the triangle is (0,0,0), (1,0,0), (0,1,0), see BVH::PrecomputeTris
+struct TriWoop { float4 m0, m1, m2; };
+
+// block of LEAF_SOA triangles in SoA layout: vertex0 and the two edges; unused lanes have zero edges
+#if LEAF_SOA == 8
+__declspec(align(64)) struct TriSoA { __m256 v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z; uint prim[8]; };
+#else
+__declspec(align(64)) struct TriSoA { __m128 v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z; uint prim[4]; };
+#endif
+
 // additional triangle data, for texturing and shading
 struct TriEx { float2 uv0, uv1, uv2; float3 N0, N1, N2; };
 
@@ -35,22 +90,110 @@ struct aabb
 	}
 };
 
-// intersection record, carefully tuned to be 16 bytes in size
+// intersection record, carefully tuned to be 16 bytes in size (24 bytes with WIDE_INDICES)
 struct Intersection
 {
 	float t;		// intersection distance along ray
 	float u, v;		// barycentric coordinates of the intersection
-	uint instPrim;	// instance index (12 bit) and primitive index (20 bit)
+#ifdef WIDE_INDICES
+	uint inner;		// for a hit in a nested TLAS: the instance inside it (fills the padding)
+#endif
+	instprim instPrim;	// instance and primitive index, see INST_PRIM in common.h
 };
 
 // ray struct, prepared for SIMD AABB intersection
 __declspec(align(64)) struct Ray
 {
-	Ray() { O4 = D4 = rD4 = _mm_set1_ps( 1 ); }
-	union { struct { float3 O; float dummy1; }; __m128 O4; };
-	union { struct { float3 D; float dummy2; }; __m128 D4; };
-	union { struct { float3 rD; float dummy3; }; __m128 rD4; };
-	Intersection hit; // total ray size: 64 bytes
+	Ray() { O4 = rD4 = D4 = _mm_set_ps( 0, 1, 1, 1 ); }
+	union { struct { float3 O; float coneWidth; }; __m128 O4; };
+	union { struct { float3 D; float time; }; __m128 D4; }; // time in the shutter interval, 0..1, see MotionTLAS
+	union { struct { float3 rD; float coneSpread; }; __m128 rD4; };
+	Intersection hit; // total ray size: 64 bytes (128 bytes with WIDE_INDICES)
+};
+
+// ray cones (Akenine-Moller et al., 2019): coneWidth is the width of the ray's footprint at O,
+// coneSpread the angle by which it grows per unit of distance; 0 for both is a thin ray.
+// After a mirror reflection at distance t, the cone continues from the hit point; curved
+// mirrors change its spread (see Mesh::Curvature), so a convex mirror widens the cone.
+inline void ReflectCone( Ray& ray, const float t, const float curvature )
+{
+	ray.coneWidth += ray.coneSpread * t;
+	ray.coneSpread += 2 * curvature * ray.coneWidth;
+}
+
+// sort key for ray reordering: the direction octant in the top 3 bits, then the 27-bit Morton
+// code of the origin in 'bounds'; secondary rays sorted by it form more coherent streams
+uint RayKey( const Ray& ray, const aabb& bounds );
+
+// traversal counters of the calling thread; they only grow, so callers take the difference
+// of two snapshots to get the cost of a query. packets count a node visit once for the packet,
+// and a ray/triangle test for each active ray.
+#ifdef TRAVERSAL_STATS
+struct TraversalStats
+{
+	uint64_t nodes = 0, tris = 0, instances = 0;
+	uint maxDepth = 0; // deepest stack seen; reset by the caller
+	void Depth( const uint d ) { if (d > maxDepth) maxDepth = d; }
+	void Merge( const TraversalStats& s )
+	{
+		nodes += s.nodes, tris += s.tris, instances += s.instances;
+		Depth( s.maxDepth );
+	}
+};
+extern thread_local TraversalStats traversalStats;
+#define TRAVERSAL_STAT( x ) x
+#else
+#define TRAVERSAL_STAT( x )
+#endif
+
+// ray packet size for coherent traversal: 4, 8 or 16 rays
+#define PACKET_SIZE 16
+
+// intersection records for a packet, in SoA layout
+struct PacketHit
+{
+	union { __m128 t4[PACKET_SIZE / 4]; float t[PACKET_SIZE]; };
+	union { __m128 u4[PACKET_SIZE / 4]; float u[PACKET_SIZE]; };
+	union { __m128 v4[PACKET_SIZE / 4]; float v[PACKET_SIZE]; };
+	union { __m128 instPrim4[PACKET_SIZE / 4]; uint instPrim[PACKET_SIZE]; }; // primitive index only with WIDE_INDICES
+#ifdef WIDE_INDICES
+	union { __m128 inst4[PACKET_SIZE / 4]; uint inst[PACKET_SIZE]; };
+	uint inner[PACKET_SIZE]; // see Intersection::inner
+#endif
+};
+
+// packet of coherent rays, in SoA layout for SIMD traversal
+__declspec(align(64)) struct RayPacket
+{
+	void SetRay( const uint i, const Ray& ray )
+	{
+		for (int a = 0; a < 3; a++) O[a][i] = ray.O.cell[a], D[a][i] = ray.D.cell[a];
+		hit.t[i] = ray.hit.t, hit.u[i] = ray.hit.u, hit.v[i] = ray.hit.v;
+	#ifdef WIDE_INDICES
+		hit.instPrim[i] = PRIM_IDX( ray.hit.instPrim ), hit.inst[i] = INST_IDX( ray.hit.instPrim );
+		hit.inner[i] = ray.hit.inner;
+	#else
+		hit.instPrim[i] = ray.hit.instPrim;
+	#endif
+	}
+	void GetRay( const uint i, Ray& ray ) const
+	{
+		ray.O = float3( O[0][i], O[1][i], O[2][i] ), ray.D = float3( D[0][i], D[1][i], D[2][i] );
+		ray.hit.t = hit.t[i], ray.hit.u = hit.u[i], ray.hit.v = hit.v[i];
+	#ifdef WIDE_INDICES
+		ray.hit.instPrim = INST_PRIM( hit.inst[i], hit.instPrim[i] ), ray.hit.inner = hit.inner[i];
+	#else
+		ray.hit.instPrim = hit.instPrim[i];
+	#endif
+	}
+	void Prepare(); // calculates reciprocal directions and packet bounds
+	union { __m128 O4[3][PACKET_SIZE / 4]; float O[3][PACKET_SIZE]; };
+	union { __m128 D4[3][PACKET_SIZE / 4]; float D[3][PACKET_SIZE]; };
+	union { __m128 rD4[3][PACKET_SIZE / 4]; float rD[3][PACKET_SIZE]; };
+	PacketHit hit;
+	// interval bounds over the packet, for culling entire nodes
+	__m128 Omin4, Omax4, rDmin4, rDmax4, sign4;
+	bool coherent; // false if directions differ in sign along an axis
 };
 
 // 32-byte BVH node struct
@@ -64,6 +207,87 @@ struct BVHNode
 		float3 e = aabbMax - aabbMin; // extent of the node
 		return (e.x * e.y + e.y * e.z + e.z * e.x) * triCount;
 	}
+	float SurfaceArea() const
+	{
+		float3 e = aabbMax - aabbMin; // extent of the node
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+};
+
+// 4-wide BVH node with SoA child bounds, for SSE traversal (128 bytes)
+struct BVHNode4
+{
+	union { __m128 xmin4; float xmin[4]; };
+	union { __m128 xmax4; float xmax[4]; };
+	union { __m128 ymin4; float ymin[4]; };
+	union { __m128 ymax4; float ymax[4]; };
+	union { __m128 zmin4; float zmin[4]; };
+	union { __m128 zmax4; float zmax[4]; };
+	uint child[4];		// wide node index, or first triIdx entry for a leaf
+	uint triCount[4];	// 0 for interior nodes and empty slots
+};
+
+// 8-wide BVH node with SoA child bounds, for AVX traversal (256 bytes)
+struct BVHNode8
+{
+	union { __m256 xmin8; float xmin[8]; };
+	union { __m256 xmax8; float xmax[8]; };
+	union { __m256 ymin8; float ymin[8]; };
+	union { __m256 ymax8; float ymax[8]; };
+	union { __m256 zmin8; float zmin[8]; };
+	union { __m256 zmax8; float zmax[8]; };
+	uint child[8];		// wide node index, or first triIdx entry for a leaf
+	uint triCount[8];	// 0 for interior nodes and empty slots
+};
+
+// 4-wide BVH node with child bounds quantized to 8 bits in a local grid (64 bytes);
+// child bounds are origin + q * step, with a power-of-two step per axis
+struct BVHNodeQ4
+{
+	float3 origin;		// minimum of the child bounds
+	char ex, ey, ez;	// per-axis quantization step: 2^e
+	uchar validMask;	// bit i is set if child slot i is in use
+	uchar xmin[4], xmax[4], ymin[4], ymax[4], zmin[4], zmax[4];
+	uint child[4];		// wide node index, or first triIdx entry for a leaf
+	ushort triCount[4];	// 0 for interior nodes and empty slots
+};
+
+// linear allocator: 64-byte aligned allocations are carved from large blocks, so frequent
+// allocations cost a pointer bump and are released all at once. Reset keeps the blocks for
+// reuse (per-frame or per-build scratch); ShrinkToFit returns the unused blocks to the
+// system. Not thread-safe: allocate from one thread at a time.
+class Arena
+{
+public:
+	Arena( size_t minBlockSize = 1 << 20 ) : blockSize( minBlockSize ) {}
+	void* Alloc( size_t size );
+	template <class T> T* Alloc( size_t count ) { return (T*)Alloc( count * sizeof( T ) ); }
+	void Reset();		// releases all allocations; the blocks are kept
+	void ShrinkToFit();	// frees the blocks that hold no allocations
+	size_t Used() const, Reserved() const;
+private:
+	struct Block { char* data; size_t size, used; };
+	vector<Block> block;
+	uint current = 0; // blocks before this one are full
+	size_t blockSize;
+};
+
+// key / payload pair for RadixSort; float keys share the storage of the integer keys
+struct SortItem { union { uint key; float pos; }; uint idx; };
+
+// parallel LSD radix sort, 8 bits per pass; each chunk of the input has its own histogram,
+// so chunks scatter in parallel and the sort is stable. Passes in which all keys have the
+// same digit are skipped. The scratch buffer grows as needed and is kept between calls.
+class RadixSort
+{
+public:
+	void Sort( SortItem* items, uint N );		// ascending by key
+	void SortFloat( SortItem* items, uint N );	// ascending by pos; keys are flipped to sort as uints
+	void ShrinkToFit();	// frees the scratch buffer
+private:
+	SortItem* tmp = 0;
+	uint* offset = 0; // per chunk: digit count, then scatter position
+	uint capacity = 0;
 };
 
 // bounding volume hierarchy, to be used as BLAS
@@ -73,25 +297,123 @@ __declspec(align(64)) class BVH
 	{
 		uint nodeIdx;
 		float3 centroidMin, centroidMax;
+		// after Build: the triangles (triIdx range) and nodes of the subtree; its SAH cost is
+		// filled in with buildCost, see ComputeBuildCost
+		uint first, count, firstNode, nodeCount;
+		float cost;
 	};
+	struct SBVHRef { aabb bounds; uint tri; }; // (clipped) triangle reference
 public:
 	BVH() = default;
 	BVH( class Mesh* mesh );
+	BVH( class Mesh* mesh, BVHNode* nodes, uint nodeCount, uint* idx, uint idxCount ); // wrap existing data
 	void Build();
+	void BuildSBVH( float budget = 0.3f ); // budget: fraction of extra triangle references
+	void BuildLBVH( bool optimize = false ); // Morton code BVH, for per-frame rebuilds; optimize: treelet restructuring
 	void Refit();
+	void Refit( const uint2* dirty, const int rangeCount ); // changed triangles: x = first, y = count
+	void Update( float rebuildThreshold = 1.25f ); // refit; rebuilds if the SAH cost degrades too much
+	void UpdatePartial( float rebuildThreshold = 1.25f ); // refit; rebuilds the degraded subtrees of the last Build
+	void Reorder(); // memory layout optimization; renumbers the mesh triangles
+	void ShrinkToFit(); // frees build scratch and unused nodes; a rebuild reallocates (moves) bvhNode
+	void PrecomputeTris( uint first = 0, uint count = 0xffffffff ); // updates triWoop (TRI_WOOP)
+	void BuildLeafSoA(); // updates leafSoA and leafBlock (LEAF_SOA)
 	void Intersect( Ray& ray, uint instanceIdx );
+	void Intersect( RayPacket& packet, uint instanceIdx );
+	// wide BVH: collapse the binary tree for SIMD traversal
+	void Collapse4();
+	void Collapse8();
+	void CollapseWide(); // the width that BVH_WIDTH selects; none for a binary BVH
+	void Intersect4( Ray& ray, uint instanceIdx );
+	void Intersect8( Ray& ray, uint instanceIdx );
+	// quantized 4-wide BVH, derived from the 4-wide tree
+	void CompressQ4();
+	void IntersectQ4( Ray& ray, uint instanceIdx );
+	// any hit closer than ray.hit.t, using the widest available version of the BVH
+	bool IsOccluded( const Ray& ray );
+	// tree quality, relative to the root area: SAH cost with unit traversal and intersection cost,
+	// and the summed surface area of sibling overlap (a cheap stand-in for EPO)
+	float ComputeSAHCost( uint nodeIdx = 0 ); // of the subtree at nodeIdx, relative to its root area
+	float ComputeOverlap();
+	float Degradation() { ComputeBuildCost(); return ComputeSAHCost() / buildCost; } // > 1: refitting made the tree worse
 private:
+	template <int W, class T> void CollapseNode( T* wideNode, uint* wideSlot, uint nodeIdx, uint wideIdx, uint& widePtr );
 	void Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax );
 	void UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax );
 	float FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax );
-	class Mesh* mesh = 0;
+	// data-parallel versions, for the large nodes near the root
+	void UpdateNodeBoundsParallel( uint nodeIdx, float3& centroidMin, float3& centroidMax );
+	float FindBestSplitPlaneParallel( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax );
+	uint PartitionParallel( BVHNode& node, int axis, int splitPos, float3& centroidMin, float3& centroidMax );
+	void SubdivideSBVH( uint nodeIdx, uint depth, vector<SBVHRef>& refs, float minOverlap, int& spareRefs );
+	// refitting: parent links, leaf per triangle and nodes per tree level, built after each build
+	void PrepareRefit();
+	void ComputeBuildCost(); // buildCost and the subtree costs, before the first refit after a build
+	void RefitNode( uint nodeIdx );
+	void RefitNodes( vector<vector<uint>>& levels ); // binary nodes only
+	void RefitLevels( vector<vector<uint>>& levels, bool partial );
+	template <int W, class T> void RefitWide( T* wideNode, const uint* wideSlot, vector<vector<uint>>& levels );
+	void FillLeafSoA( const BVHNode& leaf );
+	uint* nodeParent = 0, * triLeaf = 0;
+	uint* wideSlot4 = 0, * wideSlot8 = 0; // wide node and lane (idx * W + lane) per binary node, or ~0
+	ushort* nodeLevel = 0; // tree depth; not bounded by 255 for SBVH and unbalanced builds
+	uchar* nodeDirty = 0;
+	vector<vector<uint>> refitLevel;
+	bool refitReady = false;
+	uint* tmpIdx = 0; // scratch space for parallel partitioning
+	Arena scratch; // temporary data of Build and Reorder; reset when they start
+	// LBVH construction: a binary tree with interior nodes 0..N-2 and leaves N-1..2N-2, for N triangles
+	struct LBVHNode
+	{
+		float3 aabbMin; uint left;
+		float3 aabbMax; uint right;
+		uint parent, count;	// count: triangles in the subtree
+		float cost;		// SAH cost of the subtree, as in ComputeSAHCost but not normalized
+		float SurfaceArea() const { float3 e = aabbMax - aabbMin; return e.x * e.y + e.y * e.z + e.z * e.x; }
+	};
+	void OptimizeLBVH( uint nodeIdx );
+	void RestructureTreelet( uint nodeIdx );
+	LBVHNode* lbvhNode = 0;
+	SortItem* mortonCode = 0; // Morton code and triangle index, sorted
+	RadixSort sorter;
+	atomic<uint>* lbvhVisits = 0; // bottom-up pass: the second child to arrive refits the parent
+	void ReserveNodes( uint count ); // grows bvhNode to at least count nodes; contents are lost
+	uint nodeCapacity = 0; // size of bvhNode; a wrapped (cached, reordered) tree may not fit a rebuild
+	bool ownsNodes = true, ownsIdx = true; // false for wrapped data, e.g. in a mapped cache file
 public:
+	class Mesh* mesh = 0;
 	uint* triIdx = 0;
+	uint idxCount = 0; // triIdx entries; exceeds the triangle count for an SBVH
+	bool directTris = false; // triIdx is the identity (after Reorder): leaf traversal skips it
 	uint nodesUsed;
 	BVHNode* bvhNode = 0;
+	BVHNode4* bvhNode4 = 0;			// optional 4-wide version of bvhNode
+	BVHNode8* bvhNode8 = 0;			// optional 8-wide version of bvhNode
+	BVHNodeQ4* bvhNodeQ4 = 0;		// optional quantized version of bvhNode4, same indices
+	TriWoop* triWoop = 0;			// precomputed triangles, same indices as mesh->tri (TRI_WOOP)
+	TriSoA* leafSoA = 0;			// leaf triangles in blocks of LEAF_SOA (LEAF_SOA)
+	uint* leafBlock = 0;			// first block of the leaf that starts at triIdx entry i
+	uint leafBlocks = 0;
+	uint leafSoACapacity = 0, leafBlockCapacity = 0; // allocated blocks and leafBlock entries
+	uint nodes4Used = 0, nodes8Used = 0;
 	bool subdivToOnePrim = false; // for TLAS experiment
-	BuildJob buildStack[64];
-	int buildStackPtr;
+	float buildCost = 0; // SAH cost right after the last Build, BuildSBVH or BuildLBVH; 0 until needed
+	uint refitCount = 0; // refits since then
+	BuildJob buildStack[64]; // after Build: the subtrees that were built in parallel, see UpdatePartial
+	int buildStackPtr = 0;
+};
+
+// binary mesh cache file header; the header is followed by 64-byte aligned data sections
+struct MeshCacheHeader
+{
+	uint magic;			// 'BVHC'
+	uint version;		// MESH_CACHE_VERSION
+	uint layout[3];		// sizeof Tri, TriEx and BVHNode, to detect struct changes
+	uint flags;			// 1: SBVH
+	uint triCount, vertexCount, normalCount, nodeCount, idxCount;
+	uint dummy;
+	uint64_t offset[6];	// tri, triEx, P, N, bvhNode, triIdx
+	uint64_t fileSize;
 };
 
 // minimalist mesh class
@@ -101,40 +423,97 @@ public:
 	Mesh() = default;
 	Mesh( uint primCount );
 	Mesh( const char* objFile, const char* texFile );
+	Mesh* Simplify( float cellSize ); // vertex clustering; the result has its own BVH
+	void BuildLODs( uint levels ); // fills lods; each level doubles the cell size of the previous one
+	void BuildMips(); // fills texMips
+	// mip level for a ray cone of the given width at a hit on triangle triIdx, with T the
+	// transform of the instance; nearest texel of that level; see TextureLOD in cl/tools.cl
+	float TextureLOD( uint triIdx, const mat4& T, const float3& D, const float3& N, float width ) const;
+	float3 SampleTexture( float2 uv, float lod ) const;
+	float Curvature( uint triIdx, const mat4& T ) const; // world space, from the vertex normals
+private:
+	bool LoadOBJ( const char* objFile );
+	bool LoadCache( const char* cacheFile, const char* objFile );
+	void SaveCache( const char* cacheFile );
+public:
 	Tri* tri = 0;			// triangle data for intersection
 	TriEx* triEx = 0;		// triangle data for shading
 	int triCount = 0;
 	BVH* bvh = 0;
 	Surface* texture = 0;
 	float3* P = 0, * N = 0;
+	int vertexCount = 0, normalCount = 0;
+	void* cache = 0;		// memory-mapped cache file, if the mesh was loaded from one
+	vector<Mesh*> lods;		// simplified versions, coarsest last, sharing the texture
+	float lodCell = 0;		// object space cell size of a simplified mesh; 0 for the original
+	uint* texMips = 0;		// the texture and its mip levels, level after level, shared with the lods
+	uint texLevels = 0;
 };
 
-// instance of a BVH, with transform and world bounds
+// instance of a BVH, with transform and world bounds; or, for multi-level instancing, of
+// another TLAS, whose instances must all be BLAS instances (requires WIDE_INDICES).
+// A hit in a nested TLAS reports this instance, and the one inside it in hit.inner.
 class BVHInstance
 {
 public:
 	BVHInstance() = default;
 	BVHInstance( BVH* blas, uint index ) : bvh( blas ), idx( index ) { SetTransform( mat4() ); }
-	void SetTransform( mat4& transform );
+	BVHInstance( class TLAS* nested, uint index ); // the nested TLAS must be built
+	void SetTransform( const mat4& transform );
+	// batched; with 'dirty', the instances whose transform changed are marked, for UploadRing
+	static void SetTransforms( BVHInstance* instances, const mat4* transforms, uint count, class DirtyRanges* dirty = 0 );
 	mat4& GetTransform() { return transform; }
+	BVH* GetBVH() { return triOffset == NESTED_TLAS ? 0 : bvh; }
+	class TLAS* GetTLAS() { return triOffset == NESTED_TLAS ? tlas : 0; }
+	// single rays expect a valid rD, as set by TLAS::Intersect; identity and translation
+	// instances trace the ray as it is, or with a moved origin
 	void Intersect( Ray& ray );
+	void Intersect( RayPacket& packet );
+	bool IsOccluded( const Ray& ray );
+	// with another inverse transform, e.g. one interpolated for the time of the ray
+	void Intersect( Ray& ray, const mat4& inverse );
+	bool IsOccluded( const Ray& ray, const mat4& inverse );
+	enum { IDENTITY = 0, TRANSLATION, AFFINE }; // transform classes, see SetTransform
+	uint GetTransformClass() { return transformClass; }
 private:
+	void LocalBounds( float3& bmin, float3& bmax ); // of the BLAS or nested TLAS root
+	void IntersectLocal( Ray& ray ); // ray in the space of the BLAS or nested TLAS
+	bool OccludedLocal( const Ray& ray );
 	mat4 transform;
 	mat4 invTransform; // inverse transform
 public:
 	aabb bounds; // in world space
 private:
-	BVH* bvh = 0;
-	uint idx;
-	int dummy[7];
+	union { BVH* bvh = 0; class TLAS* tlas; }; // tlas if triOffset == NESTED_TLAS
+	uint idx : 30, transformClass : 2; // the class shares the word, to keep the GPU layout
+public:
+	// location of the BLAS data in the consolidated buffers of a Scene, for GPU rendering;
+	// for a nested TLAS, the location of its nodes and instances, see Scene::PackTLAS
+	uint nodeOffset = 0, idxOffset = 0, triOffset = 0;
+	uint texOffset = 0, texWidth = 0, texHeight = 0, texLevels = 1; // mip chain, see Scene
 };
 
 // top-level BVH node
 struct TLASNode
 {
-	union { struct { float dummy1[3]; uint leftRight; }; struct { float dummy3[3]; unsigned short left, right; }; float3 aabbMin; __m128 aabbMin4; };
-	union { struct { float dummy2[3]; uint BLAS; }; float3 aabbMax; __m128 aabbMax4; };
-	bool isLeaf() { return leftRight == 0; }
+	// 32-bit child indices; the root is never a child, so left == 0 marks a leaf,
+	// which stores its instance index where an interior node stores its right child
+	union { struct { float dummy1[3]; uint left; }; float3 aabbMin; __m128 aabbMin4; };
+	union { struct { float dummy2[3]; uint right; }; struct { float dummy3[3]; uint BLAS; }; float3 aabbMax; __m128 aabbMax4; };
+	bool isLeaf() { return left == 0; }
+};
+
+// element ranges of a host array that changed since the last upload
+class DirtyRanges
+{
+public:
+	struct Range { uint first, last; }; // last is exclusive
+	void Mark( uint first, uint count = 1 );
+	void Merge( const DirtyRanges& other ) { range.insert( range.end(), other.range.begin(), other.range.end() ); }
+	void Clear() { range.clear(); }
+	bool Empty() const { return range.empty(); }
+	void Coalesce( uint maxGap ); // sorts the ranges and merges those less than maxGap elements apart
+	vector<Range> range;
 };
 
 // include kD-tree logic for fast agglomerative clustering
@@ -147,26 +526,283 @@ public:
 	TLAS() = default;
 	TLAS( BVHInstance* bvhList, int N );
 	void Build();
+	void Update( float rebuildThreshold = 1.25f ); // refit and rotate; rebuilds if the SAH cost degrades too much
 	void Intersect( Ray& ray );
+	void Intersect( RayPacket& packet );
+	bool IsOccluded( const Ray& ray, const float tmax ); // shadow rays: stops at the first hit
+	// the instance whose BLAS holds a hit, with its transform to world space: for a hit in a
+	// nested TLAS, the instance inside it, combined with the transform of the nested instance
+	BVHInstance& HitInstance( const Intersection& hit, mat4& transform );
+	// tree quality, relative to the root area: SAH cost with one unit per instance, comparable
+	// to BVH::ComputeSAHCost, and the summed surface area of sibling overlap
+	float ComputeSAHCost();
+	float ComputeOverlap();
 private:
 	int FindBestMatch( int N, int A );
+	float RefitRotate( uint idx );
+	float Rotate( uint idx );
 public:
 	TLASNode* tlasNode = 0;
 	BVHInstance* blas = 0;
 	uint nodesUsed, blasCount;
 	uint* nodeIdx = 0;
+	float buildCost = 0; // normalized SAH cost right after the last full rebuild
+	DirtyRanges dirty; // nodes changed by Build, BuildQuick and Update; cleared by the user
 	// fast agglomerative clustering functionality
-	struct SortItem { float pos; uint blasIdx; };
-	void BuildQuick();
+	void BuildQuick( int algorithm = TLAS_BUILD_QUICK );
 	void SortAndSplit( uint first, uint last, uint level );
+	uint ClusterGroup( uint group );
+	void MergeGroups();
+	void BuildPLOC(); // BuildQuick algorithm 3
 	void CreateParent( uint idx, uint left, uint right );
-	static void Swap( SortItem& a, SortItem& b ) { SortItem t = a; a = b; b = t; }
-	void QuickSort( SortItem a[], int first, int last );
 	// data for fast agglomerative clustering
-	KDTree* tree[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	uint treeSize[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	SortItem* item = 0;
-	uint treeIdx = 0;
+	KDTree* kdtree = 0; // BuildQuick algorithm 0: over all instances of this TLAS
+	KDTree* tree[TLAS_MAX_GROUPS] = {};
+	uint treeFirst[TLAS_MAX_GROUPS] = {}, treeSize[TLAS_MAX_GROUPS] = {}, treeRoot[TLAS_MAX_GROUPS] = {};
+	SortItem* item = 0; // instance centroids along the split axis, with instance indices
+	Mesh* boundsMesh = 0; // BuildQuick algorithm 1: instance bounds as degenerate triangles
+	KDTree* clusterTree = 0; // BuildQuick algorithm 3: over the current clusters, in clusterNode
+	TLASNode* clusterNode = 0;
+	uint* cluster = 0, * nearest = 0; // cluster roots and their nearest neighbours (clusterNode index)
+	float* nearestSA = 0; // area of the union with the nearest neighbour
+	RadixSort sorter;
+	uint treeIdx = 0, treeLevels = 0, treeCount = 0;
+};
+
+// TLAS for motion blur: every instance has a pose at shutter open and one at shutter close,
+// and every node has bounds for both. Interpolating the transforms moves each point linearly,
+// so the interpolated bounds of a node hold its instances at any time in between. Traversal
+// interpolates bounds and transforms at the time of the ray, so a single build serves the
+// whole shutter interval. Its topology is built over the bounds swept during the interval.
+class MotionTLAS
+{
+public:
+	MotionTLAS() = default;
+	MotionTLAS( BVHInstance* open, BVHInstance* close, int N ); // instance i: same BVH in both
+	void Build(); // after changing the poses
+	void Intersect( Ray& ray );
+	bool IsOccluded( const Ray& ray, const float tmax );
+	mat4 Transform( uint instIdx, const float time ); // of instance instIdx at a time in 0..1
+	mat4 InvTransform( uint instIdx, const float time ); // its inverse, from precomputed keys
+private:
+	void RefitNode( uint nodeIdx );
+public:
+	TLAS tlas; // its node bounds are those at shutter open
+	TLASNode* closeNode = 0; // bounds of the same nodes at shutter close
+	BVHInstance* open = 0, *close = 0;
+	BVHInstance* swept = 0; // the instances of tlas: the open pose, with the bounds of both
+	mat4* invKey = 0; // per instance: inverse transforms at MOTION_KEYS + 1 evenly spaced times
+	uint count = 0;
+};
+
+// scene container for GPU rendering: packs the geometry of several meshes in consolidated
+// device buffers, so that a single kernel launch can trace instances of all of them.
+// Textures are stored as mip chains, level after level, in 32-bit texels or BC1 blocks.
+class Scene
+{
+public:
+	struct MeshOffsets { uint node, idx, tri, tex, texWidth, texHeight, texLevels; };
+	Scene() = default;
+	uint AddMesh( Mesh* mesh );
+	void SetInstances( BVHInstance* instances, uint count ); // adds unknown meshes, sets offsets
+	// points each instance at the coarsest level of its mesh (see Mesh::BuildLODs) whose cells
+	// project to less than a pixel; returns the number of instances that switched level
+	uint SelectLOD( BVHInstance* instances, uint count, const float3& camPos, float pixelAngle );
+	// GPU layout of a TLAS with nested instances: the nodes and instances of each distinct nested
+	// TLAS follow those of the top level, in new arrays of nodeCount nodes and instCount instances.
+	// All BLAS instances receive their scene offsets, the nested ones the offsets of their TLAS.
+	void PackTLAS( TLAS& tlas, TLASNode*& nodes, BVHInstance*& instances, uint& nodeCount, uint& instCount );
+	void Upload(); // creates and fills the consolidated buffers
+	void UploadTextures(); // just texData; part of Upload
+public:
+	vector<Mesh*> meshes;
+	vector<MeshOffsets> offsets;
+	uint nodeCount = 0, idxCount = 0, triCount = 0, texelCount = 0;
+	Buffer* triData = 0, *triExData = 0, *texData = 0, *bvhData = 0, *idxData = 0;
+};
+
+// out-of-core variant of Scene, for scenes whose geometry does not fit in device memory
+// (BLAS_STREAMING, template/common.h). The BLASes live on the host, typically in mapped mesh
+// cache files (MESH_CACHE), so the OS pages them in from disk; the device holds a pool of
+// fixed-size slots, each with room for the largest BLAS. Rays that reach an instance flag its
+// BLAS in a table at the start of idxData; Update reads back the flags of the last frame,
+// loads missing BLASes into free or least recently used slots, and repoints the instances.
+// Textures are small compared to the geometry and stay resident.
+class StreamingScene : public Scene
+{
+public:
+	StreamingScene() = default;
+	StreamingScene( uint slots, uint uploadsPerFrame = 8 ) : slotCount( slots ), maxUploads( uploadsPerFrame ) {}
+	void SetInstances( BVHInstance* instances, uint count ); // adds unknown meshes; none is resident
+	void Upload(); // creates the pool and the texture buffer
+	void Update(); // after a frame: services its requests; changed instances are in dirty
+private:
+	void Evict( uint s );
+	void Load( uint meshIdx, uint s );
+	void Repoint( uint meshIdx ); // sets the offsets of all instances of a mesh
+public:
+	struct Slot { int mesh = -1; uint lastUsed = 0; };
+	vector<Slot> slot;
+	vector<int> resident; // per mesh: its slot, or -1
+	vector<vector<uint>> users; // per mesh: the instances that use it
+	BVHInstance* instances = 0;
+	DirtyRanges dirty; // instances changed by Update, to be uploaded before rendering
+	uint slotCount = 64, maxUploads = 8; // pool size; BLAS uploads per Update
+	uint slotNodes = 0, slotIdx = 0, slotTris = 0; // slot capacity; slotIdx includes a header word
+	uint flagWords = 0; // size of the request table that precedes the slots in idxData
+	uint frame = 0, uploaded = 0; // BLASes loaded by the last Update, for statistics
+	uint* flags = 0; // host copy of the request table
+};
+
+// HDR environment for GPU rendering, preprocessed into a single device buffer: a header
+// (width, height, cdfWidth, cdfHeight), RGBE texels (4 bytes instead of 12), and tables for
+// importance sampling: the CDF over rows, followed by the CDF over the cells of each row.
+// Cells are 4x4 texels; their weight is luminance times sin(theta). See SampleSky in tools.cl.
+class SkyDome
+{
+public:
+	SkyDome() = default;
+	SkyDome( const float* rgb, uint w, uint h ); // uploads; rgb can be freed afterwards
+public:
+	uint width = 0, height = 0, cdfWidth = 0, cdfHeight = 0;
+	Buffer* skyData = 0;
+};
+
+// per-frame uploads that overlap with rendering: data is copied into one of two host
+// staging / device buffer pairs and written on the second queue without blocking. The
+// main queue waits for the write; the next write to a pair waits for the frame that read it.
+class UploadRing
+{
+public:
+	UploadRing() = default;
+	UploadRing( uint size );
+	// returns the device buffer for this frame; 'dirty' holds the elements (of 'stride' bytes)
+	// that changed since the previous call, and only those are copied; without it, all of 'data'
+	Buffer* Upload( const void* data, uint size, const DirtyRanges* dirty = 0, uint stride = 1 );
+	void Release(); // call after enqueueing the last kernel that reads the buffer
+private:
+	Buffer* buffer[2] = {};
+	cl_event written[2] = {}, released[2] = {};
+	DirtyRanges pending[2]; // changes not yet written to each pair
+	bool valid[2] = {}; // the pair has received a full upload
+	uint slot = 1;
+};
+
+// GPU TLAS construction (LBVH) over instance bounds that already reside on the device
+class GPUTLAS
+{
+public:
+	GPUTLAS() = default;
+	GPUTLAS( Buffer* boundsData, Buffer* nodeData, uint N );
+	void Build(); // enqueues the build; does not wait for completion
+public:
+	Buffer* instBounds = 0;	// per instance: float4 aabbMin, float4 aabbMax, in world space
+	Buffer* tlasNodes = 0;	// receives 2 * count - 1 TLASNodes
+	uint count = 0, paddedCount = 0;
+private:
+	Buffer* keys = 0, *values = 0, *parent = 0, *counter = 0, *bounds = 0;
+	Kernel* sceneBounds = 0, *mortonCodes = 0, *bitonicSort = 0, *buildHierarchy = 0, *refitHierarchy = 0;
+};
+
+// GPU BLAS construction (LBVH): GPUTLAS builds a tree over the triangle bounds, which is then
+// converted to the BVHNode layout, with one triangle per leaf; see BVH::BuildLBVH for the CPU version
+class GPUBVH
+{
+public:
+	GPUBVH() = default;
+	GPUBVH( Buffer* triData, Buffer* nodeData, Buffer* idxData, uint triCount );
+	void Build(); // enqueues the build; does not wait for completion
+public:
+	Buffer* tris = 0;	// Tri array on the device
+	Buffer* bvhNodes = 0;	// receives 2 * count BVHNodes; node 1 stays unused
+	Buffer* triIdx = 0;	// receives count triangle indices
+	uint count = 0;
+private:
+	Buffer* triBounds = 0, *treeNodes = 0;
+	GPUTLAS* builder = 0;
+	Kernel* triangleBounds = 0, *emitBVH = 0;
+};
+
+// wavefront path tracer: separate generate / extend / shade / connect kernels that
+// communicate via ray buffers in device memory; see cl/wavefront.cl
+class WavefrontTracer
+{
+public:
+	WavefrontTracer() = default;
+	WavefrontTracer( uint samples, uint depth );
+	void Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+		const float3 camPos, const float3 p0, const float3 p1, const float3 p2 ); // enqueues all stages
+public:
+	uint samplesPerPixel = 1, maxDepth = 4, pathCount = 0;
+	bool reorder = false; // sort extension rays by octant and origin cell before each bounce
+private:
+	Buffer* rays[3] = {}, *hits = 0, *shadowRays = 0, *accumulator = 0, *counter = 0, *bins = 0;
+	Kernel* generate = 0, *extend = 0, *shade = 0, *connect = 0, *finalize = 0;
+	Kernel* binRays = 0, *scanBins = 0, *scatterRays = 0;
+};
+
+// denoised rendering at one sample per pixel: renderGuides in cl/raytracer.cl writes the
+// noisy color with the normal, depth and albedo of the primary hit; cl/denoise.cl then
+// accumulates the lighting over frames with reprojection, filters it with an edge-avoiding
+// a-trous wavelet and multiplies it by the albedo, into the render target
+class Denoiser
+{
+public:
+	Denoiser() = default;
+	Denoiser( Kernel* renderKernel );
+	void Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+		const float3 camPos, const float3 p0, const float3 p1, const float3 p2 ); // enqueues all stages
+	void Reset() { frame = 0; } // discards the history, e.g. after a camera cut
+public:
+	uint iterations = 5;	// a-trous filter steps; iteration i skips 2^i - 1 pixels between taps
+	uint maxHistory = 32;	// frames in the temporal average, at most
+	float sigmaColor = 1;	// color tolerance of the first iteration, for one frame of history
+private:
+	Buffer* color = 0, *albedo = 0, *normalDepth[2] = {}, *history[2] = {}, *filtered[2] = {};
+	Kernel* guides = 0, *reproject = 0, *atrous = 0, *compose = 0;
+	float3 prevCamPos, prevP0, prevP1, prevP2; // camera of the previous frame, for reprojection
+	uint frame = 0;
+};
+
+// hybrid CPU + GPU rendering: the render kernel of cl/raytracer.cl draws the top rows of
+// the screen, while CPU threads trace the remaining rows through the TLAS, using the host
+// copies of the scene and sky data. The split follows the measured throughput of both.
+class HybridRenderer
+{
+public:
+	HybridRenderer() = default;
+	HybridRenderer( Kernel* renderKernel );
+	void Render( Buffer* target, Buffer* skyData, Scene& scene, TLAS& tlas, Buffer* tlasData, Buffer* instData,
+		const float3 camPos, const float3 p0, const float3 p1, const float3 p2 ); // waits for the GPU
+public:
+	uint gpuRows = SCRHEIGHT / 2;
+	float cpuRate = 0, gpuRate = 0; // rows per millisecond, smoothed
+private:
+	float3 Trace( Ray& ray, const uint* sky, TLAS& tlas );
+	Kernel* tracer = 0, *copyRows = 0;
+	uint frame = 0; // varies the CPU sample positions per frame
+	Buffer* cpuPixels = 0; // rows rendered by the CPU, starting at row gpuRows
+};
+
+// multi-GPU rendering on a MULTI_DEVICE context (template/common.h): device 0 renders the top
+// band of rows into the render target; every other device renders a band with renderTile,
+// which device 0 copies into the target. Buffers belong to the shared context, so the runtime
+// replicates the scene data on each device. Band heights follow the measured kernel times.
+class MultiGPURenderer
+{
+public:
+	MultiGPURenderer() = default;
+	MultiGPURenderer( Kernel* renderKernel );
+	void Render( Buffer* target, Buffer* skyData, Scene& scene, Buffer* tlasData, Buffer* instData,
+		const float3 camPos, const float3 p0, const float3 p1, const float3 p2 ); // waits for all devices
+public:
+	uint deviceCount = 1;
+	vector<uint> firstRow;	// band of device i: rows firstRow[i] .. firstRow[i + 1] - 1
+	vector<float> rate;		// rows per millisecond, smoothed
+private:
+	Kernel* tracer = 0, *tileTracer = 0, *copyTile = 0;
+	vector<Buffer*> band;	// float4 pixels of the band of each device but the first
+	bool replicated = false;
 };
 
 } // namespace Tmpl8
@@ -0,0 +1,165 @@
+#include "template/common.h"
+#include "cl/tools.cl"
+
+// instance transforms for the flock of dragons, computed on the GPU so that
+// only boid positions and velocities need to be uploaded every frame.
+// Matches Translate( p ) * LookAt( p, p + dir, up ) * Scale( s ) on the host.
+void SetInstance( const float3 boidPos, const float3 boidDir, __global struct BVHInstance* inst,
+	__global float4* bounds, const float3 blasMin, const float3 blasMax, const float scale )
+{
+	const float3 p = boidPos * 0.1f;
+	const float3 dir = normalize( boidDir );
+	// rows of R^T, where R = [right, newUp, dir] is the orientation from LookAt
+	float3 r0 = cross( (float3)(0, 1, 0), dir ), r1, r2 = dir, t;
+	if (dot( r0, r0 ) == 0)
+	{
+		// LookAt falls back to identity when dir is parallel to up
+		r0 = (float3)(1, 0, 0), r1 = (float3)(0, 1, 0), r2 = (float3)(0, 0, 1), t = p;
+	}
+	else
+	{
+		r0 = normalize( r0 ), r1 = cross( dir, r0 );
+		// world = s * R^T * local + p - R^T * p
+		t = p - (float3)(dot( r0, p ), dot( r1, p ), dot( r2, p ));
+	}
+	inst->transform = (float16)(
+		r0 * scale, t.x,
+		r1 * scale, t.y,
+		r2 * scale, t.z,
+		0, 0, 0, 1
+	);
+	// inverse: local = (R * world - R * t) / s
+	const float is = 1.0f / scale;
+	const float3 c0 = (float3)(r0.x, r1.x, r2.x), c1 = (float3)(r0.y, r1.y, r2.y), c2 = (float3)(r0.z, r1.z, r2.z);
+	inst->invTransform = (float16)(
+		c0 * is, -dot( c0, t ) * is,
+		c1 * is, -dot( c1, t ) * is,
+		c2 * is, -dot( c2, t ) * is,
+		0, 0, 0, 1
+	);
+	// world space bounds of the transformed BLAS root
+	float3 bmin = (float3)(1e30f), bmax = (float3)(-1e30f);
+	for (int i = 0; i < 8; i++)
+	{
+		const float3 P = (float3)(i & 1 ? blasMax.x : blasMin.x, i & 2 ? blasMax.y : blasMin.y, i & 4 ? blasMax.z : blasMin.z);
+		const float3 W = (float3)(dot( r0, P ) * scale, dot( r1, P ) * scale, dot( r2, P ) * scale) + t;
+		bmin = min( bmin, W ), bmax = max( bmax, W );
+	}
+	bounds[0] = (float4)(bmin, 0);
+	bounds[1] = (float4)(bmax, 0);
+}
+
+__kernel void updateBoids( __global float4* boidData, __global struct BVHInstance* instData,
+	__global float4* instBounds, float3 blasMin, float3 blasMax, float scale, int N )
+{
+	const int idx = get_global_id( 0 );
+	if (idx >= N) return;
+	SetInstance( boidData[idx * 2].xyz, boidData[idx * 2 + 1].xyz, &instData[idx], &instBounds[idx * 2], blasMin, blasMax, scale );
+}
+
+// flock simulation on the GPU, following struct Flock in beyond.cpp. Boids are sorted
+// into a uniform grid of 16^3 cells over [-256..256]^3 using a counting sort; the grid
+// spans 32^3 cells, so the neighbourhood of a boid is a 5x5x5 block of cells.
+#define BOID_GRID	32
+#define BOID_CELLS	(BOID_GRID * BOID_GRID * BOID_GRID)
+#define MAX_SPEED	1.0f
+#define MAX_FORCE	0.03f
+
+int3 BoidCell( const float3 p )
+{
+	return clamp( convert_int3( (p + 256) * 0.0625f ), 0, BOID_GRID - 1 );
+}
+
+float3 Limit( const float3 v, const float maxLength )
+{
+	return dot( v, v ) > maxLength * maxLength ? normalize( v ) * maxLength : v;
+}
+
+// step 1: cell population; cellCount must be zero on entry
+__kernel void countCells( __global float4* boidData, __global uint* cellOf, __global uint* cellCount, int N )
+{
+	const int idx = get_global_id( 0 );
+	if (idx >= N) return;
+	const int3 c = BoidCell( boidData[idx * 2].xyz );
+	atomic_inc( &cellCount[cellOf[idx] = c.x + c.y * BOID_GRID + c.z * BOID_GRID * BOID_GRID] );
+}
+
+// step 2: exclusive prefix sum over the cells; a single work group of 256 threads.
+// cellCount is replaced by the first free slot of each cell, for the scatter.
+__kernel void scanCells( __global uint* cellCount, __global uint* cellStart, int N )
+{
+	__local uint partial[256];
+	const int lid = get_local_id( 0 ), first = lid * (BOID_CELLS / 256);
+	uint sum = 0;
+	for (int i = 0; i < BOID_CELLS / 256; i++) sum += cellCount[first + i];
+	partial[lid] = sum;
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (lid == 0) for (int i = 0, s = 0; i < 256; i++) { const uint n = partial[i]; partial[i] = s, s += n; }
+	barrier( CLK_LOCAL_MEM_FENCE );
+	sum = partial[lid];
+	for (int i = 0; i < BOID_CELLS / 256; i++)
+	{
+		const uint n = cellCount[first + i];
+		cellStart[first + i] = cellCount[first + i] = sum, sum += n;
+	}
+	if (lid == 0) cellStart[BOID_CELLS] = N;
+}
+
+// step 3: copy the boids into cell order
+__kernel void scatterBoids( __global float4* boidData, __global uint* cellOf, __global uint* cellCount,
+	__global float4* sortedData, int N )
+{
+	const int idx = get_global_id( 0 );
+	if (idx >= N) return;
+	const uint j = atomic_inc( &cellCount[cellOf[idx]] );
+	sortedData[j * 2] = boidData[idx * 2];
+	sortedData[j * 2 + 1] = boidData[idx * 2 + 1];
+}
+
+// step 4: steering, integration and the instance transform of each boid
+__kernel void simulateBoids( __global float4* boidData, __global float4* sortedData, __global uint* cellStart,
+	__global float4* newBoidData, __global struct BVHInstance* instData, __global float4* instBounds,
+	float3 food, float3 blasMin, float3 blasMax, float scale, int N )
+{
+	const int idx = get_global_id( 0 );
+	if (idx >= N) return;
+	const float3 position = boidData[idx * 2].xyz;
+	float3 velocity = boidData[idx * 2 + 1].xyz;
+	// gather separation, alignment and cohesion input in a single pass
+	float3 separation = (float3)(0), velocitySum = (float3)(0), positionSum = (float3)(0);
+	int separating = 0, neighbours = 0;
+	const int3 c = convert_int3( (position + 256) * 0.0625f );
+	const int3 c1 = max( c - 2, 0 ), c2 = min( c + 2, BOID_GRID - 1 );
+	for (int z = c1.z; z <= c2.z; z++) for (int y = c1.y; y <= c2.y; y++)
+	{
+		// cells c1.x..c2.x of a row are adjacent in the sorted array
+		const int row = y * BOID_GRID + z * BOID_GRID * BOID_GRID;
+		const uint last = cellStart[row + c2.x + 1];
+		for (uint j = cellStart[row + c1.x]; j < last; j++)
+		{
+			const float3 other = sortedData[j * 2].xyz, d = position - other;
+			const float d2 = dot( d, d );
+			if (d2 <= 0 || d2 >= 80 * 80) continue;
+			velocitySum += sortedData[j * 2 + 1].xyz, positionSum += other, neighbours++;
+			if (d2 <= 35 * 35) separation += d * (1.0f / d2), separating++;
+		}
+	}
+	// steering; same weights and order as Flock::Boid::Tick
+	if (dot( separation, separation ) > 0)
+		velocity += Limit( normalize( separation * (1.0f / separating) ) * MAX_SPEED - velocity, MAX_FORCE ) * 2.5f;
+	if (neighbours > 0)
+	{
+		velocity += Limit( normalize( velocitySum * (1.0f / neighbours) ) * MAX_SPEED - velocity, MAX_FORCE );
+		velocity += Limit( normalize( positionSum * (1.0f / neighbours) - position ) * MAX_SPEED - velocity, MAX_FORCE ) * 0.3f;
+	}
+	velocity += Limit( normalize( food - position ) * MAX_SPEED - velocity, MAX_FORCE ) * 0.05f;
+	velocity = Limit( velocity, MAX_SPEED );
+	float3 newpos = position + velocity;
+	newpos = select( newpos, (float3)(249.9f), newpos < -249.9f );
+	newpos = select( newpos, (float3)(-249.9f), newpos > 249.9f );
+	newBoidData[idx * 2] = (float4)(newpos, 0);
+	newBoidData[idx * 2 + 1] = (float4)(velocity, 0);
+	SetInstance( newpos, velocity, &instData[idx], &instBounds[idx * 2], blasMin, blasMax, scale );
+}
+
+// EOF
\ No newline at end of file
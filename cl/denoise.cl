@@ -0,0 +1,97 @@
+#include "template/common.h"
+
+// Denoiser for low sample counts (see Denoiser in bvh.h): the noisy color of renderGuides
+// in cl/raytracer.cl is divided by the albedo of the primary hit, so that the filters blur
+// the lighting but not the texture. The result is accumulated over frames where the
+// reprojected history is consistent, and then filtered spatially with an edge-avoiding
+// a-trous wavelet (Dammertz et al., 2010), guided by the normals and depths. As in SVGF
+// (Schied et al., 2017), but without the variance estimate: the color tolerance shrinks
+// with the number of accumulated frames, and halves with every filter iteration.
+
+// temporal accumulation: the history of a pixel is found by projecting its primary hit
+// into the previous frame; it is rejected if depth or normal there do not match, e.g. for
+// disocclusions and moving objects. w: number of frames in the history, up to maxHistory;
+// a maxHistory of 0 discards the history.
+__kernel void reproject(
+	__global float4* color, __global float4* normalDepth, __global float4* albedo,
+	__global float4* prevNormalDepth, __global float4* history, __global float4* accumulated,
+	float3 camPos, float3 p0, float3 p1, float3 p2,
+	float3 prevCamPos, float3 prevP0, float3 prevP1, float3 prevP2, int maxHistory
+)
+{
+	const int threadIdx = get_global_id( 0 );
+	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
+	const int x = threadIdx % SCRWIDTH, y = threadIdx / SCRWIDTH;
+	const float4 nd = normalDepth[threadIdx];
+	// demodulate
+	const float3 c = color[threadIdx].xyz / fmax( albedo[threadIdx].xyz, (float3)( 0.01f, 0.01f, 0.01f ) );
+	float4 prev = (float4)( 0, 0, 0, 0 );
+	if (nd.w < 1e30f && maxHistory > 0)
+	{
+		// world space position of the primary hit, through the center of the pixel
+		const float3 pixelPos = p0 + (p1 - p0) * ((x + 0.5f) / SCRWIDTH) + (p2 - p0) * ((y + 0.5f) / SCRHEIGHT);
+		const float3 P = camPos + normalize( pixelPos - camPos ) * nd.w;
+		// intersect the line from the previous camera position with the previous screen plane
+		const float3 e1 = prevP1 - prevP0, e2 = prevP2 - prevP0, n = cross( e1, e2 );
+		const float3 D = P - prevCamPos;
+		const float t = dot( prevP0 - prevCamPos, n ) / dot( D, n );
+		const float3 S = prevCamPos + D * t - prevP0;
+		const int px = (int)floor( dot( S, e1 ) / dot( e1, e1 ) * SCRWIDTH );
+		const int py = (int)floor( dot( S, e2 ) / dot( e2, e2 ) * SCRHEIGHT );
+		if (t > 0 && px >= 0 && py >= 0 && px < SCRWIDTH && py < SCRHEIGHT)
+		{
+			// the previous depth is measured from the previous camera position
+			const int prevIdx = px + py * SCRWIDTH;
+			const float4 prevND = prevNormalDepth[prevIdx];
+			const float dist = length( D );
+			if (fabs( prevND.w - dist ) < 0.05f * dist && dot( prevND.xyz, nd.xyz ) > 0.9f)
+				prev = history[prevIdx], prev.w = min( prev.w, (float)maxHistory );
+		}
+	}
+	// exponential moving average; a young history is a plain average
+	const float alpha = 1.0f / (prev.w + 1);
+	accumulated[threadIdx] = (float4)( mix( prev.xyz, c, alpha ), prev.w + 1 );
+}
+
+// one iteration of the a-trous wavelet: a 5x5 B3 spline kernel with holes of 'step' pixels;
+// each tap is weighted by the similarity of its normal, depth and color to those of the
+// center pixel. Sky pixels are not filtered, and do not contribute to geometry.
+__kernel void atrous( __global float4* in, __global float4* out, __global float4* normalDepth,
+	int step, float sigmaColor )
+{
+	const int threadIdx = get_global_id( 0 );
+	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
+	const int x = threadIdx % SCRWIDTH, y = threadIdx / SCRWIDTH;
+	const float4 center = in[threadIdx], nd = normalDepth[threadIdx];
+	if (nd.w == 1e30f) { out[threadIdx] = center; return; }
+	// the noise of the accumulated color drops with the square root of the frame count
+	const float sigma = sigmaColor / sqrt( center.w );
+	const float h[3] = { 3 / 8.0f, 1 / 4.0f, 1 / 16.0f };
+	float3 sum = (float3)( 0, 0, 0 );
+	float weightSum = 0;
+	for (int v = -2; v <= 2; v++) for (int u = -2; u <= 2; u++)
+	{
+		const int sx = x + u * step, sy = y + v * step;
+		if (sx < 0 || sy < 0 || sx >= SCRWIDTH || sy >= SCRHEIGHT) continue;
+		const int idx = sx + sy * SCRWIDTH;
+		const float4 c = in[idx], q = normalDepth[idx];
+		const float3 dc = c.xyz - center.xyz;
+		const float wn = pown( fmax( dot( nd.xyz, q.xyz ), 0.0f ), 64 );
+		const float wz = exp( -fabs( nd.w - q.w ) / (0.01f * nd.w * step) );
+		const float wc = exp( -dot( dc, dc ) / (sigma * sigma) );
+		const float w = h[abs( u )] * h[abs( v )] * wn * wz * wc;
+		sum += c.xyz * w, weightSum += w;
+	}
+	out[threadIdx] = (float4)( sum / weightSum, center.w );
+}
+
+// remodulate: the filtered lighting times the albedo of the primary hit
+__kernel void compose( write_only image2d_t target, __global float4* filtered, __global float4* albedo )
+{
+	const int threadIdx = get_global_id( 0 );
+	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
+	const float3 color = filtered[threadIdx].xyz * albedo[threadIdx].xyz;
+	write_imagef( target, (int2)(threadIdx % SCRWIDTH, threadIdx / SCRWIDTH), (float4)( color, 1 ) );
+}
+
+// EOF
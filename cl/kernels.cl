@@ -12,7 +12,7 @@ struct Intersection
 {
 	float t;			// intersection distance along ray
 	float u, v;			// barycentric coordinates of the intersection
-	uint instPrim;		// instance index (12 bit) and primitive index (20 bit)
+	instprim instPrim;	// instance and primitive index, see INST_PRIM in common.h
 };
 
 struct Ray
@@ -49,9 +49,9 @@ struct BVHNode
 struct TLASNode
 {
 	float minx, miny, minz;
-	uint leftRight; // 2x16 bits
+	uint left;	// 0 for a leaf
 	float maxx, maxy, maxz;
-	uint BLAS;
+	uint right;	// instance index for a leaf
 };
 
 struct BVHInstance
@@ -63,7 +63,7 @@ struct BVHInstance
 	uint dummy[6];
 };
 
-void IntersectTri( struct Ray* ray, struct Tri* tri, const uint instPrim )
+void IntersectTri( struct Ray* ray, struct Tri* tri, const instprim instPrim )
 {
 	float3 v0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
 	float3 v1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
@@ -108,8 +108,8 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 		{
 			for (uint i = 0; i < node->triCount; i++)
 			{
-				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
-				IntersectTri( ray, &tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+				instprim instPrim = INST_PRIM( instanceIdx, triIdx[node->leftFirst + i] );
+				IntersectTri( ray, &tri[PRIM_IDX( instPrim )], instPrim );
 			}
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
@@ -0,0 +1,190 @@
+#include "template/common.h"
+#include "cl/tools.cl"
+
+// GPU construction of a TLAS over instance bounds (or of a BLAS over triangle bounds, see
+// the last two kernels), following Karras, 2012,
+// "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees".
+// Input: per-instance world space bounds, as pairs of float4 (min, max).
+// Output: a TLASNode array in the layout expected by TLASIntersect: the root
+// is node 0, internal node i is stored at i, leaf i is stored at N - 1 + i.
+
+// floats encoded as uints that sort in the same order, for atomic min/max
+uint FloatToOrdered( float f ) { uint u = as_uint( f ); return (u & 0x80000000) ? ~u : (u | 0x80000000); }
+float OrderedToFloat( uint u ) { return as_float( (u & 0x80000000) ? (u & 0x7fffffff) : ~u ); }
+
+// spread the lower 10 bits of v so that there are two zero bits between each bit
+uint ExpandBits( uint v )
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// length of the common key prefix of sorted entries i and j; -1 if j is out of range
+int Delta( __global uint* keys, int N, int i, int j )
+{
+	if (j < 0 || j >= N) return -1;
+	uint a = keys[i], b = keys[j];
+	if (a == b) return 32 + clz( (uint)i ^ (uint)j ); // duplicate keys: use the index as tie breaker
+	return clz( a ^ b );
+}
+
+// step 1: bounds of the instance centroids, stored as 6 ordered uints (min xyz, max xyz)
+__kernel void sceneBounds( __global float4* instBounds, __global uint* bounds, int N )
+{
+	__local uint localBounds[6];
+	const int idx = get_global_id( 0 ), lid = get_local_id( 0 );
+	if (lid < 3) localBounds[lid] = 0xffffffff; else if (lid < 6) localBounds[lid] = 0;
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (idx < N)
+	{
+		const float4 c = (instBounds[idx * 2] + instBounds[idx * 2 + 1]) * 0.5f;
+		atomic_min( &localBounds[0], FloatToOrdered( c.x ) );
+		atomic_min( &localBounds[1], FloatToOrdered( c.y ) );
+		atomic_min( &localBounds[2], FloatToOrdered( c.z ) );
+		atomic_max( &localBounds[3], FloatToOrdered( c.x ) );
+		atomic_max( &localBounds[4], FloatToOrdered( c.y ) );
+		atomic_max( &localBounds[5], FloatToOrdered( c.z ) );
+	}
+	barrier( CLK_LOCAL_MEM_FENCE );
+	if (lid < 3) atomic_min( &bounds[lid], localBounds[lid] );
+	else if (lid < 6) atomic_max( &bounds[lid], localBounds[lid] );
+}
+
+// step 2: 30-bit Morton codes of the instance centroids; padding entries sort last
+__kernel void mortonCodes( __global float4* instBounds, __global uint* bounds,
+	__global uint* keys, __global uint* values, int N )
+{
+	const int idx = get_global_id( 0 );
+	if (idx >= N) { keys[idx] = 0xffffffff, values[idx] = 0; return; }
+	const float3 bmin = (float3)(OrderedToFloat( bounds[0] ), OrderedToFloat( bounds[1] ), OrderedToFloat( bounds[2] ));
+	const float3 bmax = (float3)(OrderedToFloat( bounds[3] ), OrderedToFloat( bounds[4] ), OrderedToFloat( bounds[5] ));
+	const float3 extent = max( bmax - bmin, (float3)(1e-20f) );
+	const float3 c = ((instBounds[idx * 2] + instBounds[idx * 2 + 1]) * 0.5f).xyz;
+	const float3 p = clamp( (c - bmin) / extent * 1023.0f, 0.0f, 1023.0f );
+	keys[idx] = (ExpandBits( (uint)p.x ) << 2) | (ExpandBits( (uint)p.y ) << 1) | ExpandBits( (uint)p.z );
+	values[idx] = idx;
+}
+
+// step 3: one pass of a bitonic sort over a power of two number of key/value pairs
+__kernel void bitonicSort( __global uint* keys, __global uint* values, int j, int k )
+{
+	const uint i = get_global_id( 0 ), l = i ^ j;
+	if (l <= i) return;
+	const uint ki = keys[i], kl = keys[l];
+	const bool ascending = (i & k) == 0;
+	if (ascending ? (ki > kl) : (ki < kl))
+	{
+		keys[i] = kl, keys[l] = ki;
+		const uint v = values[i];
+		values[i] = values[l], values[l] = v;
+	}
+}
+
+// step 4: topology of the tree; one thread per sorted instance
+__kernel void buildHierarchy( __global uint* keys, __global uint* values, __global float4* instBounds,
+	__global struct TLASNode* tlasNode, __global uint* parent, __global uint* counter,
+	__global uint* bounds, int N )
+{
+	const int i = get_global_id( 0 );
+	if (i >= N) return;
+	// leaf node for this instance
+	const uint inst = values[i];
+	__global struct TLASNode* leaf = &tlasNode[N - 1 + i];
+	const float4 lmin = instBounds[inst * 2], lmax = instBounds[inst * 2 + 1];
+	leaf->minx = lmin.x, leaf->miny = lmin.y, leaf->minz = lmin.z, leaf->left = 0;
+	leaf->maxx = lmax.x, leaf->maxy = lmax.y, leaf->maxz = lmax.z, leaf->right = inst;
+	if (i == 0)
+	{
+		parent[0] = 0xffffffff;
+		// the scene bounds have been consumed; reset them for the next build
+		bounds[0] = bounds[1] = bounds[2] = 0xffffffff;
+		bounds[3] = bounds[4] = bounds[5] = 0;
+	}
+	if (i == N - 1) return; // there are only N - 1 interior nodes
+	// determine the direction and range of keys covered by interior node i
+	const int d = (Delta( keys, N, i, i + 1 ) - Delta( keys, N, i, i - 1 )) > 0 ? 1 : -1;
+	const int deltaMin = Delta( keys, N, i, i - d );
+	int lmaxRange = 2;
+	while (Delta( keys, N, i, i + lmaxRange * d ) > deltaMin) lmaxRange *= 2;
+	int l = 0;
+	for (int t = lmaxRange >> 1; t > 0; t >>= 1) if (Delta( keys, N, i, i + (l + t) * d ) > deltaMin) l += t;
+	const int j = i + l * d, deltaNode = Delta( keys, N, i, j );
+	// find the split position using binary search
+	int s = 0, t = l;
+	do
+	{
+		t = (t + 1) >> 1;
+		if (Delta( keys, N, i, i + (s + t) * d ) > deltaNode) s += t;
+	} while (t > 1);
+	const int gamma = i + s * d + min( d, 0 );
+	const uint left = min( i, j ) == gamma ? (N - 1 + gamma) : gamma;
+	const uint right = max( i, j ) == gamma + 1 ? (N + gamma) : (gamma + 1);
+	tlasNode[i].left = left, tlasNode[i].right = right;
+	parent[left] = parent[right] = i;
+	counter[i] = 0;
+}
+
+// step 5: bottom-up bounds propagation; the second thread to reach a node processes it
+__kernel void refitHierarchy( volatile __global struct TLASNode* tlasNode, __global uint* parent,
+	volatile __global uint* counter, int N )
+{
+	const int i = get_global_id( 0 );
+	if (i >= N || N < 2) return;
+	uint nodeIdx = parent[N - 1 + i];
+	while (nodeIdx != 0xffffffff)
+	{
+		mem_fence( CLK_GLOBAL_MEM_FENCE );
+		if (atomic_inc( &counter[nodeIdx] ) == 0) return; // sibling subtree is not done yet
+		volatile __global struct TLASNode* node = &tlasNode[nodeIdx];
+		volatile __global struct TLASNode* a = &tlasNode[node->left];
+		volatile __global struct TLASNode* b = &tlasNode[node->right];
+		node->minx = min( a->minx, b->minx ), node->miny = min( a->miny, b->miny );
+		node->minz = min( a->minz, b->minz ), node->maxx = max( a->maxx, b->maxx );
+		node->maxy = max( a->maxy, b->maxy ), node->maxz = max( a->maxz, b->maxz );
+		nodeIdx = parent[nodeIdx];
+	}
+}
+
+// BLAS construction: the triangle bounds are the input for the steps above
+__kernel void triangleBounds( __global struct Tri* tri, __global float4* triBounds, int N )
+{
+	const int i = get_global_id( 0 );
+	if (i >= N) return;
+	const float4 v0 = (float4)(tri[i].v0x, tri[i].v0y, tri[i].v0z, 0);
+	const float4 v1 = (float4)(tri[i].v1x, tri[i].v1y, tri[i].v1z, 0);
+	const float4 v2 = (float4)(tri[i].v2x, tri[i].v2y, tri[i].v2z, 0);
+	triBounds[i * 2] = min( min( v0, v1 ), v2 ), triBounds[i * 2 + 1] = max( max( v0, v1 ), v2 );
+}
+
+// conversion of the tree to the BVHNode layout: the root is node 0, node 1 is unused and the
+// children of interior node i are nodes 2 + 2 * i and 3 + 2 * i; one triangle per leaf
+__kernel void emitBVH( __global struct TLASNode* tree, __global struct BVHNode* bvhNode, __global uint* triIdx, int N )
+{
+	const int i = get_global_id( 0 );
+	if (i >= N) return;
+	triIdx[i] = tree[N - 1 + i].right;
+	if (i == 0)
+	{
+		__global struct BVHNode* root = &bvhNode[0];
+		root->minx = tree[0].minx, root->miny = tree[0].miny, root->minz = tree[0].minz;
+		root->maxx = tree[0].maxx, root->maxy = tree[0].maxy, root->maxz = tree[0].maxz;
+		root->leftFirst = N == 1 ? 0 : 2, root->triCount = N == 1 ? 1 : 0;
+	}
+	if (i == N - 1) return; // there are only N - 1 interior nodes
+	const uint child[2] = { tree[i].left, tree[i].right };
+	for (int side = 0; side < 2; side++)
+	{
+		__global struct TLASNode* c = &tree[child[side]];
+		__global struct BVHNode* node = &bvhNode[2 + 2 * i + side];
+		node->minx = c->minx, node->miny = c->miny, node->minz = c->minz;
+		node->maxx = c->maxx, node->maxy = c->maxy, node->maxz = c->maxz;
+		const bool leaf = child[side] >= N - 1;
+		node->leftFirst = leaf ? (child[side] - (N - 1)) : (2 + 2 * child[side]);
+		node->triCount = leaf ? 1 : 0;
+	}
+}
+
+// EOF
\ No newline at end of file
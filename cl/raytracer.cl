@@ -1,19 +1,33 @@
 #include "template/common.h"
 #include "cl/tools.cl"
 
-__constant float3 lightPos = (float3)(3, 10, 2);
-__constant float3 lightColor = (float3)(150, 150, 120);
-__constant float3 ambient = (float3)(0.2f, 0.2f, 0.4f);
+// diffuse surfaces receive sky light via one importance-sampled shadow ray, instead of
+// the constant ambient term; needs several samples per pixel to converge (offline.cpp)
+// #define SKY_LIGHT
 
-float3 Trace( struct Ray* ray, float* skyPixels, 
+// minimal depth renderer for performance experiments, instead of the default renderer
+// #define DEPTH_ONLY
+
+// normal, depth and albedo of the primary hit, for the denoiser (see renderGuides)
+struct Guides
+{
+	float3 N, albedo;
+	float depth; // distance along the primary ray; 1e30f for the sky
+};
+
+// spread: angle of the ray cone of a pixel, for texture LOD selection; the footprint grows
+// with the distance along the path, and curved mirrors change the spread of the reflection.
+// guides: if not 0, receives the guides of the primary hit
+float3 Trace( struct Ray* ray, float spread, uint* seed, uint* skyPixels, 
 	struct BVHInstance* instData, struct TLASNode* tlasData,
 	uint* texData, struct Tri* triData, struct TriEx* triExData,
-	struct BVHNode* bvhNodeData, uint* idxData 
+	struct BVHNode* bvhNodeData, uint* idxData, struct Guides* guides
 )
 {
-#if 1
+#ifndef DEPTH_ONLY
 	// default renderer
 	int rayDepth = 0;
+	float width = 0; // of the ray cone at the ray origin
 	float3 R;
 	// bounce until we hit the sky or a diffuse surface
 	while (rayDepth < 2)
@@ -26,28 +40,33 @@ float3 Trace( struct Ray* ray, float* skyPixels,
 			return SampleSky( &ray->D, skyPixels );
 		}
 		// calculate texture uv based on barycentrics
-		uint triIdx = i.instPrim & 0xfffff;
-		uint instIdx = i.instPrim >> 20;
-		struct TriEx* tri = triExData + triIdx;
+		uint triIdx = PRIM_IDX( i.instPrim );
+		uint instIdx = INST_IDX( i.instPrim );
+		struct BVHInstance* inst = instData + instIdx, *outer = 0;
+	#ifdef WIDE_INDICES
+		// nested TLAS: shade with the instance inside it, see NestedIntersect
+		if (inst->triOffset == NESTED_TLAS) outer = inst, inst = instData + outer->idxOffset + i.inner;
+	#endif
+		struct TriEx* tri = triExData + inst->triOffset + triIdx;
 		float2 uv = i.u * tri->uv1 + i.v * tri->uv2 + (1 - (i.u + i.v)) * tri->uv0;
-		int iu = (int)(uv.x * 1024) & 1023;
-		int iv = (int)(uv.y * 1024) & 1023;
-		uint texel = texData[iu + (iv << 10)];
-		float3 albedo = RGB8toRGB32F( texel );
 		// calculate the normal for the intersection
 		float3 N0 = (float3)( tri->N0x, tri->N0y, tri->N0z );
 		float3 N1 = (float3)( tri->N1x, tri->N1y, tri->N1z );
 		float3 N2 = (float3)( tri->N2x, tri->N2y, tri->N2z );
 		float3 N = i.u * N1 + i.v * N2 + (1 - (i.u + i.v)) * N0;
-		N = normalize( TransformVector( &N, &instData[instIdx].transform ) );
+		N = normalize( TransformVector( &N, &inst->transform ) );
+		if (outer) N = normalize( TransformVector( &N, &outer->transform ) );
+		if (guides && rayDepth == 0) guides->N = N, guides->depth = i.t;
+		width += spread * i.t;
 		float3 I = ray->O + (ray->D * i.t);
 		// shading
-		bool mirror = (instIdx * 17) & 1;
+		bool mirror = IS_MIRROR( instIdx );
 		if (mirror)
 		{
 			// calculate the specular reflection in the intersection point
 			float3 R = ray->D - (2 * N * dot( N, ray->D ));
 			if (rayDepth >= 1) return SampleSky( &R, skyPixels );
+			spread += 2 * Curvature( inst, outer, triData + inst->triOffset + triIdx, tri ) * width;
 			ray->D = R;
 			ray->O = I + ray->D * 0.005f;
 			ray->hit.t = 1e30f;
@@ -55,16 +74,35 @@ float3 Trace( struct Ray* ray, float* skyPixels,
 		else
 		{
 			// calculate the diffuse reflection in the intersection point
+			float lod = TextureLOD( inst, outer, triData + inst->triOffset + triIdx, tri, ray->D, N, fabs( width ) );
+			float3 albedo = SampleTexture( inst, texData, uv, lod );
+			if (guides && rayDepth == 0) guides->albedo = albedo;
+			struct Ray shadow;
+		#ifdef SKY_LIGHT
+			float pdf;
+			float3 S = SampleSkyDirection( skyPixels, RandomFloat( seed ), RandomFloat( seed ), &pdf );
+			float NdotS = dot( N, S );
+			float3 indirect = (float3)( 0, 0, 0 );
+			shadow.O = I + S * 0.005f, shadow.D = S;
+			if (NdotS > 0 && pdf > 0 && !IsOccluded( &shadow, 1e30f, triData, instData, tlasData, bvhNodeData, idxData ))
+				indirect = SampleSky( &S, skyPixels ) * (NdotS * INVPI / pdf);
+		#else
+			float3 indirect = ambient;
+		#endif
 			float3 L = lightPos - I;
 			float dist = length( L );
 			L *= 1.0f / dist;
-			return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+			float NdotL = dot( N, L );
+			if (NdotL <= 0) return albedo * indirect;
+			// shadow ray
+			shadow.O = I + L * 0.005f, shadow.D = L;
+			if (IsOccluded( &shadow, dist - 0.01f, triData, instData, tlasData, bvhNodeData, idxData )) return albedo * indirect;
+			return albedo * (indirect + NdotL * lightColor * (1.0f / (dist * dist)));
 		}
 		rayDepth++;
 	}
 	return (float3)( 1, 1, 1 );
 #else
-	// minimal depth renderer for performance experiments
 	TLASIntersect( ray, triData, instData, tlasData, bvhNodeData, idxData );
 	struct Intersection i = ray->hit;
 	if (i.t == 1e30f) return (float3)( 0, 0, 0 );
@@ -73,9 +111,39 @@ float3 Trace( struct Ray* ray, float* skyPixels,
 #endif
 }
 
+float3 RenderPixel( int pixelIdx, uint* skyPixels,
+	struct Tri* triData, struct TriEx* triExData,
+	uint* texData, struct TLASNode* tlasData,
+	struct BVHInstance* instData,
+	struct BVHNode* bvhNodeData, uint* idxData,
+	float3 camPos, float3 p0, float3 p1, float3 p2 
+)
+{
+	int x = pixelIdx % SCRWIDTH;
+	int y = pixelIdx / SCRWIDTH;
+	// intialize RNG
+	uint seed = WangHash( pixelIdx * 17 + 1 );
+	// create a primary ray for the pixel
+	struct Ray ray;
+	float3 color = (float3)( 0, 0, 0 );
+	for( int i = 0; i < 2; i++ )
+	{
+		float3 pixelPos = p0 +
+			(p1 - p0) * (((float)x + RandomFloat( &seed )) / SCRWIDTH) +
+			(p2 - p0) * (((float)y + RandomFloat( &seed )) / SCRHEIGHT);
+		ray.O = camPos;
+		ray.D = normalize( pixelPos - ray.O );
+		ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+		// trace the primary ray
+		float spread = length( p1 - p0 ) / (SCRWIDTH * length( pixelPos - camPos ));
+		color += Trace( &ray, spread, &seed, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData, 0 );
+	}
+	return color * (1.0f / 2.0f);
+}
+
 __kernel void render( 
 	write_only image2d_t target,
-	__global float* skyPixels,
+	__global uint* skyPixels,
 	__global struct Tri* triData, __global struct TriEx* triExData,
 	__global uint* texData, __global struct TLASNode* tlasData,
 	__global struct BVHInstance* instData,
@@ -84,27 +152,121 @@ __kernel void render(
 )
 {
 	// plot a pixel into the target array in GPU memory
+	int threadIdx = get_global_id( 0 );
+	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
+	float3 color = RenderPixel( threadIdx, skyPixels, triData, triExData, texData, tlasData,
+		instData, bvhNodeData, idxData, camPos, p0, p1, p2 );
+	write_imagef( target, (int2)(threadIdx % SCRWIDTH, threadIdx / SCRWIDTH), (float4)( color, 1 ) );
+}
+
+// persistent threads version of render: launch enough work groups to fill the device;
+// pixelCounter must be zero at the start of the frame
+__kernel void renderPersistent( 
+	write_only image2d_t target,
+	__global uint* skyPixels,
+	__global struct Tri* triData, __global struct TriEx* triExData,
+	__global uint* texData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData,
+	__global struct BVHNode* bvhNodeData, __global uint* idxData,
+	float3 camPos, float3 p0, float3 p1, float3 p2,
+	volatile __global uint* pixelCounter
+)
+{
+	while (1)
+	{
+		const uint start = FetchBatch( pixelCounter );
+		if (start >= SCRWIDTH * SCRHEIGHT) break; // queue is empty
+		const uint pixelIdx = start + BATCH_LANE;
+		if (pixelIdx >= SCRWIDTH * SCRHEIGHT) continue;
+		float3 color = RenderPixel( pixelIdx, skyPixels, triData, triExData, texData, tlasData,
+			instData, bvhNodeData, idxData, camPos, p0, p1, p2 );
+		write_imagef( target, (int2)(pixelIdx % SCRWIDTH, pixelIdx / SCRWIDTH), (float4)( color, 1 ) );
+	}
+}
+
+// denoiser input, see Denoiser: one sample per pixel, with a seed that changes every frame,
+// and the guides of the primary hit
+__kernel void renderGuides( 
+	__global float4* color, __global float4* normalDepth, __global float4* albedo,
+	__global uint* skyPixels,
+	__global struct Tri* triData, __global struct TriEx* triExData,
+	__global uint* texData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData,
+	__global struct BVHNode* bvhNodeData, __global uint* idxData,
+	float3 camPos, float3 p0, float3 p1, float3 p2, int frame
+)
+{
 	int threadIdx = get_global_id( 0 );
 	if (threadIdx >= SCRWIDTH * SCRHEIGHT) return;
 	int x = threadIdx % SCRWIDTH;
 	int y = threadIdx / SCRWIDTH;
-	// intialize RNG
-	uint seed = WangHash( threadIdx * 17 + 1 );
-	// create a primary ray for the pixel
+	uint seed = WangHash( threadIdx * 17 + 1 + WangHash( (uint)frame ) );
+	float3 pixelPos = p0 +
+		(p1 - p0) * (((float)x + RandomFloat( &seed )) / SCRWIDTH) +
+		(p2 - p0) * (((float)y + RandomFloat( &seed )) / SCRHEIGHT);
+	struct Ray ray;
+	ray.O = camPos;
+	ray.D = normalize( pixelPos - ray.O );
+	ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+	float spread = length( p1 - p0 ) / (SCRWIDTH * length( pixelPos - camPos ));
+	struct Guides guides;
+	guides.N = (float3)( 0, 0, 0 ), guides.albedo = (float3)( 1, 1, 1 ), guides.depth = 1e30f;
+	float3 c = Trace( &ray, spread, &seed, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData, &guides );
+	color[threadIdx] = (float4)( c, 1 );
+	normalDepth[threadIdx] = (float4)( guides.N, guides.depth );
+	albedo[threadIdx] = (float4)( guides.albedo, 1 );
+}
+
+// hybrid rendering: puts the rows that the CPU rendered in the target, see HybridRenderer
+__kernel void copyRows( write_only image2d_t target, __global uint* pixels, int firstRow )
+{
+	int threadIdx = get_global_id( 0 );
+	int pixelIdx = firstRow * SCRWIDTH + threadIdx;
+	if (pixelIdx >= SCRWIDTH * SCRHEIGHT) return;
+	write_imagef( target, (int2)(pixelIdx % SCRWIDTH, pixelIdx / SCRWIDTH), (float4)( RGB8toRGB32F( pixels[threadIdx] ), 1 ) );
+}
+
+// multi-GPU rendering: puts a band of rows that another device rendered in the target,
+// see MultiGPURenderer
+__kernel void copyTile( write_only image2d_t target, __global float4* tile, int firstRow )
+{
+	int threadIdx = get_global_id( 0 );
+	int pixelIdx = firstRow * SCRWIDTH + threadIdx;
+	if (pixelIdx >= SCRWIDTH * SCRHEIGHT) return;
+	write_imagef( target, (int2)(pixelIdx % SCRWIDTH, pixelIdx / SCRWIDTH), tile[threadIdx] );
+}
+
+// offline version of render: one tile of an image of any size, see offline.cpp; p0 is the
+// top-left corner of the tile on the screen plane, dx and dy are the size of a pixel
+__kernel void renderTile( 
+	__global float4* tile,
+	__global uint* skyPixels,
+	__global struct Tri* triData, __global struct TriEx* triExData,
+	__global uint* texData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData,
+	__global struct BVHNode* bvhNodeData, __global uint* idxData,
+	float3 camPos, float3 p0, float3 dx, float3 dy,
+	int tileWidth, int tileHeight, int spp, int firstPixel
+)
+{
+	int threadIdx = get_global_id( 0 );
+	if (threadIdx >= tileWidth * tileHeight) return;
+	int x = threadIdx % tileWidth;
+	int y = threadIdx / tileWidth;
+	// seed per image pixel, so the result does not depend on the tile size
+	uint seed = WangHash( (firstPixel + threadIdx) * 17 + 1 );
 	struct Ray ray;
 	float3 color = (float3)( 0, 0, 0 );
-	for( int i = 0; i < 2; i++ )
+	for (int i = 0; i < spp; i++)
 	{
-		float3 pixelPos = p0 +
-			(p1 - p0) * (((float)x + RandomFloat( &seed )) / SCRWIDTH) +
-			(p2 - p0) * (((float)y + RandomFloat( &seed )) / SCRHEIGHT);
+		float3 pixelPos = p0 + dx * ((float)x + RandomFloat( &seed )) + dy * ((float)y + RandomFloat( &seed ));
 		ray.O = camPos;
 		ray.D = normalize( pixelPos - ray.O );
 		ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-		// trace the primary ray
-		color += Trace( &ray, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData );
+		float spread = length( dx ) / length( pixelPos - camPos );
+		color += Trace( &ray, spread, &seed, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData, 0 );
 	}
-	write_imagef( target, (int2)(x, y), (float4)( color * (1.0f / 2.0f), 1 ) );
+	tile[threadIdx] = (float4)( color * (1.0f / spp), 1 );
 }
 
 // EOF
\ No newline at end of file
@@ -27,7 +27,10 @@ struct Intersection
 {
 	float t;			// intersection distance along ray
 	float u, v;			// barycentric coordinates of the intersection
-	uint instPrim;		// instance index (12 bit) and primitive index (20 bit)
+#ifdef WIDE_INDICES
+	uint inner;			// for a hit in a nested TLAS: the instance inside it
+#endif
+	instprim instPrim;	// instance and primitive index, see INST_PRIM in common.h
 };
 
 struct Ray
@@ -61,21 +64,39 @@ struct BVHNode
 	int triCount;
 };
 
+struct BVHNodeQ4
+{
+	float ox, oy, oz;	// minimum of the child bounds
+	char ex, ey, ez;	// per-axis quantization step: 2^e
+	uchar validMask;	// bit i is set if child slot i is in use
+	uchar4 xmin, xmax, ymin, ymax, zmin, zmax;
+	uint child[4];		// wide node index, or first triIdx entry for a leaf
+	ushort triCount[4];	// 0 for interior nodes and empty slots
+};
+
 struct TLASNode
 {
 	float minx, miny, minz;
-	uint leftRight; // 2x16 bits
+	uint left;	// 0 for a leaf
 	float maxx, maxy, maxz;
-	uint BLAS;
+	uint right;	// instance index for a leaf
 };
 
 struct BVHInstance
 {
 	float16 transform;
 	float16 invTransform; // inverse transform
-	uint dummy[16];
+	uint dummy[9]; // world bounds, BLAS pointer and index; host only
+	uint nodeOffset, idxOffset, triOffset; // BLAS data in the consolidated scene buffers
+	uint texOffset, texWidth, texHeight, texLevels; // mip chain in the scene texture buffer
 };
 
+// scene lighting, shared by the render kernels
+
+__constant float3 lightPos = (float3)(LIGHT_POS);
+__constant float3 lightColor = (float3)(LIGHT_COLOR);
+__constant float3 ambient = (float3)(AMBIENT);
+
 // ray tracing helper functions
 
 uint RGB32FtoRGB8( float3 c )
@@ -113,7 +134,7 @@ float3 TransformPosition( float3* V, float16* T )
 	);
 }
 
-void IntersectTri( struct Ray* ray, struct Tri* tri, const uint instPrim )
+void IntersectTri( struct Ray* ray, struct Tri* tri, const instprim instPrim )
 {
 	float3 v0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
 	float3 v1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
@@ -146,11 +167,190 @@ float IntersectAABB( struct Ray* ray, struct BVHNode* node )
 	if (tmax >= tmin && tmin < ray->hit.t && tmax > 0) return tmin; else return 1e30f;
 }
 
+// texture sampling
+
+float3 RGB565toRGB32F( uint c )
+{
+	return (float3)((c >> 11) * (1 / 31.0f), ((c >> 5) & 63) * (1 / 63.0f), (c & 31) * (1 / 31.0f));
+}
+
+// mip level selection for a ray cone of the given width at the hit point (Akenine-Moller
+// et al., 2019): texel-to-world area ratio of the triangle, plus the projected cone width
+float TextureLOD( struct BVHInstance* inst, struct BVHInstance* outer, struct Tri* tri, struct TriEx* triEx, float3 D, float3 N, float width )
+{
+	// outer: the nested instance of a hit in a nested TLAS, or 0
+	float3 e1 = (float3)(tri->v1x - tri->v0x, tri->v1y - tri->v0y, tri->v1z - tri->v0z);
+	float3 e2 = (float3)(tri->v2x - tri->v0x, tri->v2y - tri->v0y, tri->v2z - tri->v0z);
+	e1 = TransformVector( &e1, &inst->transform ), e2 = TransformVector( &e2, &inst->transform );
+	if (outer) e1 = TransformVector( &e1, &outer->transform ), e2 = TransformVector( &e2, &outer->transform );
+	float worldArea = length( cross( e1, e2 ) );
+	float2 t1 = triEx->uv1 - triEx->uv0, t2 = triEx->uv2 - triEx->uv0;
+	float texelArea = fabs( t1.x * t2.y - t1.y * t2.x ) * inst->texWidth * inst->texHeight;
+	if (worldArea == 0 || texelArea == 0) return 0;
+	return 0.5f * log2( texelArea / worldArea ) + log2( width / max( fabs( dot( N, D ) ), 0.01f ) );
+}
+
+// change of the vertex normal along each edge, per unit of length (Akenine-Moller et al.,
+// 2021), in world space; positive for a convex surface, where a reflected ray cone widens
+float Curvature( struct BVHInstance* inst, struct BVHInstance* outer, struct Tri* tri, struct TriEx* triEx )
+{
+	float3 P0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
+	float3 P1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
+	float3 P2 = (float3)(tri->v2x, tri->v2y, tri->v2z);
+	float3 N0 = (float3)(triEx->N0x, triEx->N0y, triEx->N0z);
+	float3 N1 = (float3)(triEx->N1x, triEx->N1y, triEx->N1z);
+	float3 N2 = (float3)(triEx->N2x, triEx->N2y, triEx->N2z);
+	float3 e0 = P1 - P0, e1 = P2 - P1, e2 = P0 - P2;
+	float l0 = dot( e0, e0 ), l1 = dot( e1, e1 ), l2 = dot( e2, e2 );
+	if (l0 == 0 || l1 == 0 || l2 == 0) return 0;
+	float k = (dot( N1 - N0, e0 ) / l0 + dot( N2 - N1, e1 ) / l1 + dot( N0 - N2, e2 ) / l2) * (1 / 3.0f);
+	// to world space: curvature scales inversely with the size of the triangle
+	float objectArea = length( cross( e0, e2 ) );
+	e0 = TransformVector( &e0, &inst->transform ), e2 = TransformVector( &e2, &inst->transform );
+	if (outer) e0 = TransformVector( &e0, &outer->transform ), e2 = TransformVector( &e2, &outer->transform );
+	float worldArea = length( cross( e0, e2 ) );
+	return worldArea == 0 ? 0 : k * sqrt( objectArea / worldArea );
+}
+
+// nearest texel of the nearest mip level; levels are stored consecutively at texOffset
+float3 SampleTexture( struct BVHInstance* inst, uint* texData, float2 uv, float lod )
+{
+	int level = (int)clamp( lod + 0.5f, 0.0f, (float)(inst->texLevels - 1) );
+	uint offset = inst->texOffset, w = inst->texWidth, h = inst->texHeight;
+	for (int l = 0; l < level; l++)
+	{
+	#ifdef TEXTURE_BC1
+		offset += ((w + 3) >> 2) * ((h + 3) >> 2) * 2;
+	#else
+		offset += w * h;
+	#endif
+		w = max( w >> 1, 1u ), h = max( h >> 1, 1u );
+	}
+	uv -= floor( uv ); // wrap
+	int iu = min( (int)(uv.x * w), (int)w - 1 );
+	int iv = min( (int)(uv.y * h), (int)h - 1 );
+#ifdef TEXTURE_BC1
+	// 4x4 block: two 565 endpoints, 2-bit palette index per texel
+	uint* block = texData + offset + ((iu >> 2) + (iv >> 2) * ((w + 3) >> 2)) * 2;
+	uint e0 = block[0] & 0xffff, e1 = block[0] >> 16;
+	uint sel = (block[1] >> (((iu & 3) + (iv & 3) * 4) * 2)) & 3;
+	float3 c0 = RGB565toRGB32F( e0 ), c1 = RGB565toRGB32F( e1 );
+	if (sel == 0) return c0;
+	if (sel == 1) return c1;
+	if (e0 > e1) return sel == 2 ? (c0 * 2 + c1) * (1 / 3.0f) : (c0 + c1 * 2) * (1 / 3.0f);
+	return sel == 2 ? (c0 + c1) * 0.5f : (float3)(0, 0, 0);
+#else
+	return RGB8toRGB32F( texData[offset + iu + iv * w] );
+#endif
+}
+
 // BVH traversal
 
+// traverse binary BVHs and the TLAS without a stack, using a restart trail (Laine, 2010):
+// one bit per level records whether the near child at that level is finished; after a
+// subtree completes, traversal restarts at the root and follows the trail. Trades the
+// 32 + 64 entry stacks for three ulongs per thread, at the cost of revisiting nodes.
+// Trees deeper than 64 levels are not supported.
+// #define STACKLESS
+
+#ifdef STACKLESS
+bool TrailPop( ulong* trail, ulong* single, ulong* level )
+{
+	// the node at 'level' is done: set the trail bit of the deepest unfinished near
+	// child above it and clear the bits below; the carry does this in a single add
+	const ulong parent = *level << 1;
+	*trail = (*trail & -parent) + parent, *single &= *trail, *level = (ulong)1 << 63;
+	return *trail != 0; // false when the carry left the root: traversal is complete
+}
+#endif
+
+void BVHIntersectQ4( struct Ray* ray, uint instanceIdx,
+	struct Tri* tri, struct BVHNodeQ4* bvhNode, uint* triIdx )
+{
+	// 4-wide traversal of quantized nodes; child bounds are decoded as origin + q * step
+	uint stack[64], stackPtr = 0, nodeIdx = 0;
+	while (1)
+	{
+		struct BVHNodeQ4* node = &bvhNode[nodeIdx];
+		const float3 a = (float3)(ldexp( 1.0f, node->ex ), ldexp( 1.0f, node->ey ), ldexp( 1.0f, node->ez )) * ray->rD;
+		const float3 b = ((float3)(node->ox, node->oy, node->oz) - ray->O) * ray->rD;
+		const float4 tx1 = convert_float4( node->xmin ) * a.x + b.x, tx2 = convert_float4( node->xmax ) * a.x + b.x;
+		const float4 ty1 = convert_float4( node->ymin ) * a.y + b.y, ty2 = convert_float4( node->ymax ) * a.y + b.y;
+		const float4 tz1 = convert_float4( node->zmin ) * a.z + b.z, tz2 = convert_float4( node->zmax ) * a.z + b.z;
+		const float4 tmin4 = fmax( fmax( fmin( tx1, tx2 ), fmin( ty1, ty2 ) ), fmin( tz1, tz2 ) );
+		const float4 tmax4 = fmin( fmin( fmax( tx1, tx2 ), fmax( ty1, ty2 ) ), fmax( tz1, tz2 ) );
+		float tmin[4], tmax[4];
+		vstore4( tmin4, 0, tmin ), vstore4( tmax4, 0, tmax );
+		// intersect leaves right away; sort interior children by distance
+		uint interior[4], interiors = 0;
+		for (uint i = 0; i < 4; i++)
+		{
+			if (!(node->validMask & (1 << i)) || tmax[i] < tmin[i] || tmin[i] >= ray->hit.t || tmax[i] <= 0) continue;
+			if (node->triCount[i] == 0)
+			{
+				uint j = interiors++;
+				while (j > 0 && tmin[interior[j - 1]] > tmin[i]) interior[j] = interior[j - 1], j--;
+				interior[j] = i;
+				continue;
+			}
+			for (uint first = node->child[i], j = 0; j < node->triCount[i]; j++)
+			{
+				instprim instPrim = INST_PRIM( instanceIdx, triIdx[first + j] );
+				IntersectTri( ray, &tri[PRIM_IDX( instPrim )], instPrim );
+			}
+		}
+		// continue with the nearest interior child; push the others far to near
+		for (int i = (int)interiors - 1; i > 0; i--) stack[stackPtr++] = node->child[interior[i]];
+		if (interiors > 0) nodeIdx = node->child[interior[0]];
+		else if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+	}
+}
+
 void BVHIntersect( struct Ray* ray, uint instanceIdx,
 	struct Tri* tri, struct BVHNode* bvhNode, uint* triIdx )
 {
+#ifdef BVH_QUANTIZED
+	// the host uploads quantized nodes instead
+	BVHIntersectQ4( ray, instanceIdx, tri, (struct BVHNodeQ4*)bvhNode, triIdx );
+	return;
+#endif
+#ifdef STACKLESS
+	struct BVHNode* node = &bvhNode[0];
+	ulong trail = 0, single = 0, level = (ulong)1 << 63;
+	while (1)
+	{
+		if (node->triCount > 0) // isLeaf()
+		{
+			for (uint i = 0; i < node->triCount; i++)
+			{
+				instprim instPrim = INST_PRIM( instanceIdx, triIdx[node->leftFirst + i] );
+				IntersectTri( ray, &tri[PRIM_IDX( instPrim )], instPrim );
+			}
+			if (!TrailPop( &trail, &single, &level )) break; else node = &bvhNode[0];
+			continue;
+		}
+		struct BVHNode* child1 = &bvhNode[node->leftFirst];
+		struct BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		float dist1 = IntersectAABB( ray, child1 );
+		float dist2 = IntersectAABB( ray, child2 );
+		if (dist1 > dist2)
+		{
+			float d = dist1; dist1 = dist2; dist2 = d;
+			struct BVHNode* c = child1; child1 = child2; child2 = c;
+		}
+		if (dist1 == 1e30f || (dist2 == 1e30f && (trail & level) && !(single & level)))
+		{
+			// nothing hit, or the near child is finished and the far one is now culled
+			if (!TrailPop( &trail, &single, &level )) break; else node = &bvhNode[0];
+			continue;
+		}
+		// a single intersected child is the last one at this level: its trail bit is set right
+		// away and marked in 'single', so restarts descend into it again; with two, the trail picks
+		if (dist2 == 1e30f) trail |= level, single |= level, node = child1;
+		else node = (trail & level) ? child2 : child1;
+		level >>= 1;
+	}
+#else
 	struct BVHNode* node = &bvhNode[0], * stack[32];
 	uint stackPtr = 0;
 	while (1)
@@ -159,8 +359,8 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 		{
 			for (uint i = 0; i < node->triCount; i++)
 			{
-				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
-				IntersectTri( ray, &tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+				instprim instPrim = INST_PRIM( instanceIdx, triIdx[node->leftFirst + i] );
+				IntersectTri( ray, &tri[PRIM_IDX( instPrim )], instPrim );
 			}
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
@@ -184,6 +384,7 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 			if (dist2 != 1e30f) stack[stackPtr++] = child2;
 		}
 	}
+#endif
 }
 
 void TransformRay( struct Ray* ray, float16* invTransform )
@@ -195,42 +396,156 @@ void TransformRay( struct Ray* ray, float16* invTransform )
 	ray->rD = (float3)(1.0f / ray->D.x, 1.0f / ray->D.y, 1.0f / ray->D.z);
 }
 
+#ifdef BLAS_STREAMING
+// flags the BLAS of an instance as used in this frame, see StreamingScene. The flag of a
+// resident BLAS is found through the word before its indices; a missing one has no indices,
+// and its idxOffset holds the flag index instead.
+bool Resident( struct BVHInstance* bvhInstance, uint* triIdx )
+{
+	const bool resident = bvhInstance->triOffset != NOT_RESIDENT;
+	const uint flag = resident ? triIdx[bvhInstance->idxOffset - 1] : bvhInstance->idxOffset;
+	if (!triIdx[flag]) triIdx[flag] = 1;
+	return resident;
+}
+#endif
+
 void InstanceIntersect( struct Ray* ray, struct BVHInstance* bvhInstance,
 	int blasIdx, struct Tri* tri, struct BVHNode* bvhNode, uint* triIdx )
 {
+#ifdef BLAS_STREAMING
+	if (!Resident( bvhInstance, triIdx )) return; // requested; it may be there next frame
+#endif
 	// backup and transform ray using instance transform
 	struct Ray backup = *ray;
 	TransformRay( ray, &bvhInstance->invTransform );
-	// traverse the BLAS
-	BVHIntersect( ray, blasIdx, tri, bvhNode, triIdx );
+	// traverse the BLAS; its data starts at the per-instance offsets in the scene buffers
+#ifdef BVH_QUANTIZED
+	bvhNode = (struct BVHNode*)((struct BVHNodeQ4*)bvhNode + bvhInstance->nodeOffset);
+#else
+	bvhNode += bvhInstance->nodeOffset;
+#endif
+	BVHIntersect( ray, blasIdx, tri + bvhInstance->triOffset, bvhNode, triIdx + bvhInstance->idxOffset );
 	// restore ray without overwriting intersection record
 	backup.hit = ray->hit;
 	*ray = backup;
 }
 
+#ifdef WIDE_INDICES
+// instance of a nested TLAS (triOffset == NESTED_TLAS): its nodes start at nodeOffset in the
+// TLAS node array and its instances at idxOffset in the instance array, see Scene::PackTLAS.
+// The instances of a nested TLAS are BLAS instances, so this does not recurse.
+void NestedIntersect( struct Ray* ray, struct BVHInstance* bvhInstance, int instIdx,
+	struct Tri* tri, struct TLASNode* tlasNode, struct BVHNode* bvhNode, uint* triIdx )
+{
+	struct Ray backup = *ray;
+	struct BVHInstance* nested = &bvhInstance[instIdx];
+	TransformRay( ray, &nested->invTransform );
+	bvhInstance += nested->idxOffset, tlasNode += nested->nodeOffset;
+	struct TLASNode* node = &tlasNode[0], *stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->left == 0) // isLeaf()
+		{
+			InstanceIntersect( ray, &bvhInstance[node->right], node->right, tri, bvhNode, triIdx );
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		struct TLASNode* child1 = &tlasNode[node->left];
+		struct TLASNode* child2 = &tlasNode[node->right];
+		float dist1 = IntersectAABB( ray, child1 );
+		float dist2 = IntersectAABB( ray, child2 );
+		if (dist1 > dist2)
+		{
+			float d = dist1; dist1 = dist2; dist2 = d;
+			struct TLASNode* c = child1; child1 = child2; child2 = c;
+		}
+		if (dist1 == 1e30f)
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+		}
+		else
+		{
+			node = child1;
+			if (dist2 != 1e30f) stack[stackPtr++] = child2;
+		}
+	}
+	// a closer hit reports the instance inside the nested TLAS; it becomes the inner one
+	if (ray->hit.t < backup.hit.t)
+		ray->hit.inner = INST_IDX( ray->hit.instPrim ), ray->hit.instPrim = INST_PRIM( instIdx, PRIM_IDX( ray->hit.instPrim ) );
+	backup.hit = ray->hit;
+	*ray = backup;
+}
+#endif
+
+void LeafIntersect( struct Ray* ray, struct BVHInstance* bvhInstance, int instIdx,
+	struct Tri* tri, struct TLASNode* tlasNode, struct BVHNode* bvhNode, uint* triIdx )
+{
+#ifdef WIDE_INDICES
+	if (bvhInstance[instIdx].triOffset == NESTED_TLAS)
+	{
+		NestedIntersect( ray, bvhInstance, instIdx, tri, tlasNode, bvhNode, triIdx );
+		return;
+	}
+#endif
+	InstanceIntersect( ray, &bvhInstance[instIdx], instIdx, tri, bvhNode, triIdx );
+}
+
 void TLASIntersect( struct Ray* ray, struct Tri* tri, 
 	struct BVHInstance* bvhInstance, struct TLASNode* tlasNode, 
 	struct BVHNode* bvhNode, uint* triIdx )
 {
 	// initialize reciprocals for TLAS traversal
 	ray->rD = (float3)(1.0f / ray->D.x, 1.0f / ray->D.y, 1.0f / ray->D.z);
+#ifdef STACKLESS
+	// restart trail instead of a stack; see TrailPop
+	struct TLASNode* node = &tlasNode[0];
+	ulong trail = 0, single = 0, level = (ulong)1 << 63;
+	while (1)
+	{
+		if (node->left == 0) // isLeaf()
+		{
+			LeafIntersect( ray, bvhInstance, node->right, tri, tlasNode, bvhNode, triIdx );
+			if (!TrailPop( &trail, &single, &level )) break; else node = &tlasNode[0];
+			continue;
+		}
+		struct TLASNode* child1 = &tlasNode[node->left];
+		struct TLASNode* child2 = &tlasNode[node->right];
+		float dist1 = IntersectAABB( ray, child1 );
+		float dist2 = IntersectAABB( ray, child2 );
+		if (dist1 > dist2)
+		{
+			float d = dist1; dist1 = dist2; dist2 = d;
+			struct TLASNode* c = child1; child1 = child2; child2 = c;
+		}
+		if (dist1 == 1e30f || (dist2 == 1e30f && (trail & level) && !(single & level)))
+		{
+			// nothing hit, or the near child is finished and the far one is now culled
+			if (!TrailPop( &trail, &single, &level )) break; else node = &tlasNode[0];
+			continue;
+		}
+		if (dist2 == 1e30f) trail |= level, single |= level, node = child1;
+		else node = (trail & level) ? child2 : child1;
+		level >>= 1;
+	}
+#else
 	// use a local stack instead of a recursive function
-	struct TLASNode* node = &tlasNode[0], *stack[32];
+	struct TLASNode* node = &tlasNode[0], *stack[64];
 	uint stackPtr = 0;
 	// traversal loop; terminates when the stack is empty
 	while (1)
 	{
-		if (node->leftRight == 0) // isLeaf()
+		if (node->left == 0) // isLeaf()
 		{
 			// current node is a leaf: intersect instance
-			InstanceIntersect( ray, &bvhInstance[node->BLAS], node->BLAS, tri, bvhNode, triIdx );
+			LeafIntersect( ray, bvhInstance, node->right, tri, tlasNode, bvhNode, triIdx );
 			// pop a node from the stack; terminate if none left
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
 		// current node is an interior node: visit child nodes, ordered
-		struct TLASNode* child1 = &tlasNode[node->leftRight & 0xffff];
-		struct TLASNode* child2 = &tlasNode[node->leftRight >> 16];
+		struct TLASNode* child1 = &tlasNode[node->left];
+		struct TLASNode* child2 = &tlasNode[node->right];
 		float dist1 = IntersectAABB( ray, child1 );
 		float dist2 = IntersectAABB( ray, child2 );
 		if (dist1 > dist2) 
@@ -250,17 +565,238 @@ void TLASIntersect( struct Ray* ray, struct Tri* tri,
 			if (dist2 != 1e30f) stack[stackPtr++] = child2;
 		}
 	}
+#endif
 }
 
+// occlusion queries for shadow rays: exit on the first hit closer than ray->hit.t,
+// without near/far child ordering and without updating the hit record
+
+bool OccludesTri( struct Ray* ray, struct Tri* tri )
+{
+	float3 v0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
+	float3 v1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
+	float3 v2 = (float3)(tri->v2x, tri->v2y, tri->v2z);
+	float3 edge1 = v1 - v0, edge2 = v2 - v0;
+	float3 h = cross( ray->D, edge2 );
+	float a = dot( edge1, h );
+	if (fabs( a ) < 0.00001f) return false; // ray parallel to triangle
+	float f = 1 / a;
+	float3 s = ray->O - v0;
+	float u = f * dot( s, h );
+	if (u < 0 | u > 1) return false;
+	const float3 q = cross( s, edge1 );
+	const float v = f * dot( ray->D, q );
+	if (v < 0 | u + v > 1) return false;
+	const float t = f * dot( edge2, q );
+	return t > 0.0001f && t < ray->hit.t;
+}
+
+bool BVHOccludedQ4( struct Ray* ray, struct Tri* tri, struct BVHNodeQ4* bvhNode, uint* triIdx )
+{
+	uint stack[64], stackPtr = 0, nodeIdx = 0;
+	while (1)
+	{
+		struct BVHNodeQ4* node = &bvhNode[nodeIdx];
+		const float3 a = (float3)(ldexp( 1.0f, node->ex ), ldexp( 1.0f, node->ey ), ldexp( 1.0f, node->ez )) * ray->rD;
+		const float3 b = ((float3)(node->ox, node->oy, node->oz) - ray->O) * ray->rD;
+		const float4 tx1 = convert_float4( node->xmin ) * a.x + b.x, tx2 = convert_float4( node->xmax ) * a.x + b.x;
+		const float4 ty1 = convert_float4( node->ymin ) * a.y + b.y, ty2 = convert_float4( node->ymax ) * a.y + b.y;
+		const float4 tz1 = convert_float4( node->zmin ) * a.z + b.z, tz2 = convert_float4( node->zmax ) * a.z + b.z;
+		const float4 tmin4 = fmax( fmax( fmin( tx1, tx2 ), fmin( ty1, ty2 ) ), fmin( tz1, tz2 ) );
+		const float4 tmax4 = fmin( fmin( fmax( tx1, tx2 ), fmax( ty1, ty2 ) ), fmax( tz1, tz2 ) );
+		float tmin[4], tmax[4];
+		vstore4( tmin4, 0, tmin ), vstore4( tmax4, 0, tmax );
+		for (uint i = 0; i < 4; i++)
+		{
+			if (!(node->validMask & (1 << i)) || tmax[i] < tmin[i] || tmin[i] >= ray->hit.t || tmax[i] <= 0) continue;
+			if (node->triCount[i] == 0) { stack[stackPtr++] = node->child[i]; continue; }
+			for (uint first = node->child[i], j = 0; j < node->triCount[i]; j++)
+				if (OccludesTri( ray, &tri[triIdx[first + j]] )) return true;
+		}
+		if (stackPtr == 0) return false; else nodeIdx = stack[--stackPtr];
+	}
+}
+
+bool BVHOccluded( struct Ray* ray, struct Tri* tri, struct BVHNode* bvhNode, uint* triIdx )
+{
+#ifdef BVH_QUANTIZED
+	return BVHOccludedQ4( ray, tri, (struct BVHNodeQ4*)bvhNode, triIdx );
+#endif
+	struct BVHNode* node = &bvhNode[0], * stack[32];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->triCount > 0) // isLeaf()
+		{
+			for (uint i = 0; i < node->triCount; i++)
+				if (OccludesTri( ray, &tri[triIdx[node->leftFirst + i]] )) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		struct BVHNode* child1 = &bvhNode[node->leftFirst];
+		struct BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		const bool hit1 = IntersectAABB( ray, child1 ) != 1e30f;
+		const bool hit2 = IntersectAABB( ray, child2 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
+	}
+}
+
+bool InstanceOccluded( struct Ray* ray, struct BVHInstance* bvhInstance,
+	struct Tri* tri, struct BVHNode* bvhNode, uint* triIdx )
+{
+#ifdef BLAS_STREAMING
+	if (!Resident( bvhInstance, triIdx )) return false;
+#endif
+	// transform a copy of the ray; ray->hit.t carries over since the transform is affine
+	struct Ray r = *ray;
+	TransformRay( &r, &bvhInstance->invTransform );
+#ifdef BVH_QUANTIZED
+	bvhNode = (struct BVHNode*)((struct BVHNodeQ4*)bvhNode + bvhInstance->nodeOffset);
+#else
+	bvhNode += bvhInstance->nodeOffset;
+#endif
+	return BVHOccluded( &r, tri + bvhInstance->triOffset, bvhNode, triIdx + bvhInstance->idxOffset );
+}
+
+#ifdef WIDE_INDICES
+// see NestedIntersect
+bool NestedOccluded( struct Ray* ray, struct BVHInstance* nested, struct Tri* tri,
+	struct BVHInstance* bvhInstance, struct TLASNode* tlasNode, struct BVHNode* bvhNode, uint* triIdx )
+{
+	struct Ray r = *ray;
+	TransformRay( &r, &nested->invTransform );
+	bvhInstance += nested->idxOffset, tlasNode += nested->nodeOffset;
+	struct TLASNode* node = &tlasNode[0], *stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->left == 0) // isLeaf()
+		{
+			if (InstanceOccluded( &r, &bvhInstance[node->right], tri, bvhNode, triIdx )) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		struct TLASNode* child1 = &tlasNode[node->left];
+		struct TLASNode* child2 = &tlasNode[node->right];
+		const bool hit1 = IntersectAABB( &r, child1 ) != 1e30f;
+		const bool hit2 = IntersectAABB( &r, child2 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
+	}
+}
+#endif
+
+bool IsOccluded( struct Ray* ray, float tmax, struct Tri* tri, 
+	struct BVHInstance* bvhInstance, struct TLASNode* tlasNode, 
+	struct BVHNode* bvhNode, uint* triIdx )
+{
+	ray->rD = (float3)(1.0f / ray->D.x, 1.0f / ray->D.y, 1.0f / ray->D.z);
+	ray->hit.t = tmax;
+	struct TLASNode* node = &tlasNode[0], *stack[64];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->left == 0) // isLeaf()
+		{
+			struct BVHInstance* inst = &bvhInstance[node->right];
+		#ifdef WIDE_INDICES
+			if (inst->triOffset == NESTED_TLAS)
+			{
+				if (NestedOccluded( ray, inst, tri, bvhInstance, tlasNode, bvhNode, triIdx )) return true;
+			}
+			else
+		#endif
+			if (InstanceOccluded( ray, inst, tri, bvhNode, triIdx )) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		struct TLASNode* child1 = &tlasNode[node->left];
+		struct TLASNode* child2 = &tlasNode[node->right];
+		const bool hit1 = IntersectAABB( ray, child1 ) != 1e30f;
+		const bool hit2 = IntersectAABB( ray, child2 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
+	}
+}
+
+// persistent threads (Aila & Laine, 2009): instead of one thread per pixel, a fixed
+// number of threads keeps pulling batches of work from a global counter, so that cheap
+// (sky) and expensive (dense geometry) pixels no longer stall a launch. A batch is one
+// item per lane of a sub-group (warp), fetched by its first lane: the lanes of a warp
+// only wait for each other, never for the rest of the work group. Without sub-group
+// support each thread fetches a single item.
+// Returns the first item of the batch; identical for all lanes of the sub-group, so the
+// caller can leave its loop uniformly. The item of a lane is the start plus BATCH_LANE.
+#if defined cl_khr_subgroups || defined __opencl_c_subgroups
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#define BATCH_LANE get_sub_group_local_id()
+uint FetchBatch( volatile __global uint* counter )
+{
+	uint start = 0;
+	if (get_sub_group_local_id() == 0) start = atomic_add( counter, get_sub_group_size() );
+	return sub_group_broadcast( start, 0 );
+}
+#else
+#define BATCH_LANE 0
+uint FetchBatch( volatile __global uint* counter ) { return atomic_inc( counter ); }
+#endif
+
 // skydome
 
-float3 SampleSky( float3* D, float* skyPixels )
+// the sky buffer is built by SkyDome (bvh.cpp): header, RGBE texels, sampling tables
+
+float3 RGBEtoRGB32F( uint c )
+{
+	float s = ldexp( 1.0f, (int)(c >> 24) - 136 );
+	return (float3)(((c & 255) + 0.5f) * s, (((c >> 8) & 255) + 0.5f) * s, (((c >> 16) & 255) + 0.5f) * s);
+}
+
+float3 SampleSky( float3* D, uint* skyPixels )
 {
+	uint w = skyPixels[0], h = skyPixels[1];
 	float phi = atan2( D->z, D->x );
-	uint u = (uint)(3200 * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
-	uint v = (uint)(1600 * acos( D->y ) * INVPI - 0.5f);
-	uint skyIdx = (u + v * 3200) % (3200 * 1600);
-	return 0.65f * (float3)(skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2]);
+	uint u = (uint)(w * (phi > 0 ? phi : (phi + 2 * PI)) * INV2PI - 0.5f);
+	uint v = (uint)(h * acos( D->y ) * INVPI - 0.5f);
+	uint skyIdx = (u + v * w) % (w * h);
+	return 0.65f * RGBEtoRGB32F( skyPixels[4 + skyIdx] );
+}
+
+// first entry of a CDF that is not smaller than r
+uint FindCDF( float* cdf, uint count, float r )
+{
+	uint lo = 0, hi = count - 1;
+	while (lo < hi)
+	{
+		uint mid = (lo + hi) >> 1;
+		if (cdf[mid] < r) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+// importance sampling: picks a cell in proportion to its share of the sky light, then
+// a uniform position in the cell. Returns the direction; pdf is per steradian.
+float3 SampleSkyDirection( uint* skyPixels, float r0, float r1, float* pdf )
+{
+	uint w = skyPixels[2], h = skyPixels[3];
+	float* marginal = (float*)(skyPixels + 4 + skyPixels[0] * skyPixels[1]);
+	uint y = FindCDF( marginal, h, r0 );
+	float* cdf = marginal + h + y * w;
+	uint x = FindCDF( cdf, w, r1 );
+	float y0 = y ? marginal[y - 1] : 0, x0 = x ? cdf[x - 1] : 0;
+	float py = marginal[y] - y0, px = cdf[x] - x0;
+	// reuse the random numbers for the position within the cell; SampleSky reads the texel
+	// half a texel before the direction, so shift by half a texel to read inside the cell
+	float theta = (y + clamp( (r0 - y0) / py, 0.0f, 1.0f )) * PI / h + 0.5f * PI / skyPixels[1];
+	float phi = (x + clamp( (r1 - x0) / px, 0.0f, 1.0f )) * 2 * PI / w + PI / skyPixels[0];
+	float sinTheta = sin( theta );
+	*pdf = sinTheta > 0 ? px * py * w * h / (2 * PI * PI * sinTheta) : 0;
+	return (float3)(sinTheta * cos( phi ), cos( theta ), sinTheta * sin( phi ));
 }
 
 // EOF
\ No newline at end of file
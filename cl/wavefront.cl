@@ -0,0 +1,217 @@
+#include "template/common.h"
+#include "cl/tools.cl"
+
+// Wavefront path tracing: instead of one thread tracing a complete path, each stage of
+// the path processes all live rays in a separate kernel. Stages communicate through ray
+// buffers; new rays are compacted using atomic counters, so a stage only sees live rays.
+// Kernels are launched for the full path count; surplus threads exit immediately, which
+// keeps the host from having to read back ray counts between stages.
+// counter[d]: extension rays at depth d; counter[32 + d]: shadow rays at depth d.
+
+struct PathRay
+{
+	float4 O4;	// origin; w: path index
+	float4 D4;	// direction; w: ray cone spread angle, for texture LOD
+	float4 T4;	// path throughput; w: ray cone width at the origin
+};
+
+struct ShadowRay
+{
+	float4 O4;	// origin; w: distance to the light
+	float4 D4;	// direction; w: path index
+	float4 E4;	// contribution if the light is visible
+};
+
+// stage 1: primary rays, samplesPerPixel per pixel
+__kernel void generate( __global struct PathRay* rays, __global float4* accumulator,
+	__global uint* counter, int pathCount, float3 camPos, float3 p0, float3 p1, float3 p2 )
+{
+	const int pathIdx = get_global_id( 0 );
+	if (pathIdx >= pathCount) return;
+	if (pathIdx == 0) counter[0] = pathCount;
+	const int pixelIdx = pathIdx % (SCRWIDTH * SCRHEIGHT);
+	const int x = pixelIdx % SCRWIDTH, y = pixelIdx / SCRWIDTH;
+	uint seed = WangHash( pathIdx * 17 + 1 );
+	const float3 pixelPos = p0 +
+		(p1 - p0) * (((float)x + RandomFloat( &seed )) / SCRWIDTH) +
+		(p2 - p0) * (((float)y + RandomFloat( &seed )) / SCRHEIGHT);
+	rays[pathIdx].O4 = (float4)(camPos, as_float( pathIdx ));
+	const float spread = length( p1 - p0 ) / (SCRWIDTH * length( pixelPos - camPos ));
+	rays[pathIdx].D4 = (float4)(normalize( pixelPos - camPos ), spread);
+	rays[pathIdx].T4 = (float4)(1, 1, 1, 0);
+	accumulator[pathIdx] = (float4)(0, 0, 0, 0);
+}
+
+// stage 2: find the nearest intersection for each live ray
+__kernel void extend( __global struct PathRay* rays, __global struct Intersection* hits,
+	__global uint* counter, int depth,
+	__global struct Tri* triData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData, __global struct BVHNode* bvhNodeData, __global uint* idxData )
+{
+	const int rayIdx = get_global_id( 0 );
+	if (rayIdx >= counter[depth]) return;
+	struct Ray ray;
+	ray.O = rays[rayIdx].O4.xyz, ray.D = rays[rayIdx].D4.xyz;
+	ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+	TLASIntersect( &ray, triData, instData, tlasData, bvhNodeData, idxData );
+	hits[rayIdx] = ray.hit;
+}
+
+// stage 3: shade the hits; emits extension rays for mirrors and shadow rays for diffuse surfaces
+__kernel void shade( __global struct PathRay* rays, __global struct Intersection* hits,
+	__global struct PathRay* nextRays, __global struct ShadowRay* shadowRays,
+	__global uint* counter, __global float4* accumulator, int depth, int maxDepth,
+	__global uint* skyPixels, __global struct BVHInstance* instData,
+	__global struct Tri* triData, __global struct TriEx* triExData, __global uint* texData )
+{
+	const int rayIdx = get_global_id( 0 );
+	if (rayIdx >= counter[depth]) return;
+	const struct Intersection i = hits[rayIdx];
+	float3 O = rays[rayIdx].O4.xyz, D = rays[rayIdx].D4.xyz;
+	const float3 T = rays[rayIdx].T4.xyz;
+	const float width = rays[rayIdx].T4.w + rays[rayIdx].D4.w * i.t; // of the cone at the hit
+	float spread = rays[rayIdx].D4.w;
+	const uint pathIdx = as_uint( rays[rayIdx].O4.w );
+	if (i.t == 1e30f)
+	{
+		// sample sky
+		accumulator[pathIdx] += (float4)(T * SampleSky( &D, skyPixels ), 0);
+		return;
+	}
+	// calculate texture uv based on barycentrics
+	uint triIdx = PRIM_IDX( i.instPrim );
+	uint instIdx = INST_IDX( i.instPrim );
+	__global struct BVHInstance* inst = instData + instIdx, *outer = 0;
+#ifdef WIDE_INDICES
+	// nested TLAS: shade with the instance inside it, see NestedIntersect
+	if (inst->triOffset == NESTED_TLAS) outer = inst, inst = instData + outer->idxOffset + i.inner;
+#endif
+	__global struct TriEx* tri = triExData + inst->triOffset + triIdx;
+	float2 uv = i.u * tri->uv1 + i.v * tri->uv2 + (1 - (i.u + i.v)) * tri->uv0;
+	// calculate the normal for the intersection
+	float3 N0 = (float3)(tri->N0x, tri->N0y, tri->N0z);
+	float3 N1 = (float3)(tri->N1x, tri->N1y, tri->N1z);
+	float3 N2 = (float3)(tri->N2x, tri->N2y, tri->N2z);
+	float3 N = i.u * N1 + i.v * N2 + (1 - (i.u + i.v)) * N0;
+	N = normalize( TransformVector( &N, &inst->transform ) );
+	if (outer) N = normalize( TransformVector( &N, &outer->transform ) );
+	float lod = TextureLOD( inst, outer, triData + inst->triOffset + triIdx, tri, D, N, fabs( width ) );
+	float3 albedo = SampleTexture( inst, texData, uv, lod );
+	float3 I = O + D * i.t;
+	// shading
+	bool mirror = IS_MIRROR( instIdx );
+	if (mirror)
+	{
+		// specular reflection: continue the path, or sample the sky at the last bounce
+		float3 R = D - (2 * N * dot( N, D ));
+		if (depth + 1 >= maxDepth)
+		{
+			accumulator[pathIdx] += (float4)(T * SampleSky( &R, skyPixels ), 0);
+			return;
+		}
+		// curved mirrors change the spread of the reflected cone
+		spread += 2 * Curvature( inst, outer, triData + inst->triOffset + triIdx, tri ) * width;
+		uint newIdx = atomic_inc( &counter[depth + 1] );
+		nextRays[newIdx].O4 = (float4)(I + R * 0.005f, as_float( pathIdx ));
+		nextRays[newIdx].D4 = (float4)(R, spread);
+		nextRays[newIdx].T4 = (float4)(T, width);
+	}
+	else
+	{
+		// diffuse: ambient now, direct light if the shadow ray reaches the light
+		accumulator[pathIdx] += (float4)(T * albedo * ambient, 0);
+		float3 L = lightPos - I;
+		float dist = length( L );
+		L *= 1.0f / dist;
+		float NdotL = dot( N, L );
+		if (NdotL <= 0) return;
+		uint shadowIdx = atomic_inc( &counter[32 + depth] );
+		shadowRays[shadowIdx].O4 = (float4)(I + L * 0.005f, dist - 0.01f);
+		shadowRays[shadowIdx].D4 = (float4)(L, as_float( pathIdx ));
+		shadowRays[shadowIdx].E4 = (float4)(T * albedo * NdotL * lightColor * (1.0f / (dist * dist)), 0);
+	}
+}
+
+// optional stage between shade and extend: reorder the extension rays for the next depth by
+// direction octant and origin cell, so neighbouring threads traverse similar parts of the
+// scene. Three passes: count rays per bin, prefix sum over the bins, scatter.
+#define RAY_BINS	4096
+
+uint RayBin( const float4 O4, const float4 D4, __global struct TLASNode* root )
+{
+	// 3 bits per axis for the origin in the scene bounds, interleaved; octant in front
+	const float3 bmin = (float3)(root->minx, root->miny, root->minz);
+	const float3 bmax = (float3)(root->maxx, root->maxy, root->maxz);
+	const uint3 c = convert_uint3( clamp( (O4.xyz - bmin) * 8.0f / (bmax - bmin), 0.0f, 7.0f ) );
+	uint morton = 0;
+	for (int i = 2; i >= 0; i--) morton = (morton << 3) | (((c.x >> i) & 1) << 2) | (((c.y >> i) & 1) << 1) | ((c.z >> i) & 1);
+	const uint octant = (D4.x < 0 ? 1 : 0) + (D4.y < 0 ? 2 : 0) + (D4.z < 0 ? 4 : 0);
+	return (octant << 9) | morton;
+}
+
+__kernel void binRays( __global struct PathRay* rays, __global uint* counter, int depth,
+	__global uint* bins, __global struct TLASNode* tlasData )
+{
+	const int rayIdx = get_global_id( 0 );
+	if (rayIdx >= counter[depth]) return;
+	atomic_inc( &bins[RayBin( rays[rayIdx].O4, rays[rayIdx].D4, tlasData )] );
+}
+
+// exclusive prefix sum over the bin counts; runs as a single work group of 256 threads
+__kernel void scanBins( __global uint* bins )
+{
+	__local uint partial[256];
+	const int t = get_local_id( 0 ), first = t * (RAY_BINS / 256);
+	uint sum = 0;
+	for (int i = 0; i < RAY_BINS / 256; i++) sum += bins[first + i];
+	partial[t] = sum;
+	barrier( CLK_LOCAL_MEM_FENCE );
+	for (int offset = 1; offset < 256; offset <<= 1)
+	{
+		const uint v = t >= offset ? partial[t - offset] : 0;
+		barrier( CLK_LOCAL_MEM_FENCE );
+		partial[t] += v;
+		barrier( CLK_LOCAL_MEM_FENCE );
+	}
+	uint start = partial[t] - sum;
+	for (int i = 0; i < RAY_BINS / 256; i++)
+	{
+		const uint n = bins[first + i];
+		bins[first + i] = start, start += n;
+	}
+}
+
+// bins now holds the first slot of each bin; rays within a bin are not ordered
+__kernel void scatterRays( __global struct PathRay* rays, __global struct PathRay* sorted,
+	__global uint* counter, int depth, __global uint* bins, __global struct TLASNode* tlasData )
+{
+	const int rayIdx = get_global_id( 0 );
+	if (rayIdx >= counter[depth]) return;
+	sorted[atomic_inc( &bins[RayBin( rays[rayIdx].O4, rays[rayIdx].D4, tlasData )] )] = rays[rayIdx];
+}
+
+// stage 4: trace the shadow rays; unoccluded rays add their contribution
+__kernel void connect( __global struct ShadowRay* shadowRays, __global uint* counter,
+	__global float4* accumulator, int depth,
+	__global struct Tri* triData, __global struct TLASNode* tlasData,
+	__global struct BVHInstance* instData, __global struct BVHNode* bvhNodeData, __global uint* idxData )
+{
+	const int rayIdx = get_global_id( 0 );
+	if (rayIdx >= counter[32 + depth]) return;
+	struct Ray ray;
+	ray.O = shadowRays[rayIdx].O4.xyz, ray.D = shadowRays[rayIdx].D4.xyz;
+	if (IsOccluded( &ray, shadowRays[rayIdx].O4.w, triData, instData, tlasData, bvhNodeData, idxData )) return;
+	accumulator[as_uint( shadowRays[rayIdx].D4.w )] += shadowRays[rayIdx].E4;
+}
+
+// stage 5: average the paths of each pixel
+__kernel void finalize( write_only image2d_t target, __global float4* accumulator, int samplesPerPixel )
+{
+	const int pixelIdx = get_global_id( 0 );
+	if (pixelIdx >= SCRWIDTH * SCRHEIGHT) return;
+	float4 color = (float4)(0, 0, 0, 0);
+	for (int s = 0; s < samplesPerPixel; s++) color += accumulator[pixelIdx + s * SCRWIDTH * SCRHEIGHT];
+	write_imagef( target, (int2)(pixelIdx % SCRWIDTH, pixelIdx / SCRWIDTH), (float4)(color.xyz * (1.0f / samplesPerPixel), 1) );
+}
+
+// EOF
\ No newline at end of file
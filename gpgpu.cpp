@@ -26,6 +26,7 @@ void GPGPUApp::Init()
 	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
 	// prepare OpenCL
 	tracer = new Kernel( "cl/kernels.cl", "render" );
+	tracer->tracesRays = true;
 	target = new Buffer( SCRWIDTH * SCRHEIGHT * 4 ); // intermediate screen buffer / render target
 	skyData = new Buffer( skyWidth * skyHeight * 3 * sizeof( float ), skyPixels );
 	skyData->CopyToDevice();
@@ -36,13 +37,17 @@ void GPGPUApp::Init()
 	instData = new Buffer( 256 * sizeof( BVHInstance ), bvhInstance );
 	tlasData = new Buffer( tlas.nodesUsed * sizeof( TLASNode ), tlas.tlasNode );
 	bvhData = new Buffer( mesh->bvh->nodesUsed * sizeof( BVHNode ), mesh->bvh->bvhNode );
-	idxData = new Buffer( 1024 * sizeof( uint ), mesh->bvh->triIdx );
+	idxData = new Buffer( mesh->bvh->idxCount * sizeof( uint ), mesh->bvh->triIdx );
 	triData->CopyToDevice();
 	triExData->CopyToDevice();
 	texData->CopyToDevice();
 	instData->CopyToDevice();
 	bvhData->CopyToDevice();
 	idxData->CopyToDevice();
+	// per-frame TLAS and instance uploads go through the second queue; the ring keeps two
+	// buffers, each sized for one frame of the scene
+	instRing = new UploadRing( tlas.blasCount * sizeof( BVHInstance ) );
+	tlasRing = new UploadRing( tlas.nodesUsed * sizeof( TLASNode ) );
 }
 
 void GPGPUApp::AnimateScene()
@@ -56,7 +61,10 @@ void GPGPUApp::AnimateScene()
 		else R = mat4::Translate( 0, h[i / 2], 0 );
 		if ((a[i] += (((i * 13) & 7) + 2) * 0.005f) > 2 * PI) a[i] -= 2 * PI;
 		if ((s[i] -= 0.01f, h[i] += s[i]) < 0) s[i] = 0.2f;
-		bvhInstance[i].SetTransform( T * R * mat4::Scale( 1.5f ) );
+		const mat4 M = T * R * mat4::Scale( 1.5f );
+		if (!memcmp( bvhInstance[i].GetTransform().cell, M.cell, sizeof( mat4 ) )) continue;
+		bvhInstance[i].SetTransform( M );
+		instDirty.Mark( i );
 	}
 	// update the TLAS
 	tlas.Build();
@@ -66,7 +74,11 @@ void GPGPUApp::Tick( float deltaTime )
 {
 	// update the TLAS
 	AnimateScene();
-	tlasData->CopyToDevice();
+	// only the instances that moved and the TLAS nodes that changed are sent
+	instData = instRing->Upload( bvhInstance, tlas.blasCount * sizeof( BVHInstance ), &instDirty, sizeof( BVHInstance ) );
+	instDirty.Clear();
+	tlasData = tlasRing->Upload( tlas.tlasNode, tlas.nodesUsed * sizeof( TLASNode ), &tlas.dirty, sizeof( TLASNode ) );
+	tlas.dirty.Clear();
 	// setup screen plane in world space
 	static float angle = 0, ar = (float)SCRWIDTH / SCRHEIGHT; angle += 0.001f;
 	mat4 M1 = mat4::RotateY( angle ), M2 = M1 * mat4::RotateX( -0.65f );
@@ -81,6 +93,7 @@ void GPGPUApp::Tick( float deltaTime )
 		camPos, p0, p1, p2 
 	);
 	tracer->Run( SCRWIDTH * SCRHEIGHT );
+	instRing->Release(), tlasRing->Release();
 	// obtain the rendered result
 	target->CopyFromDevice();
 	memcpy( screen->pixels, target->GetHostPtr(), target->size );
@@ -38,6 +38,8 @@ public:
 	Buffer* instData;	// buffer for BVHInstance data
 	Buffer* bvhData;	// buffer for BVH node data
 	Buffer* idxData;	// buffer for triangle index data for BVH
+	UploadRing* instRing, *tlasRing;	// double-buffered per-frame uploads
+	DirtyRanges instDirty;	// instances that moved since the last upload
 };
 
 } // namespace Tmpl8
\ No newline at end of file
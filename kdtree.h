@@ -14,7 +14,7 @@ public:
 		union { __m128 bmin4; struct { float3 bmin; float w0; }; };			// 16 bytes
 		union { __m128 bmax4; struct { float3 bmax; float w1; }; };			// 16 bytes
 		union { __m128 minSize4; struct { float3 minSize; float w2; }; };	// 16 bytes, total: 64 bytes
-		bool isLeaf() { return (parax & 7) > 3; }
+		bool isLeaf() const { return (parax & 7) > 3; }
 	};
 	void swap( const uint a, const uint b )
 	{
@@ -28,10 +28,22 @@ public:
 		blasCount = N;				// blasCount remains constant
 		tlasCount = N;				// tlasCount will grow during aggl. clustering
 		offset = O;					// index of the first TLAS node in the array
-		if (!leaf) leaf = new uint[100000];
 		node = (KDNode*)_aligned_malloc( sizeof( KDNode ) * N * 2, 64 ); // pre-allocate kdtree nodes, aligned
 		tlasIdx = new uint[N * 2 + 64]; // tlas array indirection so we can store ranges of nodes in leaves
 	}
+	static void ReserveLeafMap( const uint N )
+	{
+		// the leaf map is indexed by TLAS node index and shared between trees
+		if (N <= leafMapSize) return;
+		delete[] leaf;
+		leaf = new uint[leafMapSize = N];
+	}
+	void rebuild( const uint N )
+	{
+		// over the first N TLAS nodes, for a tree that is reused with fewer nodes
+		blasCount = N;
+		rebuild();
+	}
 	void rebuild()
 	{
 		// we'll assume we get the same number of TLAS nodes each time
@@ -230,7 +242,7 @@ public:
 		__m128& tlasAbmin4 = state.tlasAbmin4;
 		__m128& tlasAbmax4 = state.tlasAbmax4;
 		tlasAbmin4 = _mm_setr_ps( tlas[A].aabbMin.x, tlas[A].aabbMin.y, tlas[A].aabbMin.z, 0 );
-		tlasAbmax4 = _mm_setr_ps( tlas[A].aabbMax.x, tlas[A].aabbMin.y, tlas[A].aabbMin.z, 0 );
+		tlasAbmax4 = _mm_setr_ps( tlas[A].aabbMax.x, tlas[A].aabbMax.y, tlas[A].aabbMax.z, 0 );
 		float3 tlasAbmin = *(float3*)&state.tlasAbmin4;
 		float3 tlasAbmax = *(float3*)&state.tlasAbmax4;
 		__m128& Pa4 = state.Pa4;
@@ -292,9 +304,80 @@ public:
 		startSA = smallestSA;
 		return bestB + offset;
 	}
+	// batched FindNearest for the consecutive TLAS nodes first .. first + count - 1 (count <= 4),
+	// for locally-ordered clustering: the query boxes are stored in SoA layout, so the lower
+	// bound for a subtree and the union areas are calculated for all four queries at once. The
+	// tree is not modified, so batches may run in parallel. Queries should be spatially close,
+	// so that they share most of their traversal.
+	void FindNearest4( const uint first, const uint count, uint* nearest, float* nearestSA )
+	{
+		__m128 Amin[3], Amax[3], P[3], extent[3], halfExtent[3];
+		const __m128 half4 = _mm_set_ps1( 0.5f );
+		for (int a = 0; a < 3; a++)
+		{
+			float lo[4], hi[4];
+			for (uint i = 0; i < 4; i++)
+			{
+				const TLASNode& n = tlas[first - offset + min( i, count - 1 )]; // unused lanes repeat a query
+				lo[i] = n.aabbMin.cell[a], hi[i] = n.aabbMax.cell[a];
+			}
+			Amin[a] = _mm_loadu_ps( lo ), Amax[a] = _mm_loadu_ps( hi );
+			P[a] = _mm_mul_ps( half4, _mm_add_ps( Amin[a], Amax[a] ) );
+			extent[a] = _mm_sub_ps( Amax[a], Amin[a] ), halfExtent[a] = _mm_mul_ps( half4, extent[a] );
+		}
+		const __m128i A4 = _mm_add_epi32( _mm_set1_epi32( first - offset ), _mm_setr_epi32( 0, 1, 2, 3 ) );
+		__m128 smallestSA4 = _mm_set_ps1( 1e30f );
+		__m128i bestB4 = _mm_set1_epi32( 0 );
+		// lower bound for the union area of each query with anything in a subtree, as in FindNearest
+		auto bound = [&]( const KDNode& c )
+		{
+			__m128 d[3];
+			for (int a = 0; a < 3; a++)
+			{
+				const __m128 v0 = _mm_max_ps( _mm_sub_ps( _mm_set_ps1( c.bmin.cell[a] ), P[a] ), _mm_sub_ps( P[a], _mm_set_ps1( c.bmax.cell[a] ) ) );
+				d[a] = _mm_max_ps( extent[a], _mm_sub_ps( v0, _mm_add_ps( _mm_set_ps1( c.minSize.cell[a] ), halfExtent[a] ) ) );
+			}
+			const __m128 sa4 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( d[0], d[1] ), _mm_mul_ps( d[1], d[2] ) ), _mm_mul_ps( d[2], d[0] ) );
+			return _mm_movemask_ps( _mm_cmplt_ps( sa4, smallestSA4 ) );
+		};
+		uint stack[60], stackPtr = 0, n = 0;
+		while (1)
+		{
+			const KDNode& kn = node[n];
+			if (kn.isLeaf())
+			{
+				for (uint i = 0; i < kn.count; i++)
+				{
+					const uint B = tlasIdx[kn.first + i];
+					__m128 size[3];
+					for (int a = 0; a < 3; a++)
+						size[a] = _mm_sub_ps( _mm_max_ps( Amax[a], _mm_set_ps1( tlas[B].aabbMax.cell[a] ) ), _mm_min_ps( Amin[a], _mm_set_ps1( tlas[B].aabbMin.cell[a] ) ) );
+					const __m128 SA = _mm_add_ps( _mm_add_ps( _mm_mul_ps( size[0], size[1] ), _mm_mul_ps( size[1], size[2] ) ), _mm_mul_ps( size[2], size[0] ) );
+					const __m128i B4 = _mm_set1_epi32( B );
+					const __m128 better = _mm_andnot_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( B4, A4 ) ), _mm_cmplt_ps( SA, smallestSA4 ) );
+					smallestSA4 = _mm_blendv_ps( smallestSA4, SA, better );
+					bestB4 = _mm_castps_si128( _mm_blendv_ps( _mm_castsi128_ps( bestB4 ), _mm_castsi128_ps( B4 ), better ) );
+				}
+			}
+			else
+			{
+				// near child first, as seen from the first query
+				uint nearNode = kn.left, farNode = kn.right;
+				if (P[kn.parax & 7].m128_f32[0] > kn.splitPos) nearNode = kn.right, farNode = kn.left;
+				const int visitNear = bound( node[nearNode] ), visitFar = bound( node[farNode] );
+				if (visitNear && visitFar) { stack[stackPtr++] = farNode, n = nearNode; continue; }
+				if (visitNear | visitFar) { n = visitNear ? nearNode : farNode; continue; }
+			}
+			if (stackPtr == 0) break;
+			n = stack[--stackPtr];
+		}
+		for (uint i = 0; i < count; i++)
+			nearest[i] = ((uint*)&bestB4)[i] + offset, nearestSA[i] = smallestSA4.m128_f32[i];
+	}
 	// data
 	KDNode* node = 0;
 	TLASNode* tlas = 0;
 	uint* tlasIdx = 0, nodePtr = 1, tlasCount = 0, blasCount = 0, offset = 0, freed[2] = { 0, 0 };
 	inline static uint* leaf = 0; // will be shared between trees
+	inline static uint leafMapSize = 0;
 };
\ No newline at end of file
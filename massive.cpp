@@ -15,6 +15,34 @@
 // on less powerful hardware increase this number to reduce the number of dragons
 #define SKIP 10
 
+// render with the wavefront path tracer (cl/wavefront.cl); value is the maximum path length
+// #define WAVEFRONT 4
+// with WAVEFRONT: sort the extension rays by octant and origin cell before each bounce
+// #define REORDER_RAYS
+
+// render with persistent threads that pull pixel batches from a global counter, one batch
+// per sub-group (warp); compare against the default kernel before enabling it
+// #define PERSISTENT_THREADS
+
+// simplified BLAS levels for distant dragons; the level of each instance follows its projected size
+// #define BLAS_LOD
+
+// multi-level instancing: the dragon of dragons becomes a nested TLAS, and the top level holds
+// this many instances of it, on a circle around the original (not combined with BLAS_LOD)
+// #define NESTED 8
+
+// render part of the screen on the CPU, with a split that follows the throughput of both
+// #define HYBRID
+
+// one sample per pixel, denoised with temporal accumulation and an a-trous filter (cl/denoise.cl)
+// #define DENOISE
+
+// BLAS_STREAMING (template/common.h) pages the geometry into the device on demand; it is not
+// combined with NESTED or BLAS_LOD, which set the scene offsets of instances themselves
+#if defined BLAS_STREAMING && (defined NESTED || defined BLAS_LOD)
+#error BLAS_STREAMING is not combined with NESTED or BLAS_LOD
+#endif
+
 TheApp* CreateApp() { return new MassiveApp(); }
 
 // MassiveApp implementation
@@ -90,50 +118,96 @@ void MassiveApp::HandleKeys()
 void MassiveApp::Init()
 {
 	mesh = new Mesh( "assets/dragon.obj", "assets/bricks.png" );
+#ifdef BLAS_LOD
+	mesh->BuildLODs( 4 );
+#endif
 	// load HDR sky
 	skyPixels = stbi_loadf( "assets/sky_19.hdr", &skyWidth, &skyHeight, &skyBpp, 0 );
 	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
 	// dragons in the shape of a dragon
 	int instanceCounter = 0;
-	bvhInstance = new BVHInstance[11042];
-	for( int i = 0; i < 11042; i++ )
+	bvhInstance = new BVHInstance[mesh->vertexCount];
+	for( int i = 0; i < mesh->vertexCount; i++ )
 	{
 		if (i % SKIP == 0) {
+			// OBJ normals are indexed separately and may be missing, so N may be shorter than P
+			const float3 N = i < mesh->normalCount ? mesh->N[i] : float3( 0, 1, 0 );
 			bvhInstance[instanceCounter] = BVHInstance(mesh->bvh, instanceCounter);
 			bvhInstance[instanceCounter].SetTransform(
 				mat4::Translate(mesh->P[i] * 0.2f) *
 				mat4::Scale(0.0025f) *
-				mat4::Rotate(mesh->N[i], 0) *
+				mat4::Rotate(N, 0) *
 				mat4::RotateX(PI / 2)
 			);
 			instanceCounter++;
 		}
 	}
-	tlas = TLAS( bvhInstance, instanceCounter );
+	scene.AddMesh( mesh );
 	Timer t;
+#ifdef NESTED
+	// each copy costs one instance, instead of instanceCounter
+	cluster = TLAS( bvhInstance, instanceCounter );
+	cluster.Build();
+	nestedInstance = new BVHInstance[NESTED];
+	for (int i = 0; i < NESTED; i++)
+	{
+		nestedInstance[i] = BVHInstance( &cluster, i );
+		nestedInstance[i].SetTransform( mat4::RotateY( i * 2 * PI / NESTED ) * mat4::Translate( float3( i ? 60.0f : 0, 0, 0 ) ) );
+	}
+	tlas = TLAS( nestedInstance, NESTED );
+#else
+	tlas = TLAS( bvhInstance, instanceCounter );
+#endif
 	tlas.Build();
 	printf( "building TLAS took %.2fms.\n", t.elapsed() * 1000 );
 	// prepare OpenCL
 	tracer = new Kernel( "cl/raytracer.cl", "render" );
+	tracer->tracesRays = true;
+#ifdef WAVEFRONT
+	wavefront = new WavefrontTracer( 2, WAVEFRONT );
+#ifdef REORDER_RAYS
+	wavefront->reorder = true;
+#endif
+#endif
+#ifdef HYBRID
+	hybrid = new HybridRenderer( tracer );
+#elif defined MULTI_DEVICE
+	multiGPU = new MultiGPURenderer( tracer );
+#elif defined DENOISE
+	denoiser = new Denoiser( tracer );
+#endif
+#ifdef PERSISTENT_THREADS
+	persistentTracer = new Kernel( tracer->GetProgram(), "renderPersistent" );
+	persistentTracer->tracesRays = true;
+	pixelCounter = new Buffer( sizeof( uint ) );
+	cl_uint computeUnits = 1;
+	clGetDeviceInfo( Kernel::GetDevice(), CL_DEVICE_MAX_COMPUTE_UNITS, sizeof( cl_uint ), &computeUnits, 0 );
+	// a few work groups of 64 per compute unit to hide latency, but far fewer than pixels
+	persistentThreads = min( computeUnits * 64 * 16, (uint)(SCRWIDTH * SCRHEIGHT) );
+#endif
 	target = new Buffer( GetRenderTarget()->ID, 0, Buffer::TARGET );
 	screen = 0;
 	// target = new Buffer( SCRWIDTH * SCRHEIGHT * 4 ); // intermediate screen buffer / render target
-	skyData = new Buffer( skyWidth * skyHeight * 3 * sizeof( float ), skyPixels );
-	skyData->CopyToDevice();
-	triData = new Buffer( mesh->triCount * sizeof( Tri ), mesh->tri );
-	triExData = new Buffer( mesh->triCount * sizeof( TriEx ), mesh->triEx );
-	Surface* tex = mesh->texture;
-	texData = new Buffer( tex->width * tex->height * sizeof( uint ), tex->pixels );
+	skyData = SkyDome( skyPixels, skyWidth, skyHeight ).skyData;
+	stbi_image_free( skyPixels ), skyPixels = 0;
+	// upload geometry; instances receive the offsets of their BLAS in the scene buffers
+#ifdef NESTED
+	TLASNode* nodes;
+	BVHInstance* instances;
+	uint nodeCount, instCount;
+	scene.PackTLAS( tlas, nodes, instances, nodeCount, instCount );
+	instData = new Buffer( instCount * sizeof( BVHInstance ), instances );
+	tlasData = new Buffer( nodeCount * sizeof( TLASNode ), nodes );
+#else
+	// with BLAS_STREAMING, no BLAS is resident yet; the first frames request them
+	scene.SetInstances( bvhInstance, instanceCounter );
 	instData = new Buffer( instanceCounter * sizeof( BVHInstance ), bvhInstance );
 	tlasData = new Buffer( instanceCounter * 2 * sizeof( TLASNode ), tlas.tlasNode );
-	bvhData = new Buffer( mesh->bvh->nodesUsed * sizeof( BVHNode ), mesh->bvh->bvhNode );
-	idxData = new Buffer( mesh->triCount * sizeof( uint ), mesh->bvh->triIdx );
-	triData->CopyToDevice();
-	triExData->CopyToDevice();
-	texData->CopyToDevice();
+#endif
+	scene.Upload();
+	triData = scene.triData, triExData = scene.triExData, texData = scene.texData;
+	bvhData = scene.bvhData, idxData = scene.idxData;
 	instData->CopyToDevice();
-	bvhData->CopyToDevice();
-	idxData->CopyToDevice();
 	tlasData->CopyToDevice();
 }
  
@@ -156,13 +230,41 @@ void MassiveApp::Tick( float deltaTime )
 	p0 = TransformPosition( float3( -1 * ar, 1, 1.5f ), M );
 	p1 = TransformPosition( float3( 1 * ar, 1, 1.5f ), M );
 	p2 = TransformPosition( float3( -1 * ar, -1, 1.5f ), M );
+#ifdef BLAS_LOD
+	// the instance bounds do not change with the level, so only the instance data is updated
+	const float pixelAngle = length( p1 - p0 ) / (SCRWIDTH * length( (p1 + p2) * 0.5f - camPos ));
+	if (scene.SelectLOD( bvhInstance, tlas.blasCount, camPos, pixelAngle )) instData->CopyToDevice();
+#endif
+#ifdef BLAS_STREAMING
+	// load the BLASes that the last frame requested; their instances now point at the pool
+	scene.Update();
+	if (!scene.dirty.Empty()) instData->CopyToDevice(), scene.dirty.Clear();
+#endif
 	// render the scene using the GPU
+#ifdef WAVEFRONT
+	wavefront->Render( target, skyData, scene, tlasData, instData, camPos, p0, p1, p2 );
+#elif defined HYBRID
+	hybrid->Render( target, skyData, scene, tlas, tlasData, instData, camPos, p0, p1, p2 );
+#elif defined MULTI_DEVICE
+	multiGPU->Render( target, skyData, scene, tlasData, instData, camPos, p0, p1, p2 );
+#elif defined DENOISE
+	denoiser->Render( target, skyData, scene, tlasData, instData, camPos, p0, p1, p2 );
+#elif defined PERSISTENT_THREADS
+	pixelCounter->Clear();
+	persistentTracer->SetArguments( 
+		target, skyData, 
+		triData, triExData, texData, tlasData, instData, bvhData, idxData, 
+		camPos, p0, p1, p2, pixelCounter 
+	);
+	persistentTracer->Run( persistentThreads, 64 );
+#else
 	tracer->SetArguments( 
 		target, skyData, 
 		triData, triExData, texData, tlasData, instData, bvhData, idxData, 
 		camPos, p0, p1, p2 
 	);
 	tracer->Run( SCRWIDTH * SCRHEIGHT );
+#endif
 	// obtain the rendered result
 	// target->CopyFromDevice();
 	// memcpy( screen->pixels, target->GetHostPtr(), target->size );
@@ -24,10 +24,19 @@ public:
 	Mesh* mesh;
 	BVHInstance* bvhInstance;
 	TLAS tlas;
+	TLAS cluster;		// the dragon of dragons, as a nested TLAS (NESTED)
+	BVHInstance* nestedInstance;	// top level instances of cluster (NESTED)
 	float3 p0, p1, p2;	// virtual screen plane corners
 	float* skyPixels;
 	int skyWidth, skyHeight, skyBpp;
 	Kernel* tracer;		// the ray tracing kernel
+	WavefrontTracer* wavefront;	// alternative renderer (WAVEFRONT)
+	HybridRenderer* hybrid;	// CPU + GPU renderer (HYBRID)
+	MultiGPURenderer* multiGPU;	// renderer for all GPUs (MULTI_DEVICE, template/common.h)
+	Denoiser* denoiser;	// one sample per pixel, filtered (DENOISE)
+	Kernel* persistentTracer;	// ray tracing kernel for PERSISTENT_THREADS
+	Buffer* pixelCounter;	// next pixel to render (PERSISTENT_THREADS)
+	uint persistentThreads;	// launch size for PERSISTENT_THREADS
 	Buffer* target;		// buffer encapsulating texture that holds the rendered image
 	Buffer* skyData;	// buffer for the skydome texture
 	Buffer* triData;	// buffer for the mesh Tri data (vertices for intersection)
@@ -37,6 +46,11 @@ public:
 	Buffer* instData;	// buffer for BVHInstance data
 	Buffer* bvhData;	// buffer for BVH node data
 	Buffer* idxData;	// buffer for triangle index data for BVH
+#ifdef BLAS_STREAMING
+	StreamingScene scene;	// device pool of BLAS slots, filled on demand (template/common.h)
+#else
+	Scene scene;		// consolidated geometry buffers for all meshes
+#endif
 };
 
 } // namespace Tmpl8
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include "precomp.h"
+#include "bvh.h"
+#include "whitted.h"
+#include "offline.h"
+
+// THIS SOURCE FILE:
+// Headless offline renderer for the scene of article 8 (whitted.cpp).
+// Resolution, samples per pixel and camera are taken from the command line:
+//   offline.exe [-w 1920] [-h 1080] [-spp 16] [-tile 64] [-gpu]
+//               [-cam px py pz tx ty tz] [-blur frames] [-o offline.ppm]
+// The image is rendered in tiles of full image width and 'tile' rows; each
+// tile is written to disk as soon as it is done, so the size of the image is
+// not limited by memory. Output is a PPM, or a PFM if the file name ends in
+// .pfm. The CPU path uses WhittedApp::Trace, the GPU path the renderTile
+// kernel in raytracer.cl. With -blur, the shutter stays open for the given
+// number of animation frames, and each sample is taken at a random time in
+// that interval, using a MotionTLAS (CPU path only). The project defines HEADLESS, see template.cpp,
+// and OFFLINE, which removes CreateApp from whitted.cpp.
+
+TheApp* CreateApp() { return new OfflineApp(); }
+
+// OfflineApp implementation
+
+void OfflineApp::ParseCommandLine()
+{
+	for (int i = 1; i < __argc; i++)
+	{
+		const char* a = __argv[i];
+		const bool hasValue = i + 1 < __argc;
+		if (!strcmp( a, "-w" ) && hasValue) width = atoi( __argv[++i] );
+		else if (!strcmp( a, "-h" ) && hasValue) height = atoi( __argv[++i] );
+		else if (!strcmp( a, "-spp" ) && hasValue) spp = atoi( __argv[++i] );
+		else if (!strcmp( a, "-tile" ) && hasValue) tileRows = atoi( __argv[++i] );
+		else if (!strcmp( a, "-o" ) && hasValue) fileName = __argv[++i];
+		else if (!strcmp( a, "-gpu" )) useGPU = true;
+		else if (!strcmp( a, "-blur" ) && hasValue) blurFrames = atoi( __argv[++i] );
+		else if (!strcmp( a, "-cam" ) && i + 6 < __argc)
+		{
+			camPos.x = (float)atof( __argv[i + 1] ), camPos.y = (float)atof( __argv[i + 2] );
+			camPos.z = (float)atof( __argv[i + 3] ), camTarget.x = (float)atof( __argv[i + 4] );
+			camTarget.y = (float)atof( __argv[i + 5] ), camTarget.z = (float)atof( __argv[i + 6] );
+			i += 6;
+		}
+		else FatalError( "unknown or incomplete option: %s", a );
+	}
+	if (width < 1 || height < 1 || spp < 1 || tileRows < 1) FatalError( "invalid resolution, spp or tile size." );
+	if (blurFrames < 0 || (blurFrames > 0 && useGPU)) FatalError( "-blur takes a frame count, and is not supported with -gpu." );
+	tileRows = min( tileRows, height );
+}
+
+void OfflineApp::Init()
+{
+	ParseCommandLine();
+	// scene: the first frame of the Whitted demo
+	WhittedApp::Init();
+	AnimateScene();
+	if (blurFrames > 0)
+	{
+		// motion blur: the first frame opens the shutter, a later one closes it
+		memcpy( shutterOpen, bvhInstance, 16 * sizeof( BVHInstance ) );
+		for (int i = 0; i < blurFrames; i++) AnimateScene();
+		motion = new MotionTLAS( shutterOpen, bvhInstance, 16 );
+		motion->Build();
+	}
+	// setup screen plane in world space; same field of view as the Whitted demo
+	float aspectRatio = (float)width / height;
+	float3 V = normalize( camTarget - camPos );
+	float3 R = normalize( cross( float3( 0, 1, 0 ), V ) );
+	float3 U = cross( V, R );
+	p0 = camPos + 1.5f * V - aspectRatio * R + U;
+	p1 = camPos + 1.5f * V + aspectRatio * R + U;
+	p2 = camPos + 1.5f * V - aspectRatio * R - U;
+	dx = (p1 - p0) * (1.0f / width), dy = (p2 - p0) * (1.0f / height);
+	// tile storage
+	tile = (float4*)_aligned_malloc( width * tileRows * sizeof( float4 ), 64 );
+	row = new uchar[width * 12];
+	if (useGPU)
+	{
+		// prepare OpenCL
+		tracer = new Kernel( "cl/raytracer.cl", "renderTile" );
+		tracer->tracesRays = true;
+		tileData = new Buffer( width * tileRows * sizeof( float4 ), tile );
+		skyData = SkyDome( skyPixels, skyWidth, skyHeight ).skyData;
+		scene.AddMesh( mesh );
+		scene.SetInstances( bvhInstance, 16 );
+		scene.Upload();
+		instData = new Buffer( 16 * sizeof( BVHInstance ), bvhInstance );
+		tlasData = new Buffer( tlas.nodesUsed * sizeof( TLASNode ), tlas.tlasNode );
+		instData->CopyToDevice();
+		tlasData->CopyToDevice();
+	}
+	// open the output file
+	const char* ext = strrchr( fileName, '.' );
+	pfm = ext && !_stricmp( ext, ".pfm" );
+	out = fopen( fileName, "wb" );
+	if (!out) FatalError( "could not open %s for writing.", fileName );
+	if (pfm) fprintf( out, "PF\n%i %i\n-1.0\n", width, height ); // negative scale: little endian
+	else fprintf( out, "P6\n%i %i\n255\n", width, height );
+	// render the image one tile at a time; for PFM, start at the bottom
+	Timer t;
+	const int tiles = (height + tileRows - 1) / tileRows;
+	for (int i = 0; i < tiles; i++)
+	{
+		const int firstRow = (pfm ? tiles - 1 - i : i) * tileRows, rows = min( tileRows, height - firstRow );
+		if (useGPU) RenderTileGPU( firstRow, rows ); else RenderTileCPU( firstRow, rows );
+		WriteTile( firstRow, rows );
+		printf( "tile %i of %i done, %.1fs\r", i + 1, tiles, t.elapsed() );
+	}
+	fclose( out );
+	printf( "\n%ix%i pixels, %i spp, rendered in %.2fs; saved to %s\n", width, height, spp, t.elapsed(), fileName );
+}
+
+void OfflineApp::RenderTileCPU( int firstRow, int rows )
+{
+	JobManager::GetJobManager()->ParallelFor( width * rows, [&]( int i )
+	{
+		const int x = i % width, y = firstRow + i / width;
+		// seed per image pixel, so the result does not depend on the tile size
+		uint seed = (x + y * width) * 17 + 1;
+		float3 color( 0 );
+		for (int s = 0; s < spp; s++)
+		{
+			Ray ray;
+			ray.O = camPos;
+			float3 pixelPos = p0 + dx * (x + RandomFloat( seed )) + dy * (y + RandomFloat( seed ));
+			ray.D = normalize( pixelPos - ray.O );
+			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+			ray.coneSpread = length( dx ) / length( pixelPos - camPos );
+			if (motion) ray.time = RandomFloat( seed );
+			color += Trace( ray );
+		}
+		tile[i] = float4( color * (1.0f / spp), 1 );
+	}, 64 );
+}
+
+void OfflineApp::RenderTileGPU( int firstRow, int rows )
+{
+	tracer->SetArguments( 
+		tileData, skyData, 
+		scene.triData, scene.triExData, scene.texData, tlasData, instData, scene.bvhData, scene.idxData, 
+		camPos, p0 + dy * (float)firstRow, dx, dy, width, rows, spp, firstRow * width 
+	);
+	tracer->Run( width * rows );
+	tileData->CopyFromDevice();
+}
+
+void OfflineApp::WriteTile( int firstRow, int rows )
+{
+	for (int r = 0; r < rows; r++)
+	{
+		const float4* src = tile + (pfm ? rows - 1 - r : r) * width;
+		if (pfm)
+		{
+			float* dst = (float*)row;
+			for (int x = 0; x < width; x++) dst[x * 3] = src[x].x, dst[x * 3 + 1] = src[x].y, dst[x * 3 + 2] = src[x].z;
+			fwrite( row, 12, width, out );
+		}
+		else
+		{
+			for (int x = 0; x < width; x++)
+				row[x * 3] = (uchar)min( 255, (int)(255 * src[x].x) ),
+				row[x * 3 + 1] = (uchar)min( 255, (int)(255 * src[x].y) ),
+				row[x * 3 + 2] = (uchar)min( 255, (int)(255 * src[x].z) );
+			fwrite( row, 3, width, out );
+		}
+	}
+}
+
+// EOF
@@ -0,0 +1,37 @@
+#pragma once
+
+namespace Tmpl8
+{
+
+// application class: renders a single frame of the Whitted scene to disk, without a window
+class OfflineApp : public WhittedApp
+{
+public:
+	// game flow methods
+	void Init();
+	void ParseCommandLine();
+	void RenderTileCPU( int firstRow, int rows );
+	void RenderTileGPU( int firstRow, int rows );
+	void WriteTile( int firstRow, int rows );
+	void Tick( float deltaTime ) { /* the image is rendered in Init */ }
+	// settings, see ParseCommandLine
+	int width = 1920, height = 1080, spp = 16, tileRows = 64;
+	bool useGPU = false;
+	int blurFrames = 0;	// animation frames the shutter stays open; 0: no motion blur
+	float3 camPos = float3( 0, -2, -8.5f ), camTarget = float3( 0, -1.39f, -7.70f );
+	const char* fileName = "offline.ppm";
+	// data members
+	float3 dx, dy;		// size of a pixel on the screen plane; p0 is its top-left corner
+	float4* tile;		// the tile that is being rendered: full image width, tileRows rows
+	uchar* row;		// output scanline
+	FILE* out;		// output image, written one tile at a time
+	bool pfm;		// floating point output; PFM stores the rows bottom to top
+	Kernel* tracer;		// the ray tracing kernel (useGPU)
+	Buffer* tileData;	// buffer for the tile pixels
+	Buffer* skyData;	// buffer for the skydome texture
+	Buffer* tlasData;	// buffer to store the TLAS
+	Buffer* instData;	// buffer for BVHInstance data
+	Scene scene;		// consolidated geometry buffers
+};
+
+} // namespace Tmpl8
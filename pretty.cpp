@@ -49,6 +49,11 @@ void PrettyApp::AnimateScene()
 float3 PrettyApp::Trace( Ray& ray )
 {
 	tlas.Intersect( ray );
+	return Shade( ray );
+}
+
+float3 PrettyApp::Shade( Ray& ray )
+{
 	Intersection i = ray.hit;
 	if (i.t == 1e30f) return float3( 0 );
 	return float3( i.u, i.v, 1 - (i.u + i.v) );
@@ -59,25 +64,37 @@ void PrettyApp::Tick( float deltaTime )
 	// update the TLAS
 	AnimateScene();
 	// render the scene: multithreaded tiles
-#pragma omp parallel for schedule(dynamic)
-	for (int tile = 0; tile < (SCRWIDTH * SCRHEIGHT / 64); tile++)
+	JobManager::GetJobManager()->ParallelFor( SCRWIDTH * SCRHEIGHT / 64, [&]( int tile )
 	{
 		// render an 8x8 tile
 		int x = tile % (SCRWIDTH / 8), y = tile / (SCRWIDTH / 8);
 		Ray ray;
 		ray.O = float3( 0, 3, -6.5f );
-		for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++)
+		for (int p = 0; p < 64 / PACKET_SIZE; p++)
 		{
-			// setup a primary ray
-			float3 pixelPos = ray.O + p0 +
-				(p1 - p0) * ((x * 8 + u) / (float)SCRWIDTH) +
-				(p2 - p0) * ((y * 8 + v) / (float)SCRHEIGHT);
-			ray.D = normalize( pixelPos - ray.O );
-			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-			uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
-			accumulator[pixelAddress] = Trace( ray );
+			// setup a packet of primary rays, 4 pixels wide
+			RayPacket packet;
+			for (int i = 0; i < PACKET_SIZE; i++)
+			{
+				int u = (p & 1) * 4 + (i & 3), v = (p >> 1) * (PACKET_SIZE / 4) + (i >> 2);
+				float3 pixelPos = ray.O + p0 +
+					(p1 - p0) * ((x * 8 + u) / (float)SCRWIDTH) +
+					(p2 - p0) * ((y * 8 + v) / (float)SCRHEIGHT);
+				ray.D = normalize( pixelPos - ray.O );
+				ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
+				packet.SetRay( i, ray );
+			}
+			// trace the packet, then shade the rays one by one
+			tlas.Intersect( packet );
+			for (int i = 0; i < PACKET_SIZE; i++)
+			{
+				int u = (p & 1) * 4 + (i & 3), v = (p >> 1) * (PACKET_SIZE / 4) + (i >> 2);
+				packet.GetRay( i, ray );
+				uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
+				accumulator[pixelAddress] = Shade( ray );
+			}
 		}
-	}
+	} );
 	// convert the floating point accumulator into pixels
 	for( int i = 0; i < SCRWIDTH * SCRHEIGHT; i++ )
 	{
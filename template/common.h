@@ -14,6 +14,54 @@
 #define SQRT_PI_INV	0.56418958355f
 #define LARGE_FLOAT	1e34f
 
+// BLAS traversal on CPU and GPU using 64-byte 4-wide nodes with 8-bit quantized child bounds
+// #define BVH_QUANTIZED
+
+// scene textures on the GPU are stored block-compressed (BC1: a 4x4 texel block in 64 bits),
+// for 8x less memory and texture bandwidth than 32-bit texels
+// #define TEXTURE_BC1
+
+// hit records pack a 12-bit instance index and a 20-bit primitive index in 32 bits; with
+// WIDE_INDICES they are 64 bits, holding full 32-bit instance and primitive indices. The
+// compact 16-byte Intersection suffices for scenes up to 4096 instances of 1M triangles.
+#define WIDE_INDICES
+#ifdef WIDE_INDICES
+#ifdef __OPENCL_VERSION__
+typedef ulong instprim;
+#else
+typedef unsigned long long instprim;
+#endif
+#define INST_PRIM( inst, prim )	(((instprim)(inst) << 32) + (prim))
+#define INST_IDX( instPrim )	((uint)((instPrim) >> 32))
+#define PRIM_IDX( instPrim )	((uint)(instPrim))
+#else
+typedef uint instprim;
+#define INST_PRIM( inst, prim )	(((inst) << 20) + (prim))
+#define INST_IDX( instPrim )	((instPrim) >> 20)
+#define PRIM_IDX( instPrim )	((instPrim) & 0xfffff)
+#endif
+
+// shading of the demo scenes, shared by cl/raytracer.cl, cl/wavefront.cl and HybridRenderer:
+// one point light plus a constant ambient term; instances for which IS_MIRROR holds are mirrors
+#define IS_MIRROR( instIdx )	((((instIdx) * 17) & 1) != 0)
+#define LIGHT_POS		3, 10, 2
+#define LIGHT_COLOR		150, 150, 120
+#define AMBIENT			0.2f, 0.2f, 0.4f
+
+// triOffset of an instance of a nested TLAS instead of a BLAS; its nodeOffset and idxOffset
+// then locate the nodes and instances of the nested TLAS (see BVHInstance, Scene::PackTLAS).
+// Hits in a nested TLAS store the instance inside it in Intersection::inner (WIDE_INDICES).
+#define NESTED_TLAS	0xffffffff
+
+// out-of-core geometry: BLASes are paged into a fixed-size device pool when rays reach them,
+// see StreamingScene. Instances of a BLAS that is not resident have triOffset NOT_RESIDENT.
+// #define BLAS_STREAMING
+#define NOT_RESIDENT	0xfffffffe
+
+// create one OpenCL context for all GPUs of the platform, rather than for the first capable
+// device; see Kernel::RunOnDevice and MultiGPURenderer
+// #define MULTI_DEVICE
+
 // IMPORTANT NOTE ON OPENCL COMPATIBILITY ON OLDER LAPTOPS:
 // Without a GPU, a laptop needs at least a 'Broadwell' Intel CPU (5th gen, 2015):
 // Intel's OpenCL implementation 'NEO' is not available on older devices.
@@ -14,6 +14,9 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -332,23 +335,31 @@ struct Timer
 // swap
 template <class T> void Swap( T& x, T& y ) { T t; t = x, x = y, y = t; }
 
-// Nils's jobmanager
+// work-stealing job manager: each thread owns a lock-free deque of jobs; it pushes and
+// pops at the bottom, idle threads steal from the top. Jobs may add jobs themselves:
+// a thread that waits for a counter executes pending jobs in the meantime, so nested
+// parallelism never needs more threads than there are cores.
+#define JOBDEQUE_SIZE 8192 // must be a power of 2
 class Job
 {
 public:
 	virtual void Main() = 0;
 protected:
-	friend class JobThread;
+	friend class JobManager;
 	void RunCodeWrapper();
+	atomic<int>* m_Pending = 0;
 };
-class JobThread
+struct JobCounter { atomic<int> pending = 0; };
+class JobDeque // Chase-Lev deque with a fixed capacity
 {
 public:
-	void CreateAndStartThread( unsigned int threadId );
-	void Go();
-	void BackgroundTask();
-	HANDLE m_GoSignal, m_ThreadHandle;
-	int m_ThreadID;
+	bool Push( Job* job );
+	Job* Pop();
+	Job* Steal();
+private:
+	alignas(64) atomic<int64_t> m_Top = 0;
+	alignas(64) atomic<int64_t> m_Bottom = 0;
+	atomic<Job*> m_Job[JOBDEQUE_SIZE];
 };
 class JobManager	// singleton class!
 {
@@ -359,21 +370,56 @@ public:
 	static void CreateJobManager( unsigned int numThreads );
 	static JobManager* GetJobManager();
 	static void GetProcessorCount( uint& cores, uint& logical );
-	void AddJob2( Job* a_Job );
+	// batch interface: add jobs, then wait for all of them
+	void AddJob2( Job* a_Job ) { AddJob( a_Job, m_Batch ); }
+	void RunJobs() { Wait( m_Batch ); }
+	// nested interface: add a job to the calling thread's deque, wait while helping out
+	void AddJob( Job* job, JobCounter& counter );
+	void Wait( JobCounter& counter );
+	template <class F> void ParallelFor( int count, F func, int grain = 1 );
 	unsigned int GetNumThreads() { return m_NumThreads; }
-	void RunJobs();
-	void ThreadDone( unsigned int n );
 	int MaxConcurrent() { return m_NumThreads; }
 protected:
-	friend class JobThread;
-	Job* GetNextJob();
+	void WorkerThread( int idx );
+	Job* FindJob( int idx );
+	void Execute( Job* job );
 	static JobManager* m_JobManager;
-	Job* m_JobList[256];
-	CRITICAL_SECTION m_CS;
-	HANDLE m_ThreadDone[64];
-	unsigned int m_NumThreads, m_JobCount;
-	JobThread* m_JobThreadList;
+	static thread_local int m_WorkerIdx;
+	JobDeque* m_Deque;
+	thread* m_Thread;
+	unsigned int m_NumThreads;
+	JobCounter m_Batch;
+	atomic<int> m_Queued = 0, m_Sleeping = 0;
+	atomic<bool> m_Quit = false;
+	mutex m_SleepMutex;
+	condition_variable m_WakeUp;
+};
+template <class F> class ForJob : public Job
+{
+public:
+	void Main() { for (int i = first; i < last; i++) (*func)( i ); }
+	F* func;
+	int first, last;
 };
+template <class F> void JobManager::ParallelFor( int count, F func, int grain )
+{
+	// run func( i ) for i in [0..count), in jobs of 'grain' iterations
+	const int jobCount = (count + grain - 1) / grain;
+	if (jobCount <= 1 || m_NumThreads == 1)
+	{
+		for (int i = 0; i < count; i++) func( i );
+		return;
+	}
+	vector<ForJob<F>> job( jobCount );
+	JobCounter counter;
+	for (int i = 0; i < jobCount; i++)
+	{
+		job[i].func = &func, job[i].first = i * grain;
+		job[i].last = min( count, (i + 1) * grain );
+		AddJob( &job[i], counter );
+	}
+	Wait( counter );
+}
 
 // pixel operations
 inline uint ScaleColor( const uint c, const uint scale )
@@ -411,6 +457,8 @@ bool RemoveFile( const char* f );
 string TextFileRead( const char* _File );
 int LineCount( const string s );
 void TextFileWrite( const string& text, const char* _File );
+void* MapFile( const char* file, size_t& size ); // copy-on-write mapping, 0 on failure
+void UnmapFile( void* data, size_t size );
 
 // math
 inline float fminf( float a, float b ) { return a < b ? a : b; }
@@ -1140,6 +1188,34 @@ public:
 	float w = 1, x = 0, y = 0, z = 0;
 };
 
+// GPU profiling: while enabled, kernel launches and buffer transfers are timed using
+// OpenCL events. Update() gathers completed events into per-name statistics; kernels
+// report work items (one ray each) per second, transfers bytes per second.
+class GPUProfiler
+{
+public:
+	struct Stat
+	{
+		string name;
+		bool transfer = false;	// work in bytes, throughput in GB/s
+		bool rays = false;		// a kernel with one ray per work item, throughput in Mrays/s
+		uint count = 0;
+		double last = 0, avg = 0, min = 1e30, max = 0, total = 0; // milliseconds
+		uint64_t work = 0; // total work items or bytes
+	};
+	static cl_event* Event( cl_event* userEvent ); // event to pass to an enqueue call
+	static void Record( const char* name, cl_event* e, uint64_t work, bool transfer, bool rays = false );
+	static void Update(); // collects completed events; call once per frame
+	static void Print();
+	static bool Save( const char* file ); // CSV, or JSON if the name ends in .json
+	inline static bool enabled = false;
+	inline static vector<Stat> stat;
+private:
+	struct Pending { cl_event e; uint stat; uint64_t work; };
+	inline static vector<Pending> pending;
+	inline static cl_event scratch = 0;
+};
+
 // OpenCL buffer
 class Buffer
 {
@@ -1152,7 +1228,7 @@ public:
 	cl_mem* GetDevicePtr() { return &deviceBuffer; }
 	unsigned int* GetHostPtr() { return hostBuffer; }
 	void CopyToDevice( bool blocking = true );
-	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0 );
+	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0, const size_t offset = 0 );
 	void CopyFromDevice( bool blocking = true );
 	void CopyTo( Buffer* buffer );
 	void Clear();
@@ -1179,6 +1255,10 @@ public:
 	static cl_command_queue& GetQueue2() { return queue2; }
 	static cl_context& GetContext() { return context; }
 	static cl_device_id& GetDevice() { return device; }
+	bool tracesRays = false; // GPUProfiler reports its throughput in rays per second
+	// MULTI_DEVICE: all devices of the context, each with a queue; device 0 is GetDevice()
+	static uint GetDeviceCount() { return (uint)contextDevices.size(); }
+	static cl_command_queue& GetDeviceQueue( const uint idx ) { return deviceQueues[idx]; }
 	// run methods
 #if 1
 	void Run( cl_event* eventToWaitFor = 0, cl_event* eventToSet = 0 );
@@ -1187,6 +1267,7 @@ public:
 	void Run( Buffer* buffer, const int count = 1, cl_event* eventToWaitFor = 0, cl_event* eventToSet = 0, cl_event* acq = 0, cl_event* rel = 0 );
 #endif
 	void Run( const size_t count, const size_t localSize = 0, cl_event* eventToWaitFor = 0, cl_event* eventToSet = 0 );
+	void RunOnDevice( const uint deviceIdx, const size_t count, const size_t localSize = 0, cl_event* eventToWaitFor = 0, cl_event* eventToSet = 0 );
 	void Run2D( const int2 count, const int2 lsize = 0, cl_event* eventToWaitFor = 0, cl_event* eventToSet = 0 );
 	// argument passing with template trickery
 #define T_ typename
@@ -1312,12 +1393,15 @@ public:
 private:
 	// data members
 	Buffer* acqBuffer = 0;
+	string name; // entry point, for profiling
 	cl_kernel kernel;
 	cl_mem vbo_cl;
 	cl_program program;
 	inline static cl_device_id device;
 	inline static cl_context context; // simplifies some things, but limits us to one device
 	inline static cl_command_queue queue, queue2;
+	inline static vector<cl_device_id> contextDevices;
+	inline static vector<cl_command_queue> deviceQueues; // deviceQueues[0] == queue
 	inline static char* log = 0;
 	inline static bool isNVidia = false, isAMD = false, isIntel = false, isOther = false;
 	inline static bool isAmpere = false, isTuring = false, isPascal = false;
@@ -1458,6 +1542,14 @@ public:
 	virtual void MouseWheel( float y ) = 0;
 	virtual void KeyUp( int key ) = 0;
 	virtual void KeyDown( int key ) = 0;
+	// frame pipelining: if 'pipelined' is set, the main loop runs Simulate on a worker thread
+	// right after Tick, while the GPU executes the work that Tick enqueued; it waits for both
+	// before the frame is shown. Simulate prepares the next frame on the CPU and may not use
+	// OpenCL; Tick sends the result of the last Simulate to the device and renders it, and
+	// must not leave transfers pending that read host data which Simulate modifies. This
+	// bounds the latency: the CPU is at most one frame ahead of the GPU.
+	virtual void Simulate( float deltaTime ) { /* implement for frame pipelining */ }
+	bool pipelined = false;
 	Surface* screen = 0;
 };
 
@@ -2,6 +2,12 @@
 // IGAD/NHTV/UU - Jacco Bikker - 2006-2020
 
 #include "precomp.h"
+#ifndef _WIN32
+#include <sys/mman.h> // for MapFile
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_PSD
@@ -9,7 +15,11 @@
 #define STBI_NO_PNM
 #include "lib/stb_image.h"
 
+#ifdef HEADLESS
+#pragma comment( linker, "/subsystem:console" )
+#else
 #pragma comment( linker, "/subsystem:windows /ENTRY:mainCRTStartup" )
+#endif
 
 using namespace Tmpl8;
 
@@ -43,6 +53,15 @@ TheApp* CreateApp();
 // provide access to the render target, for OpenCL / OpenGL interop
 GLTexture* GetRenderTarget() { return renderTarget; }
 
+// frame pipelining: TheApp::Simulate as a job for the worker threads
+class SimulateJob : public Job
+{
+public:
+	void Main() { app->Simulate( deltaTime ); }
+	TheApp* app;
+	float deltaTime;
+};
+
 // GLFW callbacks
 void InitRenderTarget( int w, int h )
 {
@@ -83,6 +102,16 @@ void ErrorCallback( int error, const char* description )
 // Application entry point
 void main()
 {
+#ifdef HEADLESS
+	// no window: the application does its work in Init and Tick is called once, e.g. for benchmarks
+	app = CreateApp();
+	app->screen = new Surface( SCRWIDTH, SCRHEIGHT );
+	app->Init();
+	app->Tick( 0 );
+	app->Shutdown();
+	Kernel::KillCL();
+	return;
+#endif
 	// open a window
 	if (!glfwInit()) FatalError( "glfwInit failed." );
 	glfwSetErrorCallback( ErrorCallback );
@@ -268,6 +297,16 @@ void main()
 		deltaTime = min( 500.0f, 1000.0f * timer.elapsed() );
 		timer.reset();
 		app->Tick( deltaTime );
+		if (app->pipelined)
+		{
+			// the next frame is simulated while the GPU renders this one; see TheApp
+			SimulateJob simulate;
+			simulate.app = app, simulate.deltaTime = deltaTime;
+			JobCounter simulated;
+			JobManager::GetJobManager()->AddJob( &simulate, simulated );
+			clFinish( Kernel::GetQueue() );
+			JobManager::GetJobManager()->Wait( simulated );
+		}
 		// send the rendering result to the screen using OpenGL
 		if (frameNr++ > 1)
 		{
@@ -289,95 +328,145 @@ void main()
 }
 
 // Jobmanager implementation
-DWORD JobThreadProc( LPVOID lpParameter )
+void Job::RunCodeWrapper()
 {
-	JobThread* JobThreadInstance = (JobThread*)lpParameter;
-	JobThreadInstance->BackgroundTask();
-	return 0;
+	Main();
 }
 
-void JobThread::CreateAndStartThread( unsigned int threadId )
+bool JobDeque::Push( Job* job )
 {
-	m_GoSignal = CreateEvent( 0, FALSE, FALSE, 0 );
-	m_ThreadHandle = CreateThread( 0, 0, (LPTHREAD_START_ROUTINE)&JobThreadProc, (LPVOID)this, 0, 0 );
-	m_ThreadID = threadId;
+	// owner only; fails if the deque is full
+	const int64_t b = m_Bottom.load( memory_order_relaxed ), t = m_Top.load( memory_order_acquire );
+	if (b - t >= JOBDEQUE_SIZE) return false;
+	m_Job[b & (JOBDEQUE_SIZE - 1)].store( job, memory_order_relaxed );
+	m_Bottom.store( b + 1, memory_order_release );
+	return true;
 }
-void JobThread::BackgroundTask()
+
+Job* JobDeque::Pop()
 {
-	while (1)
+	// owner only; takes the most recently pushed job
+	const int64_t b = m_Bottom.load( memory_order_relaxed ) - 1;
+	m_Bottom.store( b, memory_order_relaxed );
+	atomic_thread_fence( memory_order_seq_cst );
+	int64_t t = m_Top.load( memory_order_relaxed );
+	if (t > b)
 	{
-		WaitForSingleObject( m_GoSignal, INFINITE );
-		while (1)
-		{
-			Job* job = JobManager::GetJobManager()->GetNextJob();
-			if (!job)
-			{
-				JobManager::GetJobManager()->ThreadDone( m_ThreadID );
-				break;
-			}
-			job->RunCodeWrapper();
-		}
+		// deque was empty
+		m_Bottom.store( b + 1, memory_order_relaxed );
+		return 0;
 	}
+	Job* job = m_Job[b & (JOBDEQUE_SIZE - 1)].load( memory_order_relaxed );
+	if (t == b)
+	{
+		// last job: race against thieves
+		if (!m_Top.compare_exchange_strong( t, t + 1, memory_order_seq_cst, memory_order_relaxed )) job = 0;
+		m_Bottom.store( b + 1, memory_order_relaxed );
+	}
+	return job;
 }
 
-void JobThread::Go()
-{
-	SetEvent( m_GoSignal );
-}
-
-void Job::RunCodeWrapper()
+Job* JobDeque::Steal()
 {
-	Main();
+	// any thread; takes the oldest job
+	int64_t t = m_Top.load( memory_order_acquire );
+	atomic_thread_fence( memory_order_seq_cst );
+	const int64_t b = m_Bottom.load( memory_order_acquire );
+	if (t >= b) return 0;
+	Job* job = m_Job[t & (JOBDEQUE_SIZE - 1)].load( memory_order_relaxed );
+	if (!m_Top.compare_exchange_strong( t, t + 1, memory_order_seq_cst, memory_order_relaxed )) return 0;
+	return job;
 }
 
 JobManager* JobManager::m_JobManager = 0;
+thread_local int JobManager::m_WorkerIdx = -1;
 
-JobManager::JobManager( unsigned int threads ) : m_NumThreads( threads )
+JobManager::JobManager( unsigned int threads ) : m_NumThreads( max( 1u, threads ) )
 {
-	InitializeCriticalSection( &m_CS );
+	// the creating thread is worker 0; it executes jobs while it waits
+	m_Deque = new JobDeque[m_NumThreads];
+	m_Thread = new thread[m_NumThreads];
+	m_WorkerIdx = 0;
+	for (unsigned int i = 1; i < m_NumThreads; i++) m_Thread[i] = thread( &JobManager::WorkerThread, this, i );
 }
 
 JobManager::~JobManager()
 {
-	DeleteCriticalSection( &m_CS );
+	{
+		lock_guard<mutex> lock( m_SleepMutex );
+		m_Quit = true;
+	}
+	m_WakeUp.notify_all();
+	for (unsigned int i = 1; i < m_NumThreads; i++) m_Thread[i].join();
+	delete[] m_Thread;
+	delete[] m_Deque;
 }
 
 void JobManager::CreateJobManager( unsigned int numThreads )
 {
 	m_JobManager = new JobManager( numThreads );
-	m_JobManager->m_JobThreadList = new JobThread[numThreads];
-	for (unsigned int i = 0; i < numThreads; i++)
+}
+
+void JobManager::AddJob( Job* job, JobCounter& counter )
+{
+	job->m_Pending = &counter.pending;
+	counter.pending++;
+	// threads outside the pool, or a full deque: just run the job here
+	if (m_WorkerIdx < 0 || !m_Deque[m_WorkerIdx].Push( job ))
+	{
+		Execute( job );
+		return;
+	}
+	m_Queued++;
+	if (m_Sleeping > 0)
 	{
-		m_JobManager->m_JobThreadList[i].CreateAndStartThread( i );
-		m_JobManager->m_ThreadDone[i] = CreateEvent( 0, FALSE, FALSE, 0 );
+		// taking the lock guarantees that a thread that is going to sleep sees the new job
+		{ lock_guard<mutex> lock( m_SleepMutex ); }
+		m_WakeUp.notify_one();
 	}
-	m_JobManager->m_JobCount = 0;
 }
 
-void JobManager::AddJob2( Job* a_Job )
+Job* JobManager::FindJob( int idx )
 {
-	m_JobList[m_JobCount++] = a_Job;
+	// own deque first, then steal from the other threads
+	Job* job = m_Deque[idx].Pop();
+	for (unsigned int i = 1; !job && i < m_NumThreads; i++) job = m_Deque[(idx + i) % m_NumThreads].Steal();
+	if (job) m_Queued--;
+	return job;
 }
 
-Job* JobManager::GetNextJob()
+void JobManager::Execute( Job* job )
 {
-	Job* job = 0;
-	EnterCriticalSection( &m_CS );
-	if (m_JobCount > 0) job = m_JobList[--m_JobCount];
-	LeaveCriticalSection( &m_CS );
-	return job;
+	// the job may be deleted as soon as its counter reaches zero
+	atomic<int>* pending = job->m_Pending;
+	job->RunCodeWrapper();
+	pending->fetch_sub( 1, memory_order_release );
 }
 
-void JobManager::RunJobs()
+void JobManager::Wait( JobCounter& counter )
 {
-	if (m_JobCount == 0) return;
-	for (unsigned int i = 0; i < m_NumThreads; i++) m_JobThreadList[i].Go();
-	WaitForMultipleObjects( m_NumThreads, m_ThreadDone, TRUE, INFINITE );
+	// help out until all jobs that use the counter are done
+	while (counter.pending.load( memory_order_acquire ) > 0)
+	{
+		Job* job = m_WorkerIdx < 0 ? 0 : FindJob( m_WorkerIdx );
+		if (job) Execute( job ); else this_thread::yield();
+	}
 }
 
-void JobManager::ThreadDone( unsigned int n )
+void JobManager::WorkerThread( int idx )
 {
-	SetEvent( m_ThreadDone[n] );
+	m_WorkerIdx = idx;
+	for (int idle = 0; !m_Quit; )
+	{
+		Job* job = FindJob( idx );
+		if (job) { Execute( job ), idle = 0; continue; }
+		if (++idle < 256) { this_thread::yield(); continue; }
+		// nothing to do for a while: sleep until new jobs arrive
+		unique_lock<mutex> lock( m_SleepMutex );
+		m_Sleeping++;
+		m_WakeUp.wait( lock, [this]() { return m_Queued > 0 || m_Quit; } );
+		m_Sleeping--, idle = 0;
+	}
 }
 
 DWORD CountSetBits( ULONG_PTR bitMask )
@@ -422,12 +511,7 @@ void JobManager::GetProcessorCount( uint& cores, uint& logical )
 
 JobManager* JobManager::GetJobManager()
 {
-	if (!m_JobManager)
-	{
-		uint c, l;
-		GetProcessorCount( c, l );
-		CreateJobManager( l );
-	}
+	if (!m_JobManager) CreateJobManager( thread::hardware_concurrency() );
 	return m_JobManager;
 }
 
@@ -885,6 +969,42 @@ void TextFileWrite( const string& text, const char* _File )
 	s.write( text.c_str(), len );
 }
 
+void* MapFile( const char* file, size_t& size )
+{
+	// map a file into memory; pages are private copies on write, so the file itself is never modified
+#ifdef _WIN32
+	HANDLE f = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if (f == INVALID_HANDLE_VALUE) return 0;
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx( f, &fileSize );
+	size = (size_t)fileSize.QuadPart;
+	HANDLE mapping = size ? CreateFileMappingA( f, 0, PAGE_WRITECOPY, 0, 0, 0 ) : 0;
+	CloseHandle( f );
+	if (!mapping) return 0;
+	void* data = MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+	CloseHandle( mapping ); // the view keeps the mapping alive
+	return data;
+#else
+	int f = open( file, O_RDONLY );
+	if (f < 0) return 0;
+	struct stat s;
+	fstat( f, &s );
+	size = (size_t)s.st_size;
+	void* data = size ? mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0 ) : MAP_FAILED;
+	close( f );
+	return data == MAP_FAILED ? 0 : data;
+#endif
+}
+
+void UnmapFile( void* data, size_t size )
+{
+#ifdef _WIN32
+	UnmapViewOfFile( data );
+#else
+	munmap( data, size );
+#endif
+}
+
 void FatalError( const char* fmt, ... )
 {
 	char t[16384];
@@ -1072,15 +1192,21 @@ Buffer::~Buffer()
 void Buffer::CopyToDevice( bool blocking )
 {
 	cl_int error;
-	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size, hostBuffer, 0, 0, 0 ) );
+	cl_event* e = GPUProfiler::Event( 0 );
+	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size, hostBuffer, 0, 0, e ) );
+	GPUProfiler::Record( "upload", e, size, true );
 }
 
 // CopyToDevice2 method (uses 2nd queue)
 // ----------------------------------------------------------------------------
-void Buffer::CopyToDevice2( bool blocking, cl_event* eventToSet, const size_t s )
+void Buffer::CopyToDevice2( bool blocking, cl_event* eventToSet, const size_t s, const size_t offset )
 {
+	// s: byte count, or 0 for the remainder of the buffer; offset: first byte to write
 	cl_int error;
-	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue2(), deviceBuffer, blocking ? CL_TRUE : CL_FALSE, 0, s == 0 ? size : s, hostBuffer, 0, 0, eventToSet ) );
+	cl_event* e = GPUProfiler::Event( eventToSet );
+	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue2(), deviceBuffer, blocking ? CL_TRUE : CL_FALSE, offset,
+		s == 0 ? size - offset : s, (char*)hostBuffer + offset, 0, 0, e ) );
+	GPUProfiler::Record( "upload (queue 2)", e, s == 0 ? size - offset : s, true );
 }
 
 // CopyFromDevice method
@@ -1094,7 +1220,9 @@ void Buffer::CopyFromDevice( bool blocking )
 		ownData = true;
 		aligned = true;
 	}
-	CHECKCL( error = clEnqueueReadBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size, hostBuffer, 0, 0, 0 ) );
+	cl_event* e = GPUProfiler::Event( 0 );
+	CHECKCL( error = clEnqueueReadBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size, hostBuffer, 0, 0, e ) );
+	GPUProfiler::Record( "download", e, size, true );
 }
 
 // CopyTo
@@ -1118,6 +1246,69 @@ void Buffer::Clear()
 #endif
 }
 
+// program binary cache: a successfully built program is stored as <file>.bin, tagged with
+// a hash of the source, the files it includes, the build options, device and driver
+// ----------------------------------------------------------------------------
+static uint64_t HashSource( const string& text, uint64_t hash, int depth = 0 )
+{
+	// FNV-1a; file names in #include "..." lines are followed, like the cl compiler does
+	for (const char c : text) hash = (hash ^ (uchar)c) * 0x100000001b3ull;
+	if (depth > 8) return hash; // include cycle
+	for (size_t pos = text.find( "#include" ); pos != string::npos; pos = text.find( "#include", pos + 1 ))
+	{
+		const size_t start = text.find_first_of( "\"\n", pos );
+		if (start == string::npos || text[start] != '"') continue;
+		const size_t end = text.find( '"', start + 1 );
+		if (end == string::npos) break;
+		hash = HashSource( TextFileRead( text.substr( start + 1, end - start - 1 ).c_str() ), hash, depth + 1 );
+	}
+	return hash;
+}
+
+static cl_program LoadProgramBinary( const char* binFile, const uint64_t key, cl_context context, cl_device_id device, const char* options )
+{
+	// file layout: key, binary size, binary; returns 0 if the file is missing or stale
+	FILE* f = fopen( binFile, "rb" );
+	if (!f) return 0;
+	cl_program program = 0;
+	uint64_t header[2];
+	if (fread( header, sizeof( uint64_t ), 2, f ) == 2 && header[0] == key && header[1] > 0)
+	{
+		size_t size = (size_t)header[1];
+		uchar* binary = new uchar[size];
+		if (fread( binary, 1, size, f ) == size)
+		{
+			cl_int status, error;
+			program = clCreateProgramWithBinary( context, 1, &device, &size, (const uchar**)&binary, &status, &error );
+			if (error != CL_SUCCESS || status != CL_SUCCESS) program = 0;
+			else if (clBuildProgram( program, 0, NULL, options, NULL, NULL ) != CL_SUCCESS) clReleaseProgram( program ), program = 0;
+		}
+		delete[] binary;
+	}
+	fclose( f );
+	return program;
+}
+
+static void SaveProgramBinary( const char* binFile, const uint64_t key, cl_program program )
+{
+	// the program is built for a single device
+	size_t size = 0;
+	if (clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, sizeof( size_t ), &size, NULL ) != CL_SUCCESS || size == 0) return;
+	uchar* binary = new uchar[size];
+	if (clGetProgramInfo( program, CL_PROGRAM_BINARIES, sizeof( uchar* ), &binary, NULL ) == CL_SUCCESS)
+	{
+		FILE* f = fopen( binFile, "wb" );
+		if (f)
+		{
+			const uint64_t header[2] = { key, size };
+			fwrite( header, sizeof( uint64_t ), 2, f );
+			fwrite( binary, 1, size, f );
+			fclose( f );
+		}
+	}
+	delete[] binary;
+}
+
 // Kernel constructor
 // ----------------------------------------------------------------------------
 Kernel::Kernel( char* file, char* entryPoint )
@@ -1173,41 +1364,39 @@ Kernel::Kernel( char* file, char* entryPoint )
 		csText = tmp;
 	}
 #endif
-	// attempt to compile the loaded and expanded source text
-	const char* source = csText.c_str();
-	size_t size = strlen( source );
-	cl_int error;
-	program = clCreateProgramWithSource( context, 1, (const char**)&source, &size, &error );
-	CHECKCL( error );
 	// why does the nvidia compiler not support these:
 	// -cl-nv-maxrregcount=64 not faster than leaving it out (same for 128)
 	// -cl-no-subgroup-ifp ? fails on nvidia.
 #if 1
 	// AMD compatible compilation, thanks Jasper the Winther
-	error = clBuildProgram( program, 0, NULL, "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
-
+	const char* options = "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #else
-	error = clBuildProgram( program, 0, NULL, "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
+	const char* options = "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #endif
+	// use the cached binary if source, options, device and driver are unchanged
+	char deviceName[1024] = "", driverVersion[1024] = "";
+	clGetDeviceInfo( device, CL_DEVICE_NAME, sizeof( deviceName ), deviceName, NULL );
+	clGetDeviceInfo( device, CL_DRIVER_VERSION, sizeof( driverVersion ), driverVersion, NULL );
+	const uint64_t key = HashSource( csText + options + deviceName + driverVersion, 0xcbf29ce484222325ull );
+	const string binFile = string( file ) + ".bin";
+	// the cache holds a binary for one device; a MULTI_DEVICE context builds from source
+	program = contextDevices.size() > 1 ? 0 : LoadProgramBinary( binFile.c_str(), key, context, device, options );
+	const bool cached = program != 0;
+	// otherwise, attempt to compile the loaded and expanded source text
+	const char* source = csText.c_str();
+	size_t size = strlen( source );
+	cl_int error = CL_SUCCESS;
+	if (!cached)
+	{
+		program = clCreateProgramWithSource( context, 1, (const char**)&source, &size, &error );
+		CHECKCL( error );
+		error = clBuildProgram( program, 0, NULL, options, NULL, NULL );
+	}
 	// handle errors
 	if (error == CL_SUCCESS)
 	{
-		// dump PTX via: https://forums.developer.nvidia.com/t/pre-compiling-opencl-kernels-tutorial/17089
-		// and: https://stackoverflow.com/questions/12868889/clgetprograminfo-cl-program-binary-sizes-incorrect-results
-		cl_uint devCount;
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_NUM_DEVICES, sizeof( cl_uint ), &devCount, NULL ) );
-		size_t* size = new size_t[devCount];
-		size[0] = 0;
-		size_t received;
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES /* wrong data... */, devCount * sizeof( size_t ), size, &received ) );
-		char** binaries = new char* [devCount];
-		for (uint i = 0; i < devCount; i++)
-			binaries[i] = new char[size[i] + 1];
-		CHECKCL( clGetProgramInfo( program, CL_PROGRAM_BINARIES, devCount * sizeof( size_t ), binaries, NULL ) );
-		FILE* f = fopen( "buildlog.txt", "wb" );
-		for (uint i = 0; i < devCount; i++)
-			fwrite( binaries[i], 1, size[i] + 1, f );
-		fclose( f );
+		// store the binary for the next run
+		if (!cached && contextDevices.size() < 2) SaveProgramBinary( binFile.c_str(), key, program );
 	}
 	else
 	{
@@ -1275,6 +1464,7 @@ Kernel::Kernel( char* file, char* entryPoint )
 	kernel = clCreateKernel( program, entryPoint, &error );
 	if (kernel == 0) FatalError( "clCreateKernel failed: entry point not found." );
 	CHECKCL( error );
+	name = entryPoint;
 }
 
 Kernel::Kernel( cl_program& existingProgram, char* entryPoint )
@@ -1285,6 +1475,7 @@ Kernel::Kernel( cl_program& existingProgram, char* entryPoint )
 	kernel = clCreateKernel( program, entryPoint, &error );
 	if (kernel == 0) FatalError( "clCreateKernel failed: entry point not found." );
 	CHECKCL( error );
+	name = entryPoint;
 }
 
 // Kernel destructor
@@ -1310,6 +1501,18 @@ bool Kernel::InitCL()
 	devices = new cl_device_id[devCount];
 	if (!CHECKCL( error = clGetDeviceIDs( platform, CL_DEVICE_TYPE_ALL, devCount, devices, NULL ) )) return false;
 	uint deviceUsed = -1;
+#ifdef HEADLESS
+	// no window, so no OpenGL context to share with
+	cl_context_properties props[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
+#else
+	cl_context_properties props[] =
+	{
+		CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetWGLContext( window ),
+		CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0
+	};
+#endif
+	vector<cl_device_id> capable; // MULTI_DEVICE: all devices that pass the checks below
 	// search a capable OpenCL device
 	char device_string[1024], device_platform[1024];
 	for (uint i = 0; i < devCount; i++)
@@ -1343,17 +1546,21 @@ bool Kernel::InitCL()
 			}
 			if (hasAll)
 			{
-				cl_context_properties props[] =
-				{
-					CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetWGLContext( window ),
-					CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-					CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0
-				};
+			#ifdef MULTI_DEVICE
+				// collect the GPUs; the context is created after the search
+				cl_device_type type;
+				clGetDeviceInfo( devices[i], CL_DEVICE_TYPE, sizeof( type ), &type, NULL );
+				if (type & CL_DEVICE_TYPE_GPU) capable.push_back( devices[i] );
+				if (type & CL_DEVICE_TYPE_GPU && deviceUsed == -1) deviceUsed = i;
+				continue;
+			#endif
 				// attempt to create a context with the requested features
 				context = clCreateContext( props, 1, &devices[i], NULL, NULL, &error );
 				if (error == CL_SUCCESS)
 				{
+				#ifndef HEADLESS
 					candoInterop = true;
+				#endif
 					deviceUsed = i;
 					break;
 				}
@@ -1361,8 +1568,23 @@ bool Kernel::InitCL()
 			if (deviceUsed > -1) break;
 		}
 	}
+#ifdef MULTI_DEVICE
+	// one context for all GPUs, so that buffers and programs are shared by the devices; falls
+	// back to the first GPU if the driver cannot share the OpenGL context with all of them
+	if (capable.size() > 0)
+	{
+		context = clCreateContext( props, (cl_uint)capable.size(), capable.data(), NULL, NULL, &error );
+		if (error != CL_SUCCESS) capable.resize( 1 ), context = clCreateContext( props, 1, capable.data(), NULL, NULL, &error );
+		if (error != CL_SUCCESS) deviceUsed = -1;
+	#ifndef HEADLESS
+		else candoInterop = true;
+	#endif
+	}
+#endif
 	if (deviceUsed == -1) FatalError( "No capable OpenCL device found." );
 	device = getFirstDevice( context );
+	if (capable.empty()) capable.push_back( device );
+	contextDevices = capable;
 	if (!CHECKCL( error )) return false;
 	// print device name
 	clGetDeviceInfo( devices[deviceUsed], CL_DEVICE_NAME, 1024, &device_string, NULL );
@@ -1447,6 +1669,15 @@ bool Kernel::InitCL()
 	// create a second command queue for asynchronous copies
 	queue2 = clCreateCommandQueue( context, devices[deviceUsed], CL_QUEUE_PROFILING_ENABLE, &error );
 	if (!CHECKCL( error )) return false;
+	// MULTI_DEVICE: a queue for each other device
+	deviceQueues.push_back( queue );
+	for (size_t i = 1; i < contextDevices.size(); i++)
+	{
+		clGetDeviceInfo( contextDevices[i], CL_DEVICE_NAME, 1024, &device_string, NULL );
+		printf( "Device # %zu in the context: %s\n", i, device_string );
+		deviceQueues.push_back( clCreateCommandQueue( context, contextDevices[i], CL_QUEUE_PROFILING_ENABLE, &error ) );
+		if (!CHECKCL( error )) return false;
+	}
 	// cleanup
 	delete devices;
 	clStarted = true;
@@ -1458,6 +1689,7 @@ bool Kernel::InitCL()
 void Kernel::KillCL()
 {
 	if (!clStarted) return;
+	for (size_t i = 1; i < deviceQueues.size(); i++) clReleaseCommandQueue( deviceQueues[i] );
 	clReleaseCommandQueue( queue2 );
 	clReleaseCommandQueue( queue );
 	clReleaseContext( context );
@@ -1496,6 +1728,7 @@ void Kernel::Run( const size_t count, const size_t localSize, cl_event* eventToW
 {
 	CheckCLStarted();
 	cl_int error;
+	eventToSet = GPUProfiler::Event( eventToSet );
 	if (acqBuffer)
 	{
 		if (!Kernel::candoInterop) FatalError( "OpenGL interop functionality required but not available." );
@@ -1507,6 +1740,19 @@ void Kernel::Run( const size_t count, const size_t localSize, cl_event* eventToW
 	{
 		CHECKCL( error = clEnqueueNDRangeKernel( queue, kernel, 1, 0, &count, localSize == 0 ? 0 : &localSize, eventToWaitFor ? 1 : 0, eventToWaitFor, eventToSet ) );
 	}
+	GPUProfiler::Record( name.c_str(), eventToSet, count, false, tracesRays );
+}
+
+void Kernel::RunOnDevice( const uint deviceIdx, const size_t count, const size_t localSize, cl_event* eventToWaitFor, cl_event* eventToSet )
+{
+	CheckCLStarted();
+	if (deviceIdx == 0) { Run( count, localSize, eventToWaitFor, eventToSet ); return; }
+	// render targets are shared with OpenGL only on the first device
+	if (acqBuffer) FatalError( "Kernel::RunOnDevice: a texture target can only be used on device 0." );
+	cl_int error;
+	eventToSet = GPUProfiler::Event( eventToSet );
+	CHECKCL( error = clEnqueueNDRangeKernel( deviceQueues[deviceIdx], kernel, 1, 0, &count, localSize == 0 ? 0 : &localSize, eventToWaitFor ? 1 : 0, eventToWaitFor, eventToSet ) );
+	GPUProfiler::Record( name.c_str(), eventToSet, count, false, tracesRays );
 }
 
 void Kernel::Run2D( const int2 count, const int2 lsize, cl_event* eventToWaitFor, cl_event* eventToSet )
@@ -1527,6 +1773,7 @@ void Kernel::Run2D( const int2 count, const int2 lsize, cl_event* eventToWaitFor
 		localSize[1] = 4;
 	}
 	cl_int error;
+	eventToSet = GPUProfiler::Event( eventToSet );
 	if (acqBuffer)
 	{
 		if (!Kernel::candoInterop) FatalError( "OpenGL interop functionality required but not available." );
@@ -1538,6 +1785,99 @@ void Kernel::Run2D( const int2 count, const int2 lsize, cl_event* eventToWaitFor
 	{
 		CHECKCL( error = clEnqueueNDRangeKernel( queue, kernel, 2, 0, workSize, localSize, eventToWaitFor ? 1 : 0, eventToWaitFor, eventToSet ) );
 	}
+	GPUProfiler::Record( name.c_str(), eventToSet, workSize[0] * workSize[1], false, tracesRays );
+}
+
+// GPUProfiler implementation
+// ----------------------------------------------------------------------------
+cl_event* GPUProfiler::Event( cl_event* userEvent )
+{
+	// without a user event, enqueue calls receive a scratch event while profiling
+	return userEvent ? userEvent : (enabled ? &scratch : 0);
+}
+
+void GPUProfiler::Record( const char* name, cl_event* e, uint64_t work, bool transfer, bool rays )
+{
+	if (!enabled || !e || !*e) return;
+	uint idx = 0;
+	while (idx < stat.size() && stat[idx].name != name) idx++;
+	if (idx == stat.size()) stat.push_back( Stat() ), stat[idx].name = name, stat[idx].transfer = transfer, stat[idx].rays = rays;
+	// user events stay owned by the user: keep our own reference
+	if (e == &scratch) pending.push_back( { scratch, idx, work } ), scratch = 0;
+	else clRetainEvent( *e ), pending.push_back( { *e, idx, work } );
+}
+
+void GPUProfiler::Update()
+{
+	for (uint i = 0; i < pending.size(); i++)
+	{
+		cl_int status;
+		clGetEventInfo( pending[i].e, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof( cl_int ), &status, 0 );
+		if (status > CL_COMPLETE) continue; // still queued or running; negative values are errors
+		cl_ulong start = 0, end = 0;
+		if (status == CL_COMPLETE)
+		{
+			clGetEventProfilingInfo( pending[i].e, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &start, 0 );
+			clGetEventProfilingInfo( pending[i].e, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &end, 0 );
+			const double ms = (double)(end - start) * 1e-6;
+			// rolling average: plain for the first samples, exponential later
+			Stat& s = stat[pending[i].stat];
+			s.avg = s.count < 10 ? (s.avg * s.count + ms) / (s.count + 1) : 0.95 * s.avg + 0.05 * ms;
+			s.last = ms, s.min = min( s.min, ms ), s.max = max( s.max, ms );
+			s.total += ms, s.work += pending[i].work, s.count++;
+		}
+		clReleaseEvent( pending[i].e );
+		pending[i--] = pending.back(), pending.pop_back();
+	}
+}
+
+static double Throughput( const GPUProfiler::Stat& s )
+{
+	// GB/s for transfers, Mrays/s for ray tracing kernels; other kernels only report time
+	if (s.total == 0) return 0;
+	return s.transfer ? (double)s.work / (s.total * 1e6) : (double)s.work / (s.total * 1e3);
+}
+
+static const char* ThroughputUnit( const GPUProfiler::Stat& s )
+{
+	return s.transfer ? "GB/s" : (s.rays ? "Mrays/s" : "");
+}
+
+void GPUProfiler::Print()
+{
+	for (const Stat& s : stat)
+	{
+		printf( "%-24s %6u x, avg %7.3fms (min %7.3f, max %7.3f)", s.name.c_str(), s.count, s.avg, s.count ? s.min : 0, s.max );
+		if (s.transfer || s.rays) printf( ", %8.2f %s", Throughput( s ), ThroughputUnit( s ) );
+		printf( "\n" );
+	}
+}
+
+bool GPUProfiler::Save( const char* file )
+{
+	FILE* f = fopen( file, "w" );
+	if (!f) return false;
+	const size_t len = strlen( file );
+	const bool json = len > 5 && !strcmp( file + len - 5, ".json" );
+	if (json) fprintf( f, "[\n" ); else fprintf( f, "name,type,count,last_ms,avg_ms,min_ms,max_ms,total_ms,work,throughput,unit\n" );
+	for (uint i = 0; i < stat.size(); i++)
+	{
+		const Stat& s = stat[i];
+		// kernels that do not trace rays have no throughput: an empty field, or null in JSON
+		const char* type = s.transfer ? "transfer" : "kernel", *unit = ThroughputUnit( s );
+		char throughput[32] = "";
+		if (s.transfer || s.rays) sprintf( throughput, "%.3f", Throughput( s ) );
+		else if (json) strcpy( throughput, "null" );
+		if (json) fprintf( f, "\t{ \"name\": \"%s\", \"type\": \"%s\", \"count\": %u, \"last_ms\": %.4f, \"avg_ms\": %.4f, "
+			"\"min_ms\": %.4f, \"max_ms\": %.4f, \"total_ms\": %.4f, \"work\": %llu, \"throughput\": %s, \"unit\": \"%s\" }%s\n",
+			s.name.c_str(), type, s.count, s.last, s.avg, s.count ? s.min : 0, s.max, s.total,
+			(unsigned long long)s.work, throughput, unit, i + 1 < stat.size() ? "," : "" );
+		else fprintf( f, "%s,%s,%u,%.4f,%.4f,%.4f,%.4f,%.4f,%llu,%s,%s\n", s.name.c_str(), type, s.count, s.last,
+			s.avg, s.count ? s.min : 0, s.max, s.total, (unsigned long long)s.work, throughput, unit );
+	}
+	if (json) fprintf( f, "]\n" );
+	fclose( f );
+	return true;
 }
 
 // surface implementation
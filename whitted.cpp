@@ -11,16 +11,27 @@
 // rights are reserved. No responsibility is accepted either.
 // For updates, follow me on twitter: @j_bikker.
 
+// when the view is still, samples accumulate; with ADAPTIVE_SAMPLING, a tile stops
+// receiving samples once the estimated error of the mean is small for all its pixels
+#define ADAPTIVE_SAMPLING
+#define MIN_TILE_SAMPLES	8
+#define MAX_TILE_SAMPLES	1024
+#define ERROR_THRESHOLD		0.01f
+
+// with RAY_REORDER, batches are sorted by RayKey (octant, then origin cell) instead of just
+// by octant; this mostly helps the scattered origins of secondary rays
+// #define RAY_REORDER
+
+#ifndef OFFLINE // offline.cpp reuses this renderer
 TheApp* CreateApp() { return new WhittedApp(); }
+#endif
 
-inline float3 RGB8toRGB32F( uint c )
-{
-	float s = 1 / 256.0f;
-	int r = (c >> 16) & 255;
-	int g = (c >> 8) & 255;
-	int b = c & 255;
-	return float3( r * s, g * s, b * s );
-}
+inline uint Octant( const float3& D ) { return (D.x < 0 ? 1 : 0) + (D.y < 0 ? 2 : 0) + (D.z < 0 ? 4 : 0); }
+
+// lighting, shared with the kernels and HybridRenderer (template/common.h)
+static const float3 lightPos( LIGHT_POS );
+static const float3 lightColor( LIGHT_COLOR );
+static const float3 ambient( AMBIENT );
 
 // WhittedApp implementation
 
@@ -32,12 +43,29 @@ void WhittedApp::Init()
 	tlas = TLAS( bvhInstance, 16 );
 	// create a floating point accumulator for the screen
 	accumulator = new float3[SCRWIDTH * SCRHEIGHT];
+	lumSqr = new float[SCRWIDTH * SCRHEIGHT];
+	frameSample = new float3[SCRWIDTH * SCRHEIGHT];
+	tileSamples = new uint[SCRWIDTH * SCRHEIGHT / 64];
+	tileConverged = new bool[SCRWIDTH * SCRHEIGHT / 64];
+	memset( tileSamples, 0, SCRWIDTH * SCRHEIGHT / 64 * sizeof( uint ) );
+#ifdef TRAVERSAL_STATS
+	heat = new float[SCRWIDTH * SCRHEIGHT];
+	tileStats = new TraversalStats[SCRWIDTH * SCRHEIGHT / 64];
+#endif
 	// load HDR sky
 	int bpp = 0;
 	skyPixels = stbi_loadf( "assets/sky_19.hdr", &skyWidth, &skyHeight, &skyBpp, 0 );
 	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
 }
 
+void WhittedApp::KeyDown( int key )
+{
+	if (key == GLFW_KEY_SPACE) animate = !animate;
+#ifdef TRAVERSAL_STATS
+	if (key == GLFW_KEY_H) showHeatmap = !showHeatmap;
+#endif
+}
+
 void WhittedApp::AnimateScene()
 {
 	// animate the scene
@@ -57,61 +85,198 @@ void WhittedApp::AnimateScene()
 
 float3 WhittedApp::Trace( Ray& ray, int rayDepth )
 {
-	tlas.Intersect( ray );
+	if (motion) motion->Intersect( ray ); else tlas.Intersect( ray );
+	return Shade( ray, rayDepth );
+}
+
+float3 WhittedApp::SampleSky( const float3& D )
+{
+	uint u = (uint)(skyWidth * atan2f( D.z, D.x ) * INV2PI - 0.5f);
+	uint v = (uint)(skyHeight * acosf( D.y ) * INVPI - 0.5f);
+	uint skyIdx = (u + v * skyWidth) % (skyWidth * skyHeight);
+	return 0.65f * float3( skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2] );
+}
+
+void WhittedApp::HitPoint( const Ray& ray, float3& I, float3& N )
+{
+	// calculate the normal for the intersection
 	Intersection i = ray.hit;
-	if (i.t == 1e30f)
-	{
-		// sample sky
-		uint u = (uint)(skyWidth * atan2f( ray.D.z, ray.D.x ) * INV2PI - 0.5f);
-		uint v = (uint)(skyHeight * acosf( ray.D.y ) * INVPI - 0.5f);
-		uint skyIdx = (u + v * skyWidth) % (skyWidth * skyHeight);
-		return 0.65f * float3( skyPixels[skyIdx * 3], skyPixels[skyIdx * 3 + 1], skyPixels[skyIdx * 3 + 2] );
-	}
+	uint triIdx = PRIM_IDX( i.instPrim );
+	uint instIdx = INST_IDX( i.instPrim );
+	TriEx& tri = bvhInstance[instIdx].GetBVH()->mesh->triEx[triIdx];
+	N = i.u * tri.N1 + i.v * tri.N2 + (1 - (i.u + i.v)) * tri.N0;
+	N = normalize( TransformVector( N, HitTransform( ray ) ) );
+	I = ray.O + i.t * ray.D;
+}
+
+mat4 WhittedApp::HitTransform( const Ray& ray )
+{
+	const uint instIdx = INST_IDX( ray.hit.instPrim );
+	return motion ? motion->Transform( instIdx, ray.time ) : bvhInstance[instIdx].GetTransform();
+}
+
+float WhittedApp::Curvature( const Ray& ray )
+{
+	const Mesh* instMesh = bvhInstance[INST_IDX( ray.hit.instPrim )].GetBVH()->mesh;
+	return instMesh->Curvature( PRIM_IDX( ray.hit.instPrim ), HitTransform( ray ) );
+}
+
+float3 WhittedApp::Albedo( const Ray& ray, const float3& N )
+{
 	// calculate texture uv based on barycentrics
-	uint triIdx = i.instPrim & 0xfffff;
-	uint instIdx = i.instPrim >> 20;
-	TriEx& tri = mesh->triEx[triIdx];
-	Surface* tex = mesh->texture;
+	Intersection i = ray.hit;
+	uint triIdx = PRIM_IDX( i.instPrim );
+	Mesh* instMesh = bvhInstance[INST_IDX( i.instPrim )].GetBVH()->mesh;
+	TriEx& tri = instMesh->triEx[triIdx];
 	float2 uv = i.u * tri.uv1 + i.v * tri.uv2 + (1 - (i.u + i.v)) * tri.uv0;
-	int iu = (int)(uv.x * tex->width) % tex->width;
-	int iv = (int)(uv.y * tex->height) % tex->height;
-	uint texel = tex->pixels[iu + iv * tex->width];
-	float3 albedo = RGB8toRGB32F( texel );
-	// calculate the normal for the intersection
-	float3 N = i.u * tri.N1 + i.v * tri.N2 + (1 - (i.u + i.v)) * tri.N0;
-	N = normalize( TransformVector( N, bvhInstance[instIdx].GetTransform() ) );
-	float3 I = ray.O + i.t * ray.D;
-	// shading
-	bool mirror = (instIdx * 17) & 1;
-	if (mirror)
-	{	
+	// mip level from the footprint of the ray cone at the hit point
+	const float width = fabsf( ray.coneWidth + ray.coneSpread * i.t );
+	return instMesh->SampleTexture( uv, instMesh->TextureLOD( triIdx, HitTransform( ray ), ray.D, N, width ) );
+}
+
+float3 WhittedApp::DirectLight( const float3& I, const float3& N, const float3& albedo, const float time )
+{
+	// calculate the diffuse reflection in the intersection point
+	float3 L = lightPos - I;
+	float dist = length( L );
+	L *= 1.0f / dist;
+	float NdotL = dot( N, L );
+	if (NdotL <= 0) return albedo * ambient;
+	// shadow ray: any hit between the surface and the light suffices
+	Ray shadow;
+	shadow.O = I + L * 0.001f, shadow.D = L, shadow.time = time;
+	if (motion ? motion->IsOccluded( shadow, dist - 0.002f ) : tlas.IsOccluded( shadow, dist - 0.002f )) return albedo * ambient;
+	return albedo * (ambient + NdotL * lightColor * (1.0f / (dist * dist)));
+}
+
+float3 WhittedApp::Shade( Ray& ray, int rayDepth )
+{
+	// mirrors continue the path in a loop, rather than recursively
+	while (1)
+	{
+		if (ray.hit.t == 1e30f) return SampleSky( ray.D );
+		float3 I, N;
+		HitPoint( ray, I, N );
+		if (!IS_MIRROR( INST_IDX( ray.hit.instPrim ) )) return DirectLight( I, N, Albedo( ray, N ), ray.time );
 		// calculate the specular reflection in the intersection point
-		Ray secondary;
+		if (rayDepth++ >= 10) return float3( 0 );
+		ReflectCone( ray, ray.hit.t, Curvature( ray ) );
+		ray.D = ray.D - 2 * N * dot( N, ray.D );
+		ray.O = I + ray.D * 0.001f;
+		ray.hit.t = 1e30f;
+		if (motion) motion->Intersect( ray ); else tlas.Intersect( ray );
+	}
+}
+
+void WhittedApp::TraceBatch( Ray* rays, uint* pixel, int count )
+{
+	// sort the rays by direction octant, so packets rarely mix signs; the sort is stable,
+	// so rays of neighbouring pixels stay together
+	Ray sorted[64];
+	uint sortedPixel[64];
+#ifdef RAY_REORDER
+	// within an octant, rays with nearby origins end up in the same packet
+	aabb bounds;
+	bounds.bmin = tlas.tlasNode[0].aabbMin, bounds.bmax = tlas.tlasNode[0].aabbMax;
+	uint key[64];
+	for (int i = 0; i < count; i++)
+	{
+		// insertion sort; batches are small
+		const uint k = RayKey( rays[i], bounds );
+		int j = i;
+		for (; j > 0 && key[j - 1] > k; j--) key[j] = key[j - 1], sorted[j] = sorted[j - 1], sortedPixel[j] = sortedPixel[j - 1];
+		key[j] = k, sorted[j] = rays[i], sortedPixel[j] = pixel[i];
+	}
+#else
+	uint start[9] = { 0 };
+	for (int i = 0; i < count; i++) start[Octant( rays[i].D ) + 1]++;
+	for (int i = 0; i < 8; i++) start[i + 1] += start[i];
+	for (int i = 0; i < count; i++)
+	{
+		const uint j = start[Octant( rays[i].D )]++;
+		sorted[j] = rays[i], sortedPixel[j] = pixel[i];
+	}
+#endif
+	// trace the batch as a stream of packets; the last packet is padded with its last ray
+	for (int first = 0; first < count; first += PACKET_SIZE)
+	{
+		const int n = min( PACKET_SIZE, count - first );
+		RayPacket packet;
+		for (int i = 0; i < PACKET_SIZE; i++) packet.SetRay( i, sorted[first + min( i, n - 1 )] );
+	#ifdef TRAVERSAL_STATS
+		// the packet cost is shared evenly by its rays
+		uint64_t cost = traversalStats.nodes + traversalStats.tris;
+		tlas.Intersect( packet );
+		const float packetCost = (float)(traversalStats.nodes + traversalStats.tris - cost) / n;
+		for (int i = 0; i < n; i++) heat[sortedPixel[first + i]] += packetCost;
+	#else
+		tlas.Intersect( packet );
+	#endif
+		// the packet only holds origins, directions and hits; the rest comes from the sorted copy
+		for (int i = 0; i < n; i++) 
+			rays[first + i] = sorted[first + i], packet.GetRay( i, rays[first + i] ), pixel[first + i] = sortedPixel[first + i];
+	}
+}
+
+int WhittedApp::ShadeBatch( Ray* rays, uint* pixel, int count, int rayDepth, Ray* next, uint* nextPixel )
+{
+	// group the hits by material: sky, mirror, diffuse
+	enum { SKY = 0, MIRROR, DIFFUSE };
+	uchar material[64];
+	int order[64], start[4] = { 0 };
+	for (int i = 0; i < count; i++)
+	{
+		if (rays[i].hit.t == 1e30f) material[i] = SKY;
+		else material[i] = IS_MIRROR( INST_IDX( rays[i].hit.instPrim ) ) ? MIRROR : DIFFUSE;
+		start[material[i] + 1]++;
+	}
+	start[2] += start[1], start[3] += start[2];
+	int slot[3] = { start[0], start[1], start[2] };
+	for (int i = 0; i < count; i++) order[slot[material[i]]++] = i;
+	// sky
+	for (int k = start[0]; k < start[1]; k++) frameSample[pixel[order[k]]] += SampleSky( rays[order[k]].D );
+	// mirrors: the reflected rays form the batch for the next bounce
+	int nextCount = 0;
+	if (rayDepth < 10) for (int k = start[1]; k < start[2]; k++)
+	{
+		const Ray& ray = rays[order[k]];
+		float3 I, N;
+		HitPoint( ray, I, N );
+		Ray& secondary = next[nextCount];
+		secondary.coneWidth = ray.coneWidth, secondary.coneSpread = ray.coneSpread;
+		ReflectCone( secondary, ray.hit.t, Curvature( ray ) );
 		secondary.D = ray.D - 2 * N * dot( N, ray.D );
 		secondary.O = I + secondary.D * 0.001f;
 		secondary.hit.t = 1e30f;
-		if (rayDepth >= 10) return float3( 0 );
-		return Trace( secondary, rayDepth + 1 );
+		nextPixel[nextCount++] = pixel[order[k]];
 	}
-	else
+	// diffuse: texture lookups and shadow rays
+	for (int k = start[2]; k < start[3]; k++)
 	{
-		// calculate the diffuse reflection in the intersection point
-		float3 lightPos( 3, 10, 2 );
-		float3 lightColor( 150, 150, 120 );
-		float3 ambient( 0.2f, 0.2f, 0.4f );
-		float3 L = lightPos - I;
-		float dist = length( L );
-		L *= 1.0f / dist;
-		return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+		const Ray& ray = rays[order[k]];
+		float3 I, N;
+		HitPoint( ray, I, N );
+	#ifdef TRAVERSAL_STATS
+		uint64_t cost = traversalStats.nodes + traversalStats.tris;
+		frameSample[pixel[order[k]]] += DirectLight( I, N, Albedo( ray, N ) );
+		heat[pixel[order[k]]] += (float)(traversalStats.nodes + traversalStats.tris - cost);
+	#else
+		frameSample[pixel[order[k]]] += DirectLight( I, N, Albedo( ray, N ) );
+	#endif
 	}
+	return nextCount;
 }
 
 void WhittedApp::Tick( float deltaTime )
 {
-	// update the TLAS
-	AnimateScene();
+	// update the TLAS; any change to the view discards the accumulated samples
+	static float angle = 0;
+	if (animate)
+	{
+		AnimateScene(), angle += 0.01f;
+		memset( tileSamples, 0, SCRWIDTH * SCRHEIGHT / 64 * sizeof( uint ) );
+	}
 	// render the scene: multithreaded tiles
-	static float angle = 0; angle += 0.01f;
 	mat4 M1 = mat4::RotateY( angle ), M2 = M1 * mat4::RotateX( -0.65f );
 	// setup screen plane in world space
 	float aspectRatio = (float)SCRWIDTH / SCRHEIGHT;
@@ -119,31 +284,114 @@ void WhittedApp::Tick( float deltaTime )
 	p1 = TransformPosition( float3( aspectRatio, 1, 1.5f ), M2 );
 	p2 = TransformPosition( float3( -aspectRatio, -1, 1.5f ), M2 );
 	float3 camPos = TransformPosition( float3( 0, -2, -8.5f ), M1 );
-#pragma omp parallel for schedule(dynamic)
-	for (int tile = 0; tile < (SCRWIDTH * SCRHEIGHT / 64); tile++)
+	// ray cone spread angle: the size of a pixel, at a distance of 1 from the camera
+	const float pixelSpread = length( p1 - p0 ) / SCRWIDTH;
+	JobManager::GetJobManager()->ParallelFor( SCRWIDTH * SCRHEIGHT / 64, [&]( int tile )
 	{
 		// render an 8x8 tile
 		int x = tile % (SCRWIDTH / 8), y = tile / (SCRWIDTH / 8);
-		Ray ray;
-		ray.O = camPos;
-		for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++)
+		const uint samples = tileSamples[tile];
+		if (samples == 0) tileConverged[tile] = false;
+		else if (tileConverged[tile] || samples >= MAX_TILE_SAMPLES)
+		{
+		#ifdef TRAVERSAL_STATS
+			tileStats[tile] = TraversalStats();
+		#endif
+			return;
+		}
+	#ifdef TRAVERSAL_STATS
+		// the counters of this thread only grow; the cost of a query is the difference
+		const TraversalStats tileStart = traversalStats;
+		traversalStats.maxDepth = 0;
+	#endif
+		// primary rays, in blocks of PACKET_SIZE rays that are 4 pixels wide
+		Ray rayBuffer[2][64];
+		uint pixelBuffer[2][64];
+		Ray* rays = rayBuffer[0], *next = rayBuffer[1];
+		uint* pixel = pixelBuffer[0], *nextPixel = pixelBuffer[1];
+		for (int i = 0; i < 64; i++)
 		{
-			// setup a primary ray
-			float3 pixelPos = ray.O + p0 +
+			int p = i / PACKET_SIZE, j = i % PACKET_SIZE;
+			int u = (p & 1) * 4 + (j & 3), v = (p >> 1) * (PACKET_SIZE / 4) + (j >> 2);
+			float3 pixelPos = camPos + p0 +
 				(p1 - p0) * ((x * 8 + u + RandomFloat()) / SCRWIDTH) +
 				(p2 - p0) * ((y * 8 + v + RandomFloat()) / SCRHEIGHT);
-			ray.D = normalize( pixelPos - ray.O );
-			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-			uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
-			accumulator[pixelAddress] = Trace( ray );
+			rays[i].O = camPos;
+			rays[i].D = normalize( pixelPos - camPos );
+			rays[i].hit.t = 1e30f; // 1e30f denotes 'no hit'
+			rays[i].coneWidth = 0, rays[i].coneSpread = pixelSpread / length( pixelPos - camPos );
+			pixel[i] = x * 8 + u + (y * 8 + v) * SCRWIDTH;
+			frameSample[pixel[i]] = float3( 0 );
+		#ifdef TRAVERSAL_STATS
+			heat[pixel[i]] = 0;
+		#endif
 		}
-	}
+		// trace and shade the tile one bounce at a time; mirrors produce the next batch
+		for (int depth = 0, count = 64; count > 0; depth++)
+		{
+			TraceBatch( rays, pixel, count );
+			count = ShadeBatch( rays, pixel, count, depth, next, nextPixel );
+			swap( rays, next ), swap( pixel, nextPixel );
+		}
+		for (int i = 0; i < 64; i++)
+		{
+			uint pixelAddress = x * 8 + (i & 7) + (y * 8 + (i >> 3)) * SCRWIDTH;
+			const float3 sample = frameSample[pixelAddress];
+			const float lum = dot( sample, float3( 0.2126f, 0.7152f, 0.0722f ) );
+			if (samples == 0) accumulator[pixelAddress] = sample, lumSqr[pixelAddress] = lum * lum;
+			else accumulator[pixelAddress] += sample, lumSqr[pixelAddress] += lum * lum;
+		}
+		const uint n = tileSamples[tile] = samples + 1;
+	#ifdef ADAPTIVE_SAMPLING
+		if (n >= MIN_TILE_SAMPLES)
+		{
+			// converged if, for each pixel, the standard error of the mean luminance is small
+			bool converged = true;
+			for (int v = 0; v < 8 && converged; v++) for (int u = 0; u < 8; u++)
+			{
+				uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
+				const float mean = dot( accumulator[pixelAddress], float3( 0.2126f, 0.7152f, 0.0722f ) ) / n;
+				const float variance = max( 0.0f, lumSqr[pixelAddress] / n - mean * mean );
+				if (variance > sqrf( ERROR_THRESHOLD * (mean + 0.1f) ) * n) { converged = false; break; }
+			}
+			tileConverged[tile] = converged;
+		}
+	#endif
+	#ifdef TRAVERSAL_STATS
+		TraversalStats& s = tileStats[tile];
+		s.nodes = traversalStats.nodes - tileStart.nodes;
+		s.tris = traversalStats.tris - tileStart.tris;
+		s.instances = traversalStats.instances - tileStart.instances;
+		s.maxDepth = traversalStats.maxDepth;
+	#endif
+	} );
+#ifdef TRAVERSAL_STATS
+	// merge the tile counters and report the averages now and then
+	TraversalStats frame;
+	for (int i = 0; i < SCRWIDTH * SCRHEIGHT / 64; i++) frame.Merge( tileStats[i] );
+	static int frameIdx = 0;
+	if (++frameIdx % 100 == 0) printf( "per pixel: %.1f nodes, %.1f tris, %.2f instances; max stack depth: %i\n",
+		(float)frame.nodes / (SCRWIDTH * SCRHEIGHT), (float)frame.tris / (SCRWIDTH * SCRHEIGHT),
+		(float)frame.instances / (SCRWIDTH * SCRHEIGHT), frame.maxDepth );
+	// the heatmap overlays a blue-green-red ramp, scaled to a few times the average cost
+	const float scale = 1.0f / (4.0f * (frame.nodes + frame.tris) / (SCRWIDTH * SCRHEIGHT) + 1);
+#endif
 	// convert the floating point accumulator into pixels
 	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
 	{
-		int r = min( 255, (int)(255 * accumulator[i].x) );
-		int g = min( 255, (int)(255 * accumulator[i].y) );
-		int b = min( 255, (int)(255 * accumulator[i].z) );
+		const int tile = (i % SCRWIDTH) / 8 + (i / (SCRWIDTH * 8)) * (SCRWIDTH / 8);
+		float3 color = accumulator[i] * (1.0f / tileSamples[tile]);
+	#ifdef TRAVERSAL_STATS
+		if (showHeatmap)
+		{
+			const float h = min( 1.0f, heat[i] * scale );
+			const float3 ramp = h < 0.5f ? float3( 0, h * 2, 1 - h * 2 ) : float3( h * 2 - 1, 2 - h * 2, 0 );
+			color = color * 0.25f + ramp * 0.75f;
+		}
+	#endif
+		int r = min( 255, (int)(255 * color.x) );
+		int g = min( 255, (int)(255 * color.y) );
+		int b = min( 255, (int)(255 * color.z) );
 		screen->pixels[i] = (r << 16) + (g << 8) + b;
 	}
 }
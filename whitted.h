@@ -11,6 +11,16 @@ public:
 	void Init();
 	void AnimateScene();
 	float3 Trace( Ray& ray, int rayDepth = 0 );
+	float3 Shade( Ray& ray, int rayDepth = 0 );
+	float3 SampleSky( const float3& D );
+	void HitPoint( const Ray& ray, float3& I, float3& N );
+	mat4 HitTransform( const Ray& ray );
+	float3 Albedo( const Ray& ray, const float3& N );
+	float Curvature( const Ray& ray );
+	float3 DirectLight( const float3& I, const float3& N, const float3& albedo, const float time = 0 );
+	// batched tracing and shading of up to 64 rays, used by Tick
+	void TraceBatch( Ray* rays, uint* pixel, int count );
+	int ShadeBatch( Ray* rays, uint* pixel, int count, int rayDepth, Ray* next, uint* nextPixel );
 	void Tick( float deltaTime );
 	void Shutdown() { /* implement if you want to do something on exit */ }
 	// input handling
@@ -19,16 +29,28 @@ public:
 	void MouseMove( int x, int y ) { mousePos.x = x, mousePos.y = y; }
 	void MouseWheel( float y ) { /* implement if you want to handle the mouse wheel */ }
 	void KeyUp( int key ) { /* implement if you want to handle keys */ }
-	void KeyDown( int key ) { /* implement if you want to handle keys */ }
+	void KeyDown( int key );
 	// data members
 	int2 mousePos;
 	Mesh* mesh;
 	BVHInstance bvhInstance[256];
 	TLAS tlas;
+	BVHInstance shutterOpen[256];	// with motion blur: the poses at shutter open; bvhInstance has those at close
+	MotionTLAS* motion = 0;	// if set, Trace and Shade use it, at the time of each ray, instead of tlas
 	float3 p0, p1, p2; // virtual screen plane corners
-	float3* accumulator;
+	float3* accumulator;	// sum of the samples of each pixel
+	float3* frameSample;	// this frame's sample per pixel, gathered by ShadeBatch
+	float* lumSqr;		// sum of the squared luminance of the samples, for the error estimate
+	uint* tileSamples;	// samples per pixel taken so far, per 8x8 tile
+	bool* tileConverged;	// tile needs no more samples (ADAPTIVE_SAMPLING)
+	bool animate = true;	// toggle with space; a still view accumulates samples
 	float* skyPixels;
 	int skyWidth, skyHeight, skyBpp;
+#ifdef TRAVERSAL_STATS
+	float* heat;			// traversal cost per pixel: nodes visited plus triangles tested
+	TraversalStats* tileStats;	// per-tile counters, merged after each frame
+	bool showHeatmap = true;	// toggle with 'H'
+#endif
 };
 
 } // namespace Tmpl8
\ No newline at end of file